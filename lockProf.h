@@ -0,0 +1,223 @@
+/*
+ *      Lock and wait profiling for marketSim, built with -DLOCKPROF
+ *
+ *      Every pthread mutex and condition variable the engine touches gets
+ *      a tracker, found by address in a small open-addressing table and
+ *      named with lockName. pthread_mutex_lock, pthread_mutex_unlock and
+ *      pthread_cond_wait are redefined at the bottom of this file, so the
+ *      engine code itself is unchanged. Mutex trackers count acquisitions
+ *      and contended acquisitions and keep log2 histograms of the time
+ *      spent waiting for and holding the lock; condvar trackers keep the
+ *      histogram of the time spent in pthread_cond_wait.
+ */
+
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define NLOCKS 64
+#define NBUCKETS 40
+
+typedef struct {
+  void *addr;
+  char name[32];
+  int cond;
+  unsigned long acquired;       // acquisitions, or waits for a condvar
+  unsigned long contended;
+  unsigned long waitNsec, holdNsec;
+  unsigned long maxWait, maxHold;
+  unsigned long waitHist[NBUCKETS], holdHist[NBUCKETS];
+  long since;                   // when the current holder got the lock
+} lockTracker;
+
+lockTracker lockTable[NLOCKS];
+
+
+
+// ****************************************************************
+static long lockNsec () {
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+
+// ****************************************************************
+// Finds the tracker of addr, claiming a free slot the first time.
+static lockTracker *lockFind (void *addr) {
+  unsigned long h = ((unsigned long) addr >> 4) * 0x9e3779b97f4a7c15UL;
+  int i, n;
+  void *empty;
+
+  for (n = 0, i = h >> 58; n < NLOCKS; n++, i = (i + 1) % NLOCKS) {
+    if (lockTable[i].addr == addr)
+      return &lockTable[i];
+    empty = NULL;
+    if ((lockTable[i].addr == NULL) &&
+        __atomic_compare_exchange_n (&lockTable[i].addr, &empty, addr, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      snprintf (lockTable[i].name, sizeof (lockTable[i].name), "%p", addr);
+      return &lockTable[i];
+    }
+    if (lockTable[i].addr == addr)
+      return &lockTable[i];
+  }
+  fprintf(stderr, "lockProf: more than %d locks\n", NLOCKS);
+  exit(1);
+}
+
+
+
+// ****************************************************************
+static void lockName (void *addr, char *name) {
+  lockTracker *l = lockFind (addr);
+
+  strncpy (l->name, name, sizeof (l->name) - 1);
+}
+
+
+
+// ****************************************************************
+static void lockSample (unsigned long *hist, unsigned long *sum, unsigned long *max, long nsec) {
+  int b = (nsec > 0) ? 64 - __builtin_clzl (nsec) : 0;
+
+  if (b >= NBUCKETS)
+    b = NBUCKETS - 1;
+  __atomic_fetch_add (&hist[b], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add (sum, nsec, __ATOMIC_RELAXED);
+  if ((unsigned long) nsec > *max)
+    *max = nsec;
+}
+
+
+
+// ****************************************************************
+static int profLock (pthread_mutex_t *m) {
+  lockTracker *l = lockFind (m);
+  long t0;
+  int rc;
+
+  if ((rc = pthread_mutex_trylock (m)) == 0) {
+    l->since = lockNsec();
+  }
+  else {
+    t0 = lockNsec();
+    if ((rc = pthread_mutex_lock (m)) != 0)
+      return rc;
+    l->since = lockNsec();
+    l->contended++;
+    lockSample (l->waitHist, &l->waitNsec, &l->maxWait, l->since - t0);
+  }
+  l->acquired++;
+
+  return 0;
+}
+
+
+
+// ****************************************************************
+static int profUnlock (pthread_mutex_t *m) {
+  lockTracker *l = lockFind (m);
+
+  lockSample (l->holdHist, &l->holdNsec, &l->maxHold, lockNsec() - l->since);
+  return pthread_mutex_unlock (m);
+}
+
+
+
+// ****************************************************************
+// The mutex is released for the duration of the wait, so its hold time
+// is closed before and reopened after.
+static int profWait (pthread_cond_t *c, pthread_mutex_t *m) {
+  lockTracker *l = lockFind (m), *cv = lockFind (c);
+  long t0;
+  int rc;
+
+  t0 = lockNsec();
+  lockSample (l->holdHist, &l->holdNsec, &l->maxHold, t0 - l->since);
+  rc = pthread_cond_wait (c, m);
+  l->since = lockNsec();
+  cv->cond = 1;
+  __atomic_fetch_add (&cv->acquired, 1, __ATOMIC_RELAXED);
+  lockSample (cv->waitHist, &cv->waitNsec, &cv->maxWait, l->since - t0);
+
+  return rc;
+}
+
+
+
+// ****************************************************************
+// Upper bound of the bucket holding the q-th fraction of the samples.
+static unsigned long lockPercentile (unsigned long *hist, double q) {
+  unsigned long n = 0, seen = 0;
+  int b;
+
+  for (b = 0; b < NBUCKETS; b++)
+    n += hist[b];
+  for (b = 0; b < NBUCKETS; b++) {
+    seen += hist[b];
+    if ((n) && (seen >= q * n))
+      return 1UL << b;
+  }
+  return 0;
+}
+
+
+
+// ****************************************************************
+static int lockCompare (const void *a, const void *b) {
+  const lockTracker *x = *(lockTracker **) a, *y = *(lockTracker **) b;
+
+  return (x->waitNsec < y->waitNsec) - (x->waitNsec > y->waitNsec);
+}
+
+
+
+// ****************************************************************
+// Ranked by total time spent waiting, mutexes first, then condvars.
+static void lockReport (FILE *f) {
+  lockTracker *rank[NLOCKS], *l;
+  int i, n;
+
+  for (n = 0, i = 0; i < NLOCKS; i++)
+    if (lockTable[i].addr)
+      rank[n++] = &lockTable[i];
+  qsort (rank, n, sizeof (lockTracker *), lockCompare);
+
+  fprintf(f, "\n%-24s %10s %8s %10s %9s %9s %10s %9s %9s\n", "mutex", "acquired", "contend%",
+          "wait msec", "wait p99", "wait max", "hold avg", "hold p99", "hold max");
+  for (i = 0; i < n; i++) {
+    l = rank[i];
+    if ((l->cond) || (l->acquired == 0))
+      continue;
+    fprintf(f, "%-24s %10lu %8.2f %10.1f %9lu %9lu %10.0f %9lu %9lu\n", l->name, l->acquired,
+            100.0 * l->contended / l->acquired, l->waitNsec / 1e6,
+            lockPercentile (l->waitHist, 0.99), l->maxWait, (double) l->holdNsec / l->acquired,
+            lockPercentile (l->holdHist, 0.99), l->maxHold);
+  }
+
+  fprintf(f, "\n%-24s %10s %8s %10s %9s %9s %10s\n", "condvar", "waits", "",
+          "wait msec", "wait p50", "wait p99", "wait max");
+  for (i = 0; i < n; i++) {
+    l = rank[i];
+    if (!l->cond)
+      continue;
+    fprintf(f, "%-24s %10lu %8s %10.1f %9lu %9lu %10lu\n", l->name, l->acquired, "",
+            l->waitNsec / 1e6, lockPercentile (l->waitHist, 0.5),
+            lockPercentile (l->waitHist, 0.99), l->maxWait);
+  }
+  fprintf(f, "(times in nsec unless noted, percentiles are log2 bucket bounds)\n");
+}
+
+#define pthread_mutex_lock(m) profLock (m)
+#define pthread_mutex_unlock(m) profUnlock (m)
+#define pthread_cond_wait(c, m) profWait (c, m)
+
+#endif
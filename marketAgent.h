@@ -0,0 +1,200 @@
+/*
+ *      Trading agents run inside marketSim (-A plugin.so:kind=count,...)
+ *
+ *      A plugin is a shared object exporting agentKinds, an array of
+ *      agentKind ended by one with a NULL name. Every agent of a kind
+ *      gets kind->size bytes of zeroed state and callbacks from the
+ *      runner thread that owns it: trades in tape order, changes of the
+ *      top of the book, the fills and rejects of its own orders and, if
+ *      the kind has a period, a timer. Callbacks of one agent never
+ *      overlap and nothing is allocated or locked to make them. The book
+ *      is read in place through agentBook, without a lock, so a level
+ *      may be caught in the middle of an update; its depth, level and
+ *      position calls give views that are not. Orders go out through a
+ *      ring of the agent's own that Cons reads; agentSubmit and
+ *      agentCancel return the engine id of the order, or -1 when the
+ *      ring is full. agentMassQuote replaces the agent's whole ladder of
+ *      quotes in one message.
+ */
+
+#ifndef MARKETAGENT_H
+#define MARKETAGENT_H
+
+#define AGENTCHAN 64                    // orders an agent may have on the way
+#define AGENTOWNERS (1 << 20)
+#define AGENTIDBITS 40                  // runner r numbers its orders from (r + 1) << AGENTIDBITS
+#define AGENTQUOTE 8                    // levels a side in a mass quote
+#define AGENTPEGPRIMARY 0               // pegged to the best price of its own side
+#define AGENTPEGMID 1
+#define AGENTPEGMARKET 2                // to the best price of the other side
+
+typedef struct agent agent;
+
+typedef struct {
+  int head, tail, count, epoch;
+  long vol;                             // resting volume at the price
+  long gone;
+} agentLevel;                           // as the engine's level
+
+typedef struct {
+  int price, count;
+  long vol;
+} agentDepth;
+
+typedef struct {
+  long id, timestamp;
+  int vol;
+} agentResting;
+
+typedef struct {
+  int levels[2];                        // bids, asks
+  int price[2][AGENTQUOTE];             // best first
+  int vol[2][AGENTQUOTE];
+} agentQuote;
+
+typedef struct {
+  const agentLevel *bid, *ask;          // by price in tenths, 65536 of them
+  const int *bestBid, *bestAsk;         // -1 when the side is empty
+  const int *last;                      // price of the last trade
+  // consistent views, side 'B' or 'S': the best n levels, the orders
+  // at a price in time priority, and the volume ahead of an order
+  int (*depth) (char side, agentDepth *out, int n);
+  int (*level) (char side, int price, agentResting *out, int max);
+  long (*position) (char side, long id);
+  long (*quote) (agent *a, const agentQuote *q);       // see agentMassQuote
+} agentBook;
+
+typedef struct {
+  long timestamp;
+  int price, vol;
+  long id1, id2;
+} agentTrade;
+
+typedef struct {
+  long timestamp;
+  int bid, ask;                         // -1 when the side is empty
+  long bidVol, askVol;
+} agentTop;
+
+typedef struct {
+  long id, oldid;
+  long expire;                          // msec from now, limit orders only, 0 for none
+  int vol, price1, price2;
+  char action, type;                    // as in the engine's order
+} agentOrder;
+
+typedef struct {
+  char *name;
+  int size;                             // bytes of state
+  int period;                           // msec between timer calls, 0 for none
+  void (*start) (agent *a);
+  void (*trade) (agent *a, const agentTrade *tr);
+  void (*top) (agent *a, const agentTop *top);
+  void (*fill) (agent *a, long id, const agentTrade *tr);
+  void (*reject) (agent *a, long id, int reason);
+  void (*timer) (agent *a, long now);
+} agentKind;
+
+typedef struct {
+  long id;
+  agent *a;
+} agentOwner;
+
+typedef struct {
+  long nextId;
+  agentOwner *owner;                    // by id & (AGENTOWNERS - 1)
+  agent **dirty;                        // agents that sent since the last flush
+  int ndirty;
+} agentRunner;
+
+struct agent {
+  const agentKind *kind;
+  const agentBook *book;
+  void *state;
+  int index;                            // among all the agents
+  int account;
+  unsigned int seed;                    // for rand_r
+  long wake;                            // msec of the next timer call
+
+  agentRunner *runner;
+  int dirty;
+  long head, tail;                      // head moved by Cons, tail by the agent
+  agentOrder chan[AGENTCHAN];
+};
+
+
+
+// ****************************************************************
+static inline long agentSend (agent *a, agentOrder o) {
+  agentRunner *r = a->runner;
+
+  if (a->tail - __atomic_load_n (&a->head, __ATOMIC_ACQUIRE) == AGENTCHAN)
+    return -1;
+  o.id = r->nextId++;
+  r->owner[o.id & (AGENTOWNERS - 1)] = (agentOwner) { o.id, a };
+  a->chan[a->tail & (AGENTCHAN - 1)] = o;
+  __atomic_store_n (&a->tail, a->tail + 1, __ATOMIC_RELEASE);
+  if (!a->dirty) {
+    a->dirty = 1;
+    r->dirty[r->ndirty++] = a;
+  }
+  return o.id;
+}
+
+
+
+// ****************************************************************
+// action 'B' or 'S', type 'M', 'L', 'S', 'T' or 'P', prices in tenths,
+// price2 of a pegged order is its peg
+static inline long agentSubmit (agent *a, char action, char type, int vol, int price1, int price2) {
+  agentOrder o = { 0 };
+
+  o.action = action;
+  o.type = type;
+  o.vol = vol;
+  o.price1 = price1;
+  o.price2 = price2;
+  return agentSend (a, o);
+}
+
+
+
+// ****************************************************************
+static inline long agentCancel (agent *a, long id) {
+  agentOrder o = { 0 };
+
+  o.action = 'B';
+  o.type = 'C';
+  o.oldid = id;
+  return agentSend (a, o);
+}
+
+
+
+// ****************************************************************
+// Replaces the agent's quotes with q, as a diff. A new level k is order
+// id + k on the bid and id + AGENTQUOTE + k on the ask.
+#define agentQuoteSide(id) ((((id) & (2 * AGENTQUOTE - 1)) < AGENTQUOTE) ? 'B' : 'S')
+
+static inline long agentMassQuote (agent *a, const agentQuote *q) {
+  agentRunner *r = a->runner;
+  agentOrder o = { 0 };
+  long id, k;
+
+  if (a->tail - __atomic_load_n (&a->head, __ATOMIC_ACQUIRE) == AGENTCHAN)
+    return -1;
+  if ((o.oldid = a->book->quote (a, q)) < 0)
+    return -1;
+  r->nextId = (r->nextId + 2 * AGENTQUOTE - 1) & ~(2L * AGENTQUOTE - 1);
+  for (k = 1; k < 2 * AGENTQUOTE; k++) {
+    id = r->nextId + k;
+    r->owner[id & (AGENTOWNERS - 1)] = (agentOwner) { id, a };
+  }
+  o.action = 'B';
+  o.type = 'Q';
+  id = agentSend (a, o);
+  r->nextId += 2 * AGENTQUOTE - 1;
+  return id;
+}
+
+#endif
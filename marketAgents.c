@@ -0,0 +1,159 @@
+/*
+ *      Sample agents for marketSim -A
+ *
+ *      maker     quotes a ladder of 100 on 3 prices a side a few ticks
+ *                around the last price with one mass quote, and quotes
+ *                again when the price moves, leaning against its position
+ *      momentum  buys or sells 100 at market when a fast average of the
+ *                trade prices crosses a slow one
+ *      noise     every 50 msec or so a random limit, market or pegged order
+ *                near the top of the book, or a cancel of its last order
+ *
+ *      ./marketSim -A ./marketAgents.so:maker=100,momentum=100,noise=1000
+ */
+
+#include <stdlib.h>
+
+#include "marketAgent.h"
+
+#define QUOTE 100
+#define LADDER 3
+#define MAXPOSITION 2000
+
+typedef struct {
+  int bid, ask;                 // inner prices of the ladder last quoted, -1 to quote again
+  long position;
+} maker;
+
+typedef struct {
+  double fast, slow;
+  char side;                    // of the last crossing
+} momentum;
+
+typedef struct {
+  long last;
+} noise;
+
+
+
+// ****************************************************************
+// Quotes of agent i are 1 to 3 ticks from the price, skewed one tick
+// away from the side it is long or short of.
+void makerQuote (agent *a) {
+  maker *m = (maker *) a->state;
+  int last = *a->book->last, spread = 1 + a->index % 3;
+  int skew = (m->position > MAXPOSITION / 2) ? -1 : (m->position < -MAXPOSITION / 2) ? 1 : 0;
+  int bid = last - spread + skew, ask = last + spread + skew, k;
+  agentQuote q = { .levels = { 0, 0 } };
+
+  if ((bid == m->bid) && (ask == m->ask))
+    return;
+  for (k = 0; k < LADDER; k++) {
+    if ((m->position < MAXPOSITION) && (bid - k > 0)) {
+      q.price[0][q.levels[0]] = bid - k;
+      q.vol[0][q.levels[0]++] = QUOTE;
+    }
+    if (m->position > -MAXPOSITION) {
+      q.price[1][q.levels[1]] = ask + k;
+      q.vol[1][q.levels[1]++] = QUOTE;
+    }
+  }
+  if (agentMassQuote (a, &q) >= 0) {
+    m->bid = bid;
+    m->ask = ask;
+  }
+}
+
+
+
+// ****************************************************************
+void makerStart (agent *a) {
+  maker *m = (maker *) a->state;
+
+  m->bid = m->ask = -1;
+  makerQuote (a);
+}
+
+
+
+// ****************************************************************
+void makerTop (agent *a, const agentTop *top) {
+  (void) top;
+  makerQuote (a);
+}
+
+
+
+// ****************************************************************
+// The ladder is filled in again at the next change of the top.
+void makerFill (agent *a, long id, const agentTrade *tr) {
+  maker *m = (maker *) a->state;
+
+  m->position += (agentQuoteSide (id) == 'B') ? tr->vol : -tr->vol;
+  m->bid = m->ask = -1;
+}
+
+
+
+// ****************************************************************
+void makerReject (agent *a, long id, int reason) {
+  maker *m = (maker *) a->state;
+
+  (void) id;
+  (void) reason;
+  m->bid = m->ask = -1;
+}
+
+
+
+// ****************************************************************
+void momentumTrade (agent *a, const agentTrade *tr) {
+  momentum *m = (momentum *) a->state;
+  double fast = 0.2 + 0.01 * (a->index % 10);
+
+  if (m->slow == 0.0)
+    m->fast = m->slow = tr->price;
+  m->fast += fast * (tr->price - m->fast);
+  m->slow += 0.02 * (tr->price - m->slow);
+  if ((m->fast > m->slow + 0.5) && (m->side != 'B')) {
+    m->side = 'B';
+    agentSubmit (a, 'B', 'M', QUOTE, 0, 0);
+  }
+  else if ((m->fast < m->slow - 0.5) && (m->side != 'S')) {
+    m->side = 'S';
+    agentSubmit (a, 'S', 'M', QUOTE, 0, 0);
+  }
+}
+
+
+
+// ****************************************************************
+void noiseTimer (agent *a, long now) {
+  noise *n = (noise *) a->state;
+  int last = *a->book->last, u = rand_r (&a->seed) % 100;
+  char side = (rand_r (&a->seed) % 2) ? 'B' : 'S';
+
+  (void) now;
+  a->wake += rand_r (&a->seed) % 50;
+  if (u < 40)
+    return;
+  if ((u < 50) && (n->last > 0))
+    agentCancel (a, n->last);
+  else if (u < 60)
+    n->last = agentSubmit (a, side, 'M', 100 * (1 + rand_r (&a->seed) % 5), 0, 0);
+  else if (u < 65)
+    n->last = agentSubmit (a, side, 'P', 100 * (1 + rand_r (&a->seed) % 5), 0, rand_r (&a->seed) % 3);
+  else
+    n->last = agentSubmit (a, side, 'L', 100 * (1 + rand_r (&a->seed) % 5),
+                           last + ((side == 'B') ? -1 : 1) * (rand_r (&a->seed) % 5), 0);
+}
+
+
+
+// ****************************************************************
+agentKind agentKinds[] = {
+  { "maker", sizeof (maker), 0, makerStart, NULL, makerTop, makerFill, makerReject, NULL },
+  { "momentum", sizeof (momentum), 0, NULL, momentumTrade, NULL, NULL, NULL, NULL },
+  { "noise", sizeof (noise), 50, NULL, NULL, NULL, NULL, NULL, noiseTimer },
+  { NULL }
+};
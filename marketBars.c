@@ -0,0 +1,353 @@
+/*
+ *      Bars, volume profile and realised volatility from a trade tape
+ *
+ *      Maps a columnar tape written by marketSim -c and reduces it in
+ *      two parallel passes over contiguous ranges of blocks: the first
+ *      finds the time span, the second builds per-thread bars and a
+ *      volume profile that are merged in block order, so the open is the
+ *      first trade of a bar and the close the last one, as on the text
+ *      tape. Within a block the trades of one bar are a run, and the run
+ *      is reduced by plain loops over the columns that the compiler
+ *      vectorises.
+ *
+ *      ./marketBars [-b msec] [-j threads] [-p] [-q] [-r bars] file
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "marketTape.h"
+
+#define NPRICES 65536
+#define VALUEAREA 0.7
+
+typedef struct {
+  int open, high, low, close;
+  long volume;
+  long notional;                // sum of price x volume, for the VWAP
+  long trades;
+  double var;                   // sum of squared trade to trade log returns
+} bar;
+
+typedef struct {
+  long first, last;             // blocks [first, last)
+  long tmin, tmax;
+  bar *bars;
+  long *profile;
+} worker;
+
+tapeBlock *blocks;
+long nblocks, width = 1000, base, nbars;
+double lg[NPRICES];
+
+
+
+// ****************************************************************
+double msecSince (struct timeval *t0) {
+  struct timeval t1;
+
+  gettimeofday (&t1, NULL);
+  return (t1.tv_sec - t0->tv_sec) * 1000.0 + (t1.tv_usec - t0->tv_usec) / 1000.0;
+}
+
+
+
+// ****************************************************************
+void *span (void *arg) {
+  worker *w = (worker *) arg;
+  long b, i, n, lo = w->tmin, hi = w->tmax, *ts;
+
+  for (b = w->first; b < w->last; b++) {
+    ts = blocks[b].timestamp;
+    n = blocks[b].count;
+    for (i = 0; i < n; i++) {
+      lo = (ts[i] < lo) ? ts[i] : lo;
+      hi = (ts[i] > hi) ? ts[i] : hi;
+    }
+  }
+  w->tmin = lo;
+  w->tmax = hi;
+  return NULL;
+}
+
+
+
+// ****************************************************************
+// One run of trades of the same bar: [0, n) of the columns, prev the
+// price of the trade before the run.
+void runKernel (bar *r, int *price, int *volume, long n, int prev) {
+  long i, vol = 0, notional = 0;
+  int hi = r->high, lo = r->low;
+  double var = 0.0, d;
+
+  for (i = 0; i < n; i++) {
+    vol += volume[i];
+    notional += (long) price[i] * volume[i];
+    hi = (price[i] > hi) ? price[i] : hi;
+    lo = (price[i] < lo) ? price[i] : lo;
+  }
+  if (prev > 0) {
+    d = lg[price[0]] - lg[prev];
+    var += d * d;
+  }
+  for (i = 1; i < n; i++) {
+    d = lg[price[i]] - lg[price[i - 1]];
+    var += d * d;
+  }
+
+  if (r->trades == 0)
+    r->open = price[0];
+  r->close = price[n - 1];
+  r->high = hi;
+  r->low = lo;
+  r->volume += vol;
+  r->notional += notional;
+  r->trades += n;
+  r->var += var;
+}
+
+
+
+// ****************************************************************
+void *reduce (void *arg) {
+  worker *w = (worker *) arg;
+  tapeBlock *k;
+  long b, i, j, n, bucket, from, to;
+  int prev = 0;
+
+  w->bars = (bar *) calloc (nbars, sizeof (bar));
+  w->profile = (long *) calloc (NPRICES, sizeof (long));
+  for (i = 0; i < nbars; i++) {
+    w->bars[i].high = 0;
+    w->bars[i].low = NPRICES;
+  }
+  if (w->first > 0)
+    prev = blocks[w->first - 1].price[blocks[w->first - 1].count - 1];
+
+  for (b = w->first; b < w->last; b++) {
+    k = &blocks[b];
+    n = k->count;
+    for (i = 0; i < n; i = j) {
+      bucket = k->timestamp[i] / width;
+      from = bucket * width;
+      to = from + width;
+      for (j = i + 1; (j < n) && (k->timestamp[j] >= from) && (k->timestamp[j] < to); j++)
+        ;
+      runKernel (&w->bars[bucket - base], &k->price[i], &k->volume[i], j - i, prev);
+      prev = k->price[j - 1];
+    }
+    for (i = 0; i < n; i++)
+      w->profile[k->price[i]] += k->volume[i];
+  }
+  return NULL;
+}
+
+
+
+// ****************************************************************
+// Bars of later workers come later on the tape.
+void merge (bar *to, bar *from) {
+  if (from->trades == 0)
+    return;
+  if (to->trades == 0)
+    to->open = from->open;
+  to->close = from->close;
+  to->high = (from->high > to->high) ? from->high : to->high;
+  to->low = (from->low < to->low) ? from->low : to->low;
+  to->volume += from->volume;
+  to->notional += from->notional;
+  to->trades += from->trades;
+  to->var += from->var;
+}
+
+
+
+// ****************************************************************
+void printBars (bar *bars, int window) {
+  double roll = 0.0;
+  long i;
+
+  printf("%10s %8s %8s %8s %8s %10s %8s %7s %8s %8s\n", "msec", "open", "high", "low", "close",
+         "volume", "vwap", "trades", "rv%", "rv% roll");
+  for (i = 0; i < nbars; i++) {
+    roll += bars[i].var;
+    if (i >= window)
+      roll -= bars[i - window].var;
+    if (bars[i].trades == 0)
+      continue;
+    printf("%10ld %8.1f %8.1f %8.1f %8.1f %10ld %8.2f %7ld %8.3f %8.3f\n", (base + i) * width,
+           bars[i].open / 10.0, bars[i].high / 10.0, bars[i].low / 10.0, bars[i].close / 10.0,
+           bars[i].volume, (double) bars[i].notional / bars[i].volume / 10.0, bars[i].trades,
+           100.0 * sqrt (bars[i].var), 100.0 * sqrt ((roll > 0.0) ? roll : 0.0));
+  }
+}
+
+
+
+// ****************************************************************
+// Volume by price, the point of control and the value area.
+void printProfile (long *profile, long total) {
+  long in;
+  int p, poc = 0, lo, hi, lower, upper;
+
+  for (p = 0; p < NPRICES; p++)
+    if (profile[p] > profile[poc])
+      poc = p;
+  lo = hi = poc;
+  in = profile[poc];
+  while (in < VALUEAREA * total) {
+    for (lower = lo - 1; (lower >= 0) && (!profile[lower]); lower--)
+      ;
+    for (upper = hi + 1; (upper < NPRICES) && (!profile[upper]); upper++)
+      ;
+    if ((upper < NPRICES) && ((lower < 0) || (profile[upper] >= profile[lower])))
+      in += profile[hi = upper];
+    else if (lower >= 0)
+      in += profile[lo = lower];
+    else
+      break;
+  }
+
+  printf("\n%8s %10s %6s\n", "price", "volume", "%");
+  for (p = NPRICES - 1; p >= 0; p--)
+    if (profile[p])
+      printf("%8.1f %10ld %6.2f%s\n", p / 10.0, profile[p], 100.0 * profile[p] / total,
+             (p == poc) ? "  poc" : ((p >= lo) && (p <= hi)) ? "  va" : "");
+  printf("point of control %.1f, value area %.1f - %.1f\n", poc / 10.0, lo / 10.0, hi / 10.0);
+}
+
+
+
+// ****************************************************************
+int main (int argc, char **argv) {
+  int fd, opt, nthreads = sysconf (_SC_NPROCESSORS_ONLN), window = 20, profile = 0, quiet = 0, i;
+  long b, p, trades = 0, volume = 0, notional = 0;
+  double var = 0.0, reduceMsec;
+  struct timeval t0;
+  struct stat st;
+  tapeHeader *h;
+  pthread_t *tid;
+  worker *w;
+  bar *bars;
+  long *prof;
+
+  while ((opt = getopt (argc, argv, "b:j:pqr:")) != -1) {
+    switch (opt) {
+      case 'b':                     // bar width in msec
+        width = atol (optarg);
+        break;
+      case 'j':                     // worker threads
+        nthreads = atoi (optarg);
+        break;
+      case 'p':                     // print the volume profile
+        profile = 1;
+        break;
+      case 'q':                     // summary only
+        quiet = 1;
+        break;
+      case 'r':                     // bars in the rolling volatility window
+        window = atoi (optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-b msec] [-j threads] [-p] [-q] [-r bars] file\n", argv[0]);
+        exit(1);
+    }
+  }
+  if ((optind >= argc) || (width <= 0) || (window <= 0)) {
+    fprintf(stderr, "usage: %s [-b msec] [-j threads] [-p] [-q] [-r bars] file\n", argv[0]);
+    exit(1);
+  }
+  if (nthreads < 1)
+    nthreads = 1;
+
+  if (((fd = open (argv[optind], O_RDONLY)) < 0) || (fstat (fd, &st) != 0)) {
+    perror (argv[optind]);
+    exit(1);
+  }
+  if (st.st_size < (long) sizeof (tapeHeader)) {
+    fprintf(stderr, "%s: %s is empty\n", argv[0], argv[optind]);
+    exit(1);
+  }
+  h = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (h == MAP_FAILED) {
+    perror ("mmap");
+    exit(1);
+  }
+  if ((h->magic != TAPEMAGIC) || (h->version != TAPEVERSION) || (h->block != TAPEBLOCK)) {
+    fprintf(stderr, "%s: %s is not a version %d tape of %d trade blocks\n", argv[0], argv[optind],
+            TAPEVERSION, TAPEBLOCK);
+    exit(1);
+  }
+  blocks = (tapeBlock *) (h + 1);
+  nblocks = (st.st_size - sizeof (tapeHeader)) / sizeof (tapeBlock);
+  if (nblocks == 0) {
+    fprintf(stderr, "%s: no trades in %s\n", argv[0], argv[optind]);
+    exit(1);
+  }
+  if (nthreads > nblocks)
+    nthreads = nblocks;
+  madvise (h, st.st_size, MADV_SEQUENTIAL);
+
+  for (p = 1; p < NPRICES; p++)
+    lg[p] = log ((double) p);
+
+  gettimeofday (&t0, NULL);
+  tid = (pthread_t *) malloc (nthreads * sizeof (pthread_t));
+  w = (worker *) calloc (nthreads, sizeof (worker));
+  for (i = 0; i < nthreads; i++) {
+    w[i].first = nblocks * i / nthreads;
+    w[i].last = nblocks * (i + 1) / nthreads;
+    w[i].tmin = blocks[w[i].first].timestamp[0];
+    w[i].tmax = w[i].tmin;
+    pthread_create (&tid[i], NULL, span, &w[i]);
+  }
+  for (i = 0; i < nthreads; i++)
+    pthread_join (tid[i], NULL);
+  for (i = 1; i < nthreads; i++) {
+    w[0].tmin = (w[i].tmin < w[0].tmin) ? w[i].tmin : w[0].tmin;
+    w[0].tmax = (w[i].tmax > w[0].tmax) ? w[i].tmax : w[0].tmax;
+  }
+  base = w[0].tmin / width;
+  nbars = w[0].tmax / width - base + 1;
+
+  for (i = 0; i < nthreads; i++)
+    pthread_create (&tid[i], NULL, reduce, &w[i]);
+  for (i = 0; i < nthreads; i++)
+    pthread_join (tid[i], NULL);
+  bars = w[0].bars;
+  prof = w[0].profile;
+  for (i = 1; i < nthreads; i++) {
+    for (b = 0; b < nbars; b++)
+      merge (&bars[b], &w[i].bars[b]);
+    for (p = 0; p < NPRICES; p++)
+      prof[p] += w[i].profile[p];
+  }
+  reduceMsec = msecSince (&t0);
+
+  for (b = 0; b < nbars; b++) {
+    trades += bars[b].trades;
+    volume += bars[b].volume;
+    notional += bars[b].notional;
+    var += bars[b].var;
+  }
+  if (!quiet)
+    printBars (bars, window);
+  if (profile)
+    printProfile (prof, volume);
+
+  fprintf(stderr, "%ld trades in %ld bars of %ld msec, volume %ld, vwap %.2f, realised volatility %.3f%%\n",
+          trades, nbars, width, volume, (double) notional / volume / 10.0, 100.0 * sqrt (var));
+  fprintf(stderr, "reduced in %.1f msec with %d threads, %.1f Mtrades/sec\n", reduceMsec, nthreads,
+          trades / reduceMsec / 1000.0);
+
+  exit(0);
+}
@@ -0,0 +1,628 @@
+/*
+ *      Microbenchmarks for the marketSim queue and book primitives
+ *
+ *      Every primitive is run at a few book depths, with the ring in
+ *      different wrap-around states and with limit prices either spread
+ *      uniformly or clustered around the touch. Each timed batch of
+ *      BATCH operations is followed by an untimed restore, so every
+ *      batch starts from the same state.
+ */
+
+#define NOMAIN
+#include "marketSim.c"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#define BATCH 500
+#define ROUNDS 20
+
+#define UNIFORM 0
+#define CLUSTERED 1
+
+#define WRAP_NONE 0
+#define WRAP_SPLIT 1
+#define WRAP_TAIL0 2
+
+int depths[] = { 10, 1000, QUEUESIZE - BATCH };
+#define NDEPTHS ((int) (sizeof (depths) / sizeof (depths[0])))
+char *distName[] = { "uniform", "clustered" };
+char *wrapName[] = { "head=0", "wrapped", "tail=0" };
+
+int perfCycles = -1, perfMisses = -1;
+
+typedef struct {
+  double nsec;
+  unsigned long cycles, misses;
+  long ops;
+} sample;
+
+char *filter = NULL;
+
+queue *q, *saved;
+book *b;
+
+
+
+// ****************************************************************
+int perfOpen (unsigned long config, int group) {
+  struct perf_event_attr pe;
+
+  memset (&pe, 0, sizeof (pe));
+  pe.type = PERF_TYPE_HARDWARE;
+  pe.size = sizeof (pe);
+  pe.config = config;
+  pe.disabled = (group == -1);
+  pe.exclude_kernel = 1;
+  pe.exclude_hv = 1;
+  pe.read_format = PERF_FORMAT_GROUP;
+
+  return syscall (__NR_perf_event_open, &pe, 0, -1, group, 0);
+}
+
+
+
+// ****************************************************************
+void perfInit () {
+  perfCycles = perfOpen (PERF_COUNT_HW_CPU_CYCLES, -1);
+  if (perfCycles < 0) {
+    fprintf(stderr, "perf_event_open not available, cycles and cache misses are not reported\n");
+    return;
+  }
+  perfMisses = perfOpen (PERF_COUNT_HW_CACHE_MISSES, perfCycles);
+}
+
+
+
+// ****************************************************************
+void benchStart (struct timespec *t0) {
+  if (perfCycles >= 0) {
+    ioctl (perfCycles, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl (perfCycles, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+  clock_gettime (CLOCK_MONOTONIC, t0);
+}
+
+
+
+// ****************************************************************
+void benchStop (struct timespec *t0, sample *s, long ops) {
+  struct timespec t1;
+  struct { unsigned long nr, values[2]; } counts;
+
+  clock_gettime (CLOCK_MONOTONIC, &t1);
+  s->nsec += (t1.tv_sec - t0->tv_sec) * 1.0e9 + (t1.tv_nsec - t0->tv_nsec);
+  s->ops += ops;
+  if (perfCycles >= 0) {
+    ioctl (perfCycles, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    memset (&counts, 0, sizeof (counts));
+    if (read (perfCycles, &counts, sizeof (counts)) > 0) {
+      s->cycles += counts.values[0];
+      s->misses += counts.values[1];
+    }
+  }
+}
+
+
+
+// ****************************************************************
+void benchReport (char *name, int depth, char *ring, char *prices, sample *s) {
+  printf("%-16s %6d  %-8s %-10s %9.1f", name, depth, ring, prices, s->nsec / s->ops);
+  if (perfCycles >= 0)
+    printf(" %10.1f", (double) s->cycles / s->ops);
+  else
+    printf(" %10s", "-");
+  if (perfMisses >= 0)
+    printf(" %10.2f", (double) s->misses / s->ops);
+  else
+    printf(" %10s", "-");
+  printf("\n");
+  fflush(stdout);
+}
+
+
+
+// ****************************************************************
+int benchWanted (char *name) {
+  return (filter == NULL) || (strstr (name, filter) != NULL);
+}
+
+
+
+// ****************************************************************
+// Buy side limit prices: uniform over 10 price units, or at a
+// geometric distance below a touch of 1000.
+int benchPrice (int dist) {
+  int d = 0;
+
+  if (dist == UNIFORM)
+    return 950 + rand() % 101;
+  while ((d < 50) && (rand() & 3))
+    d++;
+  return 1000 - d;
+}
+
+
+
+// ****************************************************************
+order benchOrder (long id, int dist) {
+  order ord;
+
+  memset (&ord, 0, sizeof (ord));
+  ord.id = id;
+  ord.type = 'L';
+  ord.action = 'B';
+  ord.vol = 5000;
+  ord.price1 = benchPrice (dist);
+  return ord;
+}
+
+
+
+// ****************************************************************
+int comparePrice (const void *a, const void *b) {
+  return ((order *) b)->price1 - ((order *) a)->price1;
+}
+
+
+
+// ****************************************************************
+// depth buy limit orders sorted by price, laid out so the ring is
+// in the requested wrap-around state.
+void queueFill (queue *q, int depth, int wrap, int dist) {
+  static order tmp[QUEUESIZE];
+  int i;
+
+  q->head = (wrap == WRAP_NONE) ? 0 : (wrap == WRAP_SPLIT) ? QUEUESIZE - depth / 2 : QUEUESIZE - depth;
+  q->tail = q->head;
+  q->empty = 1;
+  q->full = 0;
+  for (i = 0; i < depth; i++)
+    tmp[i] = benchOrder (i, dist);
+  qsort (tmp, depth, sizeof (order), comparePrice);
+  for (i = 0; i < depth; i++)
+    queueAdd (q, tmp[i]);
+}
+
+
+
+// ****************************************************************
+void queueRestore (queue *q, queue *from, int all) {
+  if (all)
+    memcpy (q->item, from->item, sizeof (q->item));
+  q->head = from->head;
+  q->tail = from->tail;
+  q->empty = from->empty;
+  q->full = from->full;
+}
+
+
+
+// ****************************************************************
+void benchQueue (int depth, int wrap) {
+  struct timespec t0;
+  sample s;
+  order ord;
+  int r, i;
+
+  if (benchWanted ("queueAdd")) {
+    memset (&s, 0, sizeof (s));
+    queueFill (q, depth, wrap, UNIFORM);
+    queueRestore (saved, q, 1);
+    ord = benchOrder (depth, UNIFORM);
+    for (r = 0; r < ROUNDS; r++) {
+      benchStart (&t0);
+      for (i = 0; i < BATCH; i++)
+        queueAdd (q, ord);
+      benchStop (&t0, &s, BATCH);
+      queueRestore (q, saved, 0);
+    }
+    benchReport ("queueAdd", depth, wrapName[wrap], "-", &s);
+  }
+
+  if (benchWanted ("queueDel")) {
+    memset (&s, 0, sizeof (s));
+    queueFill (q, depth + BATCH, wrap, UNIFORM);
+    queueRestore (saved, q, 1);
+    for (r = 0; r < ROUNDS; r++) {
+      benchStart (&t0);
+      for (i = 0; i < BATCH; i++)
+        queueDel (q, &ord);
+      benchStop (&t0, &s, BATCH);
+      queueRestore (q, saved, 0);
+    }
+    benchReport ("queueDel", depth + BATCH, wrapName[wrap], "-", &s);
+  }
+
+  if (benchWanted ("queuePush")) {
+    memset (&s, 0, sizeof (s));
+    queueFill (q, depth, wrap, UNIFORM);
+    queueRestore (saved, q, 1);
+    ord = benchOrder (depth, UNIFORM);
+    for (r = 0; r < ROUNDS; r++) {
+      benchStart (&t0);
+      for (i = 0; i < BATCH; i++)
+        queuePush (q, ord);
+      benchStop (&t0, &s, BATCH);
+      queueRestore (q, saved, 0);
+    }
+    benchReport ("queuePush", depth, wrapName[wrap], "-", &s);
+  }
+}
+
+
+
+// ****************************************************************
+void benchSorted (int depth, int wrap, int dist) {
+  static order ins[BATCH];
+  static long ids[BATCH];
+  struct timespec t0;
+  sample s;
+  order out;
+  int r, i, k;
+
+  queueFill (q, depth, wrap, dist);
+  queueRestore (saved, q, 1);
+  k = (depth < BATCH) ? depth : BATCH;
+
+  if (benchWanted ("queueAddSort")) {
+    memset (&s, 0, sizeof (s));
+    for (r = 0; r < ROUNDS; r++) {
+      for (i = 0; i < BATCH; i++)
+        ins[i] = benchOrder (depth + i, dist);
+      benchStart (&t0);
+      for (i = 0; i < BATCH; i++)
+        queueAddSort (q, ins[i]);
+      benchStop (&t0, &s, BATCH);
+      queueRestore (q, saved, 1);
+    }
+    benchReport ("queueAddSort", depth, wrapName[wrap], distName[dist], &s);
+  }
+
+  if (benchWanted ("queueDelIndex")) {
+    memset (&s, 0, sizeof (s));
+    for (r = 0; r < ROUNDS; r++) {
+      for (i = 0; i < k; i++)
+        ids[i] = (depth * (long) i) / k + rand() % ((depth + k - 1) / k);
+      out.oldid = 0;
+      benchStart (&t0);
+      for (i = 0; i < k; i++) {
+        out.oldid = ids[i];
+        queueDelIndex (q, out, &out);
+      }
+      benchStop (&t0, &s, k);
+      queueRestore (q, saved, 1);
+    }
+    benchReport ("queueDelIndex", depth, wrapName[wrap], distName[dist], &s);
+  }
+
+  if (benchWanted ("cancel scan")) {
+    memset (&s, 0, sizeof (s));
+    for (r = 0; r < ROUNDS; r++) {
+      for (i = 0; i < BATCH; i++)
+        ids[i] = rand() % depth;
+      benchStart (&t0);
+      for (i = 0; i < BATCH; i++)
+        queueFind (q, ids[i]);
+      benchStop (&t0, &s, BATCH);
+    }
+    benchReport ("cancel scan", depth, wrapName[wrap], distName[dist], &s);
+  }
+}
+
+
+
+// ****************************************************************
+void benchBook (int depth, int dist) {
+  static order ins[BATCH];
+  agentDepth levels[10];
+  struct timespec t0;
+  sample s;
+  order ord, out;
+  int r, i, k;
+
+  b = bookInit ('B');
+  for (i = 0; i < depth; i++)
+    bookAdd (b, benchOrder (i, dist));
+  k = (depth < BATCH) ? depth : BATCH;
+
+  if (benchWanted ("bookAdd")) {
+    memset (&s, 0, sizeof (s));
+    for (r = 0; r < ROUNDS; r++) {
+      for (i = 0; i < BATCH; i++)
+        ins[i] = benchOrder (depth + i, dist);
+      benchStart (&t0);
+      for (i = 0; i < BATCH; i++)
+        bookAdd (b, ins[i]);
+      benchStop (&t0, &s, BATCH);
+      for (i = 0; i < BATCH; i++)
+        bookDelId (b, ins[i].id, &out);
+    }
+    benchReport ("bookAdd", depth, "-", distName[dist], &s);
+  }
+
+  if (benchWanted ("bookDelId")) {
+    memset (&s, 0, sizeof (s));
+    for (r = 0; r < ROUNDS; r++) {
+      for (i = 0; i < k; i++)
+        ins[i].id = (depth * (long) i) / k + rand() % ((depth + k - 1) / k);
+      benchStart (&t0);
+      for (i = 0; i < k; i++)
+        bookDelId (b, ins[i].id, &ins[i]);
+      benchStop (&t0, &s, k);
+      for (i = 0; i < k; i++)
+        bookAdd (b, ins[i]);
+    }
+    benchReport ("bookDelId", depth, "-", distName[dist], &s);
+  }
+
+  if (benchWanted ("bookDel")) {
+    memset (&s, 0, sizeof (s));
+    for (r = 0; r < ROUNDS; r++) {
+      benchStart (&t0);
+      for (i = 0; i < k; i++)
+        bookDel (b, &ins[i]);
+      benchStop (&t0, &s, k);
+      for (i = k - 1; i >= 0; i--)
+        bookPush (b, ins[i]);
+    }
+    benchReport ("bookDel", depth, "-", distName[dist], &s);
+  }
+
+  if (benchWanted ("bookModify")) {
+    memset (&s, 0, sizeof (s));
+    memset (&ord, 0, sizeof (ord));
+    for (r = 0; r < ROUNDS; r++) {
+      for (i = 0; i < k; i++)
+        ins[i].oldid = rand() % depth;
+      benchStart (&t0);
+      for (i = 0; i < k; i++) {
+        ord.oldid = ins[i].oldid;
+        ord.vol = 4000 - r;
+        bookModify (b, ord, &out);
+      }
+      benchStop (&t0, &s, k);
+    }
+    benchReport ("bookModify", depth, "-", distName[dist], &s);
+  }
+
+  if (benchWanted ("bookDepth")) {
+    memset (&s, 0, sizeof (s));
+    for (r = 0; r < ROUNDS; r++) {
+      benchStart (&t0);
+      for (i = 0; i < k; i++)
+        bookDepth (b, levels, 10);
+      benchStop (&t0, &s, k);
+    }
+    benchReport ("bookDepth", depth, "-", distName[dist], &s);
+  }
+
+  if (benchWanted ("bookPosition")) {
+    memset (&s, 0, sizeof (s));
+    for (r = 0; r < ROUNDS; r++) {
+      for (i = 0; i < k; i++)
+        ins[i].id = rand() % depth;
+      benchStart (&t0);
+      for (i = 0; i < k; i++)
+        bookPosition (b, ins[i].id, NULL);
+      benchStop (&t0, &s, k);
+    }
+    benchReport ("bookPosition", depth, "-", distName[dist], &s);
+  }
+
+  bookDelete (b);
+}
+
+
+
+// ****************************************************************
+void benchStops (int depth, int dist) {
+  static stopQueue savedStops;
+  static order ins[BATCH];
+  struct timespec t0;
+  stopQueue *sq;
+  sample s;
+  int r, i;
+
+  if (!benchWanted ("stopAdd"))
+    return;
+  sq = stopInit ('B');
+  for (i = 0; i < depth; i++) {
+    ins[0] = benchOrder (i, dist);
+    ins[0].price2 = 2000 - ins[0].price1;
+    stopAdd (sq, ins[0]);
+  }
+  memcpy (&savedStops, sq, sizeof (stopQueue));
+
+  memset (&s, 0, sizeof (s));
+  for (r = 0; r < ROUNDS; r++) {
+    for (i = 0; i < BATCH; i++) {
+      ins[i] = benchOrder (depth + i, dist);
+      ins[i].price2 = 2000 - ins[i].price1;
+    }
+    benchStart (&t0);
+    for (i = 0; i < BATCH; i++)
+      stopAdd (sq, ins[i]);
+    benchStop (&t0, &s, BATCH);
+    memcpy (sq, &savedStops, sizeof (stopQueue));
+  }
+  benchReport ("stopAdd", depth, "-", distName[dist], &s);
+  stopDelete (sq);
+}
+
+
+
+// ****************************************************************
+unsigned char *putBE (unsigned char *p, unsigned long v, int bytes) {
+  while (bytes--)
+    *p++ = v >> (8 * bytes);
+  return p;
+}
+
+
+
+// ****************************************************************
+// ITCH messages of one stock with about depth orders live.
+long itchFill (unsigned char *buf, long size, int depth, int dist) {
+  static unsigned long live[QUEUESIZE];
+  unsigned char *p = buf, *m;
+  unsigned long ref = 1, ts = 34200000000000UL;
+  int n = 0, i, u;
+  long msgs = 0;
+
+  while (p + 64 < buf + size) {
+    ts += rand() % 1000000;
+    u = rand() % 100;
+    m = p + 2;
+    m[ITCH_TYPE] = (n < depth) ? ITCH_ADD : (u < 30) ? ITCH_EXEC : (u < 45) ? ITCH_CANCEL :
+                   (u < 75) ? ITCH_DELETE : (u < 85) ? ITCH_REPLACE : 'S';
+    putBE (m + ITCH_LOCATE, 7, 2);
+    putBE (m + ITCH_LOCATE + 2, 0, 2);
+    putBE (m + ITCH_TIMESTAMP, ts, 6);
+    i = rand() % ((n > 0) ? n : 1);
+    switch (m[ITCH_TYPE]) {
+      case ITCH_ADD:
+        putBE (m + ITCH_REF, live[n++] = ref++, 8);
+        m[ITCH_ADD_SIDE] = (rand() & 1) ? 'B' : 'S';
+        putBE (m + ITCH_ADD_SHARES, 100000, 4);
+        memcpy (m + ITCH_ADD_STOCK, "BENCH   ", 8);
+        putBE (m + ITCH_ADD_PRICE, benchPrice (dist) * ITCH_PRICEX10, 4);
+        p = putBE (p, ITCH_ADD_LEN, 2) + ITCH_ADD_LEN;
+        break;
+      case ITCH_EXEC:
+        putBE (m + ITCH_REF, live[i], 8);
+        putBE (m + ITCH_EXEC_SHARES, 100, 4);
+        putBE (m + ITCH_EXEC_SHARES + 4, msgs, 8);
+        p = putBE (p, ITCH_EXEC_LEN, 2) + ITCH_EXEC_LEN;
+        break;
+      case ITCH_CANCEL:
+        putBE (m + ITCH_REF, live[i], 8);
+        putBE (m + ITCH_CANCEL_SHARES, 100, 4);
+        p = putBE (p, ITCH_CANCEL_LEN, 2) + ITCH_CANCEL_LEN;
+        break;
+      case ITCH_DELETE:
+        putBE (m + ITCH_REF, live[i], 8);
+        live[i] = live[--n];
+        p = putBE (p, ITCH_DELETE_LEN, 2) + ITCH_DELETE_LEN;
+        break;
+      case ITCH_REPLACE:
+        putBE (m + ITCH_REF, live[i], 8);
+        putBE (m + ITCH_REPLACE_NEWREF, live[i] = ref++, 8);
+        putBE (m + ITCH_REPLACE_SHARES, 100000, 4);
+        putBE (m + ITCH_REPLACE_PRICE, benchPrice (dist) * ITCH_PRICEX10, 4);
+        p = putBE (p, ITCH_REPLACE_LEN, 2) + ITCH_REPLACE_LEN;
+        break;
+      default:
+        p = putBE (p, 12, 2) + 12;
+        break;
+    }
+    msgs++;
+  }
+  return p - buf;
+}
+
+
+
+// ****************************************************************
+// Parse and map a whole file of messages; ops are orders made.
+void benchItch (int depth, int dist) {
+  static unsigned char buf[16 << 20];
+  char name[] = "/tmp/marketBench.XXXXXX";
+  struct timespec t0;
+  long size, n = 0;
+  sample s;
+  order ord;
+  feed *f;
+  int fd, r;
+
+  if (!benchWanted ("feedNext"))
+    return;
+  size = itchFill (buf, sizeof (buf), depth, dist);
+  if (((fd = mkstemp (name)) < 0) || (write (fd, buf, size) != size)) {
+    perror (name);
+    return;
+  }
+  close (fd);
+
+  memset (&s, 0, sizeof (s));
+  for (r = 0; r < ROUNDS / 4; r++) {
+    if ((f = feedOpen (name, "BENCH")) == NULL)
+      break;
+    benchStart (&t0);
+    for (n = 0; feedNext (f, &ord); n++)
+      ;
+    benchStop (&t0, &s, n);
+    munmap (f->map, f->size);
+    free (f->refs);
+    free (f);
+  }
+  unlink (name);
+  benchReport ("feedNext", depth, "-", distName[dist], &s);
+}
+
+
+
+// ****************************************************************
+// One event into a ring of the calling thread, drained between batches.
+void benchTrace (void) {
+  struct timespec t0;
+  sample s;
+  int r, i;
+
+  if (!benchWanted ("trace"))
+    return;
+  traces = (traceRing *) calloc (1, sizeof (traceRing));
+  tring = traces;
+  tracing = 1;
+  memset (&s, 0, sizeof (s));
+  for (r = 0; r < ROUNDS; r++) {
+    benchStart (&t0);
+    for (i = 0; i < BATCH; i++)
+      trace (TRACE_ENQUEUE, i, 1);
+    benchStop (&t0, &s, BATCH);
+    tring->tail = tring->head;
+  }
+  benchReport ("trace", 0, "-", "-", &s);
+  tracing = 0;
+  tring = NULL;
+  free (traces);
+  traces = NULL;
+}
+
+
+
+// ****************************************************************
+int main (int argc, char **argv) {
+  int d, w, p;
+
+  if (argc > 1)
+    filter = argv[1];
+  srand (0);
+  perfInit ();
+  admit = admitInit ("block");
+
+  q = queueInit ();
+  saved = queueInit ();
+
+  printf("%-16s %6s  %-8s %-10s %9s %10s %10s\n", "primitive", "depth", "ring", "prices", "nsec/op", "cycles/op", "misses/op");
+  for (d = 0; d < NDEPTHS; d++)
+    for (w = 0; w < 3; w++)
+      benchQueue (depths[d], w);
+  for (d = 0; d < NDEPTHS; d++)
+    for (w = 0; w < 3; w++)
+      for (p = 0; p < 2; p++)
+        benchSorted (depths[d], w, p);
+  for (d = 0; d < NDEPTHS; d++)
+    for (p = 0; p < 2; p++)
+      benchBook (depths[d], p);
+  for (d = 0; d < NDEPTHS; d++)
+    for (p = 0; p < 2; p++)
+      benchStops (depths[d], p);
+  for (d = 0; d < NDEPTHS; d++)
+    for (p = 0; p < 2; p++)
+      benchItch (depths[d], p);
+  benchTrace ();
+
+  return 0;
+}
@@ -0,0 +1,1294 @@
+/*
+ *      Differential checker for the marketSim matching engine
+ *
+ *      A reference matcher, written for clarity over speed with plain
+ *      arrays and linear scans, applies an inbound stream one order at a
+ *      time. The engine runs the same stream in sequenced mode (-d -r)
+ *      and has to print the same tape, line for line, and the same final
+ *      state (-b). Streams are either replayed from a file recorded with
+ *      marketSim -w, or fuzzed from a seed against the reference book,
+ *      so that stops, cancels, modifies and expiries keep hitting live
+ *      orders. Expiries that fall on the same tick may come out in any
+ *      order and are compared as a set. Pegged orders are priced from a
+ *      touch kept as the engine keeps it: moved by every change of the
+ *      books but a stage taking its next order, and set again after
+ *      every match. The risk limits and the stop triggers are the
+ *      reference's own too, so a fault in the engine's is caught.
+ *      A scripted stop cascade and a stop fired by a feed execution are
+ *      checked before the fuzzing.
+ *
+ *      ./marketCheck [-e engine] [-i iterations] [-m modes] [-n orders] [-r file] [-s seed]
+ */
+
+#define NOMAIN
+#include "marketSim.c"
+
+#include <stdarg.h>
+
+#define REFMAX QUEUESIZE
+#define HEADROOM 100
+
+typedef struct {
+  order ord;
+  long rank;                    // priority within its price, lower first
+  long due;                     // expiry tick, 0 for none
+} refOrder;
+
+typedef struct {
+  refOrder item[REFMAX];
+  int n;
+} refList;
+
+typedef struct {
+  char *s;
+  long cause;                   // inbound order that printed it, -1 for the engine
+} line;
+
+typedef struct {
+  line *l;
+  long n, size;
+} tape;
+
+// The reference book: market queues, limit books, stops, the queue of
+// each peg and the four orders posted to Market, numbered as in orderAdd
+refList bm, sm, bl, sl, bs, ss;
+refList bp[NPEGS], sp[NPEGS];
+int refTouch[2];
+order slot[4];
+int posted[4];
+long rankTail, rankFront, lastTick, refClock, refNext, refClosed;
+
+// Open volume and position of each account, the feed's last
+long refOpen[NACCOUNTS + 1], refPos[NACCOUNTS + 1];
+
+tape ref, eng;
+long cause;
+
+unsigned long rng;
+char *engine = "./marketSim";
+
+
+
+// ****************************************************************
+unsigned long rnd (unsigned long n) {
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return n ? (rng * 0x2545f4914f6cdd1dUL) % n : 0;
+}
+
+
+
+// ****************************************************************
+void tapeAdd (tape *t, char *s, long c) {
+  if (t->n == t->size) {
+    t->size = t->size ? 2 * t->size : 65536;
+    t->l = (line *) realloc (t->l, t->size * sizeof (line));
+  }
+  t->l[t->n].s = strdup (s);
+  t->l[t->n].cause = c;
+  t->n++;
+}
+
+
+
+// ****************************************************************
+void tapeFree (tape *t) {
+  long i;
+
+  for (i = 0; i < t->n; i++)
+    free (t->l[i].s);
+  t->n = 0;
+}
+
+
+
+// ****************************************************************
+void out (const char *fmt, ...) {
+  char buf[256];
+  va_list ap;
+
+  va_start (ap, fmt);
+  vsnprintf (buf, sizeof (buf), fmt, ap);
+  va_end (ap);
+  tapeAdd (&ref, buf, cause);
+}
+
+
+
+// ****************************************************************
+void refAppend (refList *l, order ord, long rank, long due) {
+  l->item[l->n].ord = ord;
+  l->item[l->n].rank = rank;
+  l->item[l->n].due = due;
+  l->n++;
+}
+
+
+
+// ****************************************************************
+void refInsert (refList *l, int i, order ord, long rank, long due) {
+  memmove (&l->item[i + 1], &l->item[i], (l->n - i) * sizeof (refOrder));
+  l->n++;
+  l->item[i].ord = ord;
+  l->item[i].rank = rank;
+  l->item[i].due = due;
+}
+
+
+
+// ****************************************************************
+order refRemove (refList *l, int i) {
+  order ord = l->item[i].ord;
+
+  memmove (&l->item[i], &l->item[i + 1], (l->n - i - 1) * sizeof (refOrder));
+  l->n--;
+  return ord;
+}
+
+
+
+// ****************************************************************
+int refFind (refList *l, long id) {
+  int i;
+
+  for (i = 0; i < l->n; i++)
+    if (l->item[i].ord.id == id)
+      return i;
+  return NIL;
+}
+
+
+
+// ****************************************************************
+// Highest bid or lowest ask, the earliest of them on a tie.
+int refBest (refList *l, char side) {
+  int i, b = NIL;
+  refOrder *x, *y;
+
+  for (i = 0; i < l->n; i++) {
+    x = &l->item[i];
+    y = &l->item[b];
+    if ((b == NIL) ||
+        ((side == 'B') ? (x->ord.price1 > y->ord.price1) : (x->ord.price1 < y->ord.price1)) ||
+        ((x->ord.price1 == y->ord.price1) && (x->rank < y->rank)))
+      b = i;
+  }
+  return b;
+}
+
+
+
+// ****************************************************************
+// Next stop to fire: the lowest buy or the highest sell trigger.
+int refNextStop (refList *l, char side) {
+  int i, b = NIL;
+  refOrder *x, *y;
+
+  for (i = 0; i < l->n; i++) {
+    x = &l->item[i];
+    y = &l->item[b];
+    if ((b == NIL) ||
+        ((side == 'B') ? (x->ord.price2 < y->ord.price2) : (x->ord.price2 > y->ord.price2)) ||
+        ((x->ord.price2 == y->ord.price2) && (x->rank < y->rank)))
+      b = i;
+  }
+  return b;
+}
+
+
+
+// ****************************************************************
+// As bookEnd, for every change of one side but a stage's take.
+void refTouchSet (int side) {
+  refList *l = side ? &sl : &bl;
+  int i;
+
+  refTouch[side] = ((i = refBest (l, side ? 'S' : 'B')) != NIL) ? l->item[i].ord.price1 : NIL;
+}
+
+
+
+// ****************************************************************
+int refPegPrice (int side, int k) {
+  int own = refTouch[side], other = refTouch[!side];
+
+  if (k == PEG_PRIMARY)
+    return own;
+  if (k == PEG_MARKET)
+    return other;
+  if ((own == NIL) || (other == NIL))
+    return NIL;
+  return (own + other + side) / 2;
+}
+
+
+
+// ****************************************************************
+// As bookNext: the better price, then the earlier order, then the limit
+// order. NPEGS for a limit order, at *at in the book, else the peg.
+int refNextOrder (int side, int *at, int *price) {
+  refList *l = side ? &sl : &bl, *peg = side ? sp : bp;
+  int from = NIL, best = NIL, k, p;
+  long first = 0;
+
+  if ((*at = refBest (l, side ? 'S' : 'B')) != NIL) {
+    from = NPEGS;
+    best = l->item[*at].ord.price1;
+    first = l->item[*at].ord.timestamp;
+  }
+  for (k = 0; k < NPEGS; k++) {
+    if ((peg[k].n == 0) || ((p = refPegPrice (side, k)) == NIL))
+      continue;
+    if ((from == NIL) || (side ? (p < best) : (p > best)) ||
+        ((p == best) && (peg[k].item[0].ord.timestamp < first))) {
+      from = k;
+      best = p;
+      first = peg[k].item[0].ord.timestamp;
+    }
+  }
+  *price = best;
+  return from;
+}
+
+
+
+// ****************************************************************
+// A stage takes the next order of side if it trades at the last price.
+int refTake (int side, order *out) {
+  int from, at, price;
+
+  if (((from = refNextOrder (side, &at, &price)) == NIL) ||
+      (side ? (price > currentPriceX10) : (price < currentPriceX10)))
+    return 0;
+  if (from == NPEGS)
+    *out = refRemove (side ? &sl : &bl, at);
+  else {
+    *out = refRemove (side ? &sp[from] : &bp[from], 0);
+    out->price1 = price;
+  }
+  return 1;
+}
+
+
+
+// ****************************************************************
+// The pre-trade limits, from the rules rather than the engine's gate.
+int refRisk (order ord) {
+  int a = ord.account, price = currentPriceX10;
+  long pos;
+
+  if (a == FEEDACCOUNT)
+    return RISK_OK;
+  if ((a < 0) || (a >= NACCOUNTS) || (ord.vol <= 0) || (ord.vol > RISKMAXORDER))
+    return RISK_SIZE;
+  if ((ord.type == 'L') || (ord.type == 'T') || ((ord.type == 'R') && (ord.price1 != 0))) {
+    if (abs (ord.price1 - price) > RISKBAND)
+      return RISK_PRICE;
+    price = ord.price1;
+  }
+  if (ord.type == 'R')
+    return RISK_OK;
+  if (refOpen[a] + ord.vol > RISKMAXOPEN)
+    return RISK_OPEN;
+  pos = refPos[a] + ((ord.action == 'B') ? ord.vol : -ord.vol);
+  if (labs (pos) > RISKMAXPOSITION)
+    return RISK_POSITION;
+  if (labs (pos) * price > RISKMAXNOTIONAL)
+    return RISK_NOTIONAL;
+  return RISK_OK;
+}
+
+
+
+// ****************************************************************
+// Only the account of an order may modify it.
+int refRiskModify (order old, order ord) {
+  order more = old;
+
+  if (ord.account != old.account)
+    return RISK_OWNER;
+  if (ord.vol <= old.vol)
+    return RISK_OK;
+  more.type = 'L';
+  more.vol = ord.vol - old.vol;
+  more.price1 = ord.price1 ? ord.price1 : old.price1;
+  return refRisk (more);
+}
+
+
+
+// ****************************************************************
+// Accepted with vol > 0, released unfilled with -vol, amended with the
+// difference.
+void refOpenAdd (order ord, long vol) {
+  refOpen[ord.account] += vol;
+}
+
+
+
+// ****************************************************************
+void refRelease (order ord) {
+  refOpenAdd (ord, -ord.vol);
+}
+
+
+
+// ****************************************************************
+void refFill (order ord, int volume) {
+  refOpen[ord.account] -= volume;
+  refPos[ord.account] += (ord.action == 'B') ? volume : -volume;
+}
+
+
+
+// ****************************************************************
+// A buy stop fires once the last trade is at or above its trigger, a
+// sell stop at or below.
+int refStopCrossed (order ord) {
+  return (ord.action == 'B') ? (currentPriceX10 >= ord.price2) : (currentPriceX10 <= ord.price2);
+}
+
+
+
+// ****************************************************************
+// A stop becomes a market order, a stop-limit a limit order at price1;
+// returns the orderAdd flag.
+int refStopActivate (order *ord) {
+  ord->type = (ord->type == 'S') ? 'M' : 'L';
+  return ((ord->type == 'M') ? 0 : 2) + (ord->action == 'S');
+}
+
+
+
+// ****************************************************************
+long refDue (order ord) {
+  if (ord.expire == 0)
+    return 0;
+  return (ord.expire > lastTick) ? ord.expire : lastTick + 1;
+}
+
+
+
+// ****************************************************************
+// As orderAdd (front 0) and orderPush (front 1).
+void refRoute (int flag, order ord, int front) {
+  refList *l = (flag == 0) ? &bm : (flag == 1) ? &sm : (flag == 2) ? &bl : &sl;
+
+  if ((flag >= 2) && (ord.type == 'P'))
+    l = (flag == 2) ? &bp[ord.price2] : &sp[ord.price2];
+  if ((flag < 2) || (ord.type == 'P')) {
+    if (front)
+      refInsert (l, 0, ord, 0, 0);
+    else
+      refAppend (l, ord, 0, 0);
+  }
+  else {
+    refAppend (l, ord, front ? --rankFront : ++rankTail, refDue (ord));
+    refTouchSet (flag - 2);
+  }
+}
+
+
+
+// ****************************************************************
+void refTrade (order order1, order order2, int volume) {
+  refFill (order1, volume);
+  refFill (order2, volume);
+  out ("Timestamp: %ld Price: %d\tVolume: %d\torderid1: %ld orderid2: %ld", refClock,
+       currentPriceX10, volume, order1.id, order2.id);
+}
+
+
+
+// ****************************************************************
+// As stopMatch, with refTake for the stage of the other side.
+void refStopMatch (int flag, order *ord) {
+  int buy = !(flag & 1), from, at, price, limit, q;
+  order rest;
+
+  while (ord->vol > 0) {
+    limit = (flag >= 2) ? ord->price1 : currentPriceX10;
+    if (buy ? (limit < currentPriceX10) : (limit > currentPriceX10))
+      return;
+    if (((from = refNextOrder (!buy, &at, &price)) != NIL) && (buy ? (price >= limit) : (price <= limit)))
+      return;
+    if (((from = refNextOrder (buy, &at, &price)) == NIL) || ((flag >= 2) && (buy ? (price > limit) : (price < limit))) ||
+        (!refTake (buy, &rest)))
+      return;
+
+    currentPriceX10 = (flag < 2) ? price : (ord->price1 + price) / 2;
+    q = (ord->vol < rest.vol) ? ord->vol : rest.vol;
+    if ((flag < 2) || (buy))
+      refTrade (*ord, rest, q);
+    else
+      refTrade (rest, *ord, q);
+    if (rest.vol > q) {
+      rest.vol -= q;
+      refRoute (buy ? 3 : 2, rest, 1);
+    }
+    ord->vol -= q;
+    refTouchSet (0);
+    refTouchSet (1);
+  }
+}
+
+
+
+// ****************************************************************
+// As stopTrigger: held has a bit for each order of Market that goes first.
+void refStopTrigger (int held) {
+  refList *l;
+  order ord;
+  int side, i, flag, fired;
+
+  do {
+    fired = 0;
+    for (side = 0; side < 2; side++) {
+      l = (side == 0) ? &bs : &ss;
+      while (((i = refNextStop (l, (side == 0) ? 'B' : 'S')) != NIL) && (refStopCrossed (l->item[i].ord))) {
+        ord = refRemove (l, i);
+        fired = 1;
+        out ("%ld %s Stop Order ---> Triggered at %d", ord.id, (side == 0) ? "Buy" : "Sell", currentPriceX10);
+        flag = refStopActivate (&ord);
+        if ((phase != CALL) && (!(held & 12)) && ((flag >= 2) || (!(held & (1 << flag)))))
+          refStopMatch (flag, &ord);
+        if (ord.vol == 0)
+          continue;
+        if (flag < 2)
+          held |= 1 << flag;
+        refRoute (flag, ord, flag < 2);
+      }
+    }
+  } while (fired);
+}
+
+
+
+// ****************************************************************
+void refTransaction (order order1, order order2, int id1, int id2) {
+  int volume = (order1.vol < order2.vol) ? order1.vol : order2.vol;
+
+  refTrade (order1, order2, volume);
+  if (order1.vol > order2.vol) {
+    order1.vol -= order2.vol;
+    refRoute (id1, order1, 1);
+  }
+  else if (order1.vol < order2.vol) {
+    order2.vol -= order1.vol;
+    refRoute (id2, order2, 1);
+  }
+}
+
+
+
+// ****************************************************************
+// Let the stages take what they may, then match until one side of
+// Market has nothing posted.
+void refRun () {
+  while (1) {
+    if (phase != CALL) {
+      if ((!posted[0]) && (bm.n > 0))
+        slot[0] = refRemove (&bm, 0), posted[0] = 1;
+      if ((!posted[1]) && (sm.n > 0))
+        slot[1] = refRemove (&sm, 0), posted[1] = 1;
+      if (!posted[2])
+        posted[2] = refTake (0, &slot[2]);
+      if (!posted[3])
+        posted[3] = refTake (1, &slot[3]);
+    }
+    if ((!(posted[0] || posted[2])) || (!(posted[1] || posted[3])))
+      return;
+
+    if (posted[2] && posted[3]) {
+      currentPriceX10 = (slot[2].price1 + slot[3].price1) / 2;
+      posted[2] = posted[3] = 0;
+      refTransaction (slot[2], slot[3], 2, 3);
+      refStopTrigger (posted[0] | (posted[1] << 1));
+    }
+    if (posted[0] && posted[3]) {
+      currentPriceX10 = slot[3].price1;
+      posted[0] = posted[3] = 0;
+      refTransaction (slot[0], slot[3], 0, 3);
+      refStopTrigger ((posted[1] << 1) | (slot[0].vol > slot[3].vol));
+    }
+    if (posted[1] && posted[2]) {
+      currentPriceX10 = slot[2].price1;
+      posted[1] = posted[2] = 0;
+      refTransaction (slot[1], slot[2], 1, 2);
+      refStopTrigger (posted[0] | ((slot[1].vol > slot[2].vol) << 1));
+    }
+    if (posted[0] && posted[1]) {
+      posted[0] = posted[1] = 0;
+      refTransaction (slot[0], slot[1], 0, 1);
+    }
+    refTouchSet (0);
+    refTouchSet (1);
+  }
+}
+
+
+
+// ****************************************************************
+void refExpire (long now) {
+  refList *l;
+  int side, i;
+
+  for (side = 0; side < 2; side++) {
+    l = (side == 0) ? &bl : &sl;
+    for (i = 0; i < l->n; )
+      if ((l->item[i].due) && (l->item[i].due <= now)) {
+        out ("%ld %s Limit Order ---> Expired", l->item[i].ord.id, (side == 0) ? "Buy" : "Sell");
+        refRelease (refRemove (l, i));
+        refTouchSet (side);
+      }
+      else
+        i++;
+  }
+  lastTick = now;
+}
+
+
+
+// ****************************************************************
+long refVol (refList *l, int side, int p) {
+  long vol = 0;
+  int i;
+
+  for (i = 0; i < l->n; i++)
+    if ((side == NIL) || ((side == 'B') ? (l->item[i].ord.price1 >= p) : (l->item[i].ord.price1 <= p)))
+      vol += l->item[i].ord.vol;
+  return vol;
+}
+
+
+
+// ****************************************************************
+// The most volume, then the least imbalance, then nearest the last
+// price, over every price between the touches and the last price.
+int refAuctionPrice (long *volume) {
+  int ref = currentPriceX10, lo = ref, hi = ref, p, price = NIL, i;
+  long demand, supply, v, imb, bestImb = 0;
+
+  if ((i = refBest (&bl, 'B')) != NIL) {
+    if (bl.item[i].ord.price1 < lo) lo = bl.item[i].ord.price1;
+    if (bl.item[i].ord.price1 > hi) hi = bl.item[i].ord.price1;
+  }
+  if ((i = refBest (&sl, 'S')) != NIL) {
+    if (sl.item[i].ord.price1 < lo) lo = sl.item[i].ord.price1;
+    if (sl.item[i].ord.price1 > hi) hi = sl.item[i].ord.price1;
+  }
+
+  *volume = 0;
+  for (p = hi; p >= lo; p--) {
+    demand = refVol (&bm, NIL, 0) + refVol (&bl, 'B', p);
+    supply = refVol (&sm, NIL, 0) + refVol (&sl, 'S', p);
+    v = (demand < supply) ? demand : supply;
+    imb = labs (demand - supply);
+    if ((v > *volume) ||
+        ((v == *volume) && (v > 0) && ((imb < bestImb) ||
+         ((imb == bestImb) && (abs (p - ref) < abs (price - ref)))))) {
+      *volume = v;
+      bestImb = imb;
+      price = p;
+    }
+  }
+  return price;
+}
+
+
+
+// ****************************************************************
+order refAuctionNext (refList *q, refList *b, char side) {
+  order o;
+
+  if (q->n > 0)
+    return refRemove (q, 0);
+  o = refRemove (b, refBest (b, side));
+  refTouchSet (side == 'S');
+  return o;
+}
+
+
+
+// ****************************************************************
+void refUncross (int next) {
+  order buy, sell;
+  long volume;
+  int price, q;
+
+  price = refAuctionPrice (&volume);
+  if (volume > 0) {
+    currentPriceX10 = price;
+    buy = refAuctionNext (&bm, &bl, 'B');
+    sell = refAuctionNext (&sm, &sl, 'S');
+    while (1) {
+      q = (buy.vol < sell.vol) ? buy.vol : sell.vol;
+      refTrade (buy, sell, q);
+      buy.vol -= q;
+      sell.vol -= q;
+      volume -= q;
+      if (volume == 0)
+        break;
+      if (buy.vol == 0)
+        buy = refAuctionNext (&bm, &bl, 'B');
+      if (sell.vol == 0)
+        sell = refAuctionNext (&sm, &sl, 'S');
+    }
+    if (buy.vol > 0)
+      refRoute ((buy.type == 'M') ? 0 : 2, buy, 1);
+    if (sell.vol > 0)
+      refRoute ((sell.type == 'M') ? 1 : 3, sell, 1);
+    refStopTrigger (posted[0] | (posted[1] << 1) | (posted[2] << 2) | (posted[3] << 3));
+  }
+  phase = next;
+}
+
+
+
+// ****************************************************************
+void refAuctionStep (long now) {
+  long day;
+
+  if (batchMsec) {
+    if (refNext == 0)
+      refNext = batchMsec;
+    if (now >= refNext) {
+      refUncross (CALL);
+      refNext = now + batchMsec;
+    }
+    return;
+  }
+
+  day = now / DAYMSEC;
+  now = now % DAYMSEC;
+  if ((phase == CALL) && (now >= OPENMSEC) && (now < DAYMSEC - CLOSEMSEC)) {
+    out ("*** Opening auction");
+    refUncross (CONTINUOUS);
+  }
+  else if ((phase == CONTINUOUS) && (now >= DAYMSEC - CLOSEMSEC)) {
+    out ("*** Closing call");
+    phase = CALL;
+  }
+  else if ((phase == CALL) && (now >= DAYMSEC - CLOSEUNCROSS) && (refClosed != day)) {
+    out ("*** Closing auction");
+    refUncross (CALL);
+    refClosed = day;
+  }
+}
+
+
+
+// ****************************************************************
+void refCancel (order ord) {
+  char *name[] = { "Buy Limit", "Buy Pegged", "Buy Pegged", "Buy Pegged", "Sell Limit", "Sell Pegged",
+                   "Sell Pegged", "Sell Pegged", "Buy Market", "Sell Market", "Buy Stop", "Sell Stop" };
+  refList *l[] = { &bl, &bp[0], &bp[1], &bp[2], &sl, &sp[0], &sp[1], &sp[2], &bm, &sm, &bs, &ss };
+  int k, i;
+
+  _Static_assert (NPEGS == 3, "a name for every peg queue");
+  for (k = 0; k < 12; k++)
+    if ((i = refFind (l[k], ord.oldid)) != NIL) {
+      refRelease (refRemove (l[k], i));
+      out ("%ld %s Order ---> Cancelled", ord.oldid, name[k]);
+      if (k % 4 == 0)
+        refTouchSet (k / 4);
+      return;
+    }
+}
+
+
+
+// ****************************************************************
+void refModify (order ord) {
+  refList *l = &bl;
+  refOrder *x;
+  order old;
+  int i, price, reason;
+
+  if ((i = refFind (&bl, ord.oldid)) == NIL)
+    i = refFind (l = &sl, ord.oldid);
+  if (i == NIL) {
+    out ("%ld Modify Order ---> Rejected (unknown order %ld)", ord.id, ord.oldid);
+    return;
+  }
+  x = &l->item[i];
+  old = x->ord;
+  if ((reason = refRiskModify (old, ord))) {
+    out ("%ld Order ---> Rejected (risk %d)", ord.id, reason);
+    return;
+  }
+  refOpenAdd (old, ord.vol - old.vol);
+  if ((ord.price1 == 0) || (ord.price1 == old.price1))
+    out ("%ld %s Limit Order ---> Modified (%d)", ord.oldid, (l == &bl) ? "Buy" : "Sell", ord.vol);
+  else
+    out ("%ld %s Limit Order ---> Replaced (%d,%d)", ord.oldid, (l == &bl) ? "Buy" : "Sell", ord.vol, ord.price1);
+
+  price = ord.price1 ? ord.price1 : old.price1;
+  if ((price != old.price1) || (ord.vol > old.vol))
+    x->rank = ++rankTail;
+  x->ord.price1 = price;
+  x->ord.vol = ord.vol;
+  refTouchSet (l == &sl);
+}
+
+
+
+// ****************************************************************
+// As orderExecute.
+void refExecute (order ord) {
+  refList *l = &bl;
+  order rest;
+  int i, vol;
+
+  if ((i = refFind (&bl, ord.oldid)) == NIL)
+    i = refFind (l = &sl, ord.oldid);
+  if (i == NIL) {
+    out ("%ld Execution ---> Ignored (unknown order %ld)", ord.id, ord.oldid);
+    refRelease (ord);
+    return;
+  }
+  rest = l->item[i].ord;
+  vol = (ord.vol < rest.vol) ? ord.vol : rest.vol;
+  if (vol < rest.vol)
+    l->item[i].ord.vol -= vol;
+  else
+    refRemove (l, i);
+  refTouchSet (l == &sl);
+
+  currentPriceX10 = (ord.price1) ? ord.price1 : rest.price1;
+  ord.action = (rest.action == 'B') ? 'S' : 'B';
+  if (rest.action == 'B')
+    refTrade (rest, ord, vol);
+  else
+    refTrade (ord, rest, vol);
+  ord.vol -= vol;
+  if (ord.vol)
+    refRelease (ord);
+  refStopTrigger (posted[0] | (posted[1] << 1) | (posted[2] << 2) | (posted[3] << 3));
+}
+
+
+
+// ****************************************************************
+// Everything Cons and the stages behind it do with one inbound order.
+void refApply (order ord) {
+  int reason, flag;
+
+  refClock = ord.timestamp;
+  refExpire (ord.timestamp);
+  if ((batchMsec) || (openClose))
+    refAuctionStep (ord.timestamp);
+  refRun ();
+
+  if (ord.type != 'C') {
+    if ((reason = refRisk (ord))) {
+      out ("%ld Order ---> Rejected (risk %d)", ord.id, reason);
+      return;
+    }
+    if (ord.type != 'R')
+      refOpenAdd (ord, ord.vol);
+  }
+
+  switch (ord.type) {
+    case 'M':
+      refRoute ((ord.action == 'B') ? 0 : 1, ord, 0);
+      break;
+
+    case 'L':
+      if ((ord.price1 <= 0) || (ord.price1 >= MAXTICK)) {
+        out ("%ld Limit Order ---> Rejected (price)", ord.id);
+        refRelease (ord);
+      }
+      else
+        refRoute ((ord.action == 'B') ? 2 : 3, ord, 0);
+      break;
+
+    case 'P':
+      if ((ord.price2 < 0) || (ord.price2 >= NPEGS)) {
+        out ("%ld Pegged Order ---> Rejected (peg)", ord.id);
+        refRelease (ord);
+      }
+      else
+        refRoute ((ord.action == 'B') ? 2 : 3, ord, 0);
+      break;
+
+    case 'S':
+    case 'T':
+      if (((ord.type == 'T') && ((ord.price1 <= 0) || (ord.price1 >= MAXTICK))) ||
+          (ord.price2 <= 0) || (ord.price2 >= MAXTICK)) {
+        out ("%ld Stop Order ---> Rejected (price)", ord.id);
+        refRelease (ord);
+      }
+      else if (refStopCrossed (ord)) {
+        flag = refStopActivate (&ord);
+        refRoute (flag, ord, 0);
+      }
+      else
+        refAppend ((ord.action == 'B') ? &bs : &ss, ord, ++rankTail, 0);
+      break;
+
+    case 'E':
+      refExecute (ord);
+      break;
+
+    case 'R':
+      if ((ord.price1 < 0) || (ord.price1 >= MAXTICK))
+        out ("%ld Modify Order ---> Rejected (price)", ord.id);
+      else
+        refModify (ord);
+      break;
+
+    default:
+      refCancel (ord);
+      break;
+  }
+  refRun ();
+}
+
+
+
+// ****************************************************************
+int byPrice (const void *a, const void *b) {
+  const refOrder *x = a, *y = b;
+
+  if (x->ord.price1 != y->ord.price1)
+    return (x->ord.price1 < y->ord.price1) ? -1 : 1;
+  return (x->rank < y->rank) ? -1 : (x->rank > y->rank);
+}
+
+
+
+// ****************************************************************
+int byTrigger (const void *a, const void *b) {
+  const refOrder *x = a, *y = b;
+
+  if (x->ord.price2 != y->ord.price2)
+    return (x->ord.price2 < y->ord.price2) ? -1 : 1;
+  return (x->rank < y->rank) ? -1 : (x->rank > y->rank);
+}
+
+
+
+// ****************************************************************
+// Same layout as stateDump in the engine.
+void refDump () {
+  static refOrder tmp[REFMAX];
+  refList *l;
+  int side, i, k;
+
+  out ("*** Final state, price %d", currentPriceX10);
+  for (side = 0; side < 2; side++) {
+    l = (side == 0) ? &bm : &sm;
+    for (i = 0; i < l->n; i++)
+      out ("%s Market %ld %d", (side == 0) ? "Buy" : "Sell", l->item[i].ord.id, l->item[i].ord.vol);
+  }
+  for (side = 0; side < 2; side++) {
+    l = (side == 0) ? &bl : &sl;
+    memcpy (tmp, l->item, l->n * sizeof (refOrder));
+    for (i = 0; (side == 0) && (i < l->n); i++)
+      tmp[i].ord.price1 = -tmp[i].ord.price1;
+    qsort (tmp, l->n, sizeof (refOrder), byPrice);
+    for (i = 0; i < l->n; i++)
+      out ("%s Limit %ld %d %d", (side == 0) ? "Buy" : "Sell", tmp[i].ord.id, tmp[i].ord.vol,
+           abs (tmp[i].ord.price1));
+    for (k = 0; k < NPEGS; k++) {
+      l = (side == 0) ? &bp[k] : &sp[k];
+      for (i = 0; i < l->n; i++)
+        out ("%s Pegged %ld %d %d", (side == 0) ? "Buy" : "Sell", l->item[i].ord.id, l->item[i].ord.vol, k);
+    }
+  }
+  for (side = 0; side < 2; side++) {
+    l = (side == 0) ? &bs : &ss;
+    memcpy (tmp, l->item, l->n * sizeof (refOrder));
+    for (i = 0; (side == 1) && (i < l->n); i++)
+      tmp[i].ord.price2 = -tmp[i].ord.price2;
+    qsort (tmp, l->n, sizeof (refOrder), byTrigger);
+    for (i = 0; i < l->n; i++)
+      out ("%s Stop %ld %d %d", (side == 0) ? "Buy" : "Sell", tmp[i].ord.id, tmp[i].ord.vol,
+           abs (tmp[i].ord.price2));
+  }
+  if (posted[0])
+    out ("Posted Buy Market %ld %d", slot[0].id, slot[0].vol);
+  if (posted[1])
+    out ("Posted Sell Market %ld %d", slot[1].id, slot[1].vol);
+  if (posted[2])
+    out ("Posted Buy Limit %ld %d %d", slot[2].id, slot[2].vol, slot[2].price1);
+  if (posted[3])
+    out ("Posted Sell Limit %ld %d %d", slot[3].id, slot[3].vol, slot[3].price1);
+}
+
+
+
+// ****************************************************************
+void refReset (char mode) {
+  int i;
+
+  bm.n = sm.n = bl.n = sl.n = bs.n = ss.n = 0;
+  for (i = 0; i < NPEGS; i++)
+    bp[i].n = sp[i].n = 0;
+  refTouch[0] = refTouch[1] = NIL;
+  memset (posted, 0, sizeof (posted));
+  rankTail = rankFront = 0;
+  lastTick = -1;
+  refNext = 0;
+  refClosed = -1;
+  currentPriceX10 = 1000;
+  batchMsec = (mode == 'a') ? 20 : 0;
+  openClose = (mode == 'o');
+  phase = ((batchMsec) || (openClose)) ? CALL : CONTINUOUS;
+  memset (refOpen, 0, sizeof (refOpen));
+  memset (refPos, 0, sizeof (refPos));
+}
+
+
+
+// ****************************************************************
+// Next fuzzed order, made against the reference book.
+order fuzzOrder (long id, long *clock) {
+  order ord;
+  double u = rnd (1000000) / 1e6;
+  int p = currentPriceX10, i;
+
+  memset (&ord, 0, sizeof (order));
+  *clock += rnd (11);
+  ord.id = id;
+  ord.timestamp = *clock;
+  ord.account = rnd (NACCOUNTS);
+  ord.action = rnd (2) ? 'B' : 'S';
+  ord.vol = (rnd (10) == 0) ? (1 + rnd (5)) * 100 : (1 + rnd (50)) * 100;
+
+  if (u < 0.30)
+    ord.type = 'M';
+  else if (u < 0.34) {
+    ord.type = 'P';
+    ord.price2 = (rnd (50) == 0) ? NPEGS : rnd (NPEGS);
+  }
+  else if (u < 0.70) {
+    ord.type = 'L';
+    ord.price1 = p - 10 + rnd (21);
+    if (rnd (20) == 0)
+      ord.price1 = p - 100 + rnd (201);
+    u = rnd (10);
+    if (u >= 4)
+      ord.expire = (u < 7) ? (ord.timestamp / DAYMSEC + 1) * DAYMSEC : ord.timestamp + 1 + rnd (2000);
+  }
+  else if (u < 0.76) {
+    ord.type = rnd (2) ? 'S' : 'T';
+    ord.price2 = (ord.action == 'B') ? p + 1 + rnd (10) : p - 1 - rnd (10);
+    ord.price1 = (ord.action == 'B') ? ord.price2 + rnd (5) : ord.price2 - rnd (5);
+  }
+  else if (u < 0.98) {
+    ord.type = (u < 0.90) ? 'C' : 'R';
+    ord.oldid = (rnd (5) && (id > 0)) ? id - 1 - rnd ((id < 300) ? id : 300) : rnd (id + 1);
+    if (ord.type == 'R')
+      ord.price1 = rnd (2) ? 0 : p - 10 + rnd (21);
+    // mostly from the account of the order, if it rests
+    if ((ord.type == 'R') && (rnd (10)) && ((i = refFind (&bl, ord.oldid)) != NIL))
+      ord.account = bl.item[i].ord.account;
+    else if ((ord.type == 'R') && (rnd (10)) && ((i = refFind (&sl, ord.oldid)) != NIL))
+      ord.account = sl.item[i].ord.account;
+  }
+  else {
+    // out of range prices for the reject paths
+    ord.type = "LTRS"[rnd (4)];
+    ord.oldid = id - 1;
+    ord.price2 = p;
+    ord.price1 = rnd (2) ? -1 : MAXTICK;
+    if (ord.type == 'S')
+      ord.price2 = ord.price1;
+  }
+  return ord;
+}
+
+
+
+// ****************************************************************
+void readEngine (char *cmd) {
+  char buf[256];
+  FILE *p;
+
+  if ((p = popen (cmd, "r")) == NULL) {
+    perror (cmd);
+    exit (1);
+  }
+  while (fgets (buf, sizeof (buf), p)) {
+    buf[strcspn (buf, "\n")] = 0;
+    tapeAdd (&eng, buf, NIL);
+  }
+  if (pclose (p) != 0) {
+    fprintf(stderr, "%s failed\n", cmd);
+    exit (1);
+  }
+}
+
+
+
+// ****************************************************************
+int byLine (const void *a, const void *b) {
+  return strcmp (((line *) a)->s, ((line *) b)->s);
+}
+
+
+
+// ****************************************************************
+// Expiries of one tick come out in wheel order on the engine side.
+void normalize (tape *t) {
+  long i, j;
+
+  for (i = 0; i < t->n; i = j) {
+    for (j = i; (j < t->n) && (strstr (t->l[j].s, "---> Expired")); j++)
+      ;
+    if (j - i > 1)
+      qsort (&t->l[i], j - i, sizeof (line), byLine);
+    if (j == i)
+      j++;
+  }
+}
+
+
+
+// ****************************************************************
+// Index of the first line the tapes differ in, or -1.
+long compare () {
+  long i;
+
+  normalize (&ref);
+  normalize (&eng);
+  for (i = 0; (i < ref.n) && (i < eng.n); i++)
+    if (strcmp (ref.l[i].s, eng.l[i].s))
+      return i;
+  return (ref.n == eng.n) ? -1 : i;
+}
+
+
+
+// ****************************************************************
+void divergence (long i, order *stream, char mode, char *file, char *flags) {
+  long j, c;
+
+  printf("First divergence in mode %c at tape line %ld\n", mode, i + 1);
+  for (j = (i > 5) ? i - 5 : 0; j < i; j++)
+    printf("             %s\n", ref.l[j].s);
+  printf("  engine:    %s\n", (i < eng.n) ? eng.l[i].s : "(end of tape)");
+  printf("  reference: %s\n", (i < ref.n) ? ref.l[i].s : "(end of tape)");
+  c = (i < ref.n) ? ref.l[i].cause : ref.l[ref.n - 1].cause;
+  if (c >= 0) {
+    printf("  while applying inbound order %ld: ", c);
+    fflush (stdout);
+    dispOrder (stream[c]);
+  }
+  printf("Replay with %s -d -b -r %s%s%s\n", engine, file, (*flags) ? " " : "", flags);
+}
+
+
+
+// ****************************************************************
+order caseOrder (long id, char action, char type, int vol, int price1, int price2) {
+  order ord;
+
+  memset (&ord, 0, sizeof (order));
+  ord.id = id;
+  ord.timestamp = id + 1;
+  ord.account = 1 + id % (NACCOUNTS - 1);
+  ord.action = action;
+  ord.type = type;
+  ord.vol = vol;
+  ord.price1 = price1;
+  ord.price2 = price2;
+  return ord;
+}
+
+
+
+// ****************************************************************
+// A scripted stream: order last has to fire at least fired stops.
+void checkCase (char *name, order *stream, long n, long last, int fired) {
+  char file[64], cmd[512];
+  long i, k = 0;
+  FILE *f;
+
+  snprintf (file, sizeof (file), "/tmp/marketCheck.%d.%s", getpid(), name);
+  f = fopen (file, "w");
+  refReset ('c');
+  tapeFree (&ref);
+  tapeFree (&eng);
+  for (i = 0; i < n; i++) {
+    orderWrite (f, stream[i]);
+    cause = i;
+    refApply (stream[i]);
+  }
+  fclose (f);
+  cause = NIL;
+  refDump ();
+
+  snprintf (cmd, sizeof (cmd), "%s -d -b -r %s -s /marketCheck.%d 2>/dev/null", engine, file, getpid());
+  readEngine (cmd);
+  if ((i = compare ()) >= 0) {
+    divergence (i, stream, 'c', file, "");
+    exit (1);
+  }
+  for (i = 0; i < ref.n; i++)
+    if ((ref.l[i].cause == last) && (strstr (ref.l[i].s, "Triggered")))
+      k++;
+  if (k < fired) {
+    printf("case %s: order %ld fired %ld stops, not %d\n", name, last, k, fired);
+    exit (1);
+  }
+  printf("case %s: %ld tape lines agree, order %ld fired %ld stops\n", name, ref.n, last, k);
+  unlink (file);
+}
+
+
+
+// ****************************************************************
+// Each stop trades at a price that fires the next, within one order.
+void checkCascade () {
+  order s[8];
+
+  s[0] = caseOrder (0, 'S', 'L', 100, 1000, 0);
+  s[1] = caseOrder (1, 'S', 'L', 100, 1001, 0);
+  s[2] = caseOrder (2, 'S', 'L', 100, 1003, 0);
+  s[3] = caseOrder (3, 'S', 'L', 100, 1006, 0);
+  s[4] = caseOrder (4, 'B', 'T', 100, 1005, 1001);
+  s[5] = caseOrder (5, 'B', 'T', 100, 1009, 1003);
+  s[6] = caseOrder (6, 'B', 'T', 100, 1012, 1006);
+  s[7] = caseOrder (7, 'B', 'L', 100, 1002, 0);
+  checkCase ("cascade", s, 8, 7, 3);
+}
+
+
+
+// ****************************************************************
+// An execution from the feed prints above a buy stop, which fires and
+// takes the sell below it.
+void checkExecution () {
+  order s[4];
+
+  s[0] = caseOrder (0, 'S', 'L', 100, 1005, 0);
+  s[1] = caseOrder (1, 'S', 'L', 100, 1002, 0);
+  s[2] = caseOrder (2, 'B', 'S', 100, 0, 1003);
+  s[3] = caseOrder (3, 'B', 'E', 100, 0, 0);
+  s[3].account = FEEDACCOUNT;
+  s[3].oldid = 0;
+  checkCase ("execution", s, 4, 3, 1);
+}
+
+
+
+// ****************************************************************
+int main (int argc, char **argv) {
+  char *modes = "cao", *replayName = NULL, file[64], cmd[512], *flags;
+  long seed = 1, iterations = 1, orders = 100000, it, n = 0, i, clock, lines;
+  order *stream;
+  struct timeval t0, t1;
+  double sec;
+  FILE *f;
+  int opt, m;
+
+  while ((opt = getopt (argc, argv, "e:i:m:n:r:s:")) != -1) {
+    switch (opt) {
+      case 'e':                     // engine binary
+        engine = optarg;
+        break;
+      case 'i':                     // fuzz iterations, 0 runs until a divergence
+        iterations = atol (optarg);
+        break;
+      case 'm':                     // modes: c continuous, a batch auctions, o open and close
+        modes = optarg;
+        break;
+      case 'n':                     // orders per fuzzed stream
+        orders = atol (optarg);
+        break;
+      case 'r':                     // check a recorded stream instead of fuzzing
+        replayName = optarg;
+        iterations = 1;
+        break;
+      case 's':                     // first seed
+        seed = atol (optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-e engine] [-i iterations] [-m modes] [-n orders] [-r file] [-s seed]\n", argv[0]);
+        exit (1);
+    }
+  }
+
+  if (!replayName) {
+    checkCascade ();
+    checkExecution ();
+  }
+
+  stream = (order *) malloc (((replayName) ? QUEUESIZE : orders) * sizeof (order));
+  for (it = 0; (iterations == 0) || (it < iterations); it++) {
+    gettimeofday (&t0, NULL);
+    lines = 0;
+
+    for (m = 0; modes[m]; m++) {
+      refReset (modes[m]);
+      tapeFree (&ref);
+      tapeFree (&eng);
+
+      // The stream is read or fuzzed once, against the first mode
+      if (m == 0) {
+        if (replayName) {
+          if ((f = fopen (replayName, "r")) == NULL) {
+            perror (replayName);
+            exit (1);
+          }
+          for (n = 0; orderRead (f, &stream[n]); n++)
+            if (((n + 1) % QUEUESIZE) == 0)
+              stream = (order *) realloc (stream, (n + 1 + QUEUESIZE) * sizeof (order));
+          fclose (f);
+          strcpy (file, replayName);
+        }
+        else {
+          rng = 0x9e3779b97f4a7c15UL ^ (seed + it);
+          snprintf (file, sizeof (file), "/tmp/marketCheck.%d.%ld", getpid(), seed + it);
+          f = fopen (file, "w");
+          for (n = 0, clock = 0; n < orders; n++) {
+            // an engine queue that fills up would block Cons
+            if ((bm.n > REFMAX - HEADROOM) || (sm.n > REFMAX - HEADROOM) || (bl.n > REFMAX - HEADROOM) ||
+                (sl.n > REFMAX - HEADROOM) || (bs.n > REFMAX - HEADROOM) || (ss.n > REFMAX - HEADROOM))
+              break;
+            stream[n] = fuzzOrder (n, &clock);
+            orderWrite (f, stream[n]);
+            cause = n;
+            refApply (stream[n]);
+          }
+          fclose (f);
+          tapeFree (&ref);
+          refReset (modes[m]);
+        }
+      }
+      for (i = 0; i < n; i++) {
+        cause = i;
+        refApply (stream[i]);
+      }
+      cause = NIL;
+      refDump ();
+
+      flags = (modes[m] == 'a') ? "-a 20" : (modes[m] == 'o') ? "-o" : "";
+      snprintf (cmd, sizeof (cmd), "%s -d -b -r %s -s /marketCheck.%d %s 2>/dev/null", engine, file, getpid(), flags);
+      readEngine (cmd);
+      if ((i = compare ()) >= 0) {
+        divergence (i, stream, modes[m], file, flags);
+        exit (1);
+      }
+      lines += ref.n;
+    }
+
+    gettimeofday (&t1, NULL);
+    sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+    if (replayName)
+      printf("%s: ", replayName);
+    else
+      printf("seed %ld: ", seed + it);
+    printf("%ld orders, modes %s, %ld tape lines agree, %.0f orders/sec\n", n, modes, lines,
+           n * strlen (modes) / sec);
+    fflush (stdout);
+    if (!replayName)
+      unlink (file);
+  }
+
+  exit (0);
+}
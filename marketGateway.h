@@ -0,0 +1,117 @@
+/*
+ *      Order entry protocol of the marketSim gateway (-g port)
+ *
+ *      Every message starts with its length, not counting the length
+ *      field itself, and its type. Fields are packed and little endian.
+ *      A client sends new orders, cancels and modifies, each carrying a
+ *      reference of its own; the gateway answers each with an ack that
+ *      gives the engine id of the order, then sends a fill for every
+ *      trade and a reject for every order the engine turns down, both
+ *      by engine id. Cancels and modifies name the engine id of an
+ *      order of the same session. A mass quote replaces all the quotes
+ *      of the session; its ack gives id, and a new bid level k becomes
+ *      order id + k, a new ask level id + GW_QUOTELEVELS + k. A
+ *      connection the gateway has no session for gets a reject with
+ *      reason GW_REJECTBUSY and id -1, and is closed.
+ */
+
+#ifndef MARKETGATEWAY_H
+#define MARKETGATEWAY_H
+
+#define GW_NEW 'N'
+#define GW_CANCEL 'C'
+#define GW_MODIFY 'R'
+#define GW_QUOTE 'Q'
+#define GW_ACK 'A'
+#define GW_FILL 'F'
+#define GW_REJECT 'J'
+
+#define GW_ACCEPTED 0                   // ack status, queued for the engine
+#define GW_MALFORMED 1
+#define GW_NOTOWNER 2                   // cancel or modify of an order of another session
+#define GW_BUSY 3                       // turned away, the engine is behind (-q inbound=)
+
+#define GW_REJECTPRICE 16               // reject reason, besides the RISK_ codes
+#define GW_REJECTUNKNOWN 17             // modify of an order no longer in the book
+#define GW_REJECTBUSY 18                // its queue is past the admission mark
+#define GW_REJECTSHED 19                // shed as low priority flow
+
+#define GW_PEGPRIMARY 0                 // pegged to the best price of its own side
+#define GW_PEGMID 1                     // to the midpoint
+#define GW_PEGMARKET 2                  // to the best price of the other side
+
+#define GW_QUOTELEVELS 8                // a side of a mass quote
+#define GW_MAXMSG 160
+
+typedef struct __attribute__ ((packed)) {
+  unsigned short len;
+  char type;
+} gwHeader;
+
+typedef struct __attribute__ ((packed)) {
+  unsigned short len;
+  char type;                            // GW_NEW
+  char side;                            // 'B' or 'S'
+  char kind;                            // 'M', 'L', 'S', 'T' or 'P' as in order.type
+  unsigned short account;
+  int vol;
+  int price1, price2;                   // a pegged order gives its peg in price2
+  long ref;
+  long expire;                          // msec from now, limit orders only, 0 for none
+} gwNew;
+
+typedef struct __attribute__ ((packed)) {
+  unsigned short len;
+  char type;                            // GW_CANCEL
+  long ref;
+  long id;
+} gwCancel;
+
+typedef struct __attribute__ ((packed)) {
+  unsigned short len;
+  char type;                            // GW_MODIFY
+  long ref;
+  long id;
+  int vol;
+  int price1;                           // 0 keeps the price
+} gwModify;
+
+typedef struct __attribute__ ((packed)) {
+  int price1;
+  int vol;
+} gwLevel;
+
+typedef struct __attribute__ ((packed)) {
+  unsigned short len;
+  char type;                            // GW_QUOTE
+  unsigned short account;
+  char bids, asks;                      // levels that follow, the bids first, best first
+  long ref;
+  gwLevel level[];
+} gwQuote;
+
+typedef struct __attribute__ ((packed)) {
+  unsigned short len;
+  char type;                            // GW_ACK
+  char status;
+  long ref;
+  long id;
+} gwAck;
+
+typedef struct __attribute__ ((packed)) {
+  unsigned short len;
+  char type;                            // GW_FILL
+  long id;
+  long timestamp;
+  int price;
+  int vol;
+} gwFill;
+
+typedef struct __attribute__ ((packed)) {
+  unsigned short len;
+  char type;                            // GW_REJECT
+  char reason;
+  long id;
+} gwReject;
+
+#endif
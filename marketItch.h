@@ -0,0 +1,52 @@
+/*
+ *      ITCH 5.0 messages read by marketSim -i
+ *
+ *      The file is a sequence of messages, each preceded by its length
+ *      as a 2 byte big endian integer, as in the NASDAQ binary files.
+ *      Fields are big endian at fixed offsets. Only the order book
+ *      messages of one stock are used, everything else is stepped over
+ *      by its length.
+ */
+
+#ifndef MARKETITCH_H
+#define MARKETITCH_H
+
+#define ITCH_ADD 'A'
+#define ITCH_ADDMPID 'F'                // add order with attribution
+#define ITCH_EXEC 'E'
+#define ITCH_EXECPRICE 'C'              // executed at a price of its own
+#define ITCH_CANCEL 'X'                 // partial cancel
+#define ITCH_DELETE 'D'
+#define ITCH_REPLACE 'U'
+
+// Common to all of them
+#define ITCH_TYPE 0
+#define ITCH_LOCATE 1                   // 2 bytes, stock locate code
+#define ITCH_TIMESTAMP 5                // 6 bytes, nsec since midnight
+#define ITCH_REF 11                     // 8 bytes, order reference number
+
+#define ITCH_ADD_SIDE 19                // 'B' or 'S'
+#define ITCH_ADD_SHARES 20
+#define ITCH_ADD_STOCK 24               // 8 bytes, space padded
+#define ITCH_ADD_PRICE 32               // 1/10000 dollar
+#define ITCH_ADD_LEN 36
+#define ITCH_ADDMPID_LEN 40
+
+#define ITCH_EXEC_SHARES 19
+#define ITCH_EXEC_LEN 31
+#define ITCH_EXECPRICE_LEN 36
+#define ITCH_EXECPRICE_PRICE 32
+
+#define ITCH_CANCEL_SHARES 19
+#define ITCH_CANCEL_LEN 23
+
+#define ITCH_DELETE_LEN 19
+
+#define ITCH_REPLACE_NEWREF 19
+#define ITCH_REPLACE_SHARES 27
+#define ITCH_REPLACE_PRICE 31
+#define ITCH_REPLACE_LEN 35
+
+#define ITCH_PRICEX10 1000              // ITCH price units per engine tick
+
+#endif
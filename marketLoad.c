@@ -0,0 +1,266 @@
+/*
+ *      Load generator for the marketSim order entry gateway
+ *
+ *      Opens connections to marketSim -g and sends a paced mix of limit
+ *      orders, market orders and cancels of its own resting orders over
+ *      them, round robin. Every request carries a reference the client
+ *      keys its send time by; the ack gives the latency to the gateway
+ *      and back, the first fill of an order the latency from the wire to
+ *      the match. Both are printed as percentiles at the end, with the
+ *      counts of every ack status and reject reason.
+ *
+ *      ./marketLoad [-c connections] [-p port] [-r orders/sec] [-t seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "marketGateway.h"
+
+#define INBUF 65536
+#define LIVE 1024               // resting orders a connection may cancel
+
+typedef struct {
+  int fd;
+  unsigned char in[INBUF];
+  long have;
+  long live[LIVE];
+  int nlive;
+} conn;
+
+long *sent;                     // nsec, by reference
+long *refOf;                    // by engine id
+long *ackLat, *fillLat;
+long nrefs, nids, nacks, nfills;
+long status[256], reasons[256];
+int price = 1000;
+
+
+
+// ****************************************************************
+long nsec (void) {
+  struct timespec t;
+
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+
+
+// ****************************************************************
+void sendAll (int fd, void *msg, int len) {
+  int n;
+
+  while (len > 0) {
+    if ((n = send (fd, msg, len, 0)) < 0) {
+      perror ("send");
+      exit (1);
+    }
+    msg = (char *) msg + n;
+    len -= n;
+  }
+}
+
+
+
+// ****************************************************************
+void sendOne (conn *c) {
+  gwNew n = { .len = sizeof (gwNew) - 2, .type = GW_NEW };
+  gwCancel x = { .len = sizeof (gwCancel) - 2, .type = GW_CANCEL };
+  double u = (double) rand () / RAND_MAX;
+  int k;
+
+  sent[nrefs] = nsec ();
+  if ((u < 0.15) && (c->nlive)) {
+    k = rand () % c->nlive;
+    x.ref = nrefs++;
+    x.id = c->live[k];
+    c->live[k] = c->live[--c->nlive];
+    sendAll (c->fd, &x, sizeof (x));
+    return;
+  }
+  n.ref = nrefs++;
+  n.side = (rand () % 2) ? 'B' : 'S';
+  n.account = rand () % 64;
+  n.vol = (1 + rand () % 10) * 100;
+  if (u < 0.5) {
+    n.kind = 'M';
+  }
+  else {
+    n.kind = 'L';
+    n.price1 = price + rand () % 11 - 5;
+  }
+  sendAll (c->fd, &n, sizeof (n));
+}
+
+
+
+// ****************************************************************
+void receive (conn *c) {
+  gwAck *a;
+  gwFill *f;
+  gwReject *j;
+  unsigned char *m;
+  long at = 0, len, ref, now = nsec ();
+  int n;
+
+  if ((n = recv (c->fd, c->in + c->have, INBUF - c->have, MSG_DONTWAIT)) <= 0) {
+    if ((n < 0) && (errno == EAGAIN))
+      return;
+    fprintf(stderr, "connection closed by the gateway\n");
+    exit (1);
+  }
+  c->have += n;
+  while (c->have - at >= 2) {
+    m = c->in + at;
+    len = m[0] | (m[1] << 8);
+    if (c->have - at < len + 2)
+      break;
+    at += len + 2;
+    switch (m[2]) {
+      case GW_ACK:
+        a = (gwAck *) m;
+        status[(unsigned char) a->status]++;
+        ackLat[nacks++] = now - sent[a->ref];
+        if (a->id < 0)
+          break;
+        if (a->id >= nids) {
+          refOf = (long *) realloc (refOf, (a->id + 65536) * sizeof (long));
+          memset (refOf + nids, -1, (a->id + 65536 - nids) * sizeof (long));
+          nids = a->id + 65536;
+        }
+        refOf[a->id] = a->ref;
+        if (c->nlive < LIVE)
+          c->live[c->nlive++] = a->id;
+        break;
+      case GW_FILL:
+        f = (gwFill *) m;
+        price = f->price;
+        if ((f->id < nids) && ((ref = refOf[f->id]) >= 0)) {
+          fillLat[nfills++] = now - sent[ref];
+          refOf[f->id] = -1;
+        }
+        break;
+      case GW_REJECT:
+        j = (gwReject *) m;
+        if (j->id < 0) {
+          fprintf(stderr, "no free session at the gateway\n");
+          exit (1);
+        }
+        reasons[(unsigned char) j->reason]++;
+        break;
+    }
+  }
+  memmove (c->in, c->in + at, c->have - at);
+  c->have -= at;
+}
+
+
+
+// ****************************************************************
+int cmp (const void *a, const void *b) {
+  long x = *(long *) a, y = *(long *) b;
+
+  return (x > y) - (x < y);
+}
+
+
+
+// ****************************************************************
+void percentiles (char *name, long *lat, long n) {
+  if (n == 0) {
+    printf("%-6s none\n", name);
+    return;
+  }
+  qsort (lat, n, sizeof (long), cmp);
+  printf("%-6s %8ld  p50 %8.1f  p90 %8.1f  p99 %8.1f  p99.9 %8.1f  max %8.1f usec\n", name, n,
+         lat[n / 2] / 1e3, lat[n * 9 / 10] / 1e3, lat[n * 99 / 100] / 1e3, lat[n * 999 / 1000] / 1e3,
+         lat[n - 1] / 1e3);
+}
+
+
+
+// ****************************************************************
+int main (int argc, char **argv) {
+  struct sockaddr_in addr = { 0 };
+  struct epoll_event ev = { 0 }, evs[64];
+  long rate = 10000, seconds = 5, start, now, due, max;
+  int port = 9000, nconns = 4, opt, ep, i, k, n, on = 1;
+  conn *c;
+
+  while ((opt = getopt (argc, argv, "c:p:r:t:")) != -1) {
+    switch (opt) {
+      case 'c':                     // connections
+        nconns = atoi (optarg);
+        break;
+      case 'p':                     // gateway port
+        port = atoi (optarg);
+        break;
+      case 'r':                     // orders per second, all connections
+        rate = atol (optarg);
+        break;
+      case 't':                     // seconds of load
+        seconds = atol (optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-c connections] [-p port] [-r orders/sec] [-t seconds]\n", argv[0]);
+        exit (1);
+    }
+  }
+  if ((nconns < 1) || (rate < 1) || (seconds < 1)) {
+    fprintf(stderr, "usage: %s [-c connections] [-p port] [-r orders/sec] [-t seconds]\n", argv[0]);
+    exit (1);
+  }
+
+  max = rate * seconds;
+  sent = (long *) malloc (max * sizeof (long));
+  ackLat = (long *) malloc (max * sizeof (long));
+  fillLat = (long *) malloc (max * sizeof (long));
+  c = (conn *) calloc (nconns, sizeof (conn));
+  ep = epoll_create1 (0);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (port);
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  for (i = 0; i < nconns; i++) {
+    if (((c[i].fd = socket (AF_INET, SOCK_STREAM, 0)) < 0) ||
+        (connect (c[i].fd, (struct sockaddr *) &addr, sizeof (addr)) != 0)) {
+      perror ("connect");
+      exit (1);
+    }
+    setsockopt (c[i].fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    epoll_ctl (ep, EPOLL_CTL_ADD, c[i].fd, &ev);
+  }
+
+  // paced by the clock, whatever is due goes out between the reads
+  start = nsec ();
+  for (i = 0; (now = nsec ()) < start + (seconds + 1) * 1000000000L; ) {
+    due = (now - start) * rate / 1000000000L;
+    due = (due < max) ? due : max;
+    for (; nrefs < due; i = (i + 1) % nconns)
+      sendOne (&c[i]);
+    n = epoll_wait (ep, evs, 64, 1);
+    for (k = 0; k < n; k++)
+      receive (&c[evs[k].data.u32]);
+  }
+
+  printf("%ld requests over %d connections in %ld sec\n", nrefs, nconns, seconds);
+  printf("acks: accepted %ld  malformed %ld  not owner %ld\n", status[GW_ACCEPTED],
+         status[GW_MALFORMED], status[GW_NOTOWNER]);
+  printf("rejects: size %ld  price %ld  open %ld  position %ld  notional %ld  book price %ld  unknown %ld\n",
+         reasons[1], reasons[2], reasons[3], reasons[4], reasons[5], reasons[GW_REJECTPRICE],
+         reasons[GW_REJECTUNKNOWN]);
+  percentiles ("ack", ackLat, nacks);
+  percentiles ("fill", fillLat, nfills);
+  exit (0);
+}
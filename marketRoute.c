@@ -0,0 +1,396 @@
+/*
+ *      Smart order router over several marketSim venues
+ *
+ *      Every venue is a marketSim of its own, with a gateway (-g) and a
+ *      statistics segment (-s), pinned to its own CPUs (-C). The router
+ *      maps the segment of each venue read-only and reads its published
+ *      top of book in place; no message is needed to learn a price. It
+ *      makes parent orders at a paced rate and splits each across the
+ *      venues that are cheapest once their fee is added, up to the volume
+ *      each shows at its top. Whatever is left rests at the parent's limit
+ *      on the venue with the lowest fee. A child reaches its venue only
+ *      after the venue's latency. The end of the run gives, per venue,
+ *      the children, the volume sent, the volume filled and the fees. It
+ *      also gives the percentiles of the time to take a routing decision.
+ *
+ *      ./marketRoute -v port:segment[:fee[:usec]] ... [-r parents/sec] [-t seconds]
+ *
+ *      fee is in price tenths a share, usec the one way latency.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "marketStats.h"
+#include "marketGateway.h"
+
+#define MAXVENUES 64
+#define INBUF 65536
+#define DELAYED 4096            // children a venue may have on the way
+
+typedef struct {
+  long due;                     // nsec it reaches the venue
+  gwNew msg;
+} child;
+
+typedef struct {
+  char *segment;
+  double fee;
+  long latency;                 // nsec
+  int fd;
+  const statSegment *seg;
+  unsigned char in[INBUF];
+  long have;
+  child wait[DELAYED];
+  long head, tail;
+  long children, sent, filled, rejected, busy;
+  double fees, notional;
+} venue;
+
+typedef struct {
+  int price;
+  long vol;
+} top;
+
+venue v[MAXVENUES];
+int nvenues;
+long *decideNsec;
+long parents, routed, rested, nosplit;
+
+
+
+// ****************************************************************
+long nsec (void) {
+  struct timespec t;
+
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+
+
+// ****************************************************************
+void sendAll (int fd, void *msg, int len) {
+  int n;
+
+  while (len > 0) {
+    if ((n = send (fd, msg, len, 0)) < 0) {
+      perror ("send");
+      exit (1);
+    }
+    msg = (char *) msg + n;
+    len -= n;
+  }
+}
+
+
+
+// ****************************************************************
+// A consistent copy of one side of a venue's top of book.
+top topRead (const statTop *t) {
+  unsigned long s;
+  top x;
+
+  do {
+    while ((s = __atomic_load_n (&t->seq, __ATOMIC_ACQUIRE)) & 1)
+#if defined(__x86_64__) || defined(__i386__)
+      _mm_pause ();
+#else
+      ;
+#endif
+    x.price = t->price;
+    x.vol = t->vol;
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n (&t->seq, __ATOMIC_RELAXED) != s);
+  return x;
+}
+
+
+
+// ****************************************************************
+// port:segment[:fee[:usec]]
+void venueOpen (venue *x, char *spec, char *prog) {
+  struct sockaddr_in addr = { 0 };
+  char *port = strtok (spec, ":"), *fee, *usec;
+  int fd, on = 1;
+
+  x->segment = strtok (NULL, ":");
+  fee = strtok (NULL, ":");
+  usec = strtok (NULL, ":");
+  if ((port == NULL) || (x->segment == NULL)) {
+    fprintf(stderr, "%s: a venue is port:segment[:fee[:usec]]\n", prog);
+    exit (1);
+  }
+  x->fee = (fee) ? atof (fee) : 0.0;
+  x->latency = (usec) ? atol (usec) * 1000 : 0;
+
+  if ((fd = shm_open (x->segment, O_RDONLY, 0)) < 0) {
+    fprintf(stderr, "%s: no statistics segment %s, is the venue running?\n", prog, x->segment);
+    exit (1);
+  }
+  x->seg = mmap (NULL, sizeof (statSegment), PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (x->seg == MAP_FAILED) {
+    perror ("mmap");
+    exit (1);
+  }
+  if ((x->seg->magic != STATSMAGIC) || (x->seg->version != STATSVERSION)) {
+    fprintf(stderr, "%s: %s is not a version %d statistics segment\n", prog, x->segment, STATSVERSION);
+    exit (1);
+  }
+
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (atoi (port));
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (((x->fd = socket (AF_INET, SOCK_STREAM, 0)) < 0) ||
+      (connect (x->fd, (struct sockaddr *) &addr, sizeof (addr)) != 0)) {
+    perror ("connect");
+    exit (1);
+  }
+  setsockopt (x->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+}
+
+
+
+// ****************************************************************
+// Held back for the latency of the venue, sent by release.
+void childAdd (venue *x, char side, int vol, int price, long now) {
+  child *c;
+
+  if (x->tail - x->head == DELAYED) {
+    x->busy++;
+    return;
+  }
+  c = &x->wait[x->tail++ % DELAYED];
+  memset (c, 0, sizeof (*c));
+  c->due = now + x->latency;
+  c->msg.len = sizeof (gwNew) - 2;
+  c->msg.type = GW_NEW;
+  c->msg.side = side;
+  c->msg.kind = 'L';
+  c->msg.account = parents % 64;
+  c->msg.vol = vol;
+  c->msg.price1 = price;
+  c->msg.ref = parents;
+  x->children++;
+  x->sent += vol;
+}
+
+
+
+// ****************************************************************
+void release (long now) {
+  venue *x;
+  int k;
+
+  for (k = 0; k < nvenues; k++)
+    for (x = &v[k]; (x->head < x->tail) && (x->wait[x->head % DELAYED].due <= now); x->head++)
+      sendAll (x->fd, &x->wait[x->head % DELAYED].msg, sizeof (gwNew));
+}
+
+
+
+// ****************************************************************
+// The venues by the price with the fee, then the faster; the parent
+// rests what they do not show up to its limit.
+void route (char side, int vol, int limit, long now) {
+  int order[MAXVENUES], price[MAXVENUES], k, j, n = 0, s = (side == 'B'), cheapest = 0;
+  long size[MAXVENUES], t0 = nsec (), take;
+  double cost[MAXVENUES], c;
+  top x;
+
+  for (k = 0; k < nvenues; k++) {
+    x = topRead (&v[k].seg->top[s]);
+    if (v[k].fee < v[cheapest].fee)
+      cheapest = k;
+    if ((x.price < 0) || ((side == 'B') ? (x.price > limit) : (x.price < limit)))
+      continue;
+    price[k] = x.price;
+    size[k] = x.vol;
+    c = cost[k] = (side == 'B') ? x.price + v[k].fee : -(x.price - v[k].fee);
+    for (j = n; (j > 0) && ((cost[order[j - 1]] > c) ||
+                            ((cost[order[j - 1]] == c) && (v[order[j - 1]].latency > v[k].latency))); j--)
+      order[j] = order[j - 1];
+    order[j] = k;
+    n++;
+  }
+  for (j = 0; (j < n) && (vol > 0); j++) {
+    k = order[j];
+    take = (size[k] < vol) ? size[k] : vol;
+    childAdd (&v[k], side, take, price[k], now);
+    vol -= take;
+  }
+  if (vol > 0)
+    childAdd (&v[cheapest], side, vol, limit, now);
+  decideNsec[parents] = nsec () - t0;
+
+  routed += (n > 0);
+  rested += (vol > 0);
+  nosplit += (n <= 1);
+}
+
+
+
+// ****************************************************************
+void receive (venue *x) {
+  gwAck *a;
+  gwFill *f;
+  unsigned char *m;
+  long at = 0, len;
+  int n;
+
+  if ((n = recv (x->fd, x->in + x->have, INBUF - x->have, MSG_DONTWAIT)) <= 0) {
+    if ((n < 0) && (errno == EAGAIN))
+      return;
+    fprintf(stderr, "connection to %s closed by the gateway\n", x->segment);
+    exit (1);
+  }
+  x->have += n;
+  while (x->have - at >= 2) {
+    m = x->in + at;
+    len = m[0] | (m[1] << 8);
+    if (x->have - at < len + 2)
+      break;
+    at += len + 2;
+    switch (m[2]) {
+      case GW_ACK:
+        a = (gwAck *) m;
+        x->busy += (a->status == GW_BUSY);
+        break;
+      case GW_FILL:
+        f = (gwFill *) m;
+        x->filled += f->vol;
+        x->fees += f->vol * x->fee;
+        x->notional += (double) f->vol * f->price;
+        break;
+      case GW_REJECT:
+        x->rejected++;
+        break;
+    }
+  }
+  memmove (x->in, x->in + at, x->have - at);
+  x->have -= at;
+}
+
+
+
+// ****************************************************************
+int cmp (const void *a, const void *b) {
+  long x = *(long *) a, y = *(long *) b;
+
+  return (x > y) - (x < y);
+}
+
+
+
+// ****************************************************************
+// The mid of the best bid and ask over all venues, or the last price.
+int reference (void) {
+  int k, bid = -1, ask = -1;
+  top x;
+
+  for (k = 0; k < nvenues; k++) {
+    x = topRead (&v[k].seg->top[0]);
+    bid = (x.price > bid) ? x.price : bid;
+    x = topRead (&v[k].seg->top[1]);
+    ask = ((x.price >= 0) && ((ask < 0) || (x.price < ask))) ? x.price : ask;
+  }
+  if ((bid >= 0) && (ask >= 0))
+    return (bid + ask) / 2;
+  return v[0].seg->price;
+}
+
+
+
+// ****************************************************************
+int main (int argc, char **argv) {
+  struct epoll_event ev = { 0 }, evs[64];
+  long rate = 1000, seconds = 5, start, now, due, max, n;
+  int opt, ep, k, ref, vol;
+  char side;
+  venue *x;
+
+  while ((opt = getopt (argc, argv, "r:t:v:")) != -1) {
+    switch (opt) {
+      case 'r':                     // parent orders per second
+        rate = atol (optarg);
+        break;
+      case 't':                     // seconds of flow
+        seconds = atol (optarg);
+        break;
+      case 'v':                     // a venue, port:segment[:fee[:usec]]
+        if (nvenues == MAXVENUES) {
+          fprintf(stderr, "%s: %d venues at most\n", argv[0], MAXVENUES);
+          exit (1);
+        }
+        venueOpen (&v[nvenues++], optarg, argv[0]);
+        break;
+      default:
+        fprintf(stderr, "usage: %s -v port:segment[:fee[:usec]] ... [-r parents/sec] [-t seconds]\n", argv[0]);
+        exit (1);
+    }
+  }
+  if ((nvenues == 0) || (rate < 1) || (seconds < 1)) {
+    fprintf(stderr, "usage: %s -v port:segment[:fee[:usec]] ... [-r parents/sec] [-t seconds]\n", argv[0]);
+    exit (1);
+  }
+
+  max = rate * seconds;
+  decideNsec = (long *) malloc (max * sizeof (long));
+  ep = epoll_create1 (0);
+  for (k = 0; k < nvenues; k++) {
+    ev.events = EPOLLIN;
+    ev.data.u32 = k;
+    epoll_ctl (ep, EPOLL_CTL_ADD, v[k].fd, &ev);
+  }
+
+  // a parent is 100 to 2000 on a random side, limited a few ticks
+  // through the consolidated mid
+  srand (0);
+  start = nsec ();
+  while ((now = nsec ()) < start + (seconds + 1) * 1000000000L) {
+    due = (now - start) * rate / 1000000000L;
+    due = (due < max) ? due : max;
+    for (; parents < due; parents++) {
+      side = (rand () % 2) ? 'B' : 'S';
+      vol = 100 * (1 + rand () % 20);
+      ref = reference ();
+      route (side, vol, ref + ((side == 'B') ? 1 : -1) * (rand () % 4), now);
+    }
+    release (now);
+    n = epoll_wait (ep, evs, 64, 0);
+    for (k = 0; k < n; k++)
+      receive (&v[evs[k].data.u32]);
+  }
+
+  printf("%ld parents over %d venues in %ld sec, %ld took from a top, %ld from one venue at most, %ld left a rest\n",
+         parents, nvenues, seconds, routed, nosplit, rested);
+  printf("%-20s %6s %6s %9s %10s %10s %10s %8s %6s\n", "venue", "fee", "usec", "children", "sent", "filled",
+         "avg price", "fees", "busy");
+  for (k = 0; k < nvenues; k++) {
+    x = &v[k];
+    printf("%-20s %6.2f %6ld %9ld %10ld %10ld %10.2f %8.0f %6ld\n", x->segment, x->fee, x->latency / 1000,
+           x->children, x->sent, x->filled, (x->filled) ? x->notional / x->filled / 10.0 : 0.0, x->fees, x->busy);
+  }
+  if (parents) {
+    qsort (decideNsec, parents, sizeof (long), cmp);
+    printf("decide %8ld  p50 %8.2f  p90 %8.2f  p99 %8.2f  p99.9 %8.2f  max %8.2f usec\n", parents,
+           decideNsec[parents / 2] / 1e3, decideNsec[parents * 9 / 10] / 1e3, decideNsec[parents * 99 / 100] / 1e3,
+           decideNsec[parents * 999 / 1000] / 1e3, decideNsec[parents - 1] / 1e3);
+  }
+  exit (0);
+}
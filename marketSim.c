@@ -13,13 +13,81 @@
 #include <sys/time.h>
 #include <string.h>
 #include <unistd.h>		
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <dlfcn.h>
 #include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "marketStats.h"
+#include "marketTape.h"
+#include "marketItch.h"
+#include "marketGateway.h"
+#include "marketAgent.h"
+#include "marketTrace.h"
+
+#ifdef LOCKPROF
+#include "lockProf.h"
+#else
+#define lockName(addr, name) ((void) 0)
+#define lockReport(f) ((void) 0)
+#endif
 
 #define QUEUESIZE 15000
+#define MAXTICK 65536
+#define IDXBITS 15
+#define IDXSIZE (1 << IDXBITS)
+#define WHEELBITS 6
+#define WHEELSIZE (1 << WHEELBITS)
+#define WHEELLEVELS 4
+#define DAYMSEC 60000
+#define OPENMSEC 2000
+#define CLOSEMSEC 3000
+#define CLOSEUNCROSS 50
+#define NIL -1
+
+#define CONTINUOUS 0
+#define CALL 1
+
+#define NSTAGES 5
+
+#define NACCOUNTS 64
+#define FEEDACCOUNT NACCOUNTS           // ITCH ingest, outside the risk gate
+#define RISKMAXORDER 5000
+#define RISKMAXOPEN 100000
+#define RISKMAXPOSITION 50000
+#define RISKMAXNOTIONAL 50000000L
+#define RISKBAND 20
+
+#define RISK_OK 0
+#define RISK_SIZE 1
+#define RISK_PRICE 2
+#define RISK_OPEN 3
+#define RISK_POSITION 4
+#define RISK_NOTIONAL 5
+#define RISK_OWNER 6                    // modify of an order of another account
+#define RISKCHECKS 7
 
 typedef struct {
   long id,oldid;
+  long seq;
   long timestamp;
+  long expire;
+  int account;
   int vol;
   int price1, price2;
   char action, type;
@@ -34,14 +102,90 @@ void *MarketSell();
 void *LimitBuy();
 void *LimitSell();
 void *Cancel();
+void *Expire();
+void *Auction();
+void *Stats (void *q);
+
+// Tracing (-T file): a ring per statistics slot, drained by Stats
+#define TRACERING (1 << 15)
+
+_Static_assert (TRACETHREADS == NSTATTHREADS, "a trace ring for every statistics slot");
+
+typedef struct {
+  long head;                    // written by the owner
+  long limit;                   // tail + TRACERING, as the owner last read it
+  long lost;
+  char pad[40];
+  long tail;                    // written by the drain
+  char pad2[56];
+  traceEvent ev[TRACERING];
+} traceRing;
+
+traceRing *traces = NULL;
+__thread traceRing *tring = NULL;
+int tracing = 0;
+FILE *traceFile = NULL;
+traceHeader traceHead;
+pthread_mutex_t traceMut = PTHREAD_MUTEX_INITIALIZER;
+
+void traceInit (char *name);
+void traceDrain (void);
+void traceClose (void);
+unsigned long cycles (void);
+
+static inline void trace (int kind, long id, int arg) {
+  traceRing *r = tring;
+  long h;
+
+  if ((!__atomic_load_n (&tracing, __ATOMIC_RELAXED)) || (r == NULL))
+    return;
+  h = r->head;
+  if ((h == r->limit) && (h == (r->limit = __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE) + TRACERING))) {
+    r->lost++;
+    return;
+  }
+  r->ev[h & (TRACERING - 1)] = (traceEvent) { .tsc = cycles(), .id = id, .arg = arg, .kind = kind };
+  __atomic_store_n (&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+// User space stages (-u): the pipeline stages run as coroutines on one
+// Stages thread, a stage that would wait yields instead.
+#define NCOROUTINES 8
+#define COSTACK (256 * 1024)
+
+typedef struct {
+  void *sp;                     // saved stack pointer while switched out
+  void *(*fn) (void *);
+  void *arg;
+  statSlot *stat;
+  traceRing *ring;
+} coroutine;
+
+void coAdd (void *(*fn) (void *), void *arg);
+void coYield (void);
+void *Stages (void *q);
+
+void stopTrigger (int held);
+int stopHeld (void);
+void transactionDone (int *flag, pthread_mutex_t *mut, pthread_cond_t *cond);
 
 order makeOrder();
 inline long getTimestamp();
 void dispOrder (order ord);
+int orderRead (FILE *f, order *ord);
+void orderWrite (FILE *f, order ord);
+void columnAdd (long timestamp, int price, int volume);
+void columnClose (void);
+void stateDump ();
+void report ();
 
 int currentPriceX10 = 1000;
 
-struct timeval startwtime, endwtime;
+int phase = CONTINUOUS;
+int batchMsec = 0;
+int openClose = 0;
+
+struct timeval startwtime;
 
 typedef struct {
   order item[QUEUESIZE];
@@ -52,6 +196,7 @@ typedef struct {
 } queue;
 
 queue *queueInit (void);
+long queueDepth (queue *q);
 
 typedef struct {
   order buyMarketOrder;
@@ -74,25 +219,711 @@ typedef struct {
 } transaction;
 
 transaction *transactionInit();
+void lockNames (queue *q);
+
+// Compressed tapes of trades (-t) and inbound orders (-z), the file
+// layout is in marketTape.h
+typedef struct {
+  long timestamp;
+  int price, volume;
+  long id1, id2;
+} trade;
+
+typedef struct {
+  long timestamp, delta;        // last timestamp and last difference
+  long price;
+  long id;
+} zState;
+
+typedef struct {
+  FILE *f;
+  int kind;
+  zBlock head;
+  unsigned char buf[ZBLOCKBYTES];
+  zState s;
+  zIndex *index;
+  long entries, size, offset;
+  pthread_mutex_t mut;
+} zWriter;
+
+typedef struct {
+  unsigned char *map, *p, *end;
+  long size;
+  int kind;
+  zIndex *index;
+  long entries, block;
+  long stop;                    // no block from here on has a record wanted
+  zState s;
+} zReader;
+
+zWriter *zOpen (char *name, int kind);
+void zPutTrade (zWriter *z, trade tr);
+void zPutOrder (zWriter *z, order ord);
+void zClose (zWriter *z);
+zReader *zMap (char *name);
+void zSeek (zReader *z, long timestamp);
+void zStop (zReader *z, long timestamp);
+int zGetTrade (zReader *z, trade *tr);
+int zGetOrder (zReader *z, order *ord);
+
+// ITCH ingest (-i): the order references of the feed that are still
+// live, by reference, with the engine id they were given
+#define FEEDBITS 21
+#define FEEDREFS (1 << FEEDBITS)
+
+typedef struct {
+  unsigned long ref;            // 0 for a free slot
+  long id;
+  int shares;
+  char side;
+} feedRef;
+
+typedef struct {
+  unsigned char *map, *p, *end;
+  long size;
+  char stock[9];
+  int locate;                   // stock locate code of the stock followed
+  int open;                     // engine price of its first add
+  long base;                    // nsec of its first add
+  long next;                    // engine id of the next order
+  long live;
+  feedRef *refs;
+} feed;
+
+feed *feedOpen (char *name, char *symbol);
+int feedNext (feed *f, order *ord);
+int replayNext (order *ord);
+
+// Order entry gateway (-g): an in and out ring per session
+#define GWSESSIONS 1024                 // sessions unless -g port:sessions says otherwise
+#define GWINBUF 4096
+#define GWOUTBUF 16384
+#define GWOWNERS (1 << 20)
+#define GWPROBES 64                     // slots past its own an owner may be put in
+#define GWREPORTS (1 << 18)
+#define GWBATCH 256
+#define GWGONE -1                       // report reason: the order left the engine, nothing is sent
+
+typedef struct {
+  int fd;                       // -1 for a free session
+  int gen;                      // bumped on close, so late reports are dropped
+  int flush;                    // on the flush list
+  int polled;                   // EPOLLOUT is on
+  int paused;                   // EPOLLIN is off until Cons has room again
+  long inHead, inTail;          // free running byte counts
+  long outHead, outTail;
+  unsigned char in[GWINBUF];
+  unsigned char out[GWOUTBUF];
+} session;
+
+typedef struct {
+  long id;
+  int session, gen;
+  int live;                     // the order may still be in the engine, the slot is not reused
+} gwOwner;
+
+typedef struct {
+  long id, timestamp;
+  int price, vol;
+  int reason;                   // 0 for a fill
+  int done;                     // the order has left the engine
+} gwReport;
+
+typedef struct {
+  int listen, epoll, wake;
+  long nextId;
+  session *s;
+  int *freeList, nfree;
+  int *flushList, nflush;
+  int *paused, npaused;
+  order pending[GWBATCH];       // held back until the inbound queue has room
+  int npending;
+  gwOwner *owners;
+  gwReport report[GWREPORTS];
+  long head, tail;
+  long sessions, dropped, slow, full, held, evicted;
+  pthread_mutex_t *mut;
+} gateway;
+
+int gwSessions = GWSESSIONS;
+
+gateway *gatewayInit (int port);
+void *Gateway (void *q);
+void gatewayReport (long id, long timestamp, int price, int vol, int reason, int done);
+void orderRejected (order ord, int reason);
+
+// The long lived memory of the engine comes from one arena, on huge
+// pages where there are any and touched at startup; -l also locks it.
+#define HUGEPAGE (2L << 20)
+#define ARENAALIGN 128
+#define ARENASLACK (4L << 20)
+
+typedef struct {
+  char *base;
+  long size, used, spilled;
+  char *pages;                  // "explicit huge", "transparent huge" or "4 KB"
+  double faultMsec;
+  int locked;
+} arena;
+
+arena mem;
+
+void arenaInit (long size, int lock);
+void *arenaAlloc (long size);
+void arenaFree (void *p);
+
+// NUMA placement (-N): every thread but the inbound one runs on the CPUs
+// and memory of one node
+#define MAXCPUS 1024
+#define MPOL_DEFAULT 0
+#define MPOL_PREFERRED 1
+
+typedef struct {
+  int nodes;
+  int node;                     // -1 when not placed
+  unsigned long cpus[NSTATNODES][MAXCPUS / 64];
+  unsigned long all[MAXCPUS / 64];
+  long local0[NSTATNODES], remote0[NSTATNODES];  // numastat at the start
+} topology;
+
+topology topo = { .node = -1 };
+
+void numaInit (int node);
+void cpuPin (char *spec);
+void numaFree (void);
+void numaUpdate (void);
+
+// In-process agents (-A): trades and rejects go out on a broadcast ring,
+// orders come back through the rings of the agents
+#define AGENTRING (1 << 16)
+#define AGENTBATCH 256
+#define AGENTRUNNERS 8
+#define AGENTSPIN 2000          // pauses before an idle runner sleeps
+#define AGENTNAP 100            // msec at most asleep
+
+// A statistics slot and trace ring for every thread
+_Static_assert (NSTATTHREADS >= 10 + AGENTRUNNERS, "a statistics slot for every thread");
+
+typedef struct {
+  long seq;                     // 2 * index + 1 while written, + 2 once whole
+  char type;                    // 'T' trade, 'J' reject
+  int reason;
+  agentTrade tr;
+} agentEvent;
+
+typedef struct {
+  agentRunner r;                // first, agents point to it
+  agent **agents;
+  int n;
+  agent **ready;                // ring of agents with orders for Cons
+  long readyHead, readyTail, readyMask;
+  long next;                    // next event on the ring
+  long lost;
+  agentTop top;
+  unsigned long topSeq[2];      // of the published tops when last read
+  pthread_t tid;
+} agentPool;
+
+agentEvent *agentBus;
+long agentClaim;
+int agentBell;                  // futex of the sleeping runners
+int agentSleepers;
+agentPool *pools;
+int npools;
+agentBook agentView;
+
+int agentsLoad (char *spec, int runners);
+void agentPublish (char type, agentTrade tr, int reason);
+void agentRing (void);
+int agentWork (void);
+int agentNext (order *ord);
+void *Agents (void *arg);
+
+// Order id -> pool node of a book or of a stop queue.
+typedef struct {
+  long key[IDXSIZE];
+  int val[IDXSIZE];
+} idTable;
+
+void idxPut (idTable *x, long id, int n);
+int idxGet (idTable *x, long id);
+void idxDel (idTable *x, long id);
+int bitScan (unsigned long *bits, int p, int up);
+
+// Stops in a list per trigger price, in arrival order. next is the
+// trigger that fires first.
+typedef struct {
+  order ord;
+  int prev, next;
+} stopNode;
+
+typedef struct {
+  stopNode pool[QUEUESIZE];
+  int freeList;
+  int head[MAXTICK], tail[MAXTICK];
+  unsigned long bits[MAXTICK / 64];
+  idTable idx;
+  int next;
+  char side;
+  long size;
+  pthread_mutex_t *mut;
+  pthread_cond_t *notFull;
+} stopQueue;
+
+stopQueue *stopInit (char side);
+void stopAdd (stopQueue *s, order ord);
+void stopUnlink (stopQueue *s, int n, order *out);
+int stopDelIndex (stopQueue *s, order ord, order *out);
+void stopDelete (stopQueue *s);
+int stopCrossed (order ord);
+int stopActivate (order *ord);
+
+// Queue position: a node rests behind before - gone of volume, a stale
+// level epoch means a query has to repair the level.
+// A removed node is off the wheel, so in limbo tnext chains the limbo
+// list and tprev holds the reclamation epoch it was removed in.
+typedef struct {
+  order ord;
+  int prev, next;
+  int tprev, tnext, tslot;
+  int epoch;
+  long before;
+} node;
+
+typedef struct {
+  int head, tail;
+  int count;
+  int epoch;
+  long vol;
+  long gone;
+} level;
+
+_Static_assert (sizeof (level) == sizeof (agentLevel), "agents read the levels in place");
+
+typedef struct {
+  int slot[WHEELLEVELS][WHEELSIZE];
+  long now;
+  long count;
+} wheel;
+
+// Epoch based reclamation of book nodes: a removed node waits in limbo
+// until the epoch has moved on twice past every reader
+#define EBRREADERS 64
+#define LIMBOSLACK 1024               // nodes beyond QUEUESIZE, for the limbo list
+#define LIMBOBATCH 32                 // removals between tries to move the epoch
+#define POOLSIZE (QUEUESIZE + LIMBOSLACK)
+
+typedef struct {
+  long epoch;
+  int readers;
+  long active[EBRREADERS][16];  // epoch each reader entered in, 0 outside, a cache line each
+} reclaimer;
+
+reclaimer ebr = { .epoch = 1 };
+__thread int ebrSlot = -1;
+
+void ebrEnter (void);
+void ebrExit (void);
+
+// Pegged orders ('P', the peg in price2) wait in a queue per peg of their
+// book, priced from touch when a stage looks
+#define PEG_PRIMARY 0                   // the best price of its own side
+#define PEG_MID 1                       // the midpoint, rounded to the side's disadvantage
+#define PEG_MARKET 2                    // the best price of the other side
+#define NPEGS 3
+
+_Static_assert ((GW_PEGPRIMARY == PEG_PRIMARY) && (GW_PEGMID == PEG_MID) && (GW_PEGMARKET == PEG_MARKET) &&
+                (AGENTPEGPRIMARY == PEG_PRIMARY) && (AGENTPEGMID == PEG_MID) && (AGENTPEGMARKET == PEG_MARKET),
+                "one numbering of the pegs");
+
+int touch[2] = { NIL, NIL };            // best limit bid and ask, at the last change of the books
+
+typedef struct {
+  node pool[POOLSIZE];
+  int freeList;
+  int limboHead, limboTail;
+  long limbo;
+  long starved;                 // inserts that found every free node in limbo
+  level lvl[MAXTICK];
+  unsigned long bits[MAXTICK / 64];
+  idTable idx;
+  wheel tw;
+  int best;
+  char side;
+  long size;
+  int full, empty;
+  long version;                 // odd while the book is being changed
+  statTop *top;                 // where the best price is published, if anywhere
+  int taking;                   // a stage takes its next order out, the touch stays
+  queue *peg[NPEGS];
+  long pegs;
+  pthread_mutex_t *mut;
+  pthread_cond_t *notFull, *notEmpty;
+} book;
+
+book *bookInit (char side);
+int bookNext (book *b, int *price);
+void touchSet (book *b);
+void pegWake (book *b);
+void touchWake (void);
+void touchUpdate (void);
+int bookRoom (book *b, int n);
+void bookAdd (book *b, order ord);
+void bookPush (book *b, order ord);
+void bookDel (book *b, order *ord);
+int bookFind (book *b, long id, order *ord);
+int bookDelId (book *b, long id, order *ord);
+int bookModify (book *b, order ord, order *old);
+void bookDelete (book *b);
+int wheelAdvance (book *b, long now);
+long wheelNext (book *b);
+
+// Queries, from any thread and without the book lock: a query that
+// overlaps a change of the book is retried.
+int bookDepth (book *b, agentDepth *out, int n);
+int bookLevel (book *b, int price, agentResting *out, int max);
+long bookPosition (book *b, long id, int *price);
+
+// Per-account limits and state, changed with atomic adds only.
+typedef struct {
+  int maxOrderVol[NACCOUNTS + 1];
+  long maxOpenVol[NACCOUNTS + 1];
+  long maxPosition[NACCOUNTS + 1];
+  long maxNotional[NACCOUNTS + 1];
+  int band;
+
+  long openVol[NACCOUNTS + 1];
+  long position[NACCOUNTS + 1];
+
+  long checks;
+  long rejects[RISKCHECKS];
+  unsigned long cycles;
+} risk;
+
+risk *riskInit (void);
+int riskCheck (order ord);
+void riskAccept (order ord);
+void riskRelease (order ord);
+int riskModify (order old, order ord);
+void riskFill (order ord, int volume);
+void riskAmend (order old, order ord);
+void tradeReport (order order1, order order2, int volume);
+unsigned long cycles (void);
+double cyclesPerNsec;
+
+// Admission control (-q): what Cons does with a new order whose queue
+// is past its mark, by queue in the order of the statistics segment.
+#define ADMIT_BLOCK 0
+#define ADMIT_REJECT 1
+#define ADMIT_SHED 2
+#define ADMITMARK (QUEUESIZE * 7 / 8)   // the rest is room for what is already inside
+#define SHEDMARK (QUEUESIZE / 2)        // from here resting flow away from the touch is shed
+#define SHEDTICKS 10
+
+typedef struct {
+  int policy[NSTATQUEUES];
+  long high[NSTATQUEUES];       // high-water marks, written under the lock of the queue
+  long refused[NSTATQUEUES];
+} admission;
+
+admission *admit;
+queue *cancelLane;
+
+admission *admitInit (char *spec);
+long admitDepth (int i);
+void admitHigh (int i, long depth);
+int admitRefuse (int i, order ord);
+int inboundAdd (queue *q, order ord);
+
+statSegment *statsInit (char *name);
+void statRegister (char *name);
+void statFull (pthread_cond_t *cond, pthread_mutex_t *mut);
+void statWait (pthread_cond_t *cond, pthread_mutex_t *mut);
 
 void queueAdd (queue *q, order ord);
 void queueDel (queue *q, order *ord);
 void queueDelete (queue *q);
+long queueFind (queue *q, long id);
 
 void orderAdd (int flag, order ord);
+int orderModify (order ord);
+int orderExecute (order ord);
+
+// Mass quotes: the ladder waits in a slot of a shared ring, the 'Q'
+// order that carries it names the slot in oldid
+#define QUOTERING 4096
+#define QUOTERS (1 << 14)               // gateway sessions, then agents
+
+_Static_assert (GW_QUOTELEVELS == AGENTQUOTE, "one ladder for the gateway and the agents");
+
+typedef struct {
+  int used;
+  int quoter;
+  long tag;                     // session generation, a new session starts afresh
+  agentQuote q;
+} quoteSlot;
+
+typedef struct {
+  long tag;
+  long id[2][AGENTQUOTE];       // resting level of each side, -1 for none
+} quoter;
+
+quoteSlot *quoteRing;
+long quoteClaim;
+quoter *quoters;
+
+void quoteInit (void);
+long quotePost (int who, long tag, const agentQuote *q);
+void quoteApply (order ord);
+
+// Sequenced mode (-d): order n is made once the first n are applied.
+typedef struct {
+  long next;                    // sequence number of the next inbound order
+  long done;                    // inbound orders fully applied
+  long clock;                   // simulated msec
+  int busy;                     // Market or the clock step is at work, the stages keep off their queues
+  int hold[NSTAGES];            // stage took an order and has not handed it on
+  pthread_mutex_t *qmut[NSTAGES];       // queue of each stage and its notEmpty
+  pthread_cond_t *qcond[NSTAGES];
+  pthread_mutex_t *mut;
+  pthread_cond_t *kick;
+} sequencer;
+
+sequencer *seqInit (void);
+void seqKick (void);
+void seqRelease (int k);
+void seqMatchWait (void);
+void seqMatched (void);
+void seqHold (void);
+void seqQuiet (void);
+void seqDone (void);
+void seqTurn (long id);
+void seqLimit (long n);
+void expireStep (long now);
+long auctionStep (long now);
+void setPhase (int next);
+
+// Expire and Auction sleep until their next deadline.
+pthread_mutex_t clockMut = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t clockCond = PTHREAD_COND_INITIALIZER;
+long clockGen;
+long expireDue = LONG_MIN;      // msec Expire waits for, LONG_MAX while it runs
+
+long expireNext (void);
+void clockKick (void);
+void clockWait (long due);
 
 queue *buyMarketOrder, *sellMarketOrder;
-queue *buyLimitOrder, *sellLimitOrder;
+book *buyLimitOrder, *sellLimitOrder;
 queue *cancelOrder;
 
+stopQueue *buyStopOrder, *sellStopOrder;
+
 transaction *t;
 
+risk *gate;
+
+sequencer *seq;
+int sequenced = 0;
+long orderLimit = 0;
+FILE *replay = NULL, *record = NULL, *columns = NULL;
+zWriter *tradeTape = NULL, *orderTape = NULL;
+zReader *replayTape = NULL;
+feed *ingest = NULL;
+gateway *gw = NULL;
+char *symbol = NULL;
+tapeBlock *column;
+pthread_mutex_t columnMut = PTHREAD_MUTEX_INITIALIZER;
+int finalState = 0;
+int stopFlow = 0;
+
+statSegment *stats;
+statSlot noStat;
+__thread statSlot *stat = &noStat;
+char *statsName = STATSNAME;
+
+int userStages = 0;
+coroutine coroutines[NCOROUTINES];
+int ncoroutines = 0;
+__thread coroutine *coSelf = NULL;      // the stage running on this thread, if any
+__thread void *coMain;                  // stack pointer of the Stages loop
+
 //FILE *infile;
 
 
 
 // ****************************************************************
-int main() {
+#ifndef NOMAIN
+int main(int argc, char **argv) {
+  char *ingestName = NULL, *admitSpec = "block", *agentSpec = NULL, *tradeName = NULL, *orderName = NULL;
+  char *traceName = NULL, *cpus = NULL;
+  int opt, gatewayPort = 0, runners = 1, lockArena = 0, numaNode = -1;
+  long arenaSize;
+
+  while ((opt = getopt (argc, argv, "A:a:bC:c:dg:i:j:lN:n:oq:r:Ss:T:t:uw:y:z:")) != -1) {
+    switch (opt) {
+      case 'A':                     // agents, plugin.so:kind=count,...
+        agentSpec = optarg;
+        break;
+      case 'a':                     // periodic batch auctions every msec
+        batchMsec = atoi (optarg);
+        break;
+      case 'b':                     // print the final state of the book
+        finalState = 1;
+        break;
+      case 'C':                     // CPUs of the engine, a list such as 2-3
+        cpus = optarg;
+        break;
+      case 'c':                     // columnar trade tape for marketBars
+        if ((columns = fopen (optarg, "w")) == NULL) {
+          perror (optarg);
+          exit (1);
+        }
+        break;
+      case 'd':                     // sequenced, deterministic matching
+        sequenced = 1;
+        break;
+      case 'g':                     // order entry gateway on a TCP port, port[:sessions]
+        gatewayPort = atoi (optarg);
+        if (strchr (optarg, ':'))
+          gwSessions = atoi (strchr (optarg, ':') + 1);
+        break;
+      case 'j':                     // agent runner threads
+        runners = atoi (optarg);
+        break;
+      case 'i':                     // ingest an ITCH 5.0 file
+        ingestName = optarg;
+        break;
+      case 'l':                     // lock the arena in memory
+        lockArena = 1;
+        break;
+      case 'N':                     // NUMA node of the engine
+        numaNode = atoi (optarg);
+        break;
+      case 'n':                     // stop after so many inbound orders
+        orderLimit = atol (optarg);
+        break;
+      case 'o':                     // opening and closing auctions
+        openClose = 1;
+        break;
+      case 'q':                     // admission policy of the queues
+        admitSpec = optarg;
+        break;
+      case 'r':                     // replay inbound orders from a file
+      case 'w':                     // record inbound orders to a file
+        if ((opt == 'r') && ((replayTape = zMap (optarg)) != NULL) && (replayTape->kind != ZORDERS)) {
+          fprintf(stderr, "%s: %s is not an order tape\n", argv[0], optarg);
+          exit (1);
+        }
+        if ((opt == 'r') && (replayTape == NULL) && ((replay = fopen (optarg, "r")) == NULL)) {
+          perror (optarg);
+          exit (1);
+        }
+        if ((opt == 'w') && ((record = fopen (optarg, "w")) == NULL)) {
+          perror (optarg);
+          exit (1);
+        }
+        break;
+      case 'S':                     // stop orders in the generated flow
+        stopFlow = 1;
+        break;
+      case 's':                     // name of the statistics segment
+        statsName = optarg;
+        break;
+      case 'y':                     // stock to take from the ITCH file
+        symbol = optarg;
+        break;
+      case 'T':                     // binary event trace for marketTrace
+        traceName = optarg;
+        break;
+      case 't':                     // compressed trade tape
+        tradeName = optarg;
+        break;
+      case 'u':                     // stages as coroutines on one thread
+        userStages = 1;
+        break;
+      case 'z':                     // compressed record of the inbound orders
+        orderName = optarg;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-A plugin:kind=n,...] [-a msec] [-b] [-C cpus] [-c file] [-d] [-g port[:sessions]] [-i itch] [-j runners] [-l] [-N node] [-n orders] [-o] [-q policy] [-r file] [-S] [-s stats] [-T file] [-t file] [-u] [-w file] [-y symbol] [-z file]\n", argv[0]);
+        exit (1);
+    }
+  }
+  if ((batchMsec) || (openClose))
+    phase = CALL;
+  if ((admit = admitInit (admitSpec)) == NULL) {
+    fprintf(stderr, "%s: policy is block, reject or shed, for all queues or as queue=policy,... of inbound, market, limit, cancel and stop\n", argv[0]);
+    exit (1);
+  }
+
+  // everything the engine keeps for the whole run, sized up front
+  arenaSize = (5 + 2 * NPEGS) * sizeof (queue) + 2 * sizeof (book) + 2 * sizeof (stopQueue) + sizeof (risk) + ARENASLACK;
+  if (columns)
+    arenaSize += sizeof (tapeBlock);
+  if (tradeName)
+    arenaSize += sizeof (zWriter);
+  if (orderName)
+    arenaSize += sizeof (zWriter);
+  if (ingestName)
+    arenaSize += FEEDREFS * sizeof (feedRef);
+  if (gatewayPort)
+    arenaSize += sizeof (gateway) + gwSessions * (sizeof (session) + 3 * sizeof (int)) + GWOWNERS * sizeof (gwOwner);
+  if ((gatewayPort) || (agentSpec))
+    arenaSize += QUOTERING * sizeof (quoteSlot) + QUOTERS * sizeof (quoter);
+  if (traceName)
+    arenaSize += TRACETHREADS * sizeof (traceRing);
+  numaInit (numaNode);
+  if (cpus)
+    cpuPin (cpus);
+  arenaInit (arenaSize, lockArena);
+  if (mem.base)
+    fprintf(stderr, "Arena %.1f MB on %s pages, faulted in %.1f msec%s\n", mem.size / 1048576.0, mem.pages,
+            mem.faultMsec, (mem.locked) ? ", locked" : "");
+  if (topo.node >= 0)
+    fprintf(stderr, "Placed on NUMA node %d of %d\n", topo.node, topo.nodes);
+
+  if ((tradeName) && ((tradeTape = zOpen (tradeName, ZTRADES)) == NULL)) {
+    perror (tradeName);
+    exit (1);
+  }
+  if ((orderName) && ((orderTape = zOpen (orderName, ZORDERS)) == NULL)) {
+    perror (orderName);
+    exit (1);
+  }
+  if ((ingestName) && ((ingest = feedOpen (ingestName, symbol)) == NULL))
+    exit (1);
+  if ((gatewayPort) && ((sequenced) || (replay) || (replayTape) || (ingest))) {
+    fprintf(stderr, "%s: the gateway takes the place of the generator, not of a replay\n", argv[0]);
+    exit (1);
+  }
+  if ((gatewayPort) && ((gwSessions < 1) || (gwSessions > QUOTERS / 2))) {
+    fprintf(stderr, "%s: the gateway takes 1 to %d sessions\n", argv[0], QUOTERS / 2);
+    exit (1);
+  }
+  if ((gatewayPort) && ((gw = gatewayInit (gatewayPort)) == NULL))
+    exit (1);
+  if ((gatewayPort) || (agentSpec))
+    quoteInit ();
+  if ((userStages) && (sequenced)) {
+    fprintf(stderr, "%s: sequenced mode runs the stages as threads\n", argv[0]);
+    exit (1);
+  }
+#if !defined(__x86_64__)
+  if (userStages) {
+    fprintf(stderr, "%s: -u is only built for x86-64\n", argv[0]);
+    exit (1);
+  }
+#endif
+  if ((agentSpec) && ((sequenced) || (runners < 1) || (runners > AGENTRUNNERS))) {
+    fprintf(stderr, "%s: agents run with 1 to %d runners and not in sequenced mode\n", argv[0], AGENTRUNNERS);
+    exit (1);
+  }
+  if (ingest) {
+    currentPriceX10 = ingest->open;
+    fprintf(stderr, "Ingesting %s, stock locate %d, opening at %.1f\n", ingest->stock, ingest->locate,
+            ingest->open / 10.0);
+  }
 
   // reset number generator seed
   // srand(time(NULL) + getpid());
@@ -101,71 +932,158 @@ int main() {
   // start the time for timestamps
   gettimeofday (&startwtime, NULL);
 
+  // ^C is taken by sigwait below, so no other thread may get it
+  sigset_t sigs;
+  int sig;
+  sigemptyset (&sigs);
+  sigaddset (&sigs, SIGINT);
+  sigaddset (&sigs, SIGTERM);
+#ifdef LOCKPROF
+  sigaddset (&sigs, SIGUSR1);
+#endif
+  if (traceName)
+    sigaddset (&sigs, SIGUSR2);
+  pthread_sigmask (SIG_BLOCK, &sigs, NULL);
+
+  gate = riskInit();
+  stats = statsInit (statsName);
+  if (traceName)
+    traceInit (traceName);
+
   pthread_t prod, cons;
+  pthread_t statsThread;
   queue *q = queueInit();
-  
-  pthread_create(&prod, NULL, Prod, q);
-  pthread_create(&cons, NULL, Cons, q);
+
+  // shares the lock and the wakeup of the inbound queue
+  cancelLane = queueInit();
+  cancelLane->mut = q->mut;
+  cancelLane->notEmpty = q->notEmpty;
 
   pthread_t market;
   pthread_t marketBuy, marketSell;
   pthread_t limitBuy, limitSell;
   pthread_t cancel;
+  pthread_t expire;
+  pthread_t auction;
+  int i;
 
   buyMarketOrder = queueInit();
   sellMarketOrder = queueInit();
-  buyLimitOrder = queueInit();
-  sellLimitOrder = queueInit();
+  buyLimitOrder = bookInit('B');
+  sellLimitOrder = bookInit('S');
+  stats->top[0].price = stats->top[1].price = -1;
+  buyLimitOrder->top = &stats->top[0];
+  sellLimitOrder->top = &stats->top[1];
   cancelOrder = queueInit();
+  buyStopOrder = stopInit ('B');
+  sellStopOrder = stopInit ('S');
 
   t = transactionInit();
-
-  pthread_create (&market, NULL, Market, 0);
-  pthread_create (&marketBuy, NULL, MarketBuy, 0);
-  pthread_create (&marketSell, NULL, MarketSell,0);
-  pthread_create (&limitBuy, NULL, LimitBuy, 0);
-  pthread_create (&limitSell, NULL, LimitSell, 0);
-  pthread_create (&cancel, NULL, Cancel, 0);
+  seq = seqInit();
+  if ((agentSpec) && (!agentsLoad (agentSpec, runners)))
+    exit (1);
+  lockNames (q);
+
+  if (gw)
+    pthread_create (&prod, NULL, Gateway, q);
+  else
+    pthread_create(&prod, NULL, Prod, q);
+  if (userStages) {
+    coAdd (Cons, q);
+    coAdd (MarketBuy, 0);
+    coAdd (MarketSell, 0);
+    coAdd (LimitBuy, 0);
+    coAdd (LimitSell, 0);
+    coAdd (Cancel, 0);
+    coAdd (Market, 0);
+    pthread_create (&cons, NULL, Stages, q);
+  }
+  else {
+    pthread_create(&cons, NULL, Cons, q);
+    pthread_create (&market, NULL, Market, 0);
+    pthread_create (&marketBuy, NULL, MarketBuy, 0);
+    pthread_create (&marketSell, NULL, MarketSell,0);
+    pthread_create (&limitBuy, NULL, LimitBuy, 0);
+    pthread_create (&limitSell, NULL, LimitSell, 0);
+    pthread_create (&cancel, NULL, Cancel, 0);
+  }
+  if (!sequenced)
+    pthread_create (&expire, NULL, Expire, 0);
+  if ((phase == CALL) && (!sequenced))
+    pthread_create (&auction, NULL, Auction, 0);
+  pthread_create (&statsThread, NULL, Stats, q);
+  for (i = 0; i < npools; i++)
+    pthread_create (&pools[i].tid, NULL, Agents, &pools[i]);
   
-  pthread_join (market, NULL);
-  pthread_join (marketBuy, NULL);
-  pthread_join (marketSell, NULL);
-  pthread_join (limitBuy, NULL);
-  pthread_join (limitSell, NULL);
-  pthread_join (cancel, NULL);
-
-  queueDelete (buyMarketOrder);
-  queueDelete (sellMarketOrder);
-  queueDelete (buyLimitOrder);
-  queueDelete (sellLimitOrder);
-  queueDelete (cancelOrder);
-
-  pthread_exit (NULL);
-  // I actually do not expect them to ever terminate
-  pthread_join (prod, NULL);
-  pthread_join (cons, NULL);
-
-  pthread_exit (NULL);
+  // I actually do not expect them to ever terminate,
+  // SIGUSR1 dumps the lock report, SIGUSR2 toggles tracing
+  while ((sigwait (&sigs, &sig) == 0) && ((sig == SIGUSR1) || (sig == SIGUSR2))) {
+    if (sig == SIGUSR2)
+      __atomic_store_n (&tracing, !tracing, __ATOMIC_RELAXED);
+    else
+      lockReport (stderr);
+  }
+  if (finalState)
+    stateDump ();
+  if (record)
+    fclose (record);
+  if (columns)
+    columnClose ();
+  if (tradeTape)
+    zClose (tradeTape);
+  if (orderTape)
+    zClose (orderTape);
+  if (traces)
+    traceClose ();
+  fflush (stdout);
+  report ();
+  shm_unlink (statsName);
+
+  exit (0);
 }
+#endif
 
 
 
 // ****************************************************************
 void *Prod (void *arg) {
   queue *q = (queue *) arg;
-  int i;
-  
-  while (1) {
-    pthread_mutex_lock (q->mut);
-    while (q->full) {
-     // printf ("*** Incoming Order Queue is EMPTY.\n"); fflush(stdout);
-      pthread_cond_wait (q->notFull, q->mut);
+  order ord;
+  long n;
+  int added;
+
+  statRegister ("Prod");
+  numaFree ();
+  for (n = 0; (!orderLimit) || (n < orderLimit); n++) {
+    // made outside the lock, a sequenced producer waits in makeOrder
+    if ((replay) || (replayTape) || (ingest)) {
+      if (sequenced)
+        seqTurn (n);
+      if (!replayNext (&ord)) {
+        seqLimit (n);
+        break;
+      }
+      if (sequenced)
+        seq->clock = ord.timestamp;
+      else if (!ingest)
+        while (getTimestamp() < ord.timestamp)
+          usleep (1000);
     }
-    queueAdd (q, makeOrder());
+    else
+      ord = makeOrder();
+    pthread_mutex_lock (q->mut);
+    added = inboundAdd (q, ord);
     pthread_mutex_unlock (q->mut);
     pthread_cond_signal (q->notEmpty);
+    stat->orders++;
+    // only what got in is recorded, so a replay meets the same flow
+    if ((added) && (record))
+      orderWrite (record, ord);
+    if ((added) && (orderTape))
+      zPutOrder (orderTape, ord);
 
   }
+  return NULL;
 }
 
 
@@ -174,21 +1092,87 @@ void *Prod (void *arg) {
 void *Cons (void *arg) {
   queue *q = (queue *) arg;
   order ord;
+  long auctionDue = 0;
+  int flag, turn = 0, hold;
 
+  statRegister ("Cons");
   while (1) {
     pthread_mutex_lock (q->mut);
-    while (q->empty) {
+    while ((q->empty) && (cancelLane->empty) && (!agentWork ())) {
      // printf ("*** Incoming Order Queue is EMPTY.\n"); fflush(stdout);
-      pthread_cond_wait (q->notEmpty, q->mut);
+      statWait (q->notEmpty, q->mut);
+    }
+    if (!cancelLane->empty) {
+      queueDel (cancelLane, &ord);
+      trace (TRACE_DEQUEUE, ord.id, 0);
+      // an order still waiting behind it is withdrawn where it is
+      long i = queueFind (q, ord.oldid);
+      if (i != NIL)
+        q->item[i].type = 'X';
+      pthread_mutex_unlock (q->mut);
+      pthread_cond_signal (cancelLane->notFull);
+      if (i != NIL) {
+        printf("%ld Order ---> Cancelled (inbound)\n", ord.oldid);
+        stat->cancelHit++;
+        seqDone ();
+        continue;
+      }
+    }
+    else if ((!q->empty) && ((turn ^= 1) || (!agentWork ()))) {
+      queueDel (q, &ord);
+      trace (TRACE_DEQUEUE, ord.id, 0);
+      pthread_mutex_unlock (q->mut);
+      pthread_cond_signal (q->notFull);
+    }
+    else {
+      pthread_mutex_unlock (q->mut);
+      if (!agentNext (&ord))
+        continue;
+    }
+    stat->orders++;
+    if (ord.type == 'X') {
+      seqDone ();
+      continue;
+    }
+
+    // The Expire and Auction work is done here, at the time of the order
+    if (sequenced) {
+      ord.seq = seq->next++;
+      hold = (expireNext () <= ord.timestamp) || (((batchMsec) || (openClose)) && (auctionDue <= ord.timestamp));
+      if (hold)
+        seqHold ();
+      expireStep (ord.timestamp);
+      if ((batchMsec) || (openClose))
+        auctionDue = auctionStep (ord.timestamp);
+      if (hold)
+        seqMatched ();
+      seqQuiet ();
+    }
+
+    // Pre-trade risk, a modify is settled in orderModify
+    if ((ord.type != 'C') && (ord.type != 'Q')) {
+      unsigned long c0 = cycles();
+      int reason = riskCheck (ord);
+      gate->cycles += cycles() - c0;
+      gate->checks++;
+      if (reason) {
+        gate->rejects[reason]++;
+        stat->rejects++;
+        printf("%ld Order ---> Rejected (risk %d)\n", ord.id, reason);
+        orderRejected (ord, reason);
+        seqDone ();
+        continue;
+      }
+      if (ord.type != 'R')
+        riskAccept (ord);
     }
-    queueDel (q, &ord);
-    pthread_mutex_unlock (q->mut);
-    pthread_cond_signal (q->notFull);
 
     // Order type
     switch (ord.type) {
 
       case 'M':                     // Market order
+        if (admitRefuse ((ord.action == 'B') ? 1 : 2, ord))
+          break;
         if (ord.action == 'B')
           orderAdd (0, ord);
         else
@@ -196,14 +1180,74 @@ void *Cons (void *arg) {
         break;
 
       case 'L':                     // Limit order
+        if ((ord.price1 <= 0) || (ord.price1 >= MAXTICK)) {
+          printf("%ld Limit Order ---> Rejected (price)\n", ord.id);
+          orderRejected (ord, GW_REJECTPRICE);
+          riskRelease (ord);
+          break;
+        }
+        if (admitRefuse ((ord.action == 'B') ? 3 : 4, ord))
+          break;
         if (ord.action == 'B')
           orderAdd (2, ord);
         else 
           orderAdd (3, ord);
         break;
 
+      case 'P':                     // Pegged order
+        if ((ord.price2 < 0) || (ord.price2 >= NPEGS)) {
+          printf("%ld Pegged Order ---> Rejected (peg)\n", ord.id);
+          orderRejected (ord, GW_REJECTPRICE);
+          riskRelease (ord);
+          break;
+        }
+        if (admitRefuse ((ord.action == 'B') ? 3 : 4, ord))
+          break;
+        orderAdd ((ord.action == 'B') ? 2 : 3, ord);
+        break;
+
+      case 'S':                     // Stop order
+      case 'T':                     // Stop-limit order
+        if (((ord.type == 'T') && ((ord.price1 <= 0) || (ord.price1 >= MAXTICK))) ||
+            (ord.price2 <= 0) || (ord.price2 >= MAXTICK)) {
+          printf("%ld Stop Order ---> Rejected (price)\n", ord.id);
+          orderRejected (ord, GW_REJECTPRICE);
+          riskRelease (ord);
+          break;
+        }
+        if (stopCrossed (ord)) {
+          flag = stopActivate (&ord);
+          if (!admitRefuse (flag + 1, ord))
+            orderAdd (flag, ord);
+        }
+        else if (admitRefuse ((ord.action == 'B') ? 6 : 7, ord))
+          break;
+        else if (ord.action == 'B')
+          stopAdd (buyStopOrder, ord);
+        else
+          stopAdd (sellStopOrder, ord);
+        break;
+
+      case 'Q':                     // Mass quote
+        quoteApply (ord);
+        break;
+
+      case 'E':                     // Execution reported by the feed
+        orderExecute (ord);
+        break;
+
+      case 'R':                     // Modify order
+        if ((ord.price1 < 0) || (ord.price1 >= MAXTICK)) {
+          printf("%ld Modify Order ---> Rejected (price)\n", ord.id);
+          orderRejected (ord, GW_REJECTPRICE);
+        }
+        else
+          orderModify (ord);
+        break;
+
       default:                      // Cancel order
-        orderAdd (4, ord);
+        if (!admitRefuse (5, ord))
+          orderAdd (4, ord);
         break;
     
     }
@@ -213,6 +1257,13 @@ void *Cons (void *arg) {
     //printf ("Processing at time %8d : ", getTimestamp());
     //dispOrder(ord); fflush(stdout);
 
+    if (sequenced)
+      seqQuiet ();
+    seqDone ();
+
+    // let the stages take it on before the next one
+    if (coSelf)
+      coYield ();
   }
 }
 
@@ -228,30 +1279,67 @@ order makeOrder() {
 
   order ord;
 
-  // wait for a random amount of time in useconds
+  // wait for a random amount of time in useconds,
+  // sequenced runs only move the clock on
   waitmsec = ((double)rand()/(double)RAND_MAX * magnitude);
-  usleep(waitmsec*1000);
+  if (sequenced) {
+    seqTurn (count);
+    seq->clock += waitmsec;
+  }
+  else
+    usleep(waitmsec*1000);
   
   ord.id = count++;
   ord.timestamp = getTimestamp();
+  ord.expire = 0;
+  ord.oldid = 0;
+  ord.vol = 0;
+  ord.price1 = ord.price2 = 0;
+  ord.account = ord.id % NACCOUNTS;
 
   // Buy or Sell
   ord.action = ((double)rand()/(double)RAND_MAX <= 0.53) ? 'B' : 'S';
 
-  // Order type
+  // Order type, -S turns some market orders into stops
   double u2 = ((double)rand()/(double)RAND_MAX);
-  if (u2 < 0.45){ 
+  if (u2 < ((stopFlow) ? 0.40 : 0.45)){ 
     ord.type = 'M';                 // Market order
     ord.vol = (1 + rand()%50)*100;
 
+  }else if (0.40 <= u2 && u2 < 0.45){
+    ord.type = (u2 < 0.43) ? 'S' : 'T';   // Stop or stop-limit order
+    ord.vol = (1 + rand()%50)*100;
+    if (ord.action == 'B') {
+      ord.price2 = currentPriceX10 + 1 + rand()%10;
+      ord.price1 = ord.price2 + rand()%5;
+    }
+    else {
+      ord.price2 = currentPriceX10 - 1 - rand()%10;
+      ord.price1 = ord.price2 - rand()%5;
+    }
+
   }else if (0.45 <= u2 && u2 < 0.9){
     ord.type = 'L';                 // Limit order
     ord.vol = (1 + rand()%50)*100;
     ord.price1 = currentPriceX10 + 10*(0.5 -((double)rand()/(double)RAND_MAX));
+
+    // Time in force: good-till-cancel, day or good-till-time
+    double u3 = ((double)rand()/(double)RAND_MAX);
+    if (0.4 <= u3 && u3 < 0.7)
+      ord.expire = (ord.timestamp / DAYMSEC + 1) * DAYMSEC;
+    else if (0.7 <= u3)
+      ord.expire = ord.timestamp + 100 + rand()%20000;
     
-  }else if (0.9 <= u2){
+  }else if (0.9 <= u2 && u2 < 0.97){
     ord.type = 'C';                 // Cancel order
     ord.oldid = ((double)rand()/(double)RAND_MAX)*count;
+
+  }else if (0.97 <= u2){
+    ord.type = 'R';                 // Modify order, price 0 keeps the price
+    ord.oldid = ((double)rand()/(double)RAND_MAX)*count;
+    ord.account = ord.oldid % NACCOUNTS;
+    ord.vol = (1 + rand()%50)*100;
+    ord.price1 = (rand()%2) ? 0 : currentPriceX10 + 10*(0.5 -((double)rand()/(double)RAND_MAX));
   }
 
   //dispOrder(ord);
@@ -263,7 +1351,10 @@ order makeOrder() {
 
 // ****************************************************************
 inline long getTimestamp() {
+  struct timeval endwtime;
 
+  if (sequenced)
+    return seq->clock;
   gettimeofday(&endwtime, NULL);
 
   return((double)((endwtime.tv_usec - startwtime.tv_usec)/1.0e6
@@ -284,8 +1375,21 @@ void dispOrder (order ord) {
   case 'L':
     printf("%c ", ord.action);
     printf("Limit  (%4d,%5.1f) ", ord.vol, (float) ord.price1/10.0); break;
+  case 'S':
+    printf("%c ", ord.action);
+    printf("Stop   (%4d,%5.1f) ", ord.vol, (float) ord.price2/10.0); break;
+  case 'T':
+    printf("%c ", ord.action);
+    printf("StopL  (%4d,%5.1f,%5.1f) ", ord.vol, (float) ord.price2/10.0, (float) ord.price1/10.0); break;
+  case 'P':
+    printf("%c ", ord.action);
+    printf("Pegged (%4d,%s)    ", ord.vol, (ord.price2 == PEG_PRIMARY) ? "pri" : (ord.price2 == PEG_MID) ? "mid" : "mkt"); break;
   case 'C':
     printf("* Cancel  %ld        ", ord.oldid); break;
+  case 'R':
+    printf("* Modify  %ld (%4d,%5.1f) ", ord.oldid, ord.vol, (float) ord.price1/10.0); break;
+  case 'E':
+    printf("* Execute %ld (%4d)        ", ord.oldid, ord.vol); break;
   default : break;
   }
   printf("\n");
@@ -294,618 +1398,4574 @@ void dispOrder (order ord) {
 
 
 // ****************************************************************
-queue *queueInit (void) {
-  queue *q;
+// One inbound order per line, as written by -w and read back by -r:
+// id timestamp account action type vol price1 price2 oldid expire
+int orderRead (FILE *f, order *ord) {
+  memset (ord, 0, sizeof (order));
+  return (fscanf (f, "%ld %ld %d %c %c %d %d %d %ld %ld", &ord->id, &ord->timestamp, &ord->account,
+                  &ord->action, &ord->type, &ord->vol, &ord->price1, &ord->price2, &ord->oldid,
+                  &ord->expire) == 10);
+}
 
-  q = (queue *) malloc (sizeof (queue));
-  if (q == NULL) return (NULL);
 
-  q->empty = 1;
-  q->full = 0;
-  q->head = 0;
-  q->tail = 0;
-  q->mut = (pthread_mutex_t *) malloc (sizeof (pthread_mutex_t));
-  pthread_mutex_init (q->mut, NULL);
-  q->notFull = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
-  pthread_cond_init (q->notFull, NULL);
-  q->notEmpty = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
-  pthread_cond_init (q->notEmpty, NULL);
-	
-  return (q);
+
+// ****************************************************************
+void orderWrite (FILE *f, order ord) {
+  fprintf(f, "%ld %ld %d %c %c %d %d %d %ld %ld\n", ord.id, ord.timestamp, ord.account,
+          ord.action, ord.type, ord.vol, ord.price1, ord.price2, ord.oldid, ord.expire);
 }
 
 
 
 // ****************************************************************
-void queueAdd (queue *q, order in){
-  q->item[q->tail] = in;
-  q->tail++;
-  if (q->tail == QUEUESIZE)
-    q->tail = 0;
-  if (q->tail == q->head)
-    q->full = 1;
-  q->empty = 0;
+// Filled under its own mutex and written out whole when full.
+void columnAdd (long timestamp, int price, int volume) {
+  static tapeHeader header = { TAPEMAGIC, TAPEVERSION, TAPEBLOCK };
 
-  return;
+  pthread_mutex_lock (&columnMut);
+  if (columns == NULL) {
+    pthread_mutex_unlock (&columnMut);
+    return;
+  }
+  if (column == NULL) {
+    column = (tapeBlock *) arenaAlloc (sizeof (tapeBlock));
+    fwrite (&header, sizeof (header), 1, columns);
+  }
+  column->timestamp[column->count] = timestamp;
+  column->price[column->count] = price;
+  column->volume[column->count] = volume;
+  if (++column->count == TAPEBLOCK) {
+    fwrite (column, sizeof (tapeBlock), 1, columns);
+    column->count = 0;
+  }
+  pthread_mutex_unlock (&columnMut);
 }
 
 
+
 // ****************************************************************
-void queuePush (queue *q, order in) {
+void columnClose (void) {
+  pthread_mutex_lock (&columnMut);
+  if ((column) && (column->count))
+    fwrite (column, sizeof (tapeBlock), 1, columns);
+  fclose (columns);
+  columns = NULL;
+  pthread_mutex_unlock (&columnMut);
+}
 
-if (!q->empty) {
-  if (q->head > 0) {
-    q->head--;
-    q->item[q->head] = in;
-    
+
+
+// ****************************************************************
+unsigned char *zPut (unsigned char *p, unsigned long v) {
+  while (v >= 0x80) {
+    *p++ = v | 0x80;
+    v >>= 7;
   }
-  else {
-    int i;  
-    for (i = q->tail; i > q->head; i--)
-      q->item[i] = q->item[i - 1];
-    q->item[0] = in;
-    q->tail++;
-    if (q->tail == QUEUESIZE)
-      q->tail = 0;
+  *p++ = v;
+  return p;
+}
+
+
+
+// ****************************************************************
+unsigned long zGet (unsigned char **p) {
+  unsigned long v = 0;
+  int shift = 0;
+
+  while (**p & 0x80) {
+    v |= (unsigned long) (*(*p)++ & 0x7f) << shift;
+    shift += 7;
   }
-  if (q->tail == q->head)
-    q->full = 1;
-  q->empty = 0;
-    
-  }else queueAdd (q, in); 
-  return; 
+  return v | ((unsigned long) *(*p)++ << shift);
 }
 
 
 
 // ****************************************************************
-void queueAddSort (queue *q, order ord) {
-  long i, index;
-  int flag;
-  
-  if(!q->empty) {
-    if ((ord.type == 'L') && (ord.action == 'B')) {
-      if(ord.price1 >= q->item[q->head].price1)
-        queuePush (q, ord);
-      else if ((ord.price1 <= q->item[q->tail - 1].price1) && (q->tail > 0))
-        queueAdd (q, ord);
-      else {
-        if(q->tail > q->head) {
-          flag = 1;
-          i=q->head;
-          while ((i < q->tail) && (flag)) {
-            if (ord.price1 > q->item[i].price1) {
-              index = i;
-              flag = 0;
-            }
-            i++;  
-          }
-          for (i= q->tail; i > index; i--)
-            q->item[i] = q->item[i - 1];
-          q->item[index] = ord;
-          q->tail++;  
-          if (q->tail == QUEUESIZE)
-            q->tail = 0;
-          if (q->tail == q->head)
-            q->full = 1;
-          q->empty = 0;
+// Zig-zag: small negative and positive differences both stay small.
+unsigned long zz (long v) {
+  return ((unsigned long) v << 1) ^ (v >> 63);
+}
+
+
+
+// ****************************************************************
+long unzz (unsigned long u) {
+  return (long) (u >> 1) ^ -(long) (u & 1);
+}
+
+
+
+// ****************************************************************
+// Whole lots of 100 stored divided, with the low bit clear.
+unsigned long zVol (int vol) {
+  if (vol % 100 == 0)
+    return zz (vol / 100) << 1;
+  return (zz (vol) << 1) | 1;
+}
+
+
+
+// ****************************************************************
+int unzVol (unsigned long u) {
+  return (u & 1) ? unzz (u >> 1) : unzz (u >> 1) * 100;
+}
+
+
+
+// ****************************************************************
+// Optional fields: 0 for none, otherwise the difference plus one.
+unsigned long zOpt (long v, long ref) {
+  return v ? zz (v - ref) + 1 : 0;
+}
+
+
+
+// ****************************************************************
+long unzOpt (unsigned long u, long ref) {
+  return u ? unzz (u - 1) + ref : 0;
+}
+
+
+
+// ****************************************************************
+unsigned char *zTime (unsigned char *p, zState *s, long timestamp) {
+  long d = timestamp - s->timestamp;
+
+  p = zPut (p, zz (d - s->delta));
+  s->delta = d;
+  s->timestamp = timestamp;
+  return p;
+}
+
+
+
+// ****************************************************************
+long unzTime (unsigned char **p, zState *s) {
+  s->delta += unzz (zGet (p));
+  s->timestamp += s->delta;
+  return s->timestamp;
+}
+
+
+
+// ****************************************************************
+zWriter *zOpen (char *name, int kind) {
+  zHeader header = { ZTAPEMAGIC, ZTAPEVERSION, kind };
+  zWriter *z;
+  FILE *f;
+
+  if ((f = fopen (name, "w")) == NULL)
+    return (NULL);
+  z = (zWriter *) arenaAlloc (sizeof (zWriter));
+  z->f = f;
+  z->kind = kind;
+  pthread_mutex_init (&z->mut, NULL);
+  fwrite (&header, sizeof (header), 1, f);
+  z->offset = sizeof (header);
+
+  return (z);
+}
+
+
+
+// ****************************************************************
+// Write out the current block and start the next one from zero.
+void zFlush (zWriter *z) {
+  if (z->head.count == 0)
+    return;
+  if (z->entries == z->size) {
+    z->size = z->size ? 2 * z->size : 1024;
+    z->index = (zIndex *) realloc (z->index, z->size * sizeof (zIndex));
+  }
+  z->index[z->entries].offset = z->offset;
+  z->index[z->entries].first = z->head.first;
+  z->index[z->entries].last = z->head.last;
+  z->index[z->entries].min = z->head.min;
+  z->index[z->entries].max = z->head.max;
+  z->entries++;
+
+  fwrite (&z->head, sizeof (zBlock), 1, z->f);
+  fwrite (z->buf, 1, z->head.bytes, z->f);
+  z->offset += sizeof (zBlock) + z->head.bytes;
+  memset (&z->head, 0, sizeof (zBlock));
+  memset (&z->s, 0, sizeof (zState));
+}
+
+
+
+// ****************************************************************
+// Where the next record goes, NULL once the tape is closed. Returns
+// with the writer locked.
+unsigned char *zBegin (zWriter *z, long timestamp) {
+  pthread_mutex_lock (&z->mut);
+  if (z->f == NULL) {
+    pthread_mutex_unlock (&z->mut);
+    return (NULL);
+  }
+  if (z->head.bytes + ZRECORDMAX > ZBLOCKBYTES)
+    zFlush (z);
+  if (z->head.count == 0)
+    z->head.first = z->head.min = z->head.max = timestamp;
+  return (z->buf + z->head.bytes);
+}
+
+
+
+// ****************************************************************
+void zEnd (zWriter *z, unsigned char *p, long timestamp) {
+  z->head.bytes = p - z->buf;
+  z->head.last = timestamp;
+  if (timestamp < z->head.min)
+    z->head.min = timestamp;
+  if (timestamp > z->head.max)
+    z->head.max = timestamp;
+  z->head.count++;
+  pthread_mutex_unlock (&z->mut);
+}
+
+
+
+// ****************************************************************
+// The buyer's id against the last one, the seller's against the buyer's.
+void zPutTrade (zWriter *z, trade tr) {
+  unsigned char *p = zBegin (z, tr.timestamp);
+
+  if (p == NULL)
+    return;
+  p = zTime (p, &z->s, tr.timestamp);
+  p = zPut (p, zz (tr.price - z->s.price));
+  p = zPut (p, zVol (tr.volume));
+  p = zPut (p, zz (tr.id1 - z->s.id));
+  p = zPut (p, zz (tr.id2 - tr.id1));
+  z->s.price = tr.price;
+  z->s.id = tr.id1;
+  zEnd (z, p, tr.timestamp);
+}
+
+
+
+// ****************************************************************
+// Action and type share a byte, the rest go as differences.
+void zPutOrder (zWriter *z, order ord) {
+  static char *types = "MLSTRC";
+  unsigned char *p = zBegin (z, ord.timestamp);
+  char *k;
+
+  if (p == NULL)
+    return;
+  p = zPut (p, zz (ord.id - z->s.id));
+  p = zTime (p, &z->s, ord.timestamp);
+  if ((ord.type) && ((k = strchr (types, ord.type)) != NULL) && ((ord.action == 'B') || (ord.action == 'S')))
+    *p++ = 2 * (k - types) + (ord.action == 'S');
+  else {
+    *p++ = 0xff;
+    *p++ = ord.action;
+    *p++ = ord.type;
+  }
+  p = zPut (p, zz (ord.account));
+  p = zPut (p, zVol (ord.vol));
+  p = zPut (p, zOpt (ord.price1, z->s.price));
+  if (ord.price1)
+    z->s.price = ord.price1;
+  p = zPut (p, zOpt (ord.price2, z->s.price));
+  if (ord.price2)
+    z->s.price = ord.price2;
+  p = zPut (p, zOpt (ord.oldid, ord.id));
+  p = zPut (p, zOpt (ord.expire, ord.timestamp));
+  z->s.id = ord.id;
+  zEnd (z, p, ord.timestamp);
+}
+
+
+
+// ****************************************************************
+// The last block, the index and the trailer.
+void zClose (zWriter *z) {
+  zTrailer trailer;
+
+  pthread_mutex_lock (&z->mut);
+  zFlush (z);
+  trailer.entries = z->entries;
+  trailer.offset = z->offset;
+  trailer.magic = ZTAPEMAGIC;
+  fwrite (z->index, sizeof (zIndex), z->entries, z->f);
+  fwrite (&trailer, sizeof (trailer), 1, z->f);
+  fclose (z->f);
+  z->f = NULL;
+  pthread_mutex_unlock (&z->mut);
+}
+
+
+
+// ****************************************************************
+// NULL if name is not a compressed tape.
+zReader *zMap (char *name) {
+  zReader *z;
+  zHeader *h;
+  zTrailer *tr;
+  zBlock *b;
+  long off, size;
+  int fd;
+
+  if ((fd = open (name, O_RDONLY)) < 0)
+    return (NULL);
+  if ((size = lseek (fd, 0, SEEK_END)) < (long) sizeof (zHeader)) {
+    close (fd);
+    return (NULL);
+  }
+  h = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (h == MAP_FAILED)
+    return (NULL);
+  if ((h->magic != ZTAPEMAGIC) || (h->version != ZTAPEVERSION)) {
+    munmap (h, size);
+    return (NULL);
+  }
+
+  z = (zReader *) calloc (1, sizeof (zReader));
+  z->map = (unsigned char *) h;
+  z->size = size;
+  z->kind = h->kind;
+  z->block = -1;
+
+  tr = (zTrailer *) (z->map + z->size - sizeof (zTrailer));
+  if ((z->size >= (long) (sizeof (zHeader) + sizeof (zTrailer))) && (tr->magic == ZTAPEMAGIC) &&
+      (tr->offset + tr->entries * (long) sizeof (zIndex) + (long) sizeof (zTrailer) == z->size)) {
+    z->index = (zIndex *) (z->map + tr->offset);
+    z->entries = z->stop = tr->entries;
+    return (z);
+  }
+
+  for (off = sizeof (zHeader); off + (long) sizeof (zBlock) <= z->size; off += sizeof (zBlock) + b->bytes) {
+    b = (zBlock *) (z->map + off);
+    if ((b->bytes <= 0) || (b->bytes > ZBLOCKBYTES) || (off + (long) sizeof (zBlock) + b->bytes > z->size))
+      break;
+    if ((z->entries & 1023) == 0)
+      z->index = (zIndex *) realloc (z->index, (z->entries + 1024) * sizeof (zIndex));
+    z->index[z->entries].offset = off;
+    z->index[z->entries].first = b->first;
+    z->index[z->entries].last = b->last;
+    z->index[z->entries].min = b->min;
+    z->index[z->entries].max = b->max;
+    z->entries++;
+  }
+  z->stop = z->entries;
+  return (z);
+}
+
+
+
+// ****************************************************************
+// From the first block that reaches timestamp, the whole block.
+void zSeek (zReader *z, long timestamp) {
+  long i;
+
+  for (i = 0; (i < z->entries) && (z->index[i].max < timestamp); i++)
+    ;
+  z->block = i - 1;
+  z->p = z->end = NULL;
+}
+
+
+
+// ****************************************************************
+// Reading ends after the last block with a record up to timestamp.
+void zStop (zReader *z, long timestamp) {
+  for (z->stop = z->entries; (z->stop > 0) && (z->index[z->stop - 1].min > timestamp); z->stop--)
+    ;
+}
+
+
+
+// ****************************************************************
+// Move on to the next block when the current one is used up.
+int zNext (zReader *z) {
+  zBlock *b;
+
+  if (z->p < z->end)
+    return 1;
+  if (++z->block >= z->stop)
+    return 0;
+  b = (zBlock *) (z->map + z->index[z->block].offset);
+  z->p = (unsigned char *) (b + 1);
+  z->end = z->p + b->bytes;
+  memset (&z->s, 0, sizeof (zState));
+  return 1;
+}
+
+
+
+// ****************************************************************
+int zGetTrade (zReader *z, trade *tr) {
+  if (!zNext (z))
+    return 0;
+  tr->timestamp = unzTime (&z->p, &z->s);
+  tr->price = z->s.price += unzz (zGet (&z->p));
+  tr->volume = unzVol (zGet (&z->p));
+  tr->id1 = z->s.id += unzz (zGet (&z->p));
+  tr->id2 = tr->id1 + unzz (zGet (&z->p));
+  return 1;
+}
+
+
+
+// ****************************************************************
+int zGetOrder (zReader *z, order *ord) {
+  static char *types = "MLSTRC";
+  int code;
+
+  if (!zNext (z))
+    return 0;
+  memset (ord, 0, sizeof (order));
+  ord->id = z->s.id += unzz (zGet (&z->p));
+  ord->timestamp = unzTime (&z->p, &z->s);
+  if ((code = *z->p++) == 0xff) {
+    ord->action = *z->p++;
+    ord->type = *z->p++;
+  }
+  else {
+    ord->action = (code & 1) ? 'S' : 'B';
+    ord->type = types[code >> 1];
+  }
+  ord->account = unzz (zGet (&z->p));
+  ord->vol = unzVol (zGet (&z->p));
+  if ((ord->price1 = unzOpt (zGet (&z->p), z->s.price)))
+    z->s.price = ord->price1;
+  if ((ord->price2 = unzOpt (zGet (&z->p), z->s.price)))
+    z->s.price = ord->price2;
+  ord->oldid = unzOpt (zGet (&z->p), ord->id);
+  ord->expire = unzOpt (zGet (&z->p), ord->timestamp);
+  return 1;
+}
+
+
+
+// ****************************************************************
+// Next inbound order of a replay or an ingest, a feed is not paced.
+int replayNext (order *ord) {
+  if (ingest)
+    return feedNext (ingest, ord);
+  if (replayTape)
+    return zGetOrder (replayTape, ord);
+  return orderRead (replay, ord);
+}
+
+
+
+// ****************************************************************
+unsigned int be16 (unsigned char *p) {
+  unsigned short v;
+
+  memcpy (&v, p, 2);
+  return __builtin_bswap16 (v);
+}
+
+
+
+// ****************************************************************
+unsigned int be32 (unsigned char *p) {
+  unsigned int v;
+
+  memcpy (&v, p, 4);
+  return __builtin_bswap32 (v);
+}
+
+
+
+// ****************************************************************
+unsigned long be48 (unsigned char *p) {
+  return ((unsigned long) be16 (p) << 32) | be32 (p + 2);
+}
+
+
+
+// ****************************************************************
+unsigned long be64 (unsigned char *p) {
+  unsigned long v;
+
+  memcpy (&v, p, 8);
+  return __builtin_bswap64 (v);
+}
+
+
+
+// ****************************************************************
+// Shortest length of each message type the feed uses, 0 for the rest.
+int itchLen (int type) {
+  static int len[256] = {
+    [ITCH_ADD] = ITCH_ADD_LEN, [ITCH_ADDMPID] = ITCH_ADDMPID_LEN,
+    [ITCH_EXEC] = ITCH_EXEC_LEN, [ITCH_EXECPRICE] = ITCH_EXECPRICE_LEN,
+    [ITCH_CANCEL] = ITCH_CANCEL_LEN, [ITCH_DELETE] = ITCH_DELETE_LEN,
+    [ITCH_REPLACE] = ITCH_REPLACE_LEN,
+  };
+
+  return len[type];
+}
+
+
+
+// ****************************************************************
+// Maps the file and follows the stock of symbol, or the first one.
+feed *feedOpen (char *name, char *symbol) {
+  unsigned char *m, *p;
+  feed *f;
+  long size;
+  int fd, len, i;
+
+  if ((fd = open (name, O_RDONLY)) < 0) {
+    perror (name);
+    return (NULL);
+  }
+  if ((size = lseek (fd, 0, SEEK_END)) <= 0) {
+    perror (name);
+    close (fd);
+    return (NULL);
+  }
+  f = (feed *) calloc (1, sizeof (feed));
+  f->map = mmap (NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close (fd);
+  if (f->map == MAP_FAILED) {
+    perror (name);
+    return (NULL);
+  }
+  madvise (f->map, size, MADV_SEQUENTIAL);
+  f->size = size;
+  f->p = f->map;
+  f->end = f->map + size;
+
+  for (p = f->map; p + 2 <= f->end; p = m + len) {
+    len = be16 (p);
+    m = p + 2;
+    if (m + len > f->end)
+      break;
+    if (((m[ITCH_TYPE] != ITCH_ADD) && (m[ITCH_TYPE] != ITCH_ADDMPID)) || (len < ITCH_ADD_LEN))
+      continue;
+    memcpy (f->stock, m + ITCH_ADD_STOCK, 8);
+    for (i = 8; (i > 0) && (f->stock[i - 1] == ' '); i--)
+      ;
+    f->stock[i] = 0;
+    if ((symbol) && (strcmp (symbol, f->stock)))
+      continue;
+    f->locate = be16 (m + ITCH_LOCATE);
+    f->base = be48 (m + ITCH_TIMESTAMP);
+    f->open = (be32 (m + ITCH_ADD_PRICE) + ITCH_PRICEX10 / 2) / ITCH_PRICEX10;
+    f->refs = (feedRef *) arenaAlloc (FEEDREFS * sizeof (feedRef));
+    return (f);
+  }
+  fprintf(stderr, "%s: no add order%s%s\n", name, (symbol) ? " for " : "", (symbol) ? symbol : "");
+  return (NULL);
+}
+
+
+
+// ****************************************************************
+// Order references rise through the day, the low bits go.
+unsigned long feedHome (unsigned long ref) {
+  return ref & (FEEDREFS - 1);
+}
+
+
+
+// ****************************************************************
+// Slot of ref, or the free slot it would go in.
+feedRef *feedFind (feed *f, unsigned long ref) {
+  unsigned long i = feedHome (ref);
+
+  while ((f->refs[i].ref) && (f->refs[i].ref != ref))
+    i = (i + 1) & (FEEDREFS - 1);
+  return &f->refs[i];
+}
+
+
+
+// ****************************************************************
+// Robin Hood: a delete shifts the entries after it back by one.
+void feedDrop (feed *f, feedRef *r) {
+  unsigned long i = r - f->refs, j;
+
+  f->live--;
+  while (1) {
+    j = (i + 1) & (FEEDREFS - 1);
+    if ((f->refs[j].ref == 0) || (feedHome (f->refs[j].ref) == j)) {
+      f->refs[i].ref = 0;
+      return;
+    }
+    f->refs[i] = f->refs[j];
+    i = j;
+  }
+}
+
+
+
+// ****************************************************************
+void feedAdd (feed *f, unsigned long ref, long id, int shares, char side) {
+  feedRef x = { ref, id, shares, side }, y;
+  unsigned long i = feedHome (ref), d = 0, e;
+
+  if (++f->live > FEEDREFS / 2) {
+    fprintf(stderr, "ITCH ingest: more than %d live orders\n", FEEDREFS / 2);
+    exit (1);
+  }
+  while (f->refs[i].ref) {
+    e = (i - feedHome (f->refs[i].ref)) & (FEEDREFS - 1);
+    if (e < d) {
+      y = f->refs[i];
+      f->refs[i] = x;
+      x = y;
+      d = e;
+    }
+    i = (i + 1) & (FEEDREFS - 1);
+    d++;
+  }
+  f->refs[i] = x;
+}
+
+
+
+// ****************************************************************
+// Next message of the stock that maps onto an inbound order of the
+// feed's account.
+int feedNext (feed *f, order *ord) {
+  unsigned char *m;
+  unsigned long ref;
+  feedRef *r;
+  int len, type, need;
+
+  while (f->p + 2 <= f->end) {
+    len = be16 (f->p);
+    m = f->p + 2;
+    if (m + len > f->end)
+      break;
+    f->p = m + len;
+    type = m[ITCH_TYPE];
+    need = itchLen (type);
+    if ((need == 0) || (len < need) || ((int) be16 (m + ITCH_LOCATE) != f->locate))
+      continue;
+
+    *ord = (order) { 0 };
+    ord->id = f->next;
+    ord->timestamp = (be48 (m + ITCH_TIMESTAMP) - f->base) / 1000000;
+    ord->account = FEEDACCOUNT;
+    ref = be64 (m + ITCH_REF);
+    r = feedFind (f, ref);
+    if ((r->ref == 0) && (type != ITCH_ADD) && (type != ITCH_ADDMPID))
+      continue;
+
+    switch (type) {
+      case ITCH_ADD:
+      case ITCH_ADDMPID:
+        ord->type = 'L';
+        ord->action = (m[ITCH_ADD_SIDE] == 'S') ? 'S' : 'B';
+        ord->vol = be32 (m + ITCH_ADD_SHARES);
+        ord->price1 = (be32 (m + ITCH_ADD_PRICE) + ITCH_PRICEX10 / 2) / ITCH_PRICEX10;
+        if ((ord->price1 <= 0) || (ord->price1 >= MAXTICK))
+          continue;
+        feedAdd (f, ref, ord->id, ord->vol, ord->action);
+        break;
+
+      case ITCH_EXEC:
+      case ITCH_EXECPRICE:
+        ord->type = 'E';
+        ord->oldid = r->id;
+        ord->action = (r->side == 'B') ? 'S' : 'B';
+        ord->vol = be32 (m + ITCH_EXEC_SHARES);
+        if (type == ITCH_EXECPRICE)
+          ord->price1 = (be32 (m + ITCH_EXECPRICE_PRICE) + ITCH_PRICEX10 / 2) / ITCH_PRICEX10;
+        if ((r->shares -= ord->vol) <= 0)
+          feedDrop (f, r);
+        break;
+
+      case ITCH_CANCEL:
+        ord->oldid = r->id;
+        ord->action = r->side;
+        if ((r->shares -= be32 (m + ITCH_CANCEL_SHARES)) > 0) {
+          ord->type = 'R';
+          ord->vol = r->shares;
         }
         else {
-          flag = 1;
-          i = q->head;
-          while ((i < QUEUESIZE) && (flag)) {
-            if (ord.price1 > q->item[i].price1) {
-              index = i;
-              flag = 0;
-            }
-            i++;  
-          }
-          if (flag) {
-            i = 0;
-            while((i < q->tail) && (flag)) {
-              if (ord.price1 > q->item[i].price1) {
-                index = i;
-                flag = 0;
-              }
-              i++;
-            }
-          }
-          if (flag) 
-            queueAdd (q, ord);
-          else {
-            if (q->head < index) {
-              for (i = q->head - 1; i < index - 1; i++)
-                q->item[i] = q->item[i + 1];
-              q->item[index - 1] = ord;
-              q->head--;  
-              if (q->tail == q->head)
-                q->full = 1;
-              q->empty = 0;
-            }
-            else {
-              for(i = q->tail; i > index; i--)
-                q->item[i] = q->item[i - 1];
-              q->item[index] = ord;
-              q->tail++;
-              if (q->tail == QUEUESIZE)
-                q->tail = 0;
-              if (q->tail == q->head)
-                q->full = 1;
-              q->empty = 0; 
-            }
-          } 
+          ord->type = 'C';
+          feedDrop (f, r);
         }
+        break;
+
+      case ITCH_DELETE:
+        ord->type = 'C';
+        ord->oldid = r->id;
+        ord->action = r->side;
+        feedDrop (f, r);
+        break;
+
+      default:
+        ord->type = 'R';
+        ord->oldid = r->id;
+        ord->action = r->side;
+        ord->vol = be32 (m + ITCH_REPLACE_SHARES);
+        ord->price1 = (be32 (m + ITCH_REPLACE_PRICE) + ITCH_PRICEX10 / 2) / ITCH_PRICEX10;
+        feedDrop (f, r);
+        feedAdd (f, be64 (m + ITCH_REPLACE_NEWREF), ord->oldid, ord->vol, ord->action);
+        break;
+    }
+    f->next++;
+    return 1;
+  }
+  return 0;
+}
+
+
+
+// ****************************************************************
+gateway *gatewayInit (int port) {
+  struct sockaddr_in addr = { 0 };
+  struct epoll_event ev = { 0 };
+  gateway *g;
+  int i, on = 1;
+
+  g = (gateway *) arenaAlloc (sizeof (gateway));
+  g->s = (session *) arenaAlloc (gwSessions * sizeof (session));
+  g->freeList = (int *) arenaAlloc (gwSessions * sizeof (int));
+  g->flushList = (int *) arenaAlloc (gwSessions * sizeof (int));
+  g->paused = (int *) arenaAlloc (gwSessions * sizeof (int));
+  g->owners = (gwOwner *) arenaAlloc (GWOWNERS * sizeof (gwOwner));
+  g->mut = (pthread_mutex_t *) malloc (sizeof (pthread_mutex_t));
+  pthread_mutex_init (g->mut, NULL);
+  for (i = 0; i < GWOWNERS; i++)
+    g->owners[i].id = -1;
+  for (i = gwSessions - 1; i >= 0; i--) {
+    g->s[i].fd = -1;
+    g->freeList[g->nfree++] = i;
+  }
+
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (port);
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (((g->listen = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) ||
+      (setsockopt (g->listen, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on)) != 0) ||
+      (bind (g->listen, (struct sockaddr *) &addr, sizeof (addr)) != 0) ||
+      (listen (g->listen, 128) != 0)) {
+    perror ("gateway");
+    return NULL;
+  }
+  g->epoll = epoll_create1 (0);
+  g->wake = eventfd (0, EFD_NONBLOCK);
+  ev.events = EPOLLIN;
+  ev.data.u32 = gwSessions;
+  epoll_ctl (g->epoll, EPOLL_CTL_ADD, g->listen, &ev);
+  ev.data.u32 = gwSessions + 1;
+  epoll_ctl (g->epoll, EPOLL_CTL_ADD, g->wake, &ev);
+  fprintf(stderr, "Gateway listening on 127.0.0.1:%d for %d sessions\n", port, gwSessions);
+  return g;
+}
+
+
+
+// ****************************************************************
+// Fills, rejects and orders leaving, dropped when the gateway is behind.
+void gatewayReport (long id, long timestamp, int price, int vol, int reason, int done) {
+  unsigned long one = 1;
+  int wasEmpty;
+
+  pthread_mutex_lock (gw->mut);
+  if (gw->tail - gw->head == GWREPORTS) {
+    gw->dropped++;
+    pthread_mutex_unlock (gw->mut);
+    return;
+  }
+  wasEmpty = (gw->tail == gw->head);
+  gw->report[gw->tail++ & (GWREPORTS - 1)] = (gwReport) { id, timestamp, price, vol, reason, done };
+  pthread_mutex_unlock (gw->mut);
+  if (wasEmpty)
+    (void) write (gw->wake, &one, sizeof (one));
+}
+
+
+
+// ****************************************************************
+void gwClose (int i) {
+  session *s = &gw->s[i];
+
+  epoll_ctl (gw->epoll, EPOLL_CTL_DEL, s->fd, NULL);
+  close (s->fd);
+  s->fd = -1;
+  s->gen++;
+  s->paused = 0;
+  gw->freeList[gw->nfree++] = i;
+}
+
+
+
+// ****************************************************************
+// What the session waits for: nothing to read while it is paused.
+void gwEvents (int i) {
+  session *s = &gw->s[i];
+  struct epoll_event ev = { 0 };
+
+  ev.events = (s->paused ? 0 : EPOLLIN) | (s->polled ? EPOLLOUT : 0);
+  ev.data.u32 = i;
+  epoll_ctl (gw->epoll, EPOLL_CTL_MOD, s->fd, &ev);
+}
+
+
+
+// ****************************************************************
+// Queues a message for the session, a client that does not read is cut off.
+void gwSend (int i, void *msg, int len) {
+  session *s = &gw->s[i];
+  long at;
+  int n;
+
+  if (s->fd < 0)
+    return;
+  if (s->outTail - s->outHead + len > GWOUTBUF) {
+    gw->slow++;
+    gwClose (i);
+    return;
+  }
+  at = s->outTail & (GWOUTBUF - 1);
+  n = (len < GWOUTBUF - at) ? len : GWOUTBUF - at;
+  memcpy (s->out + at, msg, n);
+  memcpy (s->out, (char *) msg + n, len - n);
+  s->outTail += len;
+  if (!s->flush) {
+    s->flush = 1;
+    gw->flushList[gw->nflush++] = i;
+  }
+}
+
+
+
+// ****************************************************************
+void gwFlush (int i) {
+  session *s = &gw->s[i];
+  struct iovec iov[2];
+  long at, len, n;
+
+  s->flush = 0;
+  if (s->fd < 0)
+    return;
+  while (s->outHead < s->outTail) {
+    at = s->outHead & (GWOUTBUF - 1);
+    len = s->outTail - s->outHead;
+    iov[0].iov_base = s->out + at;
+    iov[0].iov_len = (len < GWOUTBUF - at) ? len : GWOUTBUF - at;
+    iov[1].iov_base = s->out;
+    iov[1].iov_len = len - iov[0].iov_len;
+    if ((n = writev (s->fd, iov, iov[1].iov_len ? 2 : 1)) > 0) {
+      s->outHead += n;
+      continue;
+    }
+    if ((n < 0) && (errno == EINTR))
+      continue;
+    if ((n < 0) && (errno != EAGAIN)) {
+      gwClose (i);
+      return;
+    }
+    break;
+  }
+  // the rest goes out when the socket has room again
+  if ((s->outHead < s->outTail) != s->polled) {
+    s->polled = !s->polled;
+    gwEvents (i);
+  }
+}
+
+
+
+// ****************************************************************
+// The owner of an id goes in the first of GWPROBES slots whose order
+// has left the engine, or over the oldest.
+void gwOwn (long id, int i, int live) {
+  gwOwner *o;
+  int k;
+
+  for (k = 0; k < GWPROBES; k++) {
+    o = &gw->owners[(id + k) & (GWOWNERS - 1)];
+    if ((o->id < 0) || (!o->live))
+      break;
+  }
+  if (k == GWPROBES) {
+    o = &gw->owners[id & (GWOWNERS - 1)];
+    gw->evicted++;
+  }
+  *o = (gwOwner) { id, i, gw->s[i].gen, live };
+}
+
+
+
+// ****************************************************************
+gwOwner *gwOwnerOf (long id) {
+  gwOwner *o;
+  int k;
+
+  for (k = 0; (k < GWPROBES) && (id >= 0); k++) {
+    o = &gw->owners[(id + k) & (GWOWNERS - 1)];
+    if (o->id == id)
+      return o;
+    if (o->id < 0)
+      break;
+  }
+  return NULL;
+}
+
+
+
+// ****************************************************************
+// Owner check for cancels and modifies.
+int gwOwns (int i, long id) {
+  gwOwner *o = gwOwnerOf (id);
+
+  return (o != NULL) && (o->session == i) && (o->gen == gw->s[i].gen);
+}
+
+
+
+// ****************************************************************
+// One message of session i into an order, 0 when none goes to the engine.
+int gwDecode (int i, unsigned char *m, int len, order *ord, int busy) {
+  gwNew *n = (gwNew *) m;
+  gwCancel *c = (gwCancel *) m;
+  gwModify *r = (gwModify *) m;
+  gwQuote *x = (gwQuote *) m;
+  gwAck ack = { sizeof (gwAck) - 2, GW_ACK, GW_ACCEPTED, 0, -1 };
+  agentQuote lad;
+  int ok = 0, k, side, blocks = 1;
+
+  *ord = (order) { 0 };
+  ord->timestamp = getTimestamp();
+  switch (m[2]) {
+    case GW_NEW:
+      ack.ref = n->ref;
+      ok = (len >= (int) sizeof (gwNew)) && ((n->side == 'B') || (n->side == 'S')) &&
+           ((n->kind == 'M') || (n->kind == 'L') || (n->kind == 'S') || (n->kind == 'T') || (n->kind == 'P')) &&
+           (n->vol > 0) && (n->account < NACCOUNTS) && (n->expire >= 0);
+      ord->action = n->side;
+      ord->type = n->kind;
+      ord->account = n->account;
+      ord->vol = n->vol;
+      ord->price1 = n->price1;
+      ord->price2 = n->price2;
+      if ((n->kind == 'L') && (n->expire))
+        ord->expire = ord->timestamp + n->expire;
+      break;
+    case GW_CANCEL:
+      ack.ref = c->ref;
+      ok = (len >= (int) sizeof (gwCancel));
+      if ((ok) && (!gwOwns (i, c->id)))
+        ack.status = GW_NOTOWNER;
+      ord->type = 'C';
+      ord->action = 'B';
+      ord->oldid = c->id;
+      break;
+    case GW_MODIFY:
+      ack.ref = r->ref;
+      ok = (len >= (int) sizeof (gwModify)) && (r->vol > 0);
+      if ((ok) && (!gwOwns (i, r->id)))
+        ack.status = GW_NOTOWNER;
+      ord->type = 'R';
+      ord->action = 'B';
+      ord->oldid = r->id;
+      ord->vol = r->vol;
+      ord->price1 = r->price1;
+      break;
+    case GW_QUOTE:
+      ack.ref = x->ref;
+      ok = (len >= (int) sizeof (gwQuote)) && (x->bids >= 0) && (x->bids <= GW_QUOTELEVELS) && (x->asks >= 0) &&
+           (x->asks <= GW_QUOTELEVELS) && (len >= (int) (sizeof (gwQuote) + (x->bids + x->asks) * sizeof (gwLevel))) &&
+           (x->account < NACCOUNTS);
+      if (!ok)
+        break;
+      lad.levels[0] = x->bids;
+      lad.levels[1] = x->asks;
+      for (k = 0; k < x->bids + x->asks; k++) {
+        side = (k >= x->bids);
+        lad.price[side][k - side * x->bids] = x->level[k].price1;
+        lad.vol[side][k - side * x->bids] = x->level[k].vol;
+        ok &= (x->level[k].vol > 0);
       }
+      ord->type = 'Q';
+      ord->action = 'B';
+      ord->account = x->account;
+      blocks = 2 * GW_QUOTELEVELS;
+      if ((ok) && (!busy) && ((ord->oldid = quotePost (i, gw->s[i].gen, &lad)) < 0))
+        ack.status = GW_BUSY;
+      break;
+  }
+  if (!ok)
+    ack.status = GW_MALFORMED;
+  else if ((busy) && ((m[2] == GW_NEW) || (m[2] == GW_QUOTE))) {
+    ack.status = GW_BUSY;
+    admit->refused[0]++;
+  }
+  if (ack.status == GW_ACCEPTED) {
+    // a quote takes a block of ids, one for every level it may add
+    gw->nextId = (gw->nextId + blocks - 1) / blocks * blocks;
+    ord->id = ack.id = gw->nextId;
+    for (k = 0; k < blocks; k++)
+      gwOwn (ord->id + k, i, (m[2] == GW_NEW) || (m[2] == GW_QUOTE));
+    gw->nextId += blocks;
+  }
+  // the ack is queued ahead of anything the engine says about the order
+  gwSend (i, &ack, sizeof (ack));
+  return (ack.status == GW_ACCEPTED);
+}
+
+
+
+// ****************************************************************
+// Into the inbound queue as far as it has room, the rest is held back.
+void gwQueue (queue *q, order *batch, int n) {
+  int k;
+
+  pthread_mutex_lock (q->mut);
+  for (k = 0; (k < n) && (!((batch[k].type == 'C') ? cancelLane : q)->full); k++)
+    inboundAdd (q, batch[k]);
+  pthread_mutex_unlock (q->mut);
+  pthread_cond_signal (q->notEmpty);
+  stat->orders += k;
+  if (k < n) {
+    memcpy (gw->pending + gw->npending, batch + k, (n - k) * sizeof (order));
+    gw->npending += n - k;
+    gw->held++;
+  }
+}
+
+
+
+// ****************************************************************
+void gwPush (queue *q, order *batch, int n) {
+  int k;
+
+  // a mass quote is not recorded, its ladder is not in the order
+  for (k = 0; k < n; k++) {
+    if ((record) && (batch[k].type != 'Q'))
+      orderWrite (record, batch[k]);
+    if ((orderTape) && (batch[k].type != 'Q'))
+      zPutOrder (orderTape, batch[k]);
+  }
+  gwQueue (q, batch, n);
+}
+
+
+
+// ****************************************************************
+void gwPause (int i) {
+  if (gw->s[i].paused)
+    return;
+  gw->s[i].paused = 1;
+  gw->paused[gw->npaused++] = i;
+  gwEvents (i);
+}
+
+
+
+// ****************************************************************
+// Hands the complete messages of session i on in batches.
+void gwDrain (int i, queue *q) {
+  session *s = &gw->s[i];
+  unsigned char m[GW_MAXMSG];
+  order batch[GWBATCH];
+  long at, len;
+  int k = 0, busy;
+
+  while (s->inTail - s->inHead >= (long) sizeof (gwHeader)) {
+    at = s->inHead & (GWINBUF - 1);
+    len = s->in[at] | (s->in[(at + 1) & (GWINBUF - 1)] << 8);
+    if ((len < 1) || (len + 2 > GW_MAXMSG)) {
+      gwClose (i);
+      break;
     }
-    else if ((ord.type == 'L') && (ord.action == 'S')){
-      if (ord.price1 <= q->item[q->head].price1)
-        queuePush (q, ord);
-      else if ((ord.price1 >= q->item[q->tail - 1].price1) && (q->tail > 0))
-        queueAdd (q, ord);
+    if (s->inTail - s->inHead < len + 2)
+      break;
+    if (at + len + 2 <= GWINBUF)
+      memcpy (m, s->in + at, len + 2);
+    else {
+      memcpy (m, s->in + at, GWINBUF - at);
+      memcpy (m + GWINBUF - at, s->in, len + 2 - (GWINBUF - at));
+    }
+    s->inHead += len + 2;
+    // new orders are turned away at the edge when the engine is behind
+    busy = (admit->policy[0] != ADMIT_BLOCK) && (queueDepth (q) + k >= ADMITMARK);
+    if (gwDecode (i, m, len + 2, &batch[k], busy))
+      k++;
+    if (k == GWBATCH) {
+      gwPush (q, batch, k);
+      k = 0;
+      if (gw->npending)
+        break;
+    }
+    if (s->fd < 0)
+      break;
+  }
+  if (k)
+    gwPush (q, batch, k);
+  if ((gw->npending) && (s->fd >= 0))
+    gwPause (i);
+}
+
+
+
+// ****************************************************************
+// Reads what session i sent into its ring and hands it on.
+void gwRead (int i, queue *q) {
+  session *s = &gw->s[i];
+  struct iovec iov[2];
+  long at, room, n;
+
+  if (gw->npending) {
+    gwPause (i);
+    return;
+  }
+  at = s->inTail & (GWINBUF - 1);
+  room = GWINBUF - (s->inTail - s->inHead);
+  iov[0].iov_base = s->in + at;
+  iov[0].iov_len = (room < GWINBUF - at) ? room : GWINBUF - at;
+  iov[1].iov_base = s->in;
+  iov[1].iov_len = room - iov[0].iov_len;
+  n = readv (s->fd, iov, iov[1].iov_len ? 2 : 1);
+  if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+    return;
+  if (n <= 0) {
+    gwClose (i);
+    return;
+  }
+  s->inTail += n;
+  gwDrain (i, q);
+}
+
+
+
+// ****************************************************************
+// Tries the held back orders again, then lets the sessions go on.
+void gwResume (queue *q) {
+  order batch[GWBATCH];
+  int n = gw->npending, i;
+
+  memcpy (batch, gw->pending, n * sizeof (order));
+  gw->npending = 0;
+  gwQueue (q, batch, n);
+  while ((gw->npending == 0) && (gw->npaused > 0)) {
+    i = gw->paused[--gw->npaused];
+    if (!gw->s[i].paused)
+      continue;
+    gw->s[i].paused = 0;
+    gwEvents (i);
+    gwDrain (i, q);
+  }
+}
+
+
+
+// ****************************************************************
+// Fills and rejects go to the session that owns the order.
+void gwReports (void) {
+  gwReport r[GWBATCH];
+  gwOwner *o;
+  gwFill fill = { .len = sizeof (gwFill) - 2, .type = GW_FILL };
+  gwReject reject = { .len = sizeof (gwReject) - 2, .type = GW_REJECT };
+  unsigned long count;
+  int k, n;
+
+  (void) read (gw->wake, &count, sizeof (count));
+  do {
+    pthread_mutex_lock (gw->mut);
+    for (n = 0; (n < GWBATCH) && (gw->head < gw->tail); n++)
+      r[n] = gw->report[gw->head++ & (GWREPORTS - 1)];
+    pthread_mutex_unlock (gw->mut);
+    for (k = 0; k < n; k++) {
+      if ((o = gwOwnerOf (r[k].id)) == NULL)
+        continue;
+      if (r[k].done)
+        o->live = 0;
+      if ((o->gen != gw->s[o->session].gen) || (r[k].reason == GWGONE))
+        continue;
+      if (r[k].reason) {
+        reject.reason = r[k].reason;
+        reject.id = r[k].id;
+        gwSend (o->session, &reject, sizeof (reject));
+      }
       else {
-        if (q->tail > q->head) {
-          flag = 1;
-          i = q->head;
-          while ((i < q->tail) && (flag)) {
-            if (ord.price1 < q->item[i].price1) {
-              index = i;
-              flag = 0;
-            }
-            i++;
-          }
-          for (i = q->tail; i > index; i--)
-            q->item[i] = q->item[i - 1];
-          q->item[index] = ord;
-          q->tail++;  
-          if (q->tail == QUEUESIZE)
-            q->tail = 0;
-          if (q->tail == q->head)
-            q->full = 1;
-          q->empty = 0;
-        }
-        else {
-          flag = 1;
-          i = q->head;
-          while ((i < QUEUESIZE) && (flag)) {
-            if (ord.price1 < q->item[i].price1) {
-              index = i;
-              flag = 0;
-            }
-            i++;  
-          }
-          if (flag) {
-            i = 0;
-            while ((i < q->tail) && (flag)) {
-              if (ord.price1 < q->item[i].price1) {
-                index = i;
-                flag = 0;
-              }
-              i++;
-            }
-          }
-          if (flag)
-            queueAdd (q, ord);
-          else {
-            if (q->head < index) {
-              for(i = q->head - 1; i < index - 1; i++)
-                q->item[i] = q->item[i + 1];
-              q->item[index - 1] = ord;
-              q->head--;  
-              if (q->tail == q->head)
-                q->full = 1;
-              q->empty = 0;
-            }
-            else {
-              for (i = q->tail; i > index; i--)
-                q->item[i] = q->item[i - 1];
-              q->item[index] = ord;
-              q->tail++;
-              if (q->tail == QUEUESIZE)
-                q->tail = 0;
-              if (q->tail == q->head)
-                q->full = 1;
-              q->empty = 0; 
-            }
+        fill.id = r[k].id;
+        fill.timestamp = r[k].timestamp;
+        fill.price = r[k].price;
+        fill.vol = r[k].vol;
+        gwSend (o->session, &fill, sizeof (fill));
+      }
+    }
+  } while (n == GWBATCH);
+}
+
+
+
+// ****************************************************************
+// Takes the place of Prod: the inbound orders come from the sessions.
+void *Gateway (void *arg) {
+  queue *q = (queue *) arg;
+  struct epoll_event ev[64], add = { 0 };
+  gwReject full = { sizeof (gwReject) - 2, GW_REJECT, GW_REJECTBUSY, -1 };
+  int i, k, n, fd, on = 1;
+
+  statRegister ("Gateway");
+  numaFree ();
+  while (1) {
+    // with orders held back, look again for room in a msec
+    if ((n = epoll_wait (gw->epoll, ev, 64, gw->npending ? 1 : -1)) < 0)
+      continue;
+    for (k = 0; k < n; k++) {
+      i = ev[k].data.u32;
+      if (i == gwSessions) {
+        while ((fd = accept (gw->listen, NULL, NULL)) >= 0) {
+          // no session free: the client is told so before it is closed
+          if (gw->nfree == 0) {
+            (void) write (fd, &full, sizeof (full));
+            close (fd);
+            gw->full++;
+            continue;
           }
+          fcntl (fd, F_SETFL, O_NONBLOCK);
+          setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+          i = gw->freeList[--gw->nfree];
+          gw->s[i].fd = fd;
+          gw->s[i].polled = 0;
+          gw->s[i].paused = 0;
+          gw->s[i].inHead = gw->s[i].inTail = 0;
+          gw->s[i].outHead = gw->s[i].outTail = 0;
+          add.events = EPOLLIN;
+          add.data.u32 = i;
+          epoll_ctl (gw->epoll, EPOLL_CTL_ADD, fd, &add);
+          gw->sessions++;
         }
       }
+      else if (i == gwSessions + 1)
+        gwReports ();
+      else if (gw->s[i].fd >= 0) {
+        if (ev[k].events & EPOLLOUT)
+          gwFlush (i);
+        if ((gw->s[i].fd >= 0) && (ev[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+          gwRead (i, q);
+      }
+    }
+    if (gw->npending)
+      gwResume (q);
+    for (k = 0; k < gw->nflush; k++)
+      gwFlush (gw->flushList[k]);
+    gw->nflush = 0;
+  }
+  return NULL;
+}
+
+
+
+// ****************************************************************
+void orderRejected (order ord, int reason) {
+  if (gw)
+    gatewayReport (ord.id, ord.timestamp, 0, 0, reason, 1);
+  if (npools)
+    agentPublish ('J', (agentTrade) { ord.timestamp, 0, 0, ord.id, 0 }, reason);
+}
+
+
+
+// ****************************************************************
+// The queries of agentBook.
+int agentDepthOf (char side, agentDepth *out, int n) {
+  return bookDepth ((side == 'B') ? buyLimitOrder : sellLimitOrder, out, n);
+}
+
+int agentLevelOf (char side, int price, agentResting *out, int max) {
+  return bookLevel ((side == 'B') ? buyLimitOrder : sellLimitOrder, price, out, max);
+}
+
+long agentPositionOf (char side, long id) {
+  return bookPosition ((side == 'B') ? buyLimitOrder : sellLimitOrder, id, NULL);
+}
+
+long agentQuoteOf (agent *a, const agentQuote *q) {
+  return quotePost (gwSessions + a->index, 0, q);
+}
+
+
+
+// ****************************************************************
+// plugin.so:kind=count,... with the agents dealt round robin to the
+// runners. 0 if the plugin or a kind is not found.
+int agentsLoad (char *spec, int runners) {
+  char buf[1024], *item, *eq, *save, *colon;
+  agentKind *kinds, *k;
+  agentPool *p;
+  agent *a;
+  void *lib;
+  int i, n, total = 0;
+
+  snprintf (buf, sizeof (buf), "%s", spec);
+  if ((colon = strchr (buf, ':')) == NULL)
+    return 0;
+  *colon++ = '\0';
+  if ((lib = dlopen (buf, RTLD_NOW)) == NULL) {
+    fprintf(stderr, "%s\n", dlerror ());
+    return 0;
+  }
+  if ((kinds = (agentKind *) dlsym (lib, "agentKinds")) == NULL) {
+    fprintf(stderr, "%s: no agentKinds\n", buf);
+    return 0;
+  }
+
+  agentView = (agentBook) { (agentLevel *) buyLimitOrder->lvl, (agentLevel *) sellLimitOrder->lvl,
+                            &buyLimitOrder->best, &sellLimitOrder->best, &currentPriceX10,
+                            agentDepthOf, agentLevelOf, agentPositionOf, agentQuoteOf };
+  agentBus = (agentEvent *) calloc (AGENTRING, sizeof (agentEvent));
+  npools = runners;
+  pools = (agentPool *) calloc (npools, sizeof (agentPool));
+  for (i = 0; i < npools; i++) {
+    pools[i].r.nextId = (long) (i + 1) << AGENTIDBITS;
+    pools[i].r.owner = (agentOwner *) calloc (AGENTOWNERS, sizeof (agentOwner));
+    pools[i].top = (agentTop) { .bid = -2, .ask = -2 };
+  }
+
+  for (item = strtok_r (colon, ",", &save); item; item = strtok_r (NULL, ",", &save)) {
+    if ((eq = strchr (item, '=')) != NULL)
+      *eq++ = '\0';
+    n = eq ? atoi (eq) : 1;
+    for (k = kinds; (k->name) && (strcmp (k->name, item)); k++)
+      ;
+    if (k->name == NULL) {
+      fprintf(stderr, "%s: no agent kind %s\n", buf, item);
+      return 0;
+    }
+    for (i = 0; i < n; i++, total++) {
+      a = (agent *) calloc (1, sizeof (agent));
+      a->kind = k;
+      a->book = &agentView;
+      a->state = calloc (1, k->size ? k->size : 1);
+      a->index = total;
+      a->account = total % NACCOUNTS;
+      a->seed = total;
+      p = &pools[total % npools];
+      a->runner = &p->r;
+      if ((p->n & (p->n - 1)) == 0)
+        p->agents = (agent **) realloc (p->agents, (p->n ? 2 * p->n : 1) * sizeof (agent *));
+      p->agents[p->n++] = a;
+    }
+  }
+
+  for (i = 0; i < npools; i++) {
+    p = &pools[i];
+    p->r.dirty = (agent **) malloc ((p->n + 1) * sizeof (agent *));
+    for (p->readyMask = 1; p->readyMask <= p->n; p->readyMask <<= 1)
+      ;
+    p->ready = (agent **) malloc (p->readyMask * sizeof (agent *));
+    p->readyMask--;
+  }
+  fprintf(stderr, "%d agents of %s on %d runner threads\n", total, buf, npools);
+  return 1;
+}
+
+
+
+// ****************************************************************
+// Any thread may publish; the slot is odd while it is written.
+void agentPublish (char type, agentTrade tr, int reason) {
+  long n = __atomic_fetch_add (&agentClaim, 1, __ATOMIC_RELAXED);
+  agentEvent *e = &agentBus[n & (AGENTRING - 1)];
+
+  __atomic_store_n (&e->seq, 2 * n + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  e->type = type;
+  e->reason = reason;
+  e->tr = tr;
+  __atomic_store_n (&e->seq, 2 * n + 2, __ATOMIC_RELEASE);
+  agentRing ();
+}
+
+
+
+// ****************************************************************
+// After an event or a new top: wake the runners if any went to sleep.
+void agentRing (void) {
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&agentSleepers, __ATOMIC_RELAXED)) {
+    __atomic_fetch_add (&agentBell, 1, __ATOMIC_RELAXED);
+    syscall (SYS_futex, &agentBell, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+  }
+}
+
+
+
+// ****************************************************************
+int agentIdle (agentPool *p) {
+  return (__atomic_load_n (&agentClaim, __ATOMIC_ACQUIRE) == p->next) &&
+    (__atomic_load_n (&buyLimitOrder->top->seq, __ATOMIC_ACQUIRE) == p->topSeq[0]) &&
+    (__atomic_load_n (&sellLimitOrder->top->seq, __ATOMIC_ACQUIRE) == p->topSeq[1]);
+}
+
+
+
+// ****************************************************************
+// A runner with nothing to do spins a while, then sleeps until it is
+// rung or its next timer is due.
+void agentWait (agentPool *p, long until) {
+  struct timespec ts;
+  int bell, i;
+  long now;
+
+  for (i = 0; i < AGENTSPIN; i++) {
+    if (!agentIdle (p))
+      return;
+    _mm_pause ();
+  }
+  bell = __atomic_load_n (&agentBell, __ATOMIC_ACQUIRE);
+  __atomic_fetch_add (&agentSleepers, 1, __ATOMIC_SEQ_CST);
+  now = getTimestamp();
+  if ((agentIdle (p)) && (until > now)) {
+    ts.tv_sec = (until - now) / 1000;
+    ts.tv_nsec = ((until - now) % 1000) * 1000000;
+    syscall (SYS_futex, &agentBell, FUTEX_WAIT_PRIVATE, bell, &ts, NULL, 0);
+  }
+  __atomic_fetch_sub (&agentSleepers, 1, __ATOMIC_RELEASE);
+}
+
+
+
+// ****************************************************************
+// The next event for pool p, 0 if there is none yet. A runner that
+// falls a whole ring behind skips to the oldest event still there.
+int agentEventNext (agentPool *p, agentEvent *out) {
+  agentEvent *e = &agentBus[p->next & (AGENTRING - 1)];
+  long want = 2 * p->next + 2, seq = __atomic_load_n (&e->seq, __ATOMIC_ACQUIRE);
+
+  if (seq < want)
+    return 0;
+  if (seq == want) {
+    *out = *e;
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    if (__atomic_load_n (&e->seq, __ATOMIC_RELAXED) == want) {
+      p->next++;
+      return 1;
+    }
+  }
+  seq = __atomic_load_n (&agentClaim, __ATOMIC_ACQUIRE) - AGENTRING / 2;
+  p->lost += seq - p->next;
+  p->next = seq;
+  return 0;
+}
+
+
+
+// ****************************************************************
+// Hands the agents that sent orders to Cons, one wakeup per flush.
+void agentFlush (agentPool *p, queue *q) {
+  int k;
+
+  if (p->r.ndirty == 0)
+    return;
+  for (k = 0; k < p->r.ndirty; k++) {
+    while (p->readyTail - __atomic_load_n (&p->readyHead, __ATOMIC_ACQUIRE) > p->readyMask)
+      usleep (100);
+    p->r.dirty[k]->dirty = 0;
+    p->ready[p->readyTail & p->readyMask] = p->r.dirty[k];
+    __atomic_store_n (&p->readyTail, p->readyTail + 1, __ATOMIC_RELEASE);
+  }
+  stat->orders += p->r.ndirty;
+  p->r.ndirty = 0;
+  pthread_mutex_lock (q->mut);
+  pthread_cond_signal (q->notEmpty);
+  pthread_mutex_unlock (q->mut);
+}
+
+
+
+// ****************************************************************
+// Only Cons calls these. The agent being drained is kept until its ring
+// is empty, then the next one is taken off a ready ring.
+agent *draining;
+int drainPool;
+
+static inline int agentPending (agent *a) {
+  return (a) && (a->head < __atomic_load_n (&a->tail, __ATOMIC_ACQUIRE));
+}
+
+int agentWork (void) {
+  agentPool *p;
+  long tail;
+  int i;
+
+  if (agentPending (draining))
+    return 1;
+  for (i = 0; i < npools; i++) {
+    p = &pools[i];
+    tail = __atomic_load_n (&p->readyTail, __ATOMIC_ACQUIRE);
+    while ((p->readyHead < tail) && (!agentPending (p->ready[p->readyHead & p->readyMask])))
+      __atomic_store_n (&p->readyHead, p->readyHead + 1, __ATOMIC_RELEASE);
+    if (p->readyHead < tail)
+      return 1;
+  }
+  return 0;
+}
+
+
+
+// ****************************************************************
+// 0 if no agent has an order after all.
+int agentNext (order *ord) {
+  agentOrder *o;
+  agentPool *p = NULL;
+  int i;
+
+  while (!agentPending (draining)) {
+    for (i = 0; i < npools; i++) {
+      p = &pools[drainPool = (drainPool + 1) % npools];
+      if (p->readyHead < __atomic_load_n (&p->readyTail, __ATOMIC_ACQUIRE))
+        break;
+    }
+    if (i == npools)
+      return 0;
+    draining = p->ready[p->readyHead & p->readyMask];
+    __atomic_store_n (&p->readyHead, p->readyHead + 1, __ATOMIC_RELEASE);
+  }
+  o = &draining->chan[draining->head & (AGENTCHAN - 1)];
+  *ord = (order) { 0 };
+  ord->id = o->id;
+  ord->oldid = o->oldid;
+  ord->timestamp = getTimestamp();
+  ord->expire = ((o->type == 'L') && (o->expire)) ? ord->timestamp + o->expire : 0;
+  ord->account = draining->account;
+  ord->vol = o->vol;
+  ord->price1 = o->price1;
+  ord->price2 = o->price2;
+  ord->action = o->action;
+  ord->type = o->type;
+  __atomic_store_n (&draining->head, draining->head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+
+
+// ****************************************************************
+agent *agentOwnerOf (agentRunner *r, long id) {
+  agentOwner *o = &r->owner[id & (AGENTOWNERS - 1)];
+
+  return (o->id == id) ? o->a : NULL;
+}
+
+
+
+// ****************************************************************
+// One runner: its agents for every event, a new top and their timers.
+void *Agents (void *arg) {
+  agentPool *p = (agentPool *) arg;
+  queue *q = cancelLane;        // has the lock and the wakeup of Cons
+  agentEvent e;
+  agentTop top;
+  agentDepth d;
+  agentRunner *r = &p->r;
+  agent *a;
+  long now, until;
+  int i, n;
+
+  statRegister ("Agents");
+  p->next = __atomic_load_n (&agentClaim, __ATOMIC_ACQUIRE);
+  for (i = 0; i < p->n; i++)
+    if (p->agents[i]->kind->start)
+      p->agents[i]->kind->start (p->agents[i]);
+  while (1) {
+    for (n = 0; (n < AGENTBATCH) && (agentEventNext (p, &e)); n++) {
+      if (e.type == 'T') {
+        stat->trades++;
+        for (i = 0; i < p->n; i++)
+          if (p->agents[i]->kind->trade)
+            p->agents[i]->kind->trade (p->agents[i], &e.tr);
+      }
+      // fills and rejects go to the agent that sent the order, if it is here
+      a = agentOwnerOf (r, e.tr.id1);
+      if ((a) && (e.type == 'T') && (a->kind->fill))
+        a->kind->fill (a, e.tr.id1, &e.tr);
+      if ((a) && (e.type == 'J') && (a->kind->reject))
+        a->kind->reject (a, e.tr.id1, e.reason);
+      a = (e.type == 'T') ? agentOwnerOf (r, e.tr.id2) : NULL;
+      if ((a) && (a->kind->fill))
+        a->kind->fill (a, e.tr.id2, &e.tr);
+    }
+
+    now = getTimestamp();
+    p->topSeq[0] = __atomic_load_n (&buyLimitOrder->top->seq, __ATOMIC_ACQUIRE);
+    p->topSeq[1] = __atomic_load_n (&sellLimitOrder->top->seq, __ATOMIC_ACQUIRE);
+    top.timestamp = now;
+    top.bid = (bookDepth (buyLimitOrder, &d, 1)) ? d.price : -1;
+    top.bidVol = (top.bid >= 0) ? d.vol : 0;
+    top.ask = (bookDepth (sellLimitOrder, &d, 1)) ? d.price : -1;
+    top.askVol = (top.ask >= 0) ? d.vol : 0;
+    if ((top.bid != p->top.bid) || (top.ask != p->top.ask) || (top.bidVol != p->top.bidVol) ||
+        (top.askVol != p->top.askVol)) {
+      p->top = top;
+      for (i = 0; i < p->n; i++)
+        if (p->agents[i]->kind->top)
+          p->agents[i]->kind->top (p->agents[i], &top);
+    }
+
+    until = now + AGENTNAP;
+    for (i = 0; i < p->n; i++) {
+      a = p->agents[i];
+      if ((a->kind->period) && (now >= a->wake)) {
+        a->wake = now + a->kind->period;
+        a->kind->timer (a, now);
+      }
+      if ((a->kind->period) && (a->wake < until))
+        until = a->wake;
+    }
+    agentFlush (p, q);
+    if (n == 0)
+      agentWait (p, until);
+  }
+  return NULL;
+}
+
+
+
+// ****************************************************************
+// Every resting order in priority order, then the orders the stage
+// threads hold for Market. Only settled in sequenced mode.
+void stateDump () {
+  book *b;
+  queue *q;
+  stopQueue *s;
+  long i;
+  int side, p, n;
+
+  printf("*** Final state, price %d\n", currentPriceX10);
+  for (side = 0; side < 2; side++) {
+    q = (side == 0) ? buyMarketOrder : sellMarketOrder;
+    for (i = q->head; !q->empty; ) {
+      printf("%s Market %ld %d\n", (side == 0) ? "Buy" : "Sell", q->item[i].id, q->item[i].vol);
+      if (++i == QUEUESIZE)
+        i = 0;
+      if (i == q->tail)
+        break;
+    }
+  }
+  for (side = 0; side < 2; side++) {
+    b = (side == 0) ? buyLimitOrder : sellLimitOrder;
+    for (p = b->best; (p != NIL) && (p >= 0) && (p < MAXTICK); p += (side == 0) ? -1 : 1)
+      for (n = b->lvl[p].head; n != NIL; n = b->pool[n].next)
+        printf("%s Limit %ld %d %d\n", (side == 0) ? "Buy" : "Sell", b->pool[n].ord.id,
+               b->pool[n].ord.vol, p);
+    for (p = 0; p < NPEGS; p++)
+      for (i = b->peg[p]->head; !b->peg[p]->empty; ) {
+        printf("%s Pegged %ld %d %d\n", (side == 0) ? "Buy" : "Sell", b->peg[p]->item[i].id,
+               b->peg[p]->item[i].vol, p);
+        if (++i == QUEUESIZE)
+          i = 0;
+        if (i == b->peg[p]->tail)
+          break;
+      }
+  }
+  for (side = 0; side < 2; side++) {
+    s = (side == 0) ? buyStopOrder : sellStopOrder;
+    for (p = s->next; p != NIL; p = bitScan (s->bits, p, side == 0))
+      for (n = s->head[p]; n != NIL; n = s->pool[n].next)
+        printf("%s Stop %ld %d %d\n", (side == 0) ? "Buy" : "Sell", s->pool[n].ord.id, s->pool[n].ord.vol, p);
+  }
+  if (t->marketBuyer)
+    printf("Posted Buy Market %ld %d\n", t->buyMarketOrder.id, t->buyMarketOrder.vol);
+  if (t->marketSeller)
+    printf("Posted Sell Market %ld %d\n", t->sellMarketOrder.id, t->sellMarketOrder.vol);
+  if (t->limitBuyer)
+    printf("Posted Buy Limit %ld %d %d\n", t->buyLimitOrder.id, t->buyLimitOrder.vol, t->buyLimitOrder.price1);
+  if (t->limitSeller)
+    printf("Posted Sell Limit %ld %d %d\n", t->sellLimitOrder.id, t->sellLimitOrder.vol, t->sellLimitOrder.price1);
+}
+
+
+
+// ****************************************************************
+void report () {
+  struct timespec t0, t1;
+  unsigned long c0, c1;
+  long accepted;
+  int i;
+
+  // calibrate the cycle counter against the wall clock
+  clock_gettime (CLOCK_MONOTONIC, &t0);
+  c0 = cycles();
+  usleep (20000);
+  clock_gettime (CLOCK_MONOTONIC, &t1);
+  c1 = cycles();
+  cyclesPerNsec = (double)(c1 - c0) / ((t1.tv_sec - t0.tv_sec) * 1.0e9 + (t1.tv_nsec - t0.tv_nsec));
+
+  accepted = gate->checks;
+  for (i = 1; i < RISKCHECKS; i++)
+    accepted -= gate->rejects[i];
+
+  fprintf(stderr, "\n*** Run time %ld msec\n", getTimestamp());
+  fprintf(stderr, "Risk checks: %ld accepted: %ld  %.1f nsec/check\n", gate->checks, accepted,
+          gate->checks ? gate->cycles / cyclesPerNsec / gate->checks : 0.0);
+  fprintf(stderr, "Risk rejects: size %ld  price %ld  open %ld  position %ld  notional %ld  owner %ld\n",
+          gate->rejects[RISK_SIZE], gate->rejects[RISK_PRICE], gate->rejects[RISK_OPEN],
+          gate->rejects[RISK_POSITION], gate->rejects[RISK_NOTIONAL], gate->rejects[RISK_OWNER]);
+  if (mem.base)
+    fprintf(stderr, "Arena: %.1f of %.1f MB used, %.1f MB outside\n", mem.used / 1048576.0,
+            mem.size / 1048576.0, mem.spilled / 1048576.0);
+  if (topo.node >= 0) {
+    numaUpdate ();
+    fprintf(stderr, "NUMA: node %d of %d, memory", topo.node, topo.nodes);
+    for (i = 0; i < topo.nodes; i++)
+      fprintf(stderr, " node%d %.1f MB", i, stats->nodeMem[i] / 1048576.0);
+    fprintf(stderr, ", pages given to tasks of other nodes");
+    for (i = 0; i < topo.nodes; i++)
+      fprintf(stderr, " node%d %ld", i, stats->nodeRemote[i]);
+    fprintf(stderr, "\n");
+  }
+  fprintf(stderr, "Admission: high-water");
+  for (i = 0; i < NSTATQUEUES; i++)
+    fprintf(stderr, " %s %ld", stats->queueName[i], admit->high[i]);
+  fprintf(stderr, "\nAdmission: refused");
+  for (i = 0; i < NSTATQUEUES; i++)
+    fprintf(stderr, " %s %ld", stats->queueName[i], admit->refused[i]);
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Books: inserts short of a node in limbo, buy %ld  sell %ld\n",
+          buyLimitOrder->starved, sellLimitOrder->starved);
+  for (i = 0; i < npools; i++)
+    fprintf(stderr, "Agents: runner %d, %d agents, %ld orders, %ld events lost\n", i, pools[i].n,
+            pools[i].r.nextId - ((long) (i + 1) << AGENTIDBITS), pools[i].lost);
+  if (gw)
+    fprintf(stderr, "Gateway: %ld sessions, %ld refused as full, %ld orders, %ld batches held back, "
+            "%ld owners given up, %ld closed as slow, %ld reports dropped\n",
+            gw->sessions, gw->full, gw->nextId, gw->held, gw->evicted, gw->slow, gw->dropped);
+  lockReport (stderr);
+}
+
+
+
+// ****************************************************************
+// Sets the bits of a sysfs cpu list such as 0-3,8-11.
+void cpuList (char *list, unsigned long *mask) {
+  char *item, *save;
+  int lo, hi, c;
+
+  for (item = strtok_r (list, ",\n", &save); item; item = strtok_r (NULL, ",\n", &save)) {
+    if (sscanf (item, "%d-%d", &lo, &hi) == 1)
+      hi = lo;
+    for (c = lo; (c <= hi) && (c < MAXCPUS); c++)
+      mask[c / 64] |= 1UL << (c % 64);
+  }
+}
+
+
+
+// ****************************************************************
+// The numastat counters of node k, 0 if it has none.
+void nodeCounters (int k, long *local, long *remote) {
+  char name[64], key[32];
+  long v;
+  FILE *f;
+
+  *local = *remote = 0;
+  snprintf (name, sizeof (name), "/sys/devices/system/node/node%d/numastat", k);
+  if ((f = fopen (name, "r")) == NULL)
+    return;
+  while (fscanf (f, "%31s %ld", key, &v) == 2) {
+    if (strcmp (key, "local_node") == 0)
+      *local = v;
+    else if (strcmp (key, "other_node") == 0)
+      *remote = v;
+  }
+  fclose (f);
+}
+
+
+
+// ****************************************************************
+// Reads the nodes and their CPUs, node -1 is the one this thread is on.
+// Called before anything is allocated and before the threads.
+void numaInit (int node) {
+  char name[64], list[4096];
+  unsigned long nodes;
+  unsigned cpu, at;
+  int k, fd, n;
+
+  topo.node = -1;
+  for (k = 0; k < NSTATNODES; k++) {
+    snprintf (name, sizeof (name), "/sys/devices/system/node/node%d/cpulist", k);
+    if ((fd = open (name, O_RDONLY)) < 0)
+      continue;
+    n = read (fd, list, sizeof (list) - 1);
+    close (fd);
+    list[(n > 0) ? n : 0] = '\0';
+    cpuList (list, topo.cpus[k]);
+    for (n = 0; n < MAXCPUS / 64; n++)
+      topo.all[n] |= topo.cpus[k][n];
+    topo.nodes = k + 1;
+  }
+  if ((node < 0) && (topo.nodes > 1) && (syscall (SYS_getcpu, &cpu, &at, NULL) == 0))
+    node = at;
+  if (node < 0)
+    return;
+  for (k = 0, n = 0; (node < topo.nodes) && (k < MAXCPUS / 64); k++)
+    n |= (topo.cpus[node][k] != 0);
+  if (!n) {
+    fprintf(stderr, "no NUMA node %d with CPUs on this host\n", node);
+    exit (1);
+  }
+
+  nodes = 1UL << node;
+  if (syscall (SYS_sched_setaffinity, 0, sizeof (topo.cpus[node]), topo.cpus[node]) != 0)
+    perror ("sched_setaffinity");
+  if (syscall (SYS_set_mempolicy, MPOL_PREFERRED, &nodes, NSTATNODES + 1) != 0)
+    perror ("set_mempolicy");
+  for (k = 0; k < topo.nodes; k++)
+    nodeCounters (k, &topo.local0[k], &topo.remote0[k]);
+  topo.node = node;
+}
+
+
+
+// ****************************************************************
+// Every thread of the engine, the inbound one too, on the CPUs of spec.
+void cpuPin (char *spec) {
+  unsigned long mask[MAXCPUS / 64] = { 0 };
+  char list[4096];
+  int k, n = 0;
+
+  snprintf (list, sizeof (list), "%s", spec);
+  cpuList (list, mask);
+  for (k = 0; k < MAXCPUS / 64; k++)
+    n |= (mask[k] != 0);
+  if ((!n) || (syscall (SYS_sched_setaffinity, 0, sizeof (mask), mask) != 0)) {
+    fprintf(stderr, "cannot run on CPUs %s\n", spec);
+    exit (1);
+  }
+  memcpy (topo.all, mask, sizeof (mask));
+  if (topo.node >= 0)
+    memcpy (topo.cpus[topo.node], mask, sizeof (mask));
+}
+
+
+
+// ****************************************************************
+// The inbound thread runs anywhere and allocates as it likes.
+void numaFree (void) {
+  if (topo.node < 0)
+    return;
+  syscall (SYS_sched_setaffinity, 0, sizeof (topo.all), topo.all);
+  syscall (SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+}
+
+
+
+// ****************************************************************
+// The pages of the engine on each node and the numastat counters.
+void numaUpdate (void) {
+  char line[4096], *item, *save;
+  long mem[NSTATNODES] = { 0 }, pages[NSTATNODES], local, remote, kb;
+  int k;
+  FILE *f;
+
+  stats->nnodes = topo.nodes;
+  stats->node = topo.node;
+  if ((topo.node < 0) || ((f = fopen ("/proc/self/numa_maps", "r")) == NULL))
+    return;
+  while (fgets (line, sizeof (line), f)) {
+    memset (pages, 0, sizeof (pages));
+    kb = 4;
+    for (item = strtok_r (line, " \n", &save); item; item = strtok_r (NULL, " \n", &save)) {
+      if ((item[0] == 'N') && (sscanf (item + 1, "%d=%ld", &k, &local) == 2) && (k >= 0) && (k < NSTATNODES))
+        pages[k] += local;
+      else if (strncmp (item, "kernelpagesize_kB=", 18) == 0)
+        kb = atol (item + 18);
+    }
+    for (k = 0; k < NSTATNODES; k++)
+      mem[k] += pages[k] * kb * 1024;
+  }
+  fclose (f);
+  for (k = 0; k < topo.nodes; k++) {
+    nodeCounters (k, &local, &remote);
+    stats->nodeMem[k] = mem[k];
+    stats->nodeLocal[k] = local - topo.local0[k];
+    stats->nodeRemote[k] = remote - topo.remote0[k];
+  }
+}
+
+
+
+// ****************************************************************
+// Explicit huge pages, then aligned normal pages, then calloc.
+void arenaInit (long size, int lock) {
+  struct timespec t0, t1;
+  char thp[128] = "";
+  char *p;
+  int fd;
+
+  size = (size + HUGEPAGE - 1) & ~(HUGEPAGE - 1);
+  mem.pages = "explicit huge";
+  p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p == MAP_FAILED) {
+    p = mmap (NULL, size + HUGEPAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      perror ("arena");
+      return;
+    }
+    p = (char *) (((unsigned long) p + HUGEPAGE - 1) & ~(HUGEPAGE - 1));
+    mem.pages = "4 KB";
+    if (((fd = open ("/sys/kernel/mm/transparent_hugepage/enabled", O_RDONLY)) >= 0)) {
+      (void) read (fd, thp, sizeof (thp) - 1);
+      close (fd);
+    }
+    if ((madvise (p, size, MADV_HUGEPAGE) == 0) && (strstr (thp, "[never]") == NULL) && (thp[0]))
+      mem.pages = "transparent huge";
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, &t0);
+  memset (p, 0, size);
+  clock_gettime (CLOCK_MONOTONIC, &t1);
+  mem.faultMsec = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+  if (lock) {
+    if (mlock (p, size) == 0)
+      mem.locked = 1;
+    else
+      perror ("arena mlock");
+  }
+  mem.base = p;
+  mem.size = size;
+}
+
+
+
+// ****************************************************************
+// Zeroed, never given back.
+void *arenaAlloc (long size) {
+  void *p;
+
+  size = (size + ARENAALIGN - 1) & ~(ARENAALIGN - 1);
+  if ((mem.base == NULL) || (mem.used + size > mem.size)) {
+    mem.spilled += size;
+    return calloc (1, size);
+  }
+  p = mem.base + mem.used;
+  mem.used += size;
+  return p;
+}
+
+
+
+// ****************************************************************
+void arenaFree (void *p) {
+  if (((char *) p < mem.base) || ((char *) p >= mem.base + mem.size))
+    free (p);
+}
+
+
+
+// ****************************************************************
+queue *queueInit (void) {
+  queue *q;
+
+  q = (queue *) arenaAlloc (sizeof (queue));
+  if (q == NULL) return (NULL);
+
+  q->empty = 1;
+  q->full = 0;
+  q->head = 0;
+  q->tail = 0;
+  q->mut = (pthread_mutex_t *) malloc (sizeof (pthread_mutex_t));
+  pthread_mutex_init (q->mut, NULL);
+  q->notFull = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+  pthread_cond_init (q->notFull, NULL);
+  q->notEmpty = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+  pthread_cond_init (q->notEmpty, NULL);
+	
+  return (q);
+}
+
+
+
+// ****************************************************************
+void queueAdd (queue *q, order in){
+  q->item[q->tail] = in;
+  q->tail++;
+  if (q->tail == QUEUESIZE)
+    q->tail = 0;
+  if (q->tail == q->head)
+    q->full = 1;
+  q->empty = 0;
+
+  return;
+}
+
+
+// ****************************************************************
+void queuePush (queue *q, order in) {
+
+if (!q->empty) {
+  if (q->head > 0) {
+    q->head--;
+    q->item[q->head] = in;
+    
+  }
+  else {
+    int i;  
+    for (i = q->tail; i > q->head; i--)
+      q->item[i] = q->item[i - 1];
+    q->item[0] = in;
+    q->tail++;
+    if (q->tail == QUEUESIZE)
+      q->tail = 0;
+  }
+  if (q->tail == q->head)
+    q->full = 1;
+  q->empty = 0;
+    
+  }else queueAdd (q, in); 
+  return; 
+}
+
+
+
+// ****************************************************************
+void queueAddSort (queue *q, order ord) {
+  long i, index;
+  int flag;
+  
+  if(!q->empty) {
+    if ((ord.type == 'L') && (ord.action == 'B')) {
+      if(ord.price1 >= q->item[q->head].price1)
+        queuePush (q, ord);
+      else if (ord.price1 <= q->item[(q->tail + QUEUESIZE - 1) % QUEUESIZE].price1)
+        queueAdd (q, ord);
+      else {
+        if(q->tail > q->head) {
+          flag = 1;
+          i=q->head;
+          while ((i < q->tail) && (flag)) {
+            if (ord.price1 > q->item[i].price1) {
+              index = i;
+              flag = 0;
+            }
+            i++;  
+          }
+          for (i= q->tail; i > index; i--)
+            q->item[i] = q->item[i - 1];
+          q->item[index] = ord;
+          q->tail++;  
+          if (q->tail == QUEUESIZE)
+            q->tail = 0;
+          if (q->tail == q->head)
+            q->full = 1;
+          q->empty = 0;
+        }
+        else {
+          flag = 1;
+          i = q->head;
+          while ((i < QUEUESIZE) && (flag)) {
+            if (ord.price1 > q->item[i].price1) {
+              index = i;
+              flag = 0;
+            }
+            i++;  
+          }
+          if (flag) {
+            i = 0;
+            while((i < q->tail) && (flag)) {
+              if (ord.price1 > q->item[i].price1) {
+                index = i;
+                flag = 0;
+              }
+              i++;
+            }
+          }
+          if (flag) 
+            queueAdd (q, ord);
+          else {
+            if (q->head < index) {
+              for (i = q->head - 1; i < index - 1; i++)
+                q->item[i] = q->item[i + 1];
+              q->item[index - 1] = ord;
+              q->head--;  
+              if (q->tail == q->head)
+                q->full = 1;
+              q->empty = 0;
+            }
+            else {
+              for(i = q->tail; i > index; i--)
+                q->item[i] = q->item[i - 1];
+              q->item[index] = ord;
+              q->tail++;
+              if (q->tail == QUEUESIZE)
+                q->tail = 0;
+              if (q->tail == q->head)
+                q->full = 1;
+              q->empty = 0; 
+            }
+          } 
+        }
+      }
+    }
+    else if ((ord.type == 'L') && (ord.action == 'S')){
+      if (ord.price1 <= q->item[q->head].price1)
+        queuePush (q, ord);
+      else if (ord.price1 >= q->item[(q->tail + QUEUESIZE - 1) % QUEUESIZE].price1)
+        queueAdd (q, ord);
+      else {
+        if (q->tail > q->head) {
+          flag = 1;
+          i = q->head;
+          while ((i < q->tail) && (flag)) {
+            if (ord.price1 < q->item[i].price1) {
+              index = i;
+              flag = 0;
+            }
+            i++;
+          }
+          for (i = q->tail; i > index; i--)
+            q->item[i] = q->item[i - 1];
+          q->item[index] = ord;
+          q->tail++;  
+          if (q->tail == QUEUESIZE)
+            q->tail = 0;
+          if (q->tail == q->head)
+            q->full = 1;
+          q->empty = 0;
+        }
+        else {
+          flag = 1;
+          i = q->head;
+          while ((i < QUEUESIZE) && (flag)) {
+            if (ord.price1 < q->item[i].price1) {
+              index = i;
+              flag = 0;
+            }
+            i++;  
+          }
+          if (flag) {
+            i = 0;
+            while ((i < q->tail) && (flag)) {
+              if (ord.price1 < q->item[i].price1) {
+                index = i;
+                flag = 0;
+              }
+              i++;
+            }
+          }
+          if (flag)
+            queueAdd (q, ord);
+          else {
+            if (q->head < index) {
+              for(i = q->head - 1; i < index - 1; i++)
+                q->item[i] = q->item[i + 1];
+              q->item[index - 1] = ord;
+              q->head--;  
+              if (q->tail == q->head)
+                q->full = 1;
+              q->empty = 0;
+            }
+            else {
+              for (i = q->tail; i > index; i--)
+                q->item[i] = q->item[i - 1];
+              q->item[index] = ord;
+              q->tail++;
+              if (q->tail == QUEUESIZE)
+                q->tail = 0;
+              if (q->tail == q->head)
+                q->full = 1;
+              q->empty = 0; 
+            }
+          }
+        }
+      }
+    }
+  }
+  else queueAdd (q, ord);
+  return; 
+}
+
+
+
+// ****************************************************************
+void queueDel (queue *q, order *out) {
+  *out = q->item[q->head];
+  q->head++;
+  if (q->head == QUEUESIZE)
+    q->head = 0;
+  if (q->head == q->tail)
+    q->empty = 1;
+  q->full = 0;
+
+  return;
+}
+
+
+
+// ****************************************************************
+// Position of order id in the ring or NIL, the scan Cancel() does
+// on the market queues.
+long queueFind (queue *q, long id) {
+  long i;
+
+  if (q->empty)
+    return NIL;
+  i = q->head;
+  do {
+    if (q->item[i].id == id)
+      return i;
+    if (++i == QUEUESIZE)
+      i = 0;
+  } while (i != q->tail);
+  return NIL;
+}
+
+
+
+// ****************************************************************
+void queueDelete (queue *q) {
+  pthread_mutex_destroy (q->mut);
+  free (q->mut);  
+  pthread_cond_destroy (q->notFull);
+  free (q->notFull);
+  pthread_cond_destroy (q->notEmpty);
+  free (q->notEmpty);
+  arenaFree (q);
+}
+
+
+
+// ****************************************************************
+int queueDelIndex (queue *q, order ord, order *out) {
+  long i;
+  long mid = - 1;
+  if (q->tail > q->head) {
+
+    for (i = q->head; i < q->tail; i++) {
+      if (ord.oldid == q->item[i].id) {
+        mid = i;
+        break;
+        }
+      }
+    if (mid == - 1) return 0;
+    *out = q->item[mid];
+    for(i = mid; i > q->head; i--)
+        q->item[i] = q->item[i - 1];
+    q->head++;
+    if (q->head == QUEUESIZE)
+      q->head = 0;
+    if (q->head == q->tail)
+      q->empty = 1;
+    q->full = 0;
+    return 1;   
+    }
+    else if ((q->tail == 0) && (!q->empty)) {
+      for (i = q->head; i < QUEUESIZE; i++) {
+        if (ord.oldid == q->item[i].id) {
+          mid = i;
+          break;
+        }
+      }
+    if (mid == - 1) return 0;
+    *out = q->item[mid];
+    for (i = mid; i > q->head; i--)
+        q->item[i] = q->item[i - 1];
+        
+    q->head++;
+    if (q->head == QUEUESIZE)
+      q->head = 0;
+    if (q->head == q->tail)
+      q->empty = 1;
+    q->full = 0;
+    return 1;
+  }
+  else if (!q->empty) {
+    for (i = q->head; i < QUEUESIZE; i++) {
+      if (ord.oldid == q->item[i].id) {
+        mid = i;
+        break;
+      }
+    }
+    if (mid == -1) {
+      for (i = 0; i < q->tail; i++) {
+        if (ord.oldid == q->item[i].id) {
+          mid = i;
+          break;
+        }
+      }
+    }
+    if (mid == - 1) return 0;
+    *out = q->item[mid];
+    if (mid >= q->head) {
+      for (i = mid; i > q->head; i--)
+        q->item[i]=q->item[i - 1];
+      q->head++;
+      if (q->head == QUEUESIZE)
+        q->head = 0;
+      if (q->head == q->tail)
+        q->empty = 1;
+      q->full = 0;
+      return 1;   
+      }
+    else if (mid < q->head) {
+      for (i = mid; i < q->tail - 1; i++)
+        q->item[i] = q->item[i + 1];
+        
+      q->tail--;  
+      q->full = 0;
+      return 1;
+    }
+  }   
+  return 0;
+}
+
+
+
+// ****************************************************************
+stopQueue *stopInit (char side) {
+  stopQueue *s;
+  int i;
+
+  s = (stopQueue *) arenaAlloc (sizeof (stopQueue));
+  if (s == NULL) return (NULL);
+
+  for (i = 0; i < QUEUESIZE; i++)
+    s->pool[i].next = (i + 1 < QUEUESIZE) ? i + 1 : NIL;
+  s->freeList = 0;
+  for (i = 0; i < MAXTICK; i++)
+    s->head[i] = s->tail[i] = NIL;
+  memset (s->bits, 0, sizeof (s->bits));
+  for (i = 0; i < IDXSIZE; i++)
+    s->idx.key[i] = NIL;
+  s->next = NIL;
+  s->side = side;
+  s->size = 0;
+  s->mut = (pthread_mutex_t *) malloc (sizeof (pthread_mutex_t));
+  pthread_mutex_init (s->mut, NULL);
+  s->notFull = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+  pthread_cond_init (s->notFull, NULL);
+
+  return (s);
+}
+
+
+
+// ****************************************************************
+void stopAdd (stopQueue *s, order ord) {
+  int n, p = ord.price2;
+
+  pthread_mutex_lock (s->mut);
+  while (s->size == QUEUESIZE)
+    statFull (s->notFull, s->mut);
+
+  n = s->freeList;
+  s->freeList = s->pool[n].next;
+  s->pool[n].ord = ord;
+  s->pool[n].next = NIL;
+  s->pool[n].prev = s->tail[p];
+  if (s->tail[p] != NIL)
+    s->pool[s->tail[p]].next = n;
+  else {
+    s->head[p] = n;
+    s->bits[p >> 6] |= 1UL << (p & 63);
+    if ((s->next == NIL) || ((s->side == 'B') ? (p < s->next) : (p > s->next)))
+      s->next = p;
+  }
+  s->tail[p] = n;
+  idxPut (&s->idx, ord.id, n);
+  s->size++;
+  admitHigh ((s == buyStopOrder) ? 6 : 7, s->size);
+
+  pthread_mutex_unlock (s->mut);
+}
+
+
+
+// ****************************************************************
+// Takes node n out of its list, with s->mut held.
+void stopUnlink (stopQueue *s, int n, order *out) {
+  stopNode *x = &s->pool[n];
+  int p = x->ord.price2;
+
+  *out = x->ord;
+  if (x->prev != NIL)
+    s->pool[x->prev].next = x->next;
+  else
+    s->head[p] = x->next;
+  if (x->next != NIL)
+    s->pool[x->next].prev = x->prev;
+  else
+    s->tail[p] = x->prev;
+  if (s->head[p] == NIL) {
+    s->bits[p >> 6] &= ~(1UL << (p & 63));
+    if (p == s->next)
+      s->next = bitScan (s->bits, p, s->side == 'B');
+  }
+  idxDel (&s->idx, x->ord.id);
+  x->next = s->freeList;
+  s->freeList = n;
+  s->size--;
+}
+
+
+
+// ****************************************************************
+int stopDelIndex (stopQueue *s, order ord, order *out) {
+  int n;
+
+  pthread_mutex_lock (s->mut);
+  if ((n = idxGet (&s->idx, ord.oldid)) == NIL) {
+    pthread_mutex_unlock (s->mut);
+    return 0;
+  }
+  stopUnlink (s, n, out);
+  pthread_mutex_unlock (s->mut);
+  pthread_cond_signal (s->notFull);
+
+  return 1;
+}
+
+
+
+// ****************************************************************
+void stopDelete (stopQueue *s) {
+  pthread_mutex_destroy (s->mut);
+  free (s->mut);
+  pthread_cond_destroy (s->notFull);
+  free (s->notFull);
+  arenaFree (s);
+}
+
+
+
+// ****************************************************************
+int stopCrossed (order ord) {
+  if (ord.action == 'B')
+    return (currentPriceX10 >= ord.price2);
+  else
+    return (currentPriceX10 <= ord.price2);
+}
+
+
+
+// ****************************************************************
+// A triggered stop as the order it rests as, returns its orderAdd flag.
+int stopActivate (order *ord) {
+  if (ord->type == 'S') {
+    ord->type = 'M';
+    return (ord->action == 'B') ? 0 : 1;
+  }
+  ord->type = 'L';
+  return (ord->action == 'B') ? 2 : 3;
+}
+
+
+
+// ****************************************************************
+book *bookInit (char side) {
+  book *b;
+  int i, j;
+
+  b = (book *) arenaAlloc (sizeof (book));
+  if (b == NULL) return (NULL);
+
+  for (i = 0; i < POOLSIZE; i++) {
+    b->pool[i].next = i + 1;
+    b->pool[i].tslot = NIL;
+  }
+  b->pool[POOLSIZE - 1].next = NIL;
+  b->freeList = 0;
+  b->limboHead = b->limboTail = NIL;
+  for (i = 0; i < MAXTICK; i++) {
+    b->lvl[i].head = NIL;
+    b->lvl[i].tail = NIL;
+    b->lvl[i].count = 0;
+    b->lvl[i].epoch = 0;
+    b->lvl[i].vol = 0;
+    b->lvl[i].gone = 0;
+  }
+  memset (b->bits, 0, sizeof (b->bits));
+  for (i = 0; i < IDXSIZE; i++)
+    b->idx.key[i] = NIL;
+  for (i = 0; i < WHEELLEVELS; i++)
+    for (j = 0; j < WHEELSIZE; j++)
+      b->tw.slot[i][j] = NIL;
+  b->tw.now = 0;
+  b->tw.count = 0;
+
+  for (i = 0; i < NPEGS; i++)
+    b->peg[i] = queueInit ();
+  b->pegs = 0;
+  b->starved = 0;
+  b->top = NULL;
+  b->taking = 0;
+  b->side = side;
+  b->best = NIL;
+  b->size = 0;
+  b->empty = 1;
+  b->full = 0;
+  b->mut = (pthread_mutex_t *) malloc (sizeof (pthread_mutex_t));
+  pthread_mutex_init (b->mut, NULL);
+  b->notFull = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+  pthread_cond_init (b->notFull, NULL);
+  b->notEmpty = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+  pthread_cond_init (b->notEmpty, NULL);
+
+  return (b);
+}
+
+
+
+// ****************************************************************
+void bookDelete (book *b) {
+  int i;
+
+  for (i = 0; i < NPEGS; i++)
+    queueDelete (b->peg[i]);
+  pthread_mutex_destroy (b->mut);
+  free (b->mut);
+  pthread_cond_destroy (b->notFull);
+  free (b->notFull);
+  pthread_cond_destroy (b->notEmpty);
+  free (b->notEmpty);
+  arenaFree (b);
+}
+
+
+
+// ****************************************************************
+// Order id -> pool node, open addressing with linear probing.
+unsigned long idxHash (long id) {
+  return ((unsigned long) id * 0x9E3779B97F4A7C15UL) >> (64 - IDXBITS);
+}
+
+
+
+// ****************************************************************
+void idxPut (idTable *x, long id, int n) {
+  unsigned long i = idxHash (id);
+
+  while (x->key[i] != NIL)
+    i = (i + 1) & (IDXSIZE - 1);
+  x->key[i] = id;
+  x->val[i] = n;
+}
+
+
+
+// ****************************************************************
+int idxGet (idTable *x, long id) {
+  unsigned long i = idxHash (id);
+
+  while (x->key[i] != NIL) {
+    if (x->key[i] == id)
+      return x->val[i];
+    i = (i + 1) & (IDXSIZE - 1);
+  }
+  return NIL;
+}
+
+
+
+// ****************************************************************
+// Backward shift deletion, no tombstones.
+void idxDel (idTable *x, long id) {
+  unsigned long i = idxHash (id), j, home;
+
+  while (x->key[i] != id)
+    i = (i + 1) & (IDXSIZE - 1);
+  j = i;
+  while (1) {
+    j = (j + 1) & (IDXSIZE - 1);
+    if (x->key[j] == NIL)
+      break;
+    home = idxHash (x->key[j]);
+    if (((j - home) & (IDXSIZE - 1)) >= ((j - i) & (IDXSIZE - 1))) {
+      x->key[i] = x->key[j];
+      x->val[i] = x->val[j];
+      i = j;
+    }
+  }
+  x->key[i] = NIL;
+}
+
+
+
+// ****************************************************************
+// Next price set in a bitmap of MAXTICK prices, above p or below it.
+int bitScan (unsigned long *bits, int p, int up) {
+  long w = p >> 6;
+  unsigned long m;
+
+  if (!up) {
+    m = bits[w] & ((1UL << (p & 63)) - 1);
+    while (!m) {
+      if (--w < 0)
+        return NIL;
+      m = bits[w];
+    }
+    return (w << 6) + 63 - __builtin_clzl (m);
+  }
+  m = ((p & 63) == 63) ? 0 : bits[w] & (~0UL << ((p & 63) + 1));
+  while (!m) {
+    if (++w == MAXTICK / 64)
+      return NIL;
+    m = bits[w];
+  }
+  return (w << 6) + __builtin_ctzl (m);
+}
+
+
+
+// ****************************************************************
+// Next non-empty price level behind p, found through the level bitmap.
+int bookScan (book *b, int p) {
+  return bitScan (b->bits, p, b->side == 'S');
+}
+
+
+
+// ****************************************************************
+void levelLink (book *b, int n, int front) {
+  node *x = &b->pool[n];
+  int p = x->ord.price1;
+  level *l = &b->lvl[p];
+
+  if (front) {
+    x->prev = NIL;
+    x->next = l->head;
+    if (l->head != NIL)
+      b->pool[l->head].prev = n;
+    else
+      l->tail = n;
+    l->head = n;
+    l->gone -= x->ord.vol;
+    x->before = l->gone;
+  }
+  else {
+    x->next = NIL;
+    x->prev = l->tail;
+    if (l->tail != NIL)
+      b->pool[l->tail].next = n;
+    else
+      l->head = n;
+    l->tail = n;
+    x->before = l->gone + l->vol;
+  }
+  x->epoch = l->epoch;
+  l->vol += x->ord.vol;
+  if (l->count++ == 0) {
+    b->bits[p >> 6] |= 1UL << (p & 63);
+    if ((b->best == NIL) || ((b->side == 'B') ? (p > b->best) : (p < b->best)))
+      b->best = p;
+  }
+}
+
+
+
+// ****************************************************************
+void levelUnlink (book *b, int n) {
+  node *x = &b->pool[n];
+  int p = x->ord.price1;
+  level *l = &b->lvl[p];
+
+  if (x->prev == NIL)
+    l->gone += x->ord.vol;
+  else if (x->next != NIL)
+    l->epoch++;
+  if (x->prev != NIL)
+    b->pool[x->prev].next = x->next;
+  else
+    l->head = x->next;
+  if (x->next != NIL)
+    b->pool[x->next].prev = x->prev;
+  else
+    l->tail = x->prev;
+  l->vol -= x->ord.vol;
+  if (--l->count == 0) {
+    l->gone = 0;
+    b->bits[p >> 6] &= ~(1UL << (p & 63));
+    if (p == b->best)
+      b->best = bookScan (b, p);
+  }
+}
+
+
+
+// ****************************************************************
+// Hierarchical timing wheel, level k slots are WHEELSIZE^k msec wide
+// and tw.now is the next msec still to be run.
+void timerAdd (book *b, int n) {
+  wheel *w = &b->tw;
+  node *x = &b->pool[n];
+  long e = x->ord.expire, d;
+  int lv, ix;
+
+  if (e < w->now)
+    e = w->now;
+  d = e - w->now;
+  for (lv = 0; lv < WHEELLEVELS - 1; lv++)
+    if (d < (1L << (WHEELBITS * (lv + 1))))
+      break;
+  if (d >= (1L << (WHEELBITS * WHEELLEVELS)))
+    e = w->now + (1L << (WHEELBITS * WHEELLEVELS)) - 1;
+  ix = (e >> (WHEELBITS * lv)) & (WHEELSIZE - 1);
+
+  x->tslot = lv * WHEELSIZE + ix;
+  x->tprev = NIL;
+  x->tnext = w->slot[lv][ix];
+  if (x->tnext != NIL)
+    b->pool[x->tnext].tprev = n;
+  w->slot[lv][ix] = n;
+  w->count++;
+}
+
+
+
+// ****************************************************************
+void timerDel (book *b, int n) {
+  wheel *w = &b->tw;
+  node *x = &b->pool[n];
+
+  if (x->tprev != NIL)
+    b->pool[x->tprev].tnext = x->tnext;
+  else
+    w->slot[x->tslot / WHEELSIZE][x->tslot % WHEELSIZE] = x->tnext;
+  if (x->tnext != NIL)
+    b->pool[x->tnext].tprev = x->tprev;
+  x->tslot = NIL;
+  w->count--;
+}
+
+
+
+// ****************************************************************
+// Around every change of the book, under its lock.
+static inline void bookBegin (book *b) {
+  __atomic_store_n (&b->version, b->version + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+}
+
+static inline void bookEnd (book *b) {
+  statTop *top = b->top;
+
+  __atomic_store_n (&b->version, b->version + 1, __ATOMIC_RELEASE);
+  if (!b->taking)
+    touch[b->side == 'S'] = (b->empty) ? NIL : b->best;
+  if (top == NULL)
+    return;
+  __atomic_store_n (&top->seq, top->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  top->price = (b->empty) ? -1 : b->best;
+  top->vol = (b->empty) ? 0 : b->lvl[b->best].vol;
+  __atomic_store_n (&top->seq, top->seq + 1, __ATOMIC_RELEASE);
+  if (npools)
+    agentRing ();
+}
+
+
+
+// ****************************************************************
+void ebrEnter (void) {
+  long e;
+
+  if (ebrSlot < 0) {
+    ebrSlot = __atomic_fetch_add (&ebr.readers, 1, __ATOMIC_RELAXED);
+    if (ebrSlot >= EBRREADERS) {
+      fprintf(stderr, "more than %d threads read the book\n", EBRREADERS);
+      exit (1);
+    }
+  }
+  do {
+    e = __atomic_load_n (&ebr.epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n (&ebr.active[ebrSlot][0], e, __ATOMIC_SEQ_CST);
+  } while (__atomic_load_n (&ebr.epoch, __ATOMIC_SEQ_CST) != e);
+}
+
+
+
+// ****************************************************************
+void ebrExit (void) {
+  __atomic_store_n (&ebr.active[ebrSlot][0], 0, __ATOMIC_RELEASE);
+}
+
+
+
+// ****************************************************************
+void ebrAdvance (void) {
+  long e = __atomic_load_n (&ebr.epoch, __ATOMIC_SEQ_CST), a;
+  int i, n = __atomic_load_n (&ebr.readers, __ATOMIC_ACQUIRE);
+
+  for (i = 0; (i < n) && (i < EBRREADERS); i++)
+    if (((a = __atomic_load_n (&ebr.active[i][0], __ATOMIC_SEQ_CST))) && (a != e))
+      return;
+  __atomic_compare_exchange_n (&ebr.epoch, &e, e + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+
+
+// ****************************************************************
+// Nodes removed two epochs ago go back on the free list.
+void limboFree (book *b) {
+  long e;
+  int n;
+
+  if ((b->limbo >= LIMBOBATCH) || (b->freeList == NIL))
+    ebrAdvance ();
+  e = __atomic_load_n (&ebr.epoch, __ATOMIC_SEQ_CST);
+  while (((n = b->limboHead) != NIL) && ((int) e - b->pool[n].tprev >= 2)) {
+    if ((b->limboHead = b->pool[n].tnext) == NIL)
+      b->limboTail = NIL;
+    b->pool[n].next = b->freeList;
+    b->freeList = n;
+    b->limbo--;
+  }
+}
+
+
+
+// ****************************************************************
+// Room for n more nodes, none only while a reader is stuck.
+int bookRoom (book *b, int n) {
+  if (POOLSIZE - b->size - b->limbo < n)
+    limboFree (b);
+  if (POOLSIZE - b->size - b->limbo >= n)
+    return 1;
+  b->starved++;
+  return 0;
+}
+
+
+
+// ****************************************************************
+// The caller has made sure of the room with bookRoom.
+void bookInsert (book *b, order ord, int front) {
+  int n;
+
+  if (b->freeList == NIL)
+    limboFree (b);
+  if ((n = b->freeList) == NIL) {
+    fprintf(stderr, "No free node in the %s book\n", (b->side == 'B') ? "buy" : "sell");
+    exit(1);
+  }
+  bookBegin (b);
+  b->freeList = b->pool[n].next;
+  b->pool[n].ord = ord;
+  levelLink (b, n, front);
+  idxPut (&b->idx, ord.id, n);
+  if (ord.expire) {
+    timerAdd (b, n);
+    if (ord.expire < __atomic_load_n (&expireDue, __ATOMIC_RELAXED))
+      clockKick ();
+  }
+
+  b->size++;
+  if (b->size == QUEUESIZE)
+    b->full = 1;
+  b->empty = 0;
+  bookEnd (b);
+}
+
+
+
+// ****************************************************************
+void bookRemove (book *b, int n) {
+  bookBegin (b);
+  if (b->pool[n].tslot != NIL)
+    timerDel (b, n);
+  idxDel (&b->idx, b->pool[n].ord.id);
+  levelUnlink (b, n);
+
+  b->size--;
+  if (b->size == 0)
+    b->empty = 1;
+  b->full = 0;
+  bookEnd (b);
+
+  // its links stay as they were for any reader still on it
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  b->pool[n].tprev = (int) __atomic_load_n (&ebr.epoch, __ATOMIC_SEQ_CST);
+  b->pool[n].tnext = NIL;
+  if (b->limboTail != NIL)
+    b->pool[b->limboTail].tnext = n;
+  else
+    b->limboHead = n;
+  b->limboTail = n;
+  b->limbo++;
+  limboFree (b);
+}
+
+
+
+// ****************************************************************
+void bookAdd (book *b, order ord) {
+  bookInsert (b, ord, 0);
+}
+
+
+
+// ****************************************************************
+// A partially filled order goes back in front of its price level.
+void bookPush (book *b, order ord) {
+  bookInsert (b, ord, 1);
+}
+
+
+
+// ****************************************************************
+void bookDel (book *b, order *out) {
+  int n = b->lvl[b->best].head;
+
+  *out = b->pool[n].ord;
+  bookRemove (b, n);
+}
+
+
+
+// ****************************************************************
+int bookFind (book *b, long id, order *out) {
+  int n = idxGet (&b->idx, id);
+
+  if (n == NIL)
+    return 0;
+  *out = b->pool[n].ord;
+  return 1;
+}
+
+
+
+// ****************************************************************
+int bookDelId (book *b, long id, order *out) {
+  int n = idxGet (&b->idx, id);
+
+  if (n == NIL)
+    return 0;
+  *out = b->pool[n].ord;
+  bookRemove (b, n);
+  return 1;
+}
+
+
+
+// ****************************************************************
+// A pegged order rests in the queue of its peg, anything else in the book.
+int restFull (book *b, order ord) {
+  return (ord.type == 'P') ? b->peg[ord.price2]->full : (b->full || !bookRoom (b, 1));
+}
+
+
+
+// ****************************************************************
+// Waits a millisecond at a time for the readers to let the epoch move on.
+void restWait (book *b, order ord) {
+  struct timespec ts;
+
+  if ((ord.type == 'P') || b->full || coSelf) {
+    statFull (b->notFull, b->mut);
+    return;
+  }
+  clock_gettime (CLOCK_REALTIME, &ts);
+  ts.tv_nsec += 1000000;
+  if (ts.tv_nsec >= 1000000000L) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+  }
+  pthread_cond_timedwait (b->notFull, b->mut, &ts);
+  stat->blocked++;
+}
+
+
+
+// ****************************************************************
+void restAdd (book *b, order ord, int front) {
+  if (ord.type != 'P')
+    bookInsert (b, ord, front);
+  else {
+    if (front)
+      queuePush (b->peg[ord.price2], ord);
+    else
+      queueAdd (b->peg[ord.price2], ord);
+    b->pegs++;
+  }
+}
+
+
+
+// ****************************************************************
+int pegDelId (book *b, order ord, order *out) {
+  int k;
+
+  for (k = 0; (k < NPEGS) && (b->pegs); k++)
+    if ((!b->peg[k]->empty) && (queueDelIndex (b->peg[k], ord, out))) {
+      b->pegs--;
+      return 1;
+    }
+  return 0;
+}
+
+
+
+// ****************************************************************
+// The price peg k of a book stands at, NIL while the touch it needs
+// is missing.
+int pegPrice (book *b, int k) {
+  int own = touch[b->side == 'S'], other = touch[b->side == 'B'];
+
+  switch (k) {
+    case PEG_PRIMARY:
+      return own;
+    case PEG_MARKET:
+      return other;
+    default:
+      if ((own == NIL) || (other == NIL))
+        return NIL;
+      return (own + other + (b->side == 'S')) / 2;
+  }
+}
+
+
+
+// ****************************************************************
+// Where the next order of a book to trade comes from: NPEGS for the
+// limit orders, else the queue of a peg, NIL if there is none.
+int bookNext (book *b, int *price) {
+  int from = NIL, best = NIL, k, p;
+  long first = 0;
+  order *o;
+
+  if (!b->empty) {
+    from = NPEGS;
+    best = b->best;
+    first = b->pool[b->lvl[best].head].ord.timestamp;
+  }
+  for (k = 0; (k < NPEGS) && (b->pegs); k++) {
+    if ((b->peg[k]->empty) || ((p = pegPrice (b, k)) == NIL))
+      continue;
+    o = &b->peg[k]->item[b->peg[k]->head];
+    if ((from == NIL) || ((b->side == 'B') ? (p > best) : (p < best)) ||
+        ((p == best) && (o->timestamp < first))) {
+      from = k;
+      best = p;
+      first = o->timestamp;
+    }
+  }
+  *price = best;
+  return from;
+}
+
+
+
+// ****************************************************************
+// Takes the order bookNext found, a pegged one at the price it stood at.
+void bookNextDel (book *b, int from, int price, order *out) {
+  if (from == NPEGS) {
+    b->taking = 1;
+    bookDel (b, out);
+    b->taking = 0;
+  }
+  else {
+    queueDel (b->peg[from], out);
+    b->pegs--;
+    out->price1 = price;
+  }
+}
+
+
+
+// ****************************************************************
+// Market sets the touch after each match, bookEnd after any other change.
+void touchSet (book *b) {
+  touch[b->side == 'S'] = (b->empty) ? NIL : b->best;
+}
+
+
+
+// ****************************************************************
+// The pegs of a book may trade at the new touch.
+void pegWake (book *b) {
+  if (b->pegs == 0)
+    return;
+  pthread_mutex_lock (b->mut);
+  pthread_cond_broadcast (b->notEmpty);
+  pthread_mutex_unlock (b->mut);
+}
+
+
+
+// ****************************************************************
+// The pegs of both books may trade at a touch a cancel, modify, expiry,
+// execution, quote or auction moved; called with no book lock held.
+void touchWake (void) {
+  pegWake (buyLimitOrder);
+  pegWake (sellLimitOrder);
+}
+
+
+
+// ****************************************************************
+void touchUpdate (void) {
+  touchSet (buyLimitOrder);
+  touchSet (sellLimitOrder);
+  touchWake ();
+}
+
+
+
+// ****************************************************************
+// A size reduction at the same price keeps its time priority, anything
+// else moves the node to the back of the new level.
+int bookModify (book *b, order ord, order *old) {
+  int n = idxGet (&b->idx, ord.oldid);
+  level *l;
+  node *x;
+
+  if (n == NIL)
+    return 0;
+  x = &b->pool[n];
+  *old = x->ord;
+  if (ord.price1 == 0)
+    ord.price1 = x->ord.price1;
+
+  bookBegin (b);
+  if ((ord.price1 == x->ord.price1) && (ord.vol <= x->ord.vol)) {
+    l = &b->lvl[x->ord.price1];
+    if (x->prev == NIL) {
+      l->gone += x->ord.vol - ord.vol;
+      x->before += x->ord.vol - ord.vol;
+    }
+    else if (x->next != NIL)
+      l->epoch++;
+    l->vol -= x->ord.vol - ord.vol;
+    x->ord.vol = ord.vol;
+  }
+  else {
+    levelUnlink (b, n);
+    x->ord.price1 = ord.price1;
+    x->ord.vol = ord.vol;
+    levelLink (b, n, 0);
+  }
+  bookEnd (b);
+  return 1;
+}
+
+
+
+// ****************************************************************
+// Readers take the version before and check it after, an odd or a
+// changed one means they saw the book half changed and start again.
+static inline long queryBegin (book *b) {
+  long v;
+
+  while ((v = __atomic_load_n (&b->version, __ATOMIC_ACQUIRE)) & 1)
+    _mm_pause ();
+  return v;
+}
+
+static inline int queryEnd (book *b, long v) {
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+  return __atomic_load_n (&b->version, __ATOMIC_RELAXED) == v;
+}
+
+
+
+// ****************************************************************
+// The best n levels, best first, found through the level bitmap.
+int bookDepth (book *b, agentDepth *out, int n) {
+  long v;
+  int k, p;
+
+  do {
+    v = queryBegin (b);
+    for (k = 0, p = b->best; (k < n) && (p >= 0) && (p < MAXTICK); k++, p = bookScan (b, p)) {
+      out[k].price = p;
+      out[k].count = b->lvl[p].count;
+      out[k].vol = b->lvl[p].vol;
+    }
+  } while (!queryEnd (b, v));
+  return k;
+}
+
+
+
+// ****************************************************************
+// Orders resting at a price in time priority, at most max of them.
+int bookLevel (book *b, int price, agentResting *out, int max) {
+  long v;
+  int k, n;
+
+  if ((price < 0) || (price >= MAXTICK))
+    return 0;
+  ebrEnter ();
+  do {
+    v = queryBegin (b);
+    for (k = 0, n = b->lvl[price].head; (k < max) && (n >= 0) && (n < POOLSIZE); k++, n = b->pool[n].next) {
+      out[k].id = b->pool[n].ord.id;
+      out[k].timestamp = b->pool[n].ord.timestamp;
+      out[k].vol = b->pool[n].ord.vol;
+    }
+  } while (!queryEnd (b, v));
+  ebrExit ();
+  return k;
+}
+
+
+
+// ****************************************************************
+// Sets before for every node of a stale level, under the book lock.
+void levelRepair (book *b, int p) {
+  level *l = &b->lvl[p];
+  long ahead = l->gone;
+  int n;
+
+  bookBegin (b);
+  for (n = l->head; n != NIL; n = b->pool[n].next) {
+    b->pool[n].before = ahead;
+    b->pool[n].epoch = l->epoch;
+    ahead += b->pool[n].ord.vol;
+  }
+  bookEnd (b);
+}
+
+
+
+// ****************************************************************
+// Volume resting ahead of order id at its price, -1 if it is not in
+// the book. A stale level is walked, and repaired if the lock is free.
+long bookPosition (book *b, long id, int *price) {
+  long v, ahead;
+  int n, m, steps, stale, p = NIL;
+  node *x;
+
+  ebrEnter ();
+  do {
+    v = queryBegin (b);
+    ahead = -1;
+    stale = 0;
+    if ((n = idxGet (&b->idx, id)) != NIL) {
+      x = &b->pool[n];
+      p = x->ord.price1 & (MAXTICK - 1);
+      if (x->epoch == b->lvl[p].epoch)
+        ahead = x->before - b->lvl[p].gone;
+      else {
+        stale = 1;
+        for (ahead = 0, m = b->lvl[p].head, steps = 0; (m != n) && (m >= 0) && (m < POOLSIZE) && (steps < POOLSIZE);
+             m = b->pool[m].next, steps++)
+          ahead += b->pool[m].ord.vol;
+      }
+    }
+  } while (!queryEnd (b, v));
+  ebrExit ();
+
+  if ((stale) && (pthread_mutex_trylock (b->mut) == 0)) {
+    if (b->lvl[p].count)
+      levelRepair (b, p);
+    pthread_mutex_unlock (b->mut);
+  }
+  if (price)
+    *price = p;
+  return ahead;
+}
+
+
+
+// ****************************************************************
+// Run the wheel up to and including now, cascading the upper levels.
+int wheelAdvance (book *b, long now) {
+  wheel *w = &b->tw;
+  int n, next, lv, ix, expired = 0;
+
+  for (; w->now <= now; w->now++) {
+    if (w->count == 0) {
+      w->now = now + 1;
+      break;
+    }
+
+    ix = w->now & (WHEELSIZE - 1);
+    for (lv = 1; (ix == 0) && (lv < WHEELLEVELS); lv++) {
+      ix = (w->now >> (WHEELBITS * lv)) & (WHEELSIZE - 1);
+      n = w->slot[lv][ix];
+      w->slot[lv][ix] = NIL;
+      while (n != NIL) {
+        next = b->pool[n].tnext;
+        w->count--;
+        timerAdd (b, n);
+        n = next;
+      }
+    }
+
+    ix = w->now & (WHEELSIZE - 1);
+    n = w->slot[0][ix];
+    w->slot[0][ix] = NIL;
+    while (n != NIL) {
+      next = b->pool[n].tnext;
+      w->count--;
+      b->pool[n].tslot = NIL;
+      if (b->pool[n].ord.expire > w->now)
+        timerAdd (b, n);
+      else {
+        printf("%ld %s Limit Order ---> Expired\n", b->pool[n].ord.id, (b->side == 'B') ? "Buy" : "Sell");
+        riskRelease (b->pool[n].ord);
+        bookRemove (b, n);
+        expired++;
+      }
+      n = next;
+    }
+  }
+  return expired;
+}
+
+
+
+// ****************************************************************
+// The first msec the wheel has to run.
+long wheelNext (book *b) {
+  wheel *w = &b->tw;
+  long t;
+
+  if (w->count == 0)
+    return LONG_MAX;
+  t = w->now;
+  if ((t & (WHEELSIZE - 1)) == 0)
+    return t;
+  do {
+    if (w->slot[0][t & (WHEELSIZE - 1)] != NIL)
+      return t;
+  } while (++t & (WHEELSIZE - 1));
+  return t;
+}
+
+
+
+// ****************************************************************
+void orderAdd(int flag, order ord) {
+  switch (flag) {
+
+    case 0:
+      pthread_mutex_lock (buyMarketOrder->mut);
+      while (buyMarketOrder->full)
+        statFull (buyMarketOrder->notFull, buyMarketOrder->mut);
+      queueAdd (buyMarketOrder, ord);
+      admitHigh (1, queueDepth (buyMarketOrder));
+      pthread_mutex_unlock (buyMarketOrder->mut);
+      pthread_cond_broadcast (buyMarketOrder->notEmpty);
+      break;
+
+    case 1:
+      pthread_mutex_lock (sellMarketOrder->mut);
+      while (sellMarketOrder->full)
+        statFull (sellMarketOrder->notFull, sellMarketOrder->mut);
+      queueAdd (sellMarketOrder, ord);
+      admitHigh (2, queueDepth (sellMarketOrder));
+      pthread_mutex_unlock (sellMarketOrder->mut);
+      pthread_cond_broadcast (sellMarketOrder->notEmpty);
+      break;
+
+    case 2:
+      pthread_mutex_lock (buyLimitOrder->mut);
+      while (restFull (buyLimitOrder, ord))
+        restWait (buyLimitOrder, ord);
+      restAdd (buyLimitOrder, ord, 0);
+      admitHigh (3, buyLimitOrder->size);
+      pthread_mutex_unlock (buyLimitOrder->mut);
+      pthread_cond_broadcast (buyLimitOrder->notEmpty);
+      pegWake (sellLimitOrder);
+      break;
+
+    case 3:
+      pthread_mutex_lock (sellLimitOrder->mut);
+      while (restFull (sellLimitOrder, ord))
+        restWait (sellLimitOrder, ord);
+      restAdd (sellLimitOrder, ord, 0);
+      admitHigh (4, sellLimitOrder->size);
+      pthread_mutex_unlock (sellLimitOrder->mut);
+      pthread_cond_broadcast (sellLimitOrder->notEmpty);
+      pegWake (buyLimitOrder);
+      break;
+
+
+    default:
+      pthread_mutex_lock (cancelOrder->mut);
+      while (cancelOrder->full)
+        statFull (cancelOrder->notFull, cancelOrder->mut);
+      queueAdd (cancelOrder, ord);
+      admitHigh (5, queueDepth (cancelOrder));
+      pthread_mutex_unlock (cancelOrder->mut);
+      pthread_cond_broadcast (cancelOrder->notEmpty);
+      break;
+
+
+  }
+  trace (TRACE_ENQUEUE, ord.id, (flag < 4) ? flag + 1 : 5);
+}
+
+
+
+// ****************************************************************
+void orderPush (int flag, order ord) {
+
+  switch (flag) {
+
+    case 0:
+      pthread_mutex_lock (buyMarketOrder->mut);
+      while (buyMarketOrder->full) {
+        fflush(stdout);
+        statFull (buyMarketOrder->notFull, buyMarketOrder->mut);
+      }
+      queuePush (buyMarketOrder, ord);
+      admitHigh (1, queueDepth (buyMarketOrder));
+      pthread_mutex_unlock (buyMarketOrder->mut);
+      pthread_cond_broadcast (buyMarketOrder->notEmpty);
+      break;
+
+    case 1:
+      pthread_mutex_lock (sellMarketOrder->mut);
+      while (sellMarketOrder->full) {
+        fflush(stdout);
+        statFull (sellMarketOrder->notFull, sellMarketOrder->mut);
+      }
+      queuePush (sellMarketOrder, ord);
+      admitHigh (2, queueDepth (sellMarketOrder));
+      pthread_mutex_unlock (sellMarketOrder->mut);
+      pthread_cond_broadcast (sellMarketOrder->notEmpty);
+      break;
+
+    case 2:
+      pthread_mutex_lock (buyLimitOrder->mut);
+      while (restFull (buyLimitOrder, ord)) {
+        fflush(stdout);
+        restWait (buyLimitOrder, ord);
+      }
+      restAdd (buyLimitOrder, ord, 1);
+      admitHigh (3, buyLimitOrder->size);
+      pthread_mutex_unlock (buyLimitOrder->mut);
+      pthread_cond_broadcast (buyLimitOrder->notEmpty);
+      break;
+
+    case 3:
+      pthread_mutex_lock (sellLimitOrder->mut);
+      while (restFull (sellLimitOrder, ord)) {
+        fflush(stdout);
+        restWait (sellLimitOrder, ord);
+      }
+      restAdd (sellLimitOrder, ord, 1);
+      admitHigh (4, sellLimitOrder->size);
+      pthread_mutex_unlock (sellLimitOrder->mut);
+      pthread_cond_broadcast (sellLimitOrder->notEmpty);
+      break;
+
+
+    default :
+      pthread_mutex_lock (cancelOrder->mut);
+      while (cancelOrder->full) {
+        fflush(stdout);
+        statFull (cancelOrder->notFull, cancelOrder->mut);
+      }
+      queuePush (cancelOrder, ord);
+      admitHigh (5, queueDepth (cancelOrder));
+      pthread_mutex_unlock (cancelOrder->mut);
+      pthread_cond_broadcast (cancelOrder->notEmpty);
+      break;
+
+  }
+  trace (TRACE_ENQUEUE, ord.id, (flag < 4) ? flag + 1 : 5);
+}
+
+
+
+// ****************************************************************
+order orderDel (int flag) {
+  order ord;
+  switch (flag) {
+
+    case 0:
+      pthread_mutex_lock (buyMarketOrder->mut);
+      while ((buyMarketOrder->empty) || (phase == CALL) || (seq->busy))
+        statWait (buyMarketOrder->notEmpty, buyMarketOrder->mut);
+      queueDel (buyMarketOrder, &ord);
+      seq->hold[0] = 1;
+      pthread_mutex_unlock (buyMarketOrder->mut);
+      pthread_cond_signal (buyMarketOrder->notFull);
+      break;
+
+    case 1:
+      pthread_mutex_lock (sellMarketOrder->mut);
+      while ((sellMarketOrder->empty) || (phase == CALL) || (seq->busy))
+        statWait (sellMarketOrder->notEmpty, sellMarketOrder->mut);
+      queueDel (sellMarketOrder, &ord);
+      seq->hold[1] = 1;
+      pthread_mutex_unlock (sellMarketOrder->mut);
+      pthread_cond_signal (sellMarketOrder->notFull);
+      break;
+
+    case 2:
+      pthread_mutex_lock (buyLimitOrder->mut);
+      while (buyLimitOrder->empty)
+        statWait (buyLimitOrder->notEmpty, buyLimitOrder->mut);
+      bookDel (buyLimitOrder, &ord);
+      pthread_mutex_unlock (buyLimitOrder->mut);
+      pthread_cond_signal (buyLimitOrder->notFull);
+      break;
+
+    case 3:
+      pthread_mutex_lock (sellLimitOrder->mut);
+      while (sellLimitOrder->empty)
+        statWait (sellLimitOrder->notEmpty, sellLimitOrder->mut);
+      bookDel (sellLimitOrder, &ord);
+      pthread_mutex_unlock (sellLimitOrder->mut);
+      pthread_cond_signal (sellLimitOrder->notFull);
+      break;
+
+
+    default :
+      pthread_mutex_lock (cancelOrder->mut);
+      while (cancelOrder->empty)
+        statWait (cancelOrder->notEmpty, cancelOrder->mut);
+      queueDel (cancelOrder, &ord);
+      seq->hold[4] = 1;
+      pthread_mutex_unlock (cancelOrder->mut);
+      pthread_cond_signal (cancelOrder->notFull);
+      break;
+
+  }
+
+  trace (TRACE_DEQUEUE, ord.id, (flag < 4) ? flag + 1 : 5);
+  return ord;
+}
+
+
+
+// ****************************************************************
+// 2 for an order found in the queue of a peg.
+int orderDelIndex (int flag, order ord) {
+    order out;
+    int found = 0;
+
+    switch (flag) {
+
+    case 0:
+      pthread_mutex_lock (buyMarketOrder->mut);
+      if (!buyMarketOrder->empty)
+        found = queueDelIndex (buyMarketOrder, ord, &out);
+      pthread_mutex_unlock (buyMarketOrder->mut);
+      pthread_cond_signal (buyMarketOrder->notFull);
+      break;
+
+    case 1:
+      pthread_mutex_lock (sellMarketOrder->mut);
+      if (!sellMarketOrder->empty)
+        found = queueDelIndex (sellMarketOrder, ord, &out);
+      pthread_mutex_unlock (sellMarketOrder->mut);
+      pthread_cond_signal (sellMarketOrder->notFull);
+      break;
+
+    case 2:
+      pthread_mutex_lock (buyLimitOrder->mut);
+      if (!(found = bookDelId (buyLimitOrder, ord.oldid, &out)))
+        found = 2 * pegDelId (buyLimitOrder, ord, &out);
+      pthread_mutex_unlock (buyLimitOrder->mut);
+      pthread_cond_signal (buyLimitOrder->notFull);
+      break;
+
+    case 3:
+      pthread_mutex_lock (sellLimitOrder->mut);
+      if (!(found = bookDelId (sellLimitOrder, ord.oldid, &out)))
+        found = 2 * pegDelId (sellLimitOrder, ord, &out);
+      pthread_mutex_unlock (sellLimitOrder->mut);
+      pthread_cond_signal (sellLimitOrder->notFull);
+      break;
+
+    default : break;
+  }
+
+  if (found)
+    riskRelease (out);
+  if ((found == 1) && (flag >= 2))
+    touchWake ();
+  return found;
+}
+
+
+
+// ****************************************************************
+// The modify is checked against the order under the book lock.
+int orderModify (order ord) {
+  book *b;
+  order old;
+  int side, found = 0, reason = RISK_OK;
+
+  for (side = 0; (side < 2) && (!found); side++) {
+    b = (side == 0) ? buyLimitOrder : sellLimitOrder;
+    pthread_mutex_lock (b->mut);
+    if ((found = bookFind (b, ord.oldid, &old)) && (!(reason = riskModify (old, ord))))
+      bookModify (b, ord, &old);
+    pthread_mutex_unlock (b->mut);
+  }
+  if (!found) {
+    printf("%ld Modify Order ---> Rejected (unknown order %ld)\n", ord.id, ord.oldid);
+    orderRejected (ord, GW_REJECTUNKNOWN);
+    return 0;
+  }
+  if (reason) {
+    gate->rejects[reason]++;
+    stat->rejects++;
+    printf("%ld Order ---> Rejected (risk %d)\n", ord.id, reason);
+    orderRejected (ord, reason);
+    return 0;
+  }
+
+  riskAmend (old, ord);
+  if ((ord.price1 == 0) || (ord.price1 == old.price1))
+    printf("%ld %s Limit Order ---> Modified (%d)\n", ord.oldid, (b == buyLimitOrder) ? "Buy" : "Sell", ord.vol);
+  else
+    printf("%ld %s Limit Order ---> Replaced (%d,%d)\n", ord.oldid, (b == buyLimitOrder) ? "Buy" : "Sell", ord.vol, ord.price1);
+  pthread_cond_broadcast (b->notEmpty);
+  touchWake ();
+  return 1;
+}
+
+
+
+// ****************************************************************
+// An execution from the feed takes its shares off the order it names.
+int orderExecute (order ord) {
+  book *b;
+  order rest, cut = { 0 };
+  int side, vol = 0, found = 0;
+
+  for (side = 0; (side < 2) && (!found); side++) {
+    b = (side == 0) ? buyLimitOrder : sellLimitOrder;
+    pthread_mutex_lock (b->mut);
+    if ((found = bookFind (b, ord.oldid, &rest))) {
+      vol = (ord.vol < rest.vol) ? ord.vol : rest.vol;
+      cut.oldid = rest.id;
+      cut.vol = rest.vol - vol;
+      if (cut.vol)
+        bookModify (b, cut, &rest);
+      else
+        bookDelId (b, rest.id, &rest);
     }
+    pthread_mutex_unlock (b->mut);
   }
-  else queueAdd (q, ord);
-  return; 
+  if (!found) {
+    printf("%ld Execution ---> Ignored (unknown order %ld)\n", ord.id, ord.oldid);
+    riskRelease (ord);
+    return 0;
+  }
+
+  currentPriceX10 = (ord.price1) ? ord.price1 : rest.price1;
+  ord.action = (rest.action == 'B') ? 'S' : 'B';
+  if (rest.action == 'B')
+    tradeReport (rest, ord, vol);
+  else
+    tradeReport (ord, rest, vol);
+  ord.vol -= vol;
+  if (ord.vol)
+    riskRelease (ord);
+  stopTrigger (stopHeld ());
+  pthread_cond_broadcast (buyLimitOrder->notEmpty);
+  pthread_cond_broadcast (sellLimitOrder->notEmpty);
+  touchWake ();
+  return 1;
 }
 
 
 
 // ****************************************************************
-void queueDel (queue *q, order *out) {
-  *out = q->item[q->head];
-  q->head++;
-  if (q->head == QUEUESIZE)
-    q->head = 0;
-  if (q->head == q->tail)
-    q->empty = 1;
-  q->full = 0;
+void quoteInit (void) {
+  int i;
 
-  return;
+  quoteRing = (quoteSlot *) arenaAlloc (QUOTERING * sizeof (quoteSlot));
+  quoters = (quoter *) arenaAlloc (QUOTERS * sizeof (quoter));
+  for (i = 0; i < QUOTERS; i++)
+    memset (quoters[i].id, -1, sizeof (quoters[i].id));
 }
 
 
 
 // ****************************************************************
-void queueDelete (queue *q) {
-  pthread_mutex_destroy (q->mut);
-  free (q->mut);  
-  pthread_cond_destroy (q->notFull);
-  free (q->notFull);
-  pthread_cond_destroy (q->notEmpty);
-  free (q->notEmpty);
-  free (q);
+// Copies a ladder into the ring, the slot or -1.
+long quotePost (int who, long tag, const agentQuote *q) {
+  long n;
+  int side, k, free = 0;
+  quoteSlot *s;
+
+  if ((quoteRing == NULL) || (who < 0) || (who >= QUOTERS))
+    return -1;
+  for (side = 0; side < 2; side++) {
+    if ((q->levels[side] < 0) || (q->levels[side] > AGENTQUOTE))
+      return -1;
+    for (k = 0; k < q->levels[side]; k++)
+      if (q->vol[side][k] <= 0)
+        return -1;
+  }
+  n = __atomic_fetch_add (&quoteClaim, 1, __ATOMIC_RELAXED);
+  s = &quoteRing[n & (QUOTERING - 1)];
+  if (!__atomic_compare_exchange_n (&s->used, &free, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return -1;
+  s->quoter = who;
+  s->tag = tag;
+  s->q = *q;
+  return n;
 }
 
 
 
 // ****************************************************************
-void queueDelIndex (queue *q, order ord) {
-  long i;
-  long mid = - 1;
-  if (q->tail > q->head) {
+// The whole ladder against account a at once, less the levels it
+// replaces, as if every level of one side filled.
+int quoteRisk (int a, agentQuote *q, quoter *w) {
+  long open = 0, vol, pos;
+  int side, k, n, price, far;
+  book *b;
+
+  if ((a < 0) || (a >= NACCOUNTS))
+    return RISK_SIZE;
+  for (side = 0; side < 2; side++) {
+    b = side ? sellLimitOrder : buyLimitOrder;
+    for (k = 0; k < AGENTQUOTE; k++)
+      if ((w->id[side][k] >= 0) && ((n = idxGet (&b->idx, w->id[side][k])) != NIL))
+        open -= b->pool[n].ord.vol;
+    for (k = 0; k < q->levels[side]; k++) {
+      price = q->price[side][k];
+      if ((price <= 0) || (price >= MAXTICK))
+        return GW_REJECTPRICE;
+      if (q->vol[side][k] > gate->maxOrderVol[a])
+        return RISK_SIZE;
+      if ((price > currentPriceX10 + gate->band) || (price < currentPriceX10 - gate->band))
+        return RISK_PRICE;
+      open += q->vol[side][k];
+    }
+  }
+  if (__atomic_load_n (&gate->openVol[a], __ATOMIC_RELAXED) + open > gate->maxOpenVol[a])
+    return RISK_OPEN;
 
-    for (i = q->head; i < q->tail; i++) {
-      if (ord.oldid == q->item[i].id) {
-        mid = i;
-        break;
-        }
-      }
-    if (mid == - 1) return;
-    for(i = mid; i > q->head; i--)
-        q->item[i] = q->item[i - 1];
-    q->head++;
-    if (q->head == QUEUESIZE)
-      q->head = 0;
-    if (q->head == q->tail)
-      q->empty = 1;
-    q->full = 0;
-    return;   
+  for (side = 0; side < 2; side++) {
+    for (k = 0, vol = 0, far = 0; k < q->levels[side]; k++) {
+      vol += q->vol[side][k];
+      far = (q->price[side][k] > far) ? q->price[side][k] : far;
     }
-    else if ((q->tail == 0) && (!q->empty)) {
-      for (i = q->head; i < QUEUESIZE; i++) {
-        if (ord.oldid == q->item[i].id) {
-          mid = i;
-          break;
-        }
-      }
-    if (mid == - 1) return;
-    for (i = mid; i > q->head; i--)
-        q->item[i] = q->item[i - 1];
-        
-    q->head++;
-    if (q->head == QUEUESIZE)
-      q->head = 0;
-    if (q->head == q->tail)
-      q->empty = 1;
-    q->full = 0;
+    pos = __atomic_load_n (&gate->position[a], __ATOMIC_RELAXED) + (side ? -vol : vol);
+    if (labs (pos) > gate->maxPosition[a])
+      return RISK_POSITION;
+    if (labs (pos) * far > gate->maxNotional[a])
+      return RISK_NOTIONAL;
+  }
+  return RISK_OK;
+}
+
+
+
+// ****************************************************************
+// Ids of a quote block stay live until it is known which made orders.
+void quoteGone (order ord, long id[2][AGENTQUOTE]) {
+  int side, k;
+
+  if ((gw == NULL) || (ord.id < 0))
     return;
+  for (side = 0; side < 2; side++)
+    for (k = 0; k < AGENTQUOTE; k++)
+      if ((id == NULL) || (id[side][k] != ord.id + side * AGENTQUOTE + k))
+        gatewayReport (ord.id + side * AGENTQUOTE + k, 0, 0, 0, GWGONE, 1);
+}
+
+
+
+// ****************************************************************
+// The ladder as a diff against the quoter's resting levels, under both
+// book locks. All or nothing.
+void quoteApply (order ord) {
+  quoteSlot *s = &quoteRing[ord.oldid & (QUOTERING - 1)];
+  agentQuote q = s->q;
+  quoter *w = &quoters[s->quoter];
+  long id[2][AGENTQUOTE];
+  int side, k, j, n, used[AGENTQUOTE], reason = 0;
+  int kept = 0, changed = 0, added = 0, gone = 0;
+  order o, old;
+  book *b;
+
+  if (w->tag != s->tag) {
+    w->tag = s->tag;
+    memset (w->id, -1, sizeof (w->id));
   }
-  else if (!q->empty) {
-    for (i = q->head; i < QUEUESIZE; i++) {
-      if (ord.oldid == q->item[i].id) {
-        mid = i;
-        break;
-      }
-    }
-    if (mid == -1) {
-      for (i = 0; i < q->tail; i++) {
-        if (ord.oldid == q->item[i].id) {
-          mid = i;
+  __atomic_store_n (&s->used, 0, __ATOMIC_RELEASE);
+
+  o = ord;
+  o.type = 'L';
+  o.oldid = 0;
+  pthread_mutex_lock (buyLimitOrder->mut);
+  pthread_mutex_lock (sellLimitOrder->mut);
+  if ((reason = quoteRisk (ord.account, &q, w))) {
+    pthread_mutex_unlock (sellLimitOrder->mut);
+    pthread_mutex_unlock (buyLimitOrder->mut);
+    printf("%ld Mass Quote ---> Rejected (risk %d)\n", ord.id, reason);
+    orderRejected (ord, reason);
+    quoteGone (ord, NULL);
+    return;
+  }
+  if ((buyLimitOrder->size + q.levels[0] > QUEUESIZE) || (sellLimitOrder->size + q.levels[1] > QUEUESIZE) ||
+      !bookRoom (buyLimitOrder, q.levels[0]) || !bookRoom (sellLimitOrder, q.levels[1])) {
+    pthread_mutex_unlock (sellLimitOrder->mut);
+    pthread_mutex_unlock (buyLimitOrder->mut);
+    printf("%ld Mass Quote ---> Rejected (busy)\n", ord.id);
+    orderRejected (ord, GW_REJECTBUSY);
+    quoteGone (ord, NULL);
+    return;
+  }
+  for (side = 0; side < 2; side++) {
+    b = side ? sellLimitOrder : buyLimitOrder;
+    memset (used, 0, sizeof (used));
+    for (k = 0; k < AGENTQUOTE; k++) {
+      id[side][k] = -1;
+      if (k >= q.levels[side])
+        continue;
+      for (j = 0, n = NIL; j < AGENTQUOTE; j++)
+        if ((!used[j]) && (w->id[side][j] >= 0) && ((n = idxGet (&b->idx, w->id[side][j])) != NIL) &&
+            (b->pool[n].ord.price1 == q.price[side][k]))
           break;
+      o.action = side ? 'S' : 'B';
+      o.vol = q.vol[side][k];
+      o.price1 = q.price[side][k];
+      if (j < AGENTQUOTE) {
+        used[j] = 1;
+        id[side][k] = o.oldid = w->id[side][j];
+        if (b->pool[n].ord.vol == o.vol)
+          kept++;
+        else {
+          o.price1 = 0;
+          bookModify (b, o, &old);
+          riskAmend (old, o);
+          changed++;
         }
       }
-    }
-    if (mid == - 1) return; 
-    if (mid >= q->head) {
-      for (i = mid; i > q->head; i--)
-        q->item[i]=q->item[i - 1];
-      q->head++;
-      if (q->head == QUEUESIZE)
-        q->head = 0;
-      if (q->head == q->tail)
-        q->empty = 1;
-      q->full = 0;
-      return;   
+      else {
+        o.id = id[side][k] = ord.id + side * AGENTQUOTE + k;
+        o.oldid = 0;
+        bookAdd (b, o);
+        riskAccept (o);
+        added++;
       }
-    else if (mid < q->head) {
-      for (i = mid; i < q->tail - 1; i++)
-        q->item[i] = q->item[i + 1];
-        
-      q->tail--;  
-      q->full = 0;
-      return;
     }
-  }   
-  return;
+    for (j = 0; j < AGENTQUOTE; j++)
+      if ((!used[j]) && (w->id[side][j] >= 0) && (bookDelId (b, w->id[side][j], &old))) {
+        riskRelease (old);
+        gone++;
+      }
+  }
+  memcpy (w->id, id, sizeof (id));
+  admitHigh (3, buyLimitOrder->size);
+  admitHigh (4, sellLimitOrder->size);
+  pthread_mutex_unlock (sellLimitOrder->mut);
+  pthread_mutex_unlock (buyLimitOrder->mut);
+  pthread_cond_broadcast (buyLimitOrder->notEmpty);
+  pthread_cond_broadcast (sellLimitOrder->notEmpty);
+  touchWake ();
+  quoteGone (ord, id);
+  printf("%ld Mass Quote ---> %d kept, %d amended, %d added, %d cancelled\n", ord.id, kept, changed, added, gone);
+}
+
+
+
+// ****************************************************************
+transaction *transactionInit() {
+  transaction *trans;
+  
+  trans = (transaction *) malloc (sizeof (transaction));
+
+  trans->marketBuyer = 0;
+  trans->marketSeller = 0;
+  trans->limitBuyer = 0;
+  trans->limitSeller = 0;
+
+  trans->mutBuyer = (pthread_mutex_t *) malloc (sizeof (pthread_mutex_t));
+  pthread_mutex_init (trans->mutBuyer, NULL);
+  trans->mutSeller = (pthread_mutex_t *) malloc (sizeof (pthread_mutex_t));
+  pthread_mutex_init (trans->mutSeller, NULL);
+
+  trans->conBuyer = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+  pthread_cond_init (trans->conBuyer, NULL);
+  trans->conSeller = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+  pthread_cond_init (trans->conSeller, NULL);
+  trans->buyMarketTransaction = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+  pthread_cond_init (trans->buyMarketTransaction, NULL);
+  trans->sellMarketTransaction = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+  pthread_cond_init (trans->sellMarketTransaction, NULL);
+  trans->buyLimitTransaction = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+  pthread_cond_init (trans->buyLimitTransaction, NULL);
+  trans->sellLimitTransaction = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+  pthread_cond_init (trans->sellLimitTransaction, NULL);
+  
+  return (trans);
+}
+
+
+
+// ****************************************************************
+void lockNames (queue *q) {
+  (void) q;
+  lockName (q->mut, "inbound.mut");
+  lockName (q->notFull, "inbound.notFull");
+  lockName (q->notEmpty, "inbound.notEmpty");
+  lockName (cancelLane->notFull, "cancelLane.notFull");
+  lockName (buyMarketOrder->mut, "buyMarket.mut");
+  lockName (buyMarketOrder->notFull, "buyMarket.notFull");
+  lockName (buyMarketOrder->notEmpty, "buyMarket.notEmpty");
+  lockName (sellMarketOrder->mut, "sellMarket.mut");
+  lockName (sellMarketOrder->notFull, "sellMarket.notFull");
+  lockName (sellMarketOrder->notEmpty, "sellMarket.notEmpty");
+  lockName (buyLimitOrder->mut, "buyLimit.mut");
+  lockName (buyLimitOrder->notFull, "buyLimit.notFull");
+  lockName (buyLimitOrder->notEmpty, "buyLimit.notEmpty");
+  lockName (sellLimitOrder->mut, "sellLimit.mut");
+  lockName (sellLimitOrder->notFull, "sellLimit.notFull");
+  lockName (sellLimitOrder->notEmpty, "sellLimit.notEmpty");
+  lockName (cancelOrder->mut, "cancel.mut");
+  lockName (cancelOrder->notFull, "cancel.notFull");
+  lockName (cancelOrder->notEmpty, "cancel.notEmpty");
+  lockName (buyStopOrder->mut, "buyStop.mut");
+  lockName (buyStopOrder->notFull, "buyStop.notFull");
+  lockName (sellStopOrder->mut, "sellStop.mut");
+  lockName (sellStopOrder->notFull, "sellStop.notFull");
+  lockName (t->mutBuyer, "mutBuyer");
+  lockName (t->mutSeller, "mutSeller");
+  lockName (t->conBuyer, "conBuyer");
+  lockName (t->conSeller, "conSeller");
+  lockName (t->buyMarketTransaction, "buyMarketTransaction");
+  lockName (t->sellMarketTransaction, "sellMarketTransaction");
+  lockName (t->buyLimitTransaction, "buyLimitTransaction");
+  lockName (t->sellLimitTransaction, "sellLimitTransaction");
+  lockName (seq->mut, "seq.mut");
+  lockName (seq->kick, "seq.kick");
+  lockName (&columnMut, "column.mut");
+  if (gw)
+    lockName (gw->mut, "gateway.mut");
+}
+
+
+
+// ****************************************************************
+sequencer *seqInit (void) {
+  sequencer *s;
+
+  s = (sequencer *) calloc (1, sizeof (sequencer));
+  s->qmut[0] = buyMarketOrder->mut;
+  s->qmut[1] = sellMarketOrder->mut;
+  s->qmut[2] = buyLimitOrder->mut;
+  s->qmut[3] = sellLimitOrder->mut;
+  s->qmut[4] = cancelOrder->mut;
+  s->qcond[0] = buyMarketOrder->notEmpty;
+  s->qcond[1] = sellMarketOrder->notEmpty;
+  s->qcond[2] = buyLimitOrder->notEmpty;
+  s->qcond[3] = sellLimitOrder->notEmpty;
+  s->qcond[4] = cancelOrder->notEmpty;
+
+  s->mut = (pthread_mutex_t *) malloc (sizeof (pthread_mutex_t));
+  pthread_mutex_init (s->mut, NULL);
+  s->kick = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
+  pthread_cond_init (s->kick, NULL);
+
+  return (s);
+}
+
+
+
+// ****************************************************************
+// Whether stage k, numbered as in orderAdd with 4 for Cancel, may take
+// an order off its queue. Called with its queue mutex held.
+int stagePending (int k) {
+  int p;
+
+  switch (k) {
+    case 0:
+      return (!buyMarketOrder->empty) && (phase != CALL);
+    case 1:
+      return (!sellMarketOrder->empty) && (phase != CALL);
+    case 2:
+      return (bookNext (buyLimitOrder, &p) != NIL) && (p >= currentPriceX10) && (phase != CALL);
+    case 3:
+      return (bookNext (sellLimitOrder, &p) != NIL) && (p <= currentPriceX10) && (phase != CALL);
+    default:
+      return !cancelOrder->empty;
+  }
+}
+
+
+
+// ****************************************************************
+int stagePosted (int k) {
+  pthread_mutex_t *mut = (k % 2 == 0) ? t->mutBuyer : t->mutSeller;
+  int posted;
+
+  if (k == 4)
+    return 0;
+  pthread_mutex_lock (mut);
+  posted = (k == 0) ? t->marketBuyer : (k == 1) ? t->marketSeller :
+           (k == 2) ? t->limitBuyer : t->limitSeller;
+  pthread_mutex_unlock (mut);
+  return posted;
+}
+
+
+
+// ****************************************************************
+// Every stage has posted its order or has nothing to take. Called with
+// seq->mut held.
+int seqSettled (void) {
+  int k, pending;
+
+  for (k = 0; k < NSTAGES; k++) {
+    pthread_mutex_lock (seq->qmut[k]);
+    pending = (seq->hold[k]) || (stagePending (k));
+    pthread_mutex_unlock (seq->qmut[k]);
+    if ((pending) && (!stagePosted (k)))
+      return 0;
+  }
+  return 1;
+}
+
+
+
+// ****************************************************************
+int seqCrossed (void) {
+  return ((stagePosted (0)) || (stagePosted (2))) && ((stagePosted (1)) || (stagePosted (3)));
+}
+
+
+
+// ****************************************************************
+void seqKick (void) {
+  pthread_mutex_lock (seq->mut);
+  pthread_cond_broadcast (seq->kick);
+  pthread_mutex_unlock (seq->mut);
+}
+
+
+
+// ****************************************************************
+void seqRelease (int k) {
+  pthread_mutex_lock (seq->qmut[k]);
+  seq->hold[k] = 0;
+  pthread_mutex_unlock (seq->qmut[k]);
+  seqKick ();
+}
+
+
+
+// ****************************************************************
+// Market waits for both sides and for every stage to settle.
+void seqMatchWait (void) {
+  pthread_mutex_lock (seq->mut);
+  while ((!seqSettled ()) || (!seqCrossed ()))
+    pthread_cond_wait (seq->kick, seq->mut);
+  seq->busy = 1;
+  pthread_mutex_unlock (seq->mut);
+}
+
+
+
+// ****************************************************************
+// With the price final, the stages may take the next orders.
+void seqMatched (void) {
+  int k;
+
+  pthread_mutex_lock (seq->mut);
+  seq->busy = 0;
+  pthread_mutex_unlock (seq->mut);
+
+  for (k = 0; k < 4; k++) {
+    pthread_mutex_lock (seq->qmut[k]);
+    pthread_cond_broadcast (seq->qcond[k]);
+    pthread_mutex_unlock (seq->qmut[k]);
+  }
+  seqKick ();
+}
+
+
+
+// ****************************************************************
+// The stages keep off while Cons runs a due expiry or auction.
+void seqHold (void) {
+  pthread_mutex_lock (seq->mut);
+  seq->busy = 1;
+  pthread_mutex_unlock (seq->mut);
+}
+
+
+
+// ****************************************************************
+// Cons waits here until the last order has run its course.
+void seqQuiet (void) {
+  pthread_mutex_lock (seq->mut);
+  while ((seq->busy) || (!seqSettled ()) || (seqCrossed ()))
+    pthread_cond_wait (seq->kick, seq->mut);
+  pthread_mutex_unlock (seq->mut);
+}
+
+
+
+// ****************************************************************
+void seqDone (void) {
+  pthread_mutex_lock (seq->mut);
+  seq->done++;
+  if ((orderLimit) && (seq->done == orderLimit))
+    kill (getpid(), SIGTERM);
+  pthread_cond_broadcast (seq->kick);
+  pthread_mutex_unlock (seq->mut);
 }
 
 
 
 // ****************************************************************
-void orderAdd(int flag, order ord) {
-  switch (flag) {
+// The input ran out after n orders: stop once they are all done.
+void seqLimit (long n) {
+  pthread_mutex_lock (seq->mut);
+  orderLimit = n;
+  if (seq->done >= n)
+    kill (getpid(), SIGTERM);
+  pthread_mutex_unlock (seq->mut);
+}
 
-    case 0:
-      pthread_mutex_lock (buyMarketOrder->mut);
-      while (buyMarketOrder->full)
-        pthread_cond_wait(buyMarketOrder->notFull, buyMarketOrder->mut);
-      queueAdd (buyMarketOrder, ord);
-      pthread_mutex_unlock (buyMarketOrder->mut);
-      pthread_cond_broadcast (buyMarketOrder->notEmpty);
-      break;
 
-    case 1:
-      pthread_mutex_lock (sellMarketOrder->mut);
-      while (sellMarketOrder->full)
-        pthread_cond_wait(sellMarketOrder->notFull, sellMarketOrder->mut);
-      queueAdd (sellMarketOrder, ord);
-      pthread_mutex_unlock (sellMarketOrder->mut);
-      pthread_cond_broadcast (sellMarketOrder->notEmpty);
-      break;
 
-    case 2:
-      pthread_mutex_lock (buyLimitOrder->mut);
-      while (buyLimitOrder->full)
-        pthread_cond_wait(buyLimitOrder->notFull, buyLimitOrder->mut);
-      queueAddSort (buyLimitOrder, ord);
-      pthread_mutex_unlock (buyLimitOrder->mut);
-      pthread_cond_broadcast (buyLimitOrder->notEmpty);
-      break;
+// ****************************************************************
+// The producer makes order id only once all the earlier ones are done.
+void seqTurn (long id) {
+  pthread_mutex_lock (seq->mut);
+  while (seq->done < id)
+    pthread_cond_wait (seq->kick, seq->mut);
+  pthread_mutex_unlock (seq->mut);
+}
 
-    case 3:
-      pthread_mutex_lock (sellLimitOrder->mut);
-      while (sellLimitOrder->full)
-        pthread_cond_wait(sellLimitOrder->notFull, sellLimitOrder->mut);
-      queueAddSort (sellLimitOrder, ord);
-      pthread_mutex_unlock (sellLimitOrder->mut);
-      pthread_cond_broadcast (sellLimitOrder->notEmpty);
-      break;
+// ****************************************************************
+risk *riskInit (void) {
+  risk *r;
+  int a;
+
+  r = (risk *) arenaAlloc (sizeof (risk));
+  if (r == NULL) return (NULL);
+
+  for (a = 0; a < NACCOUNTS; a++) {
+    r->maxOrderVol[a] = RISKMAXORDER;
+    r->maxOpenVol[a] = RISKMAXOPEN;
+    r->maxPosition[a] = RISKMAXPOSITION;
+    r->maxNotional[a] = RISKMAXNOTIONAL;
+  }
+  r->band = RISKBAND;
 
+  return (r);
+}
 
-    default:
-      pthread_mutex_lock (cancelOrder->mut);
-      while (cancelOrder->full)
-        pthread_cond_wait(cancelOrder->notFull, cancelOrder->mut);
-      queueAdd (cancelOrder, ord);
-      pthread_mutex_unlock (cancelOrder->mut);
-      pthread_cond_broadcast (cancelOrder->notEmpty);
-      break;
 
 
+// ****************************************************************
+// RISK_OK or the first check that failed.
+int riskCheck (order ord) {
+  int a = ord.account;
+  int price = currentPriceX10;
+  long open, pos, notional;
+
+  if (a == FEEDACCOUNT)
+    return RISK_OK;
+  if ((a < 0) || (a >= NACCOUNTS) || (ord.vol <= 0) || (ord.vol > gate->maxOrderVol[a]))
+    return RISK_SIZE;
+
+  if ((ord.type == 'L') || (ord.type == 'T') || ((ord.type == 'R') && ord.price1)) {
+    if ((ord.price1 > price + gate->band) || (ord.price1 < price - gate->band))
+      return RISK_PRICE;
+    price = ord.price1;
   }
+  if (ord.type == 'R')
+    return RISK_OK;
+
+  open = __atomic_load_n (&gate->openVol[a], __ATOMIC_RELAXED);
+  if (open + ord.vol > gate->maxOpenVol[a])
+    return RISK_OPEN;
+
+  pos = __atomic_load_n (&gate->position[a], __ATOMIC_RELAXED);
+  pos += (ord.action == 'B') ? ord.vol : -ord.vol;
+  if (labs (pos) > gate->maxPosition[a])
+    return RISK_POSITION;
+
+  notional = labs (pos) * price;
+  if (notional > gate->maxNotional[a])
+    return RISK_NOTIONAL;
+
+  return RISK_OK;
 }
 
 
 
 // ****************************************************************
-void orderPush (int flag, order ord) {
+void riskAccept (order ord) {
+  __atomic_fetch_add (&gate->openVol[ord.account], ord.vol, __ATOMIC_RELAXED);
+}
 
-  switch (flag) {
 
-    case 0:
-      pthread_mutex_lock (buyMarketOrder->mut);
-      while (buyMarketOrder->full) {
-        fflush(stdout);
-        pthread_cond_wait(buyMarketOrder->notFull, buyMarketOrder->mut);
-      }
-      queuePush (buyMarketOrder, ord);
-      pthread_mutex_unlock (buyMarketOrder->mut);
-      pthread_cond_broadcast (buyMarketOrder->notEmpty);
-      break;
 
-    case 1:
-      pthread_mutex_lock (sellMarketOrder->mut);
-      while (sellMarketOrder->full) {
-        fflush(stdout);
-        pthread_cond_wait(sellMarketOrder->notFull, sellMarketOrder->mut);
-      }
-      queuePush (sellMarketOrder, ord);
-      pthread_mutex_unlock (sellMarketOrder->mut);
-      pthread_cond_broadcast (sellMarketOrder->notEmpty);
-      break;
+// ****************************************************************
+// The order left the book unfilled: cancel, expiry or a late reject.
+void riskRelease (order ord) {
+  __atomic_fetch_sub (&gate->openVol[ord.account], ord.vol, __ATOMIC_RELAXED);
+  if (gw)
+    gatewayReport (ord.id, 0, 0, 0, GWGONE, 1);
+}
 
-    case 2:
-      pthread_mutex_lock (buyLimitOrder->mut);
-      while (buyLimitOrder->full) {
-        fflush(stdout);
-        pthread_cond_wait(buyLimitOrder->notFull, buyLimitOrder->mut);
-      }
-      queuePush (buyLimitOrder, ord);
-      pthread_mutex_unlock (buyLimitOrder->mut);
-      pthread_cond_broadcast (buyLimitOrder->notEmpty);
-      break;
 
-    case 3:
-      pthread_mutex_lock (sellLimitOrder->mut);
-      while (sellLimitOrder->full) {
-        fflush(stdout);
-        pthread_cond_wait(sellLimitOrder->notFull, sellLimitOrder->mut);
-      }
-      queuePush (sellLimitOrder, ord);
-      pthread_mutex_unlock (sellLimitOrder->mut);
-      pthread_cond_broadcast (sellLimitOrder->notEmpty);
-      break;
 
+// ****************************************************************
+// "reject" or "shed" for all the queues past the inbound one, or a list
+// of queue=policy, e.g. "inbound=reject,limit=shed". NULL if malformed.
+admission *admitInit (char *spec) {
+  static char *policies[] = { "block", "reject", "shed" };
+  char buf[256], *item, *eq, *save;
+  admission *a;
+  int i, p;
+
+  a = (admission *) calloc (1, sizeof (admission));
+  snprintf (buf, sizeof (buf), "%s", spec);
+  for (item = strtok_r (buf, ",", &save); item; item = strtok_r (NULL, ",", &save)) {
+    if ((eq = strchr (item, '=')) != NULL)
+      *eq++ = '\0';
+    for (p = 0; (p < 3) && (strcmp (eq ? eq : item, policies[p])); p++)
+      ;
+    if (p == 3)
+      return NULL;
+    if (eq == NULL)
+      for (i = 1; i < NSTATQUEUES; i++)
+        a->policy[i] = p;
+    else if (!strcmp (item, "inbound"))
+      a->policy[0] = p;
+    else if (!strcmp (item, "market"))
+      a->policy[1] = a->policy[2] = p;
+    else if (!strcmp (item, "limit"))
+      a->policy[3] = a->policy[4] = p;
+    else if (!strcmp (item, "cancel"))
+      a->policy[5] = p;
+    else if (!strcmp (item, "stop"))
+      a->policy[6] = a->policy[7] = p;
+    else
+      return NULL;
+  }
+  return a;
+}
 
-    default :
-      pthread_mutex_lock (cancelOrder->mut);
-      while (cancelOrder->full) {
-        fflush(stdout);
-        pthread_cond_wait(cancelOrder->notFull, cancelOrder->mut);
-      }
-      queuePush (cancelOrder, ord);
-      pthread_mutex_unlock (cancelOrder->mut);
-      pthread_cond_broadcast (cancelOrder->notEmpty);
-      break;
 
+
+// ****************************************************************
+// Orders in queue i, read without its lock.
+long admitDepth (int i) {
+  switch (i) {
+    case 1: return queueDepth (buyMarketOrder);
+    case 2: return queueDepth (sellMarketOrder);
+    case 3: return buyLimitOrder->size;
+    case 4: return sellLimitOrder->size;
+    case 5: return queueDepth (cancelOrder);
+    case 6: return buyStopOrder->size;
+    case 7: return sellStopOrder->size;
   }
+  return 0;
 }
 
 
 
 // ****************************************************************
-order orderDel (int flag) {
-  order ord;
-  switch (flag) {
+void admitHigh (int i, long depth) {
+  if (depth > admit->high[i])
+    admit->high[i] = depth;
+}
 
-    case 0:
-      pthread_mutex_lock (buyMarketOrder->mut);
-      while (buyMarketOrder->empty) 
-        pthread_cond_wait (buyMarketOrder->notEmpty, buyMarketOrder->mut);
-      queueDel (buyMarketOrder, &ord);
-      pthread_mutex_unlock (buyMarketOrder->mut);
-      pthread_cond_signal (buyMarketOrder->notFull);
-      break;
 
-    case 1:
-      pthread_mutex_lock (sellMarketOrder->mut);
-      while (sellMarketOrder->empty)
-        pthread_cond_wait (sellMarketOrder->notEmpty, sellMarketOrder->mut);
-      queueDel (sellMarketOrder, &ord);
-      pthread_mutex_unlock (sellMarketOrder->mut);
-      pthread_cond_signal (sellMarketOrder->notFull);
-      break;
 
-    case 2:
-      pthread_mutex_lock (buyLimitOrder->mut);
-      while (buyLimitOrder->empty)
-        pthread_cond_wait (buyLimitOrder->notEmpty, buyLimitOrder->mut);
-      queueDel (buyLimitOrder, &ord);
-      pthread_mutex_unlock (buyLimitOrder->mut);
-      pthread_cond_signal (buyLimitOrder->notFull);
-      break;
+// ****************************************************************
+// 1 if a new order for queue i is turned away. Under shed the flow
+// least likely to trade goes first.
+int admitRefuse (int i, order ord) {
+  long depth;
+  int reason = 0, best;
+
+  if ((admit->policy[i] == ADMIT_BLOCK) || (replay) || (replayTape) || (ingest))
+    return 0;
+  depth = admitDepth (i);
+  if (depth >= ADMITMARK)
+    reason = GW_REJECTBUSY;
+  else if ((admit->policy[i] == ADMIT_SHED) && (depth >= SHEDMARK)) {
+    if (i >= 6)
+      reason = GW_REJECTSHED;
+    else if (i >= 3) {
+      best = (i == 3) ? buyLimitOrder->best : sellLimitOrder->best;
+      if ((best != NIL) && ((i == 3) ? (ord.price1 < best - SHEDTICKS) : (ord.price1 > best + SHEDTICKS)))
+        reason = GW_REJECTSHED;
+    }
+  }
+  if (reason == 0)
+    return 0;
+
+  admit->refused[i]++;
+  stat->rejects++;
+  printf("%ld Order ---> Rejected (%s)\n", ord.id, (reason == GW_REJECTBUSY) ? "busy" : "shed");
+  orderRejected (ord, reason);
+  if (ord.type != 'C')
+    riskRelease (ord);
+  return 1;
+}
 
-    case 3:
-      pthread_mutex_lock (sellLimitOrder->mut);
-      while (sellLimitOrder->empty)
-        pthread_cond_wait (sellLimitOrder->notEmpty, sellLimitOrder->mut);
-      queueDel (sellLimitOrder, &ord);
-      pthread_mutex_unlock (sellLimitOrder->mut);
-      pthread_cond_signal (sellLimitOrder->notFull);
-      break;
 
 
-    default :
-      pthread_mutex_lock (cancelOrder->mut);
-      while (cancelOrder->empty)
-        pthread_cond_wait (cancelOrder->notEmpty, cancelOrder->mut);
-      queueDel (cancelOrder, &ord);
-      pthread_mutex_unlock (cancelOrder->mut);
-      pthread_cond_signal (cancelOrder->notFull);
-      break;
+// ****************************************************************
+// With q->mut held: cancels go to their lane, which Cons empties first.
+// 0 if a generated order is turned away.
+int inboundAdd (queue *q, order ord) {
+  queue *to = (ord.type == 'C') ? cancelLane : q;
+
+  if ((to == q) && (admit->policy[0] != ADMIT_BLOCK) && (!replay) && (!replayTape) && (!ingest) && (!sequenced) &&
+      (ord.type != 'R') && (ord.type != 'Q') && (queueDepth (q) >= ADMITMARK)) {
+    admit->refused[0]++;
+    printf("%ld Order ---> Rejected (busy)\n", ord.id);
+    orderRejected (ord, GW_REJECTBUSY);
+    return 0;
+  }
+  while (to->full)
+    statFull (to->notFull, q->mut);
+  queueAdd (to, ord);
+  trace (TRACE_ENQUEUE, ord.id, 0);
+  if (to == q)
+    admitHigh (0, queueDepth (q));
+  return 1;
+}
+
+
+
+// ****************************************************************
+// What a modify adds is checked as a new order of that size.
+int riskModify (order old, order ord) {
+  order more = old;
+
+  if (ord.account != old.account)
+    return RISK_OWNER;
+  more.type = 'L';
+  more.vol = ord.vol - old.vol;
+  more.price1 = (ord.price1) ? ord.price1 : old.price1;
+  return (more.vol > 0) ? riskCheck (more) : RISK_OK;
+}
+
+
+
+// ****************************************************************
+void riskAmend (order old, order ord) {
+  __atomic_fetch_add (&gate->openVol[old.account], ord.vol - old.vol, __ATOMIC_RELAXED);
+}
+
+
 
+// ****************************************************************
+void riskFill (order ord, int volume) {
+  __atomic_fetch_sub (&gate->openVol[ord.account], volume, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&gate->position[ord.account], (ord.action == 'B') ? volume : -volume, __ATOMIC_RELAXED);
+}
+
+
+
+// ****************************************************************
+statSegment *statsInit (char *name) {
+  statSegment *seg = MAP_FAILED;
+  int fd;
+
+  fd = shm_open (name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+  if ((fd >= 0) && (ftruncate (fd, sizeof (statSegment)) == 0))
+    seg = mmap (NULL, sizeof (statSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (fd >= 0)
+    close (fd);
+  if (seg == MAP_FAILED) {
+    fprintf(stderr, "Statistics segment %s not available, keeping it private\n", name);
+    seg = (statSegment *) calloc (1, sizeof (statSegment));
   }
 
-  return ord;
+  memset (seg, 0, sizeof (statSegment));
+  seg->version = STATSVERSION;
+  seg->pid = getpid();
+  strcpy (seg->queueName[0], "inbound");
+  strcpy (seg->queueName[1], "buyMarket");
+  strcpy (seg->queueName[2], "sellMarket");
+  strcpy (seg->queueName[3], "buyLimit");
+  strcpy (seg->queueName[4], "sellLimit");
+  strcpy (seg->queueName[5], "cancel");
+  strcpy (seg->queueName[6], "buyStop");
+  strcpy (seg->queueName[7], "sellStop");
+  __atomic_store_n (&seg->magic, STATSMAGIC, __ATOMIC_RELEASE);
+
+  return seg;
 }
 
 
 
 // ****************************************************************
-void orderDelIndex (int flag, order ord) {
-    switch (flag) {
+// Called once at the top of every pipeline thread.
+void statRegister (char *name) {
+  int n = __atomic_fetch_add (&stats->nthreads, 1, __ATOMIC_RELAXED);
 
-    case 0:
-      pthread_mutex_lock (buyMarketOrder->mut);
-      while (buyMarketOrder->empty)
-        pthread_cond_wait(buyMarketOrder->notEmpty, buyMarketOrder->mut);
-      queueDelIndex (buyMarketOrder, ord);
-      pthread_mutex_unlock (buyMarketOrder->mut);
-      pthread_cond_signal (buyMarketOrder->notFull);
-      break;
+  if (n >= NSTATTHREADS) {
+    fprintf(stderr, "No statistics slot left for %s, %d are in use\n", name, NSTATTHREADS);
+    exit(1);
+  }
+  stat = &stats->slot[n];
+  strncpy (stat->name, name, sizeof (stat->name) - 1);
+  if (traces)
+    tring = &traces[n];
+}
 
-    case 1:
-      pthread_mutex_lock (sellMarketOrder->mut);
-      while (sellMarketOrder->empty)
-        pthread_cond_wait(sellMarketOrder->notEmpty, sellMarketOrder->mut);
-      queueDelIndex (sellMarketOrder, ord);
-      pthread_mutex_unlock (sellMarketOrder->mut);
-      pthread_cond_signal (sellMarketOrder->notFull);
-      break;
 
-    case 2:
-      pthread_mutex_lock (buyLimitOrder->mut);
-      while (buyLimitOrder->empty)
-        pthread_cond_wait(buyLimitOrder->notEmpty, buyLimitOrder->mut);
-      queueDelIndex (buyLimitOrder, ord);
-      pthread_mutex_unlock (buyLimitOrder->mut);
-      pthread_cond_signal (buyLimitOrder->notFull);
-      break;
 
-    case 3:
-      pthread_mutex_lock (sellLimitOrder->mut);
-      while (sellLimitOrder->empty)
-        pthread_cond_wait(sellLimitOrder->notEmpty, sellLimitOrder->mut);
-      queueDelIndex (sellLimitOrder, ord);
-      pthread_mutex_unlock (sellLimitOrder->mut);
-      pthread_cond_signal (sellLimitOrder->notFull);
-      break;
+// ****************************************************************
+long nsecNow () {
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+
+// ****************************************************************
+// Wait for room in a full queue.
+void statFull (pthread_cond_t *cond, pthread_mutex_t *mut) {
+  long t0 = nsecNow();
+
+  trace (TRACE_WAIT, 0, 1);
+  if (coSelf) {
+    pthread_mutex_unlock (mut);
+    coYield ();
+    pthread_mutex_lock (mut);
+  }
+  else
+    pthread_cond_wait (cond, mut);
+  trace (TRACE_WAITEND, 0, 1);
+  stat->blocked++;
+  stat->blockedNsec += nsecNow() - t0;
+}
+
+
+
+// ****************************************************************
+// Wait for work.
+void statWait (pthread_cond_t *cond, pthread_mutex_t *mut) {
+  long t0 = nsecNow();
+
+  trace (TRACE_WAIT, 0, 0);
+  if (coSelf) {
+    pthread_mutex_unlock (mut);
+    coYield ();
+    pthread_mutex_lock (mut);
+  }
+  else
+    pthread_cond_wait (cond, mut);
+  trace (TRACE_WAITEND, 0, 0);
+  stat->waits++;
+  stat->waitNsec += nsecNow() - t0;
+}
 
-    default : break;
 
+
+// ****************************************************************
+// The header is written in full again by traceClose.
+void traceInit (char *name) {
+  if ((traceFile = fopen (name, "w")) == NULL) {
+    perror (name);
+    exit (1);
+  }
+  traces = (traceRing *) arenaAlloc (TRACETHREADS * sizeof (traceRing));
+  traceHead.magic = TRACEMAGIC;
+  traceHead.version = TRACEVERSION;
+  traceHead.tsc0 = cycles();
+  traceHead.nsec0 = nsecNow();
+  fwrite (&traceHead, sizeof (traceHead), 1, traceFile);
+  tracing = 1;
+}
+
+
+
+// ****************************************************************
+// Moves what every ring holds to the file, by the Stats thread.
+void traceDrain (void) {
+  static traceEvent buf[TRACERING];
+  traceRing *r;
+  long head, i, n;
+  int k;
+
+  if (traces == NULL)
     return;
+  pthread_mutex_lock (&traceMut);
+  for (k = 0; (k < TRACETHREADS) && (traceFile); k++) {
+    r = &traces[k];
+    head = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+    for (n = 0, i = r->tail; i < head; i++, n++) {
+      buf[n] = r->ev[i & (TRACERING - 1)];
+      buf[n].thread = k;
+    }
+    __atomic_store_n (&r->tail, head, __ATOMIC_RELEASE);
+    fwrite (buf, sizeof (traceEvent), n, traceFile);
+    traceHead.events += n;
   }
+  pthread_mutex_unlock (&traceMut);
 }
 
 
 
 // ****************************************************************
-transaction *transactionInit() {
-  transaction *trans;
-  
-  trans = (transaction *) malloc (sizeof (transaction));
+void traceClose (void) {
+  long lost = 0;
+  int i;
 
-  trans->marketBuyer = 0;
-  trans->marketSeller = 0;
-  trans->limitBuyer = 0;
-  trans->limitSeller = 0;
+  __atomic_store_n (&tracing, 0, __ATOMIC_RELAXED);
+  traceDrain ();
+  pthread_mutex_lock (&traceMut);
+  traceHead.tsc1 = cycles();
+  traceHead.nsec1 = nsecNow();
+  traceHead.nthreads = (stats->nthreads < TRACETHREADS) ? stats->nthreads : TRACETHREADS;
+  for (i = 0; i < traceHead.nthreads; i++) {
+    memcpy (traceHead.name[i], stats->slot[i].name, sizeof (traceHead.name[i]));
+    lost += traceHead.lost[i] = traces[i].lost;
+  }
+  for (i = 0; i < TRACEQUEUES; i++)
+    memcpy (traceHead.queue[i], stats->queueName[i], sizeof (traceHead.queue[i]));
+  fseek (traceFile, 0, SEEK_SET);
+  fwrite (&traceHead, sizeof (traceHead), 1, traceFile);
+  fclose (traceFile);
+  traceFile = NULL;
+  pthread_mutex_unlock (&traceMut);
+  fprintf(stderr, "Traced %ld events, %ld lost to full rings\n", traceHead.events, lost);
+}
 
-  trans->mutBuyer = (pthread_mutex_t *) malloc (sizeof (pthread_mutex_t));
-  pthread_mutex_init (trans->mutBuyer, NULL);
-  trans->mutSeller = (pthread_mutex_t *) malloc (sizeof (pthread_mutex_t));
-  pthread_mutex_init (trans->mutSeller, NULL);
 
-  trans->conBuyer = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
-  pthread_cond_init (trans->conBuyer, NULL);
-  trans->conSeller = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
-  pthread_cond_init (trans->conSeller, NULL);
-  trans->buyMarketTransaction = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
-  pthread_cond_init (trans->buyMarketTransaction, NULL);
-  trans->sellMarketTransaction = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
-  pthread_cond_init (trans->sellMarketTransaction, NULL);
-  trans->buyLimitTransaction = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
-  pthread_cond_init (trans->buyLimitTransaction, NULL);
-  trans->sellLimitTransaction = (pthread_cond_t *) malloc (sizeof (pthread_cond_t));
-  pthread_cond_init (trans->sellLimitTransaction, NULL);
-  
-  return (trans);
+
+// ****************************************************************
+long queueDepth (queue *q) {
+  if (q->full)
+    return QUEUESIZE;
+  return (q->tail - q->head + QUEUESIZE) % QUEUESIZE;
 }
 
+
+
+// ****************************************************************
+unsigned long cycles (void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+
+
 // ****************************************************************
 void makeTransaction (order order1, order order2, int id1, int id2) {
-  int volume = order1.vol;
+  int volume = (order1.vol < order2.vol) ? order1.vol : order2.vol;
+
+  trace (TRACE_MATCH, order1.id, volume);
+  tradeReport (order1, order2, volume);
+
   //static flag = 0;
   if (order1.vol > order2.vol) {
     order1.vol = order1.vol - order2.vol;
-    volume = order2.vol;
-    if (id1 < 2)
-      orderPush (id1, order1);
-    else
-      orderAdd (id1, order1);
+    trace (TRACE_REQUEUE, order1.id, order1.vol);
+    orderPush (id1, order1);
   }
   else if (order1.vol < order2.vol) {
     order2.vol = order2.vol - order1.vol;
-    if (id2 < 2)
-      orderPush (id2, order2);
-    else
-      orderAdd(id2, order2);
+    trace (TRACE_REQUEUE, order2.id, order2.vol);
+    orderPush (id2, order2);
   }
   //if (!flag) {
     //infile = fopen("log4marketSim.txt", "w");
@@ -914,17 +5974,41 @@ void makeTransaction (order order1, order order2, int id1, int id2) {
   //fprintf(infile, "%ld\t%d\t%d\n", getTimestamp(), currentPriceX10, volume);
   //fflush(infile);
 
-  printf("Timestamp: %ld Price: %d\tVolume: %d\torderid1: %ld orderid2: %ld\n", getTimestamp(), currentPriceX10, volume, order1.id, order2.id);
   return;
 }
 
 
 
+// ****************************************************************
+void tradeReport (order order1, order order2, int volume) {
+  long now = getTimestamp();
+
+  riskFill (order1, volume);
+  riskFill (order2, volume);
+  stat->trades++;
+  stat->volume += volume;
+
+  printf("Timestamp: %ld Price: %d\tVolume: %d\torderid1: %ld orderid2: %ld\n", now, currentPriceX10, volume, order1.id, order2.id);
+  if (columns)
+    columnAdd (now, currentPriceX10, volume);
+  if (tradeTape)
+    zPutTrade (tradeTape, (trade) { now, currentPriceX10, volume, order1.id, order2.id });
+  if (gw) {
+    gatewayReport (order1.id, now, currentPriceX10, volume, 0, order1.vol == volume);
+    gatewayReport (order2.id, now, currentPriceX10, volume, 0, order2.vol == volume);
+  }
+  if (npools)
+    agentPublish ('T', (agentTrade) { now, currentPriceX10, volume, order1.id, order2.id }, 0);
+}
+
+
+
 //**********************************************************
 void *Market() {
   
-  int i;
+  int mb, ms, lb, ls;
   
+  statRegister ("Market");
   while(1) {
     
     order offerB1;
@@ -932,90 +6016,216 @@ void *Market() {
     order offerS1;
     order offerS2;
 
-    pthread_mutex_lock (t->mutBuyer);
-    
-    while ((!t->marketBuyer) && (!t->limitBuyer))
-      pthread_cond_wait (t->conBuyer, t->mutBuyer);
-    pthread_mutex_unlock (t->mutBuyer);  
-    
-    pthread_mutex_lock (t->mutSeller);
-    
-    while ((!t->marketSeller) && (!t->limitSeller))
-      pthread_cond_wait (t->conSeller, t->mutSeller);
-    pthread_mutex_unlock (t->mutSeller); 
+    if (sequenced)
+      seqMatchWait ();
+    else {
+      pthread_mutex_lock (t->mutBuyer);
+
+      while ((!t->marketBuyer) && (!t->limitBuyer))
+        statWait (t->conBuyer, t->mutBuyer);
+      pthread_mutex_unlock (t->mutBuyer);
+
+      pthread_mutex_lock (t->mutSeller);
+
+      while ((!t->marketSeller) && (!t->limitSeller))
+        statWait (t->conSeller, t->mutSeller);
+      pthread_mutex_unlock (t->mutSeller);
+    }
     
-    if (t->marketBuyer)
+    // the round goes by this snapshot, not by t
+    mb = t->marketBuyer;
+    ms = t->marketSeller;
+    lb = t->limitBuyer;
+    ls = t->limitSeller;
+    if (mb)
       offerB1 = t->buyMarketOrder;
-    if (t->marketSeller)
+    if (ms)
       offerS1 = t->sellMarketOrder;
-    if (t->limitBuyer)
+    if (lb)
       offerB2 = t->buyLimitOrder;
-    if (t->limitSeller)
+    if (ls)
       offerS2 = t->sellLimitOrder;
-      
-    
-      if ((t->limitBuyer) && (t->limitSeller)) {
-        currentPriceX10 = (int)((offerB2.price1 + offerS2.price1) / 2);
-        makeTransaction (offerB2, offerS2, 2, 3);
-        t->limitBuyer = 0;
-        t->limitSeller = 0;
-        pthread_cond_signal (t->buyLimitTransaction);
-        pthread_cond_signal (t->sellLimitTransaction);
-      }
-      
-      if ((t->marketBuyer) && (t->limitSeller)) {
-        currentPriceX10 = offerS2.price1;
-        makeTransaction (offerB1, offerS2, 0, 3);
-        t->marketBuyer = 0;
-        t->limitSeller = 0;
-        pthread_cond_signal (t->buyMarketTransaction);
-        pthread_cond_signal (t->sellLimitTransaction);
-      }
 
-      if ((t->marketSeller) && (t->limitBuyer)) {
-        currentPriceX10 = offerB2.price1;
-        makeTransaction (offerS1, offerB2, 1, 2);
-        t->marketSeller = 0;
-        t->limitBuyer = 0;
-        pthread_cond_signal (t->sellMarketTransaction);
-        pthread_cond_signal (t->buyLimitTransaction);
-      }
-      
-      if ((t->marketBuyer) && (t->marketSeller)) {
-        makeTransaction (offerB1, offerS1, 0, 1);
-        t->marketBuyer = 0;
-        t->marketSeller = 0;
-        pthread_cond_signal (t->buyMarketTransaction);
-        pthread_cond_signal (t->sellMarketTransaction);
-      }     
-    
-    pthread_cond_signal (buyLimitOrder->notEmpty);
-    pthread_cond_signal (sellLimitOrder->notEmpty);
+    if ((lb) && (ls)) {
+      currentPriceX10 = (int)((offerB2.price1 + offerS2.price1) / 2);
+      makeTransaction (offerB2, offerS2, 2, 3);
+      stopTrigger (mb | (ms << 1));
+      transactionDone (&t->limitBuyer, t->mutBuyer, t->buyLimitTransaction);
+      transactionDone (&t->limitSeller, t->mutSeller, t->sellLimitTransaction);
+      lb = ls = 0;
+    }
+
+    if ((mb) && (ls)) {
+      currentPriceX10 = offerS2.price1;
+      makeTransaction (offerB1, offerS2, 0, 3);
+      stopTrigger ((ms << 1) | (offerB1.vol > offerS2.vol));
+      transactionDone (&t->marketBuyer, t->mutBuyer, t->buyMarketTransaction);
+      transactionDone (&t->limitSeller, t->mutSeller, t->sellLimitTransaction);
+      mb = ls = 0;
+    }
+
+    if ((ms) && (lb)) {
+      currentPriceX10 = offerB2.price1;
+      makeTransaction (offerS1, offerB2, 1, 2);
+      stopTrigger (mb | ((offerS1.vol > offerB2.vol) << 1));
+      transactionDone (&t->marketSeller, t->mutSeller, t->sellMarketTransaction);
+      transactionDone (&t->limitBuyer, t->mutBuyer, t->buyLimitTransaction);
+      ms = lb = 0;
+    }
+
+    if ((mb) && (ms)) {
+      makeTransaction (offerB1, offerS1, 0, 1);
+      transactionDone (&t->marketBuyer, t->mutBuyer, t->buyMarketTransaction);
+      transactionDone (&t->marketSeller, t->mutSeller, t->sellMarketTransaction);
+    }
+
+    touchUpdate ();
+    if (sequenced)
+      seqMatched ();
+    else {
+      pthread_cond_signal (buyLimitOrder->notEmpty);
+      pthread_cond_signal (sellLimitOrder->notEmpty);
+    }
+
+  }
+}
+
 
+
+// ****************************************************************
+// Hand a matched order back to the stage thread that is waiting on it.
+void transactionDone (int *flag, pthread_mutex_t *mut, pthread_cond_t *cond) {
+  pthread_mutex_lock (mut);
+  *flag = 0;
+  pthread_mutex_unlock (mut);
+  pthread_cond_signal (cond);
+}
+
+
+
+// ****************************************************************
+// Posted orders not yet matched, a bit for each by its orderAdd flag.
+int stopHeld (void) {
+  int held;
+
+  pthread_mutex_lock (t->mutBuyer);
+  held = t->marketBuyer | (t->limitBuyer << 2);
+  pthread_mutex_unlock (t->mutBuyer);
+  pthread_mutex_lock (t->mutSeller);
+  held |= (t->marketSeller << 1) | (t->limitSeller << 3);
+  pthread_mutex_unlock (t->mutSeller);
+  return held;
+}
+
+
+
+// ****************************************************************
+// A triggered stop trades with the other side's next orders, unless an
+// order of its own side is due first.
+void stopMatch (int flag, order *ord) {
+  int buy = !(flag & 1), from, price, limit, q;
+  book *b = buy ? sellLimitOrder : buyLimitOrder, *own = buy ? buyLimitOrder : sellLimitOrder;
+  order rest;
+
+  while (ord->vol > 0) {
+    limit = (flag >= 2) ? ord->price1 : currentPriceX10;
+    if (buy ? (limit < currentPriceX10) : (limit > currentPriceX10))
+      return;
+    pthread_mutex_lock (own->mut);
+    from = bookNext (own, &price);
+    pthread_mutex_unlock (own->mut);
+    if ((from != NIL) && (buy ? (price >= limit) : (price <= limit)))
+      return;
+    pthread_mutex_lock (b->mut);
+    from = bookNext (b, &price);
+    if ((from == NIL) || (buy ? (price > currentPriceX10) : (price < currentPriceX10)) ||
+        ((flag >= 2) && (buy ? (price > ord->price1) : (price < ord->price1)))) {
+      pthread_mutex_unlock (b->mut);
+      return;
+    }
+    bookNextDel (b, from, price, &rest);
+    pthread_mutex_unlock (b->mut);
+
+    currentPriceX10 = (flag < 2) ? price : (ord->price1 + price) / 2;
+    q = (ord->vol < rest.vol) ? ord->vol : rest.vol;
+    trace (TRACE_MATCH, ord->id, q);
+    if ((flag < 2) || (buy))
+      tradeReport (*ord, rest, q);
+    else
+      tradeReport (rest, *ord, q);
+    if (rest.vol > q) {
+      rest.vol -= q;
+      orderPush (buy ? 3 : 2, rest);
+    }
+    ord->vol -= q;
+    touchUpdate ();
   }
 }
 
 
 
+// ****************************************************************
+// After every trade, until the price stops moving. held is as stopHeld.
+void stopTrigger (int held) {
+  stopQueue *s;
+  order ord;
+  int flag, side, fired;
+
+  do {
+    fired = 0;
+    for (side = 0; side < 2; side++) {
+      s = (side == 0) ? buyStopOrder : sellStopOrder;
+      while (1) {
+        pthread_mutex_lock (s->mut);
+        if ((s->next == NIL) || (!stopCrossed (s->pool[s->head[s->next]].ord))) {
+          pthread_mutex_unlock (s->mut);
+          break;
+        }
+        stopUnlink (s, s->head[s->next], &ord);
+        pthread_mutex_unlock (s->mut);
+        pthread_cond_signal (s->notFull);
+        fired = 1;
+
+        printf("%ld %s Stop Order ---> Triggered at %d\n", ord.id, (side == 0) ? "Buy" : "Sell", currentPriceX10);
+        flag = stopActivate (&ord);
+        if ((phase != CALL) && (!(held & 12)) && ((flag >= 2) || (!(held & (1 << flag)))))
+          stopMatch (flag, &ord);
+        if (ord.vol == 0)
+          continue;
+        if (flag < 2) {
+          held |= 1 << flag;
+          orderPush (flag, ord);
+        }
+        else
+          orderAdd (flag, ord);
+      }
+    }
+  } while (fired);
+}
+
+
+
 // ****************************************************************
 void *MarketBuy() {
   order ord;
-  pthread_mutex_t mutex;
-  pthread_mutex_init (&mutex, NULL);
   
+  statRegister ("MarketBuy");
   while(1) {
     ord = orderDel(0);
+    stat->orders++;
     
     pthread_mutex_lock (t->mutBuyer);
     t->marketBuyer = 1;
     t->buyMarketOrder = ord;
     pthread_mutex_unlock (t->mutBuyer);
     pthread_cond_signal (t->conBuyer);
+    if (sequenced)
+      seqRelease (0);
     
-    pthread_mutex_lock (&mutex);
+    pthread_mutex_lock (t->mutBuyer);
     while (t->marketBuyer)
-      pthread_cond_wait (t->buyMarketTransaction, &mutex); 
-    pthread_mutex_unlock (&mutex);
+      statWait (t->buyMarketTransaction, t->mutBuyer); 
+    pthread_mutex_unlock (t->mutBuyer);
     
     } 
 }
@@ -1025,22 +6235,24 @@ void *MarketBuy() {
 //**********************************************************
 void *MarketSell() {
   order ord;
-  pthread_mutex_t mutex;
-  pthread_mutex_init (&mutex, NULL);
   
-  while(1) { 
+  statRegister ("MarketSell");
+  while(1) {
     ord = orderDel(1);
+    stat->orders++;
     
     pthread_mutex_lock (t->mutSeller);
     t->marketSeller = 1;
     t->sellMarketOrder = ord;
     pthread_mutex_unlock (t->mutSeller);
     pthread_cond_signal (t->conSeller);
+    if (sequenced)
+      seqRelease (1);
     
-    pthread_mutex_lock(&mutex);
+    pthread_mutex_lock (t->mutSeller);
     while (t->marketSeller)
-      pthread_cond_wait (t->sellMarketTransaction, &mutex);
-    pthread_mutex_unlock (&mutex);
+      statWait (t->sellMarketTransaction, t->mutSeller);
+    pthread_mutex_unlock (t->mutSeller);
     
     }
 }
@@ -1050,16 +6262,18 @@ void *MarketSell() {
 //**********************************************************
 void *LimitBuy() {
   order ord;
-  pthread_mutex_t mutex;
-  pthread_mutex_init(&mutex, NULL);
+  int from, price;
   
+  statRegister ("LimitBuy");
   while(1) {
     pthread_mutex_lock (buyLimitOrder->mut);  
-    while ((buyLimitOrder->empty) || (buyLimitOrder->item[buyLimitOrder->head].price1 < currentPriceX10))
-      pthread_cond_wait (buyLimitOrder->notEmpty, buyLimitOrder->mut);
-    
-    queueDel (buyLimitOrder, &ord);
+    while (((from = bookNext (buyLimitOrder, &price)) == NIL) || (price < currentPriceX10) || (phase == CALL) ||
+           (seq->busy))
+      statWait (buyLimitOrder->notEmpty, buyLimitOrder->mut);
     
+    bookNextDel (buyLimitOrder, from, price, &ord);
+    seq->hold[2] = 1;
+    stat->orders++;
     
     pthread_mutex_unlock (buyLimitOrder->mut);
     pthread_cond_signal (buyLimitOrder->notFull);
@@ -1068,13 +6282,15 @@ void *LimitBuy() {
     t->buyLimitOrder = ord;
     pthread_mutex_unlock (t->mutBuyer);
     pthread_cond_signal (t->conBuyer);
+    if (sequenced)
+      seqRelease (2);
   
-    pthread_mutex_lock (&mutex);
+    pthread_mutex_lock (t->mutBuyer);
     
     while (t->limitBuyer)
-      pthread_cond_wait (t->buyLimitTransaction, &mutex);
+      statWait (t->buyLimitTransaction, t->mutBuyer);
     
-    pthread_mutex_unlock (&mutex);
+    pthread_mutex_unlock (t->mutBuyer);
   }
 }
 
@@ -1083,15 +6299,18 @@ void *LimitBuy() {
 //**********************************************************
 void *LimitSell() {
   order ord;
-  pthread_mutex_t mutex;
-  pthread_mutex_init (&mutex, NULL);
+  int from, price;
   
+  statRegister ("LimitSell");
   while(1) {
     pthread_mutex_lock (sellLimitOrder->mut);
-    while ((sellLimitOrder->empty) || (sellLimitOrder->item[sellLimitOrder->head].price1 > currentPriceX10)) {
-      pthread_cond_wait (sellLimitOrder->notEmpty, sellLimitOrder->mut);
+    while (((from = bookNext (sellLimitOrder, &price)) == NIL) || (price > currentPriceX10) || (phase == CALL) ||
+           (seq->busy)) {
+      statWait (sellLimitOrder->notEmpty, sellLimitOrder->mut);
     }
-    queueDel (sellLimitOrder, &ord);
+    bookNextDel (sellLimitOrder, from, price, &ord);
+    seq->hold[3] = 1;
+    stat->orders++;
       
     pthread_mutex_unlock (sellLimitOrder->mut);  
     pthread_cond_signal (sellLimitOrder->notFull);
@@ -1100,13 +6319,15 @@ void *LimitSell() {
     t->sellLimitOrder = ord;
     pthread_mutex_unlock (t->mutSeller);
     pthread_cond_signal (t->conSeller);
+    if (sequenced)
+      seqRelease (3);
     
-    pthread_mutex_lock (&mutex);
+    pthread_mutex_lock (t->mutSeller);
     
     while (t->limitSeller) {
-      pthread_cond_wait (t->sellLimitTransaction, &mutex);
+      statWait (t->sellLimitTransaction, t->mutSeller);
     }
-    pthread_mutex_unlock (&mutex);
+    pthread_mutex_unlock (t->mutSeller);
   } 
 }
 
@@ -1114,152 +6335,538 @@ void *LimitSell() {
 
 //**********************************************************
 void *Cancel() {
-  int i;
-  order ord;
+  order ord, out;
+  int found;
+
+  statRegister ("Cancel");
   while(1) {
     start:
+    if (sequenced)
+      seqRelease (4);
     ord = orderDel(4);
-    if ((!buyMarketOrder->empty) && (buyMarketOrder->tail > buyMarketOrder->head)) {
-      for (i = buyMarketOrder->head; i < buyMarketOrder->tail; i++) {
-        if (ord.oldid == buyMarketOrder->item[i].id) {
-          orderDelIndex (0, ord);  
-          printf("%ld Buy Market Order ---> Cancelled\n", ord.oldid);
-          goto start;
-        }
-      }
+    stat->orders++;
+    trace (TRACE_SCAN, ord.oldid, 0);
+    if ((found = orderDelIndex (2, ord))) {
+      trace (TRACE_SCANEND, ord.oldid, 1);
+      printf("%ld Buy %s Order ---> Cancelled\n", ord.oldid, (found == 2) ? "Pegged" : "Limit");
+      stat->cancelHit++;
+      goto start;
     }
-    else if ((!buyMarketOrder->empty) && (buyMarketOrder->tail == 0)) {
-      for (i = buyMarketOrder->head; i < QUEUESIZE; i++) {
-        if (ord.oldid == buyMarketOrder->item[i].id) {
-          orderDelIndex (0, ord);
-          printf("%ld Buy Market Order ---> Cancelled\n", ord.oldid);
-          goto start;
-        }
-      }
+    if ((found = orderDelIndex (3, ord))) {
+      trace (TRACE_SCANEND, ord.oldid, 1);
+      printf("%ld Sell %s Order ---> Cancelled\n", ord.oldid, (found == 2) ? "Pegged" : "Limit");
+      stat->cancelHit++;
+      goto start;
     }
-    else if (!buyMarketOrder->empty)
-    {
-      for (i = buyMarketOrder->head; i < QUEUESIZE; i++) {
-        if(ord.oldid == buyMarketOrder->item[i].id) {
-          orderDelIndex (0, ord);
-          printf("%ld Buy Market Order ---> Cancelled\n", ord.oldid);
-          goto start;
-        }
-      }
-      for (i = 0; i < buyMarketOrder->tail; i++) {
-        if (ord.oldid == buyMarketOrder->item[i].id){
-          orderDelIndex (0, ord);
-          printf("%ld Buy Market Order ---> Cancelled\n", ord.oldid);
-          goto start;
-        }
-      }
-    } 
-
-    if ((!sellMarketOrder->empty) && (sellMarketOrder->tail > sellMarketOrder->head)) {
-      for (i = sellMarketOrder->head; i < sellMarketOrder->tail; i++) {
-        if (ord.oldid == sellMarketOrder->item[i].id) {
-          orderDelIndex (1, ord);  
-          printf("%ld Sell Market Order ---> Cancelled\n", ord.oldid);
-          goto start;
-        }
-      }
+    if (orderDelIndex (0, ord)) {
+      trace (TRACE_SCANEND, ord.oldid, 1);
+      printf("%ld Buy Market Order ---> Cancelled\n", ord.oldid);
+      stat->cancelHit++;
+      goto start;
     }
-    else if ((!sellMarketOrder->empty) && (sellMarketOrder->tail == 0)) {
-      for (i = sellMarketOrder->head; i < QUEUESIZE; i++) {
-        if (ord.oldid == sellMarketOrder->item[i].id) {
-          orderDelIndex (1, ord);
-          printf("%ld Sell Market Order ---> Cancelled\n", ord.oldid);
-          goto start;
-        }
-      }
+    if (orderDelIndex (1, ord)) {
+      trace (TRACE_SCANEND, ord.oldid, 1);
+      printf("%ld Sell Market Order ---> Cancelled\n", ord.oldid);
+      stat->cancelHit++;
+      goto start;
     }
-    else if (!sellMarketOrder->empty)
-    {
-      for (i = sellMarketOrder->head; i < QUEUESIZE; i++) {
-        if(ord.oldid == sellMarketOrder->item[i].id) {
-          orderDelIndex (1, ord);
-          printf("%ld Sell Market Order ---> Cancelled\n", ord.oldid);
-          goto start;
-        }
-      }
-      for (i = 0; i < sellMarketOrder->tail; i++) {
-        if (ord.oldid == sellMarketOrder->item[i].id){
-          orderDelIndex (1, ord);
-          printf("%ld Sell Market Order ---> Cancelled\n", ord.oldid);
-          goto start;
-        }
-      }
+    if (stopDelIndex (buyStopOrder, ord, &out)) {
+      trace (TRACE_SCANEND, ord.oldid, 1);
+      riskRelease (out);
+      printf("%ld Buy Stop Order ---> Cancelled\n", ord.oldid);
+      stat->cancelHit++;
     }
-    if ((!buyLimitOrder->empty) && (buyLimitOrder->tail > buyLimitOrder->head)) {
-      for (i = buyLimitOrder->head; i < buyLimitOrder->tail; i++) {
-        if (ord.oldid == buyLimitOrder->item[i].id) {
-          orderDelIndex (2, ord);  
-          printf("%ld Buy Limit Order ---> Cancelled\n", ord.oldid);
-          goto start;
-        }
-      }
+    else if (stopDelIndex (sellStopOrder, ord, &out)) {
+      trace (TRACE_SCANEND, ord.oldid, 1);
+      riskRelease (out);
+      printf("%ld Sell Stop Order ---> Cancelled\n", ord.oldid);
+      stat->cancelHit++;
     }
-    else if ((!buyLimitOrder->empty) && (buyLimitOrder->tail == 0)) {
-      for (i = buyLimitOrder->head; i < QUEUESIZE; i++) {
-        if (ord.oldid == buyLimitOrder->item[i].id) {
-          orderDelIndex (2, ord);
-          printf("%ld Buy Limit Order ---> Cancelled\n", ord.oldid);
-          goto start;
-        }
-      }
+    else {
+      trace (TRACE_SCANEND, ord.oldid, 0);
+      stat->cancelMiss++;
     }
-    else if (!buyLimitOrder->empty)
-    {
-      for (i = buyLimitOrder->head; i < QUEUESIZE; i++) {
-        if(ord.oldid == buyLimitOrder->item[i].id) {
-          orderDelIndex (2, ord);
-          printf("%ld Buy Limit Order ---> Cancelled\n", ord.oldid);
-          goto start;
-        }
-      }
-      for (i = 0; i < buyLimitOrder->tail; i++) {
-        if (ord.oldid == buyLimitOrder->item[i].id){
-          orderDelIndex (2, ord);
-          printf("%ld Buy Limit Order ---> Cancelled\n", ord.oldid);
-          goto start;
-        }
-      }
+  }
+}
+
+
+
+// ****************************************************************
+// Saves the running stack in *from and carries on from to; x86-64 only.
+void coSwitch (void **from, void *to);
+#if defined(__x86_64__)
+__asm__ (
+  ".text\n"
+  ".globl coSwitch\n"
+  ".type coSwitch, @function\n"
+  "coSwitch:\n"
+  "  pushq %rbp\n"
+  "  pushq %rbx\n"
+  "  pushq %r12\n"
+  "  pushq %r13\n"
+  "  pushq %r14\n"
+  "  pushq %r15\n"
+  "  movq %rsp, (%rdi)\n"
+  "  movq %rsi, %rsp\n"
+  "  popq %r15\n"
+  "  popq %r14\n"
+  "  popq %r13\n"
+  "  popq %r12\n"
+  "  popq %rbx\n"
+  "  popq %rbp\n"
+  "  ret\n"
+  ".size coSwitch, .-coSwitch\n");
+#else
+void coSwitch (void **from, void *to) {
+  fprintf(stderr, "user space stages need x86-64\n");
+  exit (1);
+}
+#endif
+
+
+
+// ****************************************************************
+// First code run on a new stack. The stages loop forever.
+void coEntry (void) {
+  coSelf->fn (coSelf->arg);
+  fprintf(stderr, "a stage returned\n");
+  exit (1);
+}
+
+
+
+// ****************************************************************
+// A stage gets a stack of its own, with a guard page below it, laid
+// out as if coSwitch had saved it on the way into coEntry.
+void coAdd (void *(*fn) (void *), void *arg) {
+  coroutine *c = &coroutines[ncoroutines++];
+  void **sp;
+  char *stack;
+
+  stack = (char *) mmap (NULL, COSTACK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (stack == MAP_FAILED) {
+    perror ("mmap");
+    exit (1);
+  }
+  mprotect (stack, 4096, PROT_NONE);
+  sp = (void **) (stack + COSTACK);
+  *--sp = NULL;                 // keeps coEntry's frame aligned as after a call
+  *--sp = (void *) coEntry;
+  sp -= 6;                      // rbp, rbx, r12 to r15
+  memset (sp, 0, 6 * sizeof (void *));
+  c->sp = sp;
+  c->fn = fn;
+  c->arg = arg;
+}
+
+
+
+// ****************************************************************
+void coYield (void) {
+  coSwitch (&coSelf->sp, coMain);
+}
+
+
+
+// ****************************************************************
+// Work done by a stage, as counted in its slot.
+unsigned long coWork (coroutine *c) {
+  if (c->stat == NULL)
+    return 0;
+  return c->stat->orders + c->stat->trades + c->stat->cancelHit + c->stat->cancelMiss + c->stat->rejects;
+}
+
+
+
+// ****************************************************************
+// Runs the stages round robin, after two idle rounds it sleeps until an
+// inbound order or for a msec.
+void *Stages (void *arg) {
+  queue *q = (queue *) arg;
+  struct timespec ts;
+  unsigned long work, last = 0;
+  int i, idle = 0;
+
+  while (1) {
+    for (i = 0, work = 0; i < ncoroutines; i++) {
+      coSelf = &coroutines[i];
+      stat = (coSelf->stat) ? coSelf->stat : &noStat;
+      tring = coSelf->ring;
+      coSwitch (&coMain, coSelf->sp);
+      coSelf->stat = stat;
+      coSelf->ring = tring;
+      work += coWork (coSelf);
     }
-    if ((!sellLimitOrder->empty) && (sellLimitOrder->tail > sellLimitOrder->head)) {
-      for (i = sellLimitOrder->head; i < sellLimitOrder->tail; i++) {
-        if (ord.oldid == sellLimitOrder->item[i].id) {
-          orderDelIndex (3, ord);  
-          printf("%ld Sell Limit Order ---> Cancelled\n", ord.oldid);
-          goto start;
-        }
+    coSelf = NULL;
+    idle = (work == last) ? idle + 1 : 0;
+    last = work;
+    if (idle < 2)
+      continue;
+
+    pthread_mutex_lock (q->mut);
+    if ((q->empty) && (cancelLane->empty) && (!agentWork ())) {
+      clock_gettime (CLOCK_REALTIME, &ts);
+      if ((ts.tv_nsec += 1000000) >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
       }
+      pthread_cond_timedwait (q->notEmpty, q->mut, &ts);
     }
-    else if ((!sellLimitOrder->empty) && (sellLimitOrder->tail == 0)) {
-      for (i = sellLimitOrder->head; i < QUEUESIZE; i++) {
-        if (ord.oldid == sellLimitOrder->item[i].id) {
-          orderDelIndex (3, ord);
-          printf("%ld Sell Limit Order ---> Cancelled\n", ord.oldid);
-          goto start;
-        }
-      }
+    pthread_mutex_unlock (q->mut);
+    idle = 0;
+  }
+  return NULL;
+}
+
+
+
+//**********************************************************
+void *Expire() {
+  long due, gen;
+
+  statRegister ("Expire");
+  while(1) {
+    pthread_mutex_lock (&clockMut);
+    gen = clockGen;
+    __atomic_store_n (&expireDue, LONG_MAX, __ATOMIC_RELAXED);
+    pthread_mutex_unlock (&clockMut);
+    expireStep (getTimestamp());
+
+    due = expireNext ();
+    pthread_mutex_lock (&clockMut);
+    __atomic_store_n (&expireDue, due, __ATOMIC_RELAXED);
+    while ((clockGen == gen) && (getTimestamp() < due))
+      clockWait (due);
+    pthread_mutex_unlock (&clockMut);
+  }
+}
+
+
+
+// ****************************************************************
+// The first msec either wheel has to run.
+long expireNext (void) {
+  long due, d;
+
+  pthread_mutex_lock (buyLimitOrder->mut);
+  due = wheelNext (buyLimitOrder);
+  pthread_mutex_unlock (buyLimitOrder->mut);
+  pthread_mutex_lock (sellLimitOrder->mut);
+  d = wheelNext (sellLimitOrder);
+  pthread_mutex_unlock (sellLimitOrder->mut);
+  return (d < due) ? d : due;
+}
+
+
+
+// ****************************************************************
+void clockKick (void) {
+  pthread_mutex_lock (&clockMut);
+  clockGen++;
+  pthread_cond_broadcast (&clockCond);
+  pthread_mutex_unlock (&clockMut);
+}
+
+
+
+// ****************************************************************
+// With clockMut held, until msec due of the run or a kick.
+void clockWait (long due) {
+  struct timespec ts;
+
+  if (due == LONG_MAX) {
+    pthread_cond_wait (&clockCond, &clockMut);
+    return;
+  }
+  ts.tv_sec = startwtime.tv_sec + due / 1000;
+  ts.tv_nsec = startwtime.tv_usec * 1000L + (due % 1000) * 1000000L;
+  if (ts.tv_nsec >= 1000000000L) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+  }
+  pthread_cond_timedwait (&clockCond, &clockMut, &ts);
+}
+
+
+
+// ****************************************************************
+void expireStep (long now) {
+  book *b;
+  int side, expired, any = 0;
+
+  for (side = 0; side < 2; side++) {
+    b = (side == 0) ? buyLimitOrder : sellLimitOrder;
+    pthread_mutex_lock (b->mut);
+    expired = wheelAdvance (b, now);
+    pthread_mutex_unlock (b->mut);
+    if (expired)
+      pthread_cond_broadcast (b->notFull);
+    stat->orders += expired;
+    any += expired;
+  }
+  if (any)
+    touchWake ();
+}
+
+
+
+// ****************************************************************
+long queueVol (queue *q) {
+  long i, vol = 0;
+
+  if (q->empty)
+    return 0;
+  i = q->head;
+  do {
+    vol += q->item[i].vol;
+    if (++i == QUEUESIZE)
+      i = 0;
+  } while (i != q->tail);
+  return vol;
+}
+
+
+
+// ****************************************************************
+// Equilibrium price of the call book: most volume, then least imbalance,
+// then nearest the last price.
+int auctionPrice (long *volume) {
+  static long supply[MAXTICK];
+  book *bb = buyLimitOrder, *sb = sellLimitOrder;
+  int ref = currentPriceX10, lo = ref, hi = ref, p, price = NIL;
+  long demand, acc, v, imb, bestImb = 0;
+
+  if (!bb->empty) {
+    if (bb->best < lo) lo = bb->best;
+    if (bb->best > hi) hi = bb->best;
+  }
+  if (!sb->empty) {
+    if (sb->best < lo) lo = sb->best;
+    if (sb->best > hi) hi = sb->best;
+  }
+
+  acc = queueVol (sellMarketOrder);
+  for (p = lo; p <= hi; p++) {
+    acc += sb->lvl[p].vol;
+    supply[p - lo] = acc;
+  }
+
+  *volume = 0;
+  demand = queueVol (buyMarketOrder);
+  for (p = hi; p >= lo; p--) {
+    demand += bb->lvl[p].vol;
+    v = (demand < supply[p - lo]) ? demand : supply[p - lo];
+    imb = labs (demand - supply[p - lo]);
+    if ((v > *volume) ||
+        ((v == *volume) && (v > 0) && ((imb < bestImb) ||
+         ((imb == bestImb) && (abs (p - ref) < abs (price - ref)))))) {
+      *volume = v;
+      bestImb = imb;
+      price = p;
     }
-    else if (!sellLimitOrder->empty)
-    {
-      for (i = sellLimitOrder->head; i < QUEUESIZE; i++) {
-        if(ord.oldid == sellLimitOrder->item[i].id) {
-          orderDelIndex (3, ord);
-          printf("%ld Sell Limit Order ---> Cancelled\n", ord.oldid);
-          goto start;
-        }
-      }
-      for (i = 0; i < sellLimitOrder->tail; i++) {
-        if (ord.oldid == sellLimitOrder->item[i].id){
-          orderDelIndex (3, ord);
-          printf("%ld Sell Limit Order ---> Cancelled\n", ord.oldid);
-          goto start;
-        }
-      }
+  }
+  return price;
+}
+
+
+
+// ****************************************************************
+// Next order in priority on one side of the auction.
+order auctionNext (queue *q, book *b) {
+  order ord;
+
+  if (!q->empty)
+    queueDel (q, &ord);
+  else
+    bookDel (b, &ord);
+  return ord;
+}
+
+
+
+// ****************************************************************
+// Uncross the call book and switch to the next phase, with all four
+// order queues held.
+void uncross (int next) {
+  order buy, sell;
+  book *b;
+  long volume;
+  int price, q, traded;
+
+  while (1) {
+    pthread_mutex_lock (buyMarketOrder->mut);
+    pthread_mutex_lock (sellMarketOrder->mut);
+    pthread_mutex_lock (buyLimitOrder->mut);
+    pthread_mutex_lock (sellLimitOrder->mut);
+    if (bookRoom (buyLimitOrder, 1) && bookRoom (sellLimitOrder, 1))
+      break;
+    b = bookRoom (buyLimitOrder, 1) ? sellLimitOrder : buyLimitOrder;
+    pthread_mutex_unlock (sellLimitOrder->mut);
+    pthread_mutex_unlock (buyLimitOrder->mut);
+    pthread_mutex_unlock (sellMarketOrder->mut);
+    pthread_mutex_unlock (buyMarketOrder->mut);
+    pthread_mutex_lock (b->mut);
+    if (!bookRoom (b, 1))
+      restWait (b, (order) { .type = 'L' });
+    pthread_mutex_unlock (b->mut);
+  }
+
+  price = auctionPrice (&volume);
+  traded = (volume > 0);
+  if (traded) {
+    currentPriceX10 = price;
+    buy = auctionNext (buyMarketOrder, buyLimitOrder);
+    sell = auctionNext (sellMarketOrder, sellLimitOrder);
+    while (1) {
+      q = (buy.vol < sell.vol) ? buy.vol : sell.vol;
+      tradeReport (buy, sell, q);
+      buy.vol -= q;
+      sell.vol -= q;
+      volume -= q;
+      if (volume == 0)
+        break;
+      if (buy.vol == 0)
+        buy = auctionNext (buyMarketOrder, buyLimitOrder);
+      if (sell.vol == 0)
+        sell = auctionNext (sellMarketOrder, sellLimitOrder);
+    }
+    if (buy.vol > 0) {
+      if (buy.type == 'M')
+        queuePush (buyMarketOrder, buy);
+      else
+        bookPush (buyLimitOrder, buy);
+    }
+    if (sell.vol > 0) {
+      if (sell.type == 'M')
+        queuePush (sellMarketOrder, sell);
+      else
+        bookPush (sellLimitOrder, sell);
+    }
+  }
+
+  pthread_mutex_unlock (sellLimitOrder->mut);
+  pthread_mutex_unlock (buyLimitOrder->mut);
+  pthread_mutex_unlock (sellMarketOrder->mut);
+  pthread_mutex_unlock (buyMarketOrder->mut);
+
+  pthread_cond_broadcast (buyMarketOrder->notFull);
+  pthread_cond_broadcast (sellMarketOrder->notFull);
+  pthread_cond_broadcast (buyLimitOrder->notFull);
+  pthread_cond_broadcast (sellLimitOrder->notFull);
+
+  if (traded)
+    stopTrigger (stopHeld ());
+  touchWake ();
+  setPhase (next);
+}
+
+
+
+// ****************************************************************
+void setPhase (int next) {
+  pthread_mutex_lock (buyMarketOrder->mut);
+  pthread_mutex_lock (sellMarketOrder->mut);
+  pthread_mutex_lock (buyLimitOrder->mut);
+  pthread_mutex_lock (sellLimitOrder->mut);
+  phase = next;
+  pthread_mutex_unlock (sellLimitOrder->mut);
+  pthread_mutex_unlock (buyLimitOrder->mut);
+  pthread_mutex_unlock (sellMarketOrder->mut);
+  pthread_mutex_unlock (buyMarketOrder->mut);
+
+  pthread_cond_broadcast (buyMarketOrder->notEmpty);
+  pthread_cond_broadcast (sellMarketOrder->notEmpty);
+  pthread_cond_broadcast (buyLimitOrder->notEmpty);
+  pthread_cond_broadcast (sellLimitOrder->notEmpty);
+}
+
+
+
+//**********************************************************
+// Drives the call phases, -a batch auctions or -o opening and closing.
+void *Auction() {
+  long due;
+
+  statRegister ("Auction");
+  while(1) {
+    due = auctionStep (getTimestamp());
+    pthread_mutex_lock (&clockMut);
+    while (getTimestamp() < due)
+      clockWait (due);
+    pthread_mutex_unlock (&clockMut);
+  }
+}
+
+
+
+// ****************************************************************
+// Returns the msec it is next due.
+long auctionStep (long now) {
+  static long next = 0, closed = -1;
+  long day;
+
+  if (batchMsec) {
+    if (next == 0)
+      next = batchMsec;
+    if (now >= next) {
+      uncross (CALL);
+      next = now + batchMsec;
+    }
+    return next;
+  }
+
+  day = now / DAYMSEC;
+  now = now % DAYMSEC;
+  if ((phase == CALL) && (now >= OPENMSEC) && (now < DAYMSEC - CLOSEMSEC)) {
+    printf("*** Opening auction\n");
+    uncross (CONTINUOUS);
+  }
+  else if ((phase == CONTINUOUS) && (now >= DAYMSEC - CLOSEMSEC)) {
+    printf("*** Closing call\n");
+    setPhase (CALL);
+  }
+  else if ((phase == CALL) && (now >= DAYMSEC - CLOSEUNCROSS) && (closed != day)) {
+    printf("*** Closing auction\n");
+    uncross (CALL);
+    closed = day;
+  }
+
+  if (now < OPENMSEC)
+    return day * DAYMSEC + OPENMSEC;
+  if (now < DAYMSEC - CLOSEMSEC)
+    return day * DAYMSEC + DAYMSEC - CLOSEMSEC;
+  if (now < DAYMSEC - CLOSEUNCROSS)
+    return day * DAYMSEC + DAYMSEC - CLOSEUNCROSS;
+  return (day + 1) * DAYMSEC + OPENMSEC;
+}
+
+
+
+//**********************************************************
+// Publishes the gauges: queue depths and the last price, every 10 msec.
+void *Stats (void *arg) {
+  queue *q = (queue *) arg;
+  int i, n;
+
+  for (n = 0; ; n++) {
+    usleep (10000);
+    if (n % 100 == 0)
+      numaUpdate ();
+    traceDrain ();
+    stats->depth[0] = queueDepth (q);
+    stats->depth[1] = queueDepth (buyMarketOrder);
+    stats->depth[2] = queueDepth (sellMarketOrder);
+    stats->depth[3] = buyLimitOrder->size + buyLimitOrder->pegs;
+    stats->depth[4] = sellLimitOrder->size + sellLimitOrder->pegs;
+    stats->depth[5] = queueDepth (cancelOrder);
+    stats->depth[6] = buyStopOrder->size;
+    stats->depth[7] = sellStopOrder->size;
+    for (i = 0; i < NSTATQUEUES; i++) {
+      stats->high[i] = admit->high[i];
+      stats->refused[i] = admit->refused[i];
     }
+    stats->price = currentPriceX10;
+    stats->msec = getTimestamp();
   }
 }
 
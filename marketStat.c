@@ -0,0 +1,128 @@
+/*
+ *      Live statistics for a running marketSim
+ *
+ *      Maps the statistics segment read-only and prints, every interval,
+ *      the last price, the queue depths and per-thread rates computed
+ *      from the difference of two snapshots. Nothing here takes a lock
+ *      in the engine, so counters may be a few increments apart.
+ *
+ *      ./marketStat [-i msec] [segment name]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "marketStats.h"
+
+#define PER(x, d, sec) ((double) (x.d - y.d) / (sec))
+
+
+
+// ****************************************************************
+double avgUsec (unsigned long nsec, unsigned long n) {
+  return n ? (double) nsec / n / 1000.0 : 0.0;
+}
+
+
+
+// ****************************************************************
+void print (statSegment *now, statSegment *last, double sec) {
+  int i;
+
+  printf("price %.1f  msec %ld", now->price / 10.0, now->msec);
+  for (i = 0; i < 2; i++)
+    if (now->top[i].price >= 0)
+      printf("  %s %ld @ %.1f", i ? "ask" : "bid", now->top[i].vol, now->top[i].price / 10.0);
+  printf("\n");
+  for (i = 0; i < NSTATQUEUES; i++)
+    printf("  %-10s %6ld", now->queueName[i], now->depth[i]);
+  printf("\n");
+  for (i = 0; i < NSTATQUEUES; i++)
+    printf("  %-10s %6ld", i ? "" : "high-water", now->high[i]);
+  printf("\n");
+  for (i = 0; i < NSTATQUEUES; i++)
+    printf("  %-10s %6ld", i ? "" : "refused", now->refused[i]);
+  if (now->node >= 0) {
+    printf("\n  node %d of %d, MB", now->node, now->nnodes);
+    for (i = 0; (i < now->nnodes) && (i < NSTATNODES); i++)
+      printf("  %d: %.1f", i, now->nodeMem[i] / 1048576.0);
+    printf("   remote pages/s");
+    for (i = 0; (i < now->nnodes) && (i < NSTATNODES); i++)
+      printf("  %d: %.0f", i, (now->nodeRemote[i] - last->nodeRemote[i]) / sec);
+  }
+  printf("\n%-11s %10s %10s %10s %9s %10s %9s %8s %8s\n", "thread", "orders/s", "trades/s",
+         "volume/s", "blocked/s", "usec", "waits/s", "usec", "cancel%");
+  for (i = 0; (i < now->nthreads) && (i < NSTATTHREADS); i++) {
+    statSlot x = now->slot[i], y = last->slot[i];
+    unsigned long hit = x.cancelHit - y.cancelHit, miss = x.cancelMiss - y.cancelMiss;
+
+    printf("%-11s %10.0f %10.0f %10.0f %9.0f %10.1f %9.0f %8.1f ", x.name,
+           PER(x, orders, sec), PER(x, trades, sec), PER(x, volume, sec),
+           PER(x, blocked, sec), avgUsec (x.blockedNsec - y.blockedNsec, x.blocked - y.blocked),
+           PER(x, waits, sec), avgUsec (x.waitNsec - y.waitNsec, x.waits - y.waits));
+    if (hit + miss)
+      printf("%8.1f", 100.0 * hit / (hit + miss));
+    else
+      printf("%8s", "-");
+    if (x.rejects - y.rejects)
+      printf("  %lu rejected", x.rejects - y.rejects);
+    printf("\n");
+  }
+  printf("\n");
+  fflush (stdout);
+}
+
+
+
+// ****************************************************************
+int main (int argc, char **argv) {
+  char *name = STATSNAME;
+  int fd, opt, interval = 1000;
+  statSegment *seg, now, last;
+
+  while ((opt = getopt (argc, argv, "i:")) != -1) {
+    if (opt == 'i')
+      interval = atoi (optarg);
+    else {
+      fprintf(stderr, "usage: %s [-i msec] [segment name]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (optind < argc)
+    name = argv[optind];
+  if (interval <= 0)
+    interval = 1000;
+
+  fd = shm_open (name, O_RDONLY, 0);
+  if (fd < 0) {
+    fprintf(stderr, "%s: no statistics segment %s, is marketSim running?\n", argv[0], name);
+    exit(1);
+  }
+  seg = mmap (NULL, sizeof (statSegment), PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (seg == MAP_FAILED) {
+    perror ("mmap");
+    exit(1);
+  }
+  if ((seg->magic != STATSMAGIC) || (seg->version != STATSVERSION)) {
+    fprintf(stderr, "%s: %s is not a version %d statistics segment\n", argv[0], name, STATSVERSION);
+    exit(1);
+  }
+
+  memcpy (&last, seg, sizeof (statSegment));
+  while(1) {
+    usleep (interval * 1000);
+    if (kill (seg->pid, 0) != 0) {
+      fprintf(stderr, "%s: marketSim (pid %d) has exited\n", argv[0], seg->pid);
+      exit(0);
+    }
+    memcpy (&now, seg, sizeof (statSegment));
+    print (&now, &last, interval / 1000.0);
+    last = now;
+  }
+}
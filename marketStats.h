@@ -0,0 +1,63 @@
+/*
+ *      Layout of the marketSim statistics segment
+ *
+ *      marketSim creates the segment with shm_open and updates it in
+ *      place while it runs, marketStat maps it read-only. Each pipeline
+ *      thread owns one slot and is its only writer, so counters are
+ *      plain increments; gauges are written by the Stats thread alone.
+ */
+
+#ifndef MARKETSTATS_H
+#define MARKETSTATS_H
+
+#define STATSNAME "/marketSim.stats"
+#define STATSMAGIC 0x6d53696dUL
+#define STATSVERSION 5
+
+#define NSTATTHREADS 24           // every thread that registers, agent runners included
+#define NSTATQUEUES 8
+#define NSTATNODES 8
+
+typedef struct {
+  char name[16];
+  unsigned long orders;         // orders generated, routed or handed on
+  unsigned long trades;
+  unsigned long volume;
+  unsigned long blocked;        // waits for room in a full queue
+  unsigned long blockedNsec;
+  unsigned long waits;          // waits for work
+  unsigned long waitNsec;
+  unsigned long cancelHit;
+  unsigned long cancelMiss;
+  unsigned long rejects;
+} __attribute__ ((aligned (128))) statSlot;
+
+// The best price and the volume resting at it of one side of the book,
+// a reader retries while seq is odd or moves.
+typedef struct {
+  unsigned long seq;
+  int price;                    // -1 for an empty side
+  long vol;
+} __attribute__ ((aligned (64))) statTop;
+
+typedef struct {
+  unsigned long magic;
+  int version;
+  int pid;
+  int nthreads;
+  int price;
+  long msec;
+  char queueName[NSTATQUEUES][16];
+  long depth[NSTATQUEUES];
+  long high[NSTATQUEUES];       // high-water marks
+  long refused[NSTATQUEUES];    // orders turned away by admission control
+  int nnodes;                   // NUMA nodes of the host
+  int node;                     // the engine is placed on, -1 if not placed
+  long nodeMem[NSTATNODES];     // bytes of the engine on each node
+  long nodeLocal[NSTATNODES];   // pages given on each node since the start, host wide,
+  long nodeRemote[NSTATNODES];  // to a task on it or on another node
+  statTop top[2];               // bid, ask
+  statSlot slot[NSTATTHREADS];
+} statSegment;
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ *      Decoder for the marketSim compressed tapes
+ *
+ *      Prints a trade tape (marketSim -t) as the lines of the text tape
+ *      and an order tape (marketSim -z) in the -w record format, so the
+ *      output can be replayed with marketSim -r. -f and -u restrict the
+ *      output to a time range, found through the block index. -s prints
+ *      the size of the tape against fixed width and text records and
+ *      the decode and encode rates instead.
+ *
+ *      ./marketTape [-f msec] [-s] [-u msec] file
+ */
+
+#define NOMAIN
+#include "marketSim.c"
+
+
+
+// ****************************************************************
+double usecSince (struct timeval *t0) {
+  struct timeval t1;
+
+  gettimeofday (&t1, NULL);
+  return (t1.tv_sec - t0->tv_sec) * 1e6 + (t1.tv_usec - t0->tv_usec);
+}
+
+
+
+// ****************************************************************
+// Decode everything, then encode it again into /dev/null, both timed.
+void sizes (zReader *z, char *name) {
+  char line[256];
+  long i, n = 0, text = 0, fixed;
+  double decode, encode;
+  struct timeval t0;
+  zWriter *w;
+  trade tr, *trades = NULL;
+  order ord, *orders = NULL;
+
+  gettimeofday (&t0, NULL);
+  if (z->kind == ZTRADES) {
+    while (zGetTrade (z, &tr)) {
+      if ((n & 65535) == 0)
+        trades = (trade *) realloc (trades, (n + 65536) * sizeof (trade));
+      trades[n++] = tr;
+    }
+  }
+  else {
+    while (zGetOrder (z, &ord)) {
+      if ((n & 65535) == 0)
+        orders = (order *) realloc (orders, (n + 65536) * sizeof (order));
+      orders[n++] = ord;
+    }
+  }
+  decode = usecSince (&t0);
+  if (n == 0) {
+    printf("%s: no records\n", name);
+    return;
+  }
+
+  w = zOpen ("/dev/null", z->kind);
+  gettimeofday (&t0, NULL);
+  for (i = 0; i < n; i++) {
+    if (z->kind == ZTRADES)
+      zPutTrade (w, trades[i]);
+    else
+      zPutOrder (w, orders[i]);
+  }
+  zClose (w);
+  encode = usecSince (&t0);
+
+  for (i = 0; i < n; i++) {
+    if (z->kind == ZTRADES)
+      text += snprintf (line, sizeof (line), "Timestamp: %ld Price: %d\tVolume: %d\torderid1: %ld orderid2: %ld\n",
+                        trades[i].timestamp, trades[i].price, trades[i].volume, trades[i].id1, trades[i].id2);
+    else
+      text += snprintf (line, sizeof (line), "%ld %ld %d %c %c %d %d %d %ld %ld\n", orders[i].id,
+                        orders[i].timestamp, orders[i].account, orders[i].action, orders[i].type,
+                        orders[i].vol, orders[i].price1, orders[i].price2, orders[i].oldid, orders[i].expire);
+  }
+  fixed = n * ((z->kind == ZTRADES) ? sizeof (trade) : sizeof (order));
+
+  printf("%s: %ld %s in %ld blocks, %ld bytes, %.2f bytes per record\n", name, n,
+         (z->kind == ZTRADES) ? "trades" : "orders", z->entries, z->size, (double) z->size / n);
+  printf("  %.1fx smaller than %ld byte records, %.1fx smaller than text\n",
+         (double) fixed / z->size, fixed / n, (double) text / z->size);
+  printf("  decode %.1f Mrecords/sec, encode %.1f Mrecords/sec\n", n / decode, n / encode);
+}
+
+
+
+// ****************************************************************
+int main (int argc, char **argv) {
+  long from = 0, until = -1;
+  int opt, stats = 0;
+  zReader *z;
+  trade tr;
+  order ord;
+
+  while ((opt = getopt (argc, argv, "f:su:")) != -1) {
+    switch (opt) {
+      case 'f':                     // from msec
+        from = atol (optarg);
+        break;
+      case 's':                     // sizes and rates only
+        stats = 1;
+        break;
+      case 'u':                     // until msec, inclusive
+        until = atol (optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-f msec] [-s] [-u msec] file\n", argv[0]);
+        exit (1);
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-f msec] [-s] [-u msec] file\n", argv[0]);
+    exit (1);
+  }
+  if ((z = zMap (argv[optind])) == NULL) {
+    fprintf(stderr, "%s: %s is not a compressed tape\n", argv[0], argv[optind]);
+    exit (1);
+  }
+
+  if (stats) {
+    sizes (z, argv[optind]);
+    exit (0);
+  }
+
+  zSeek (z, from);
+  if (until >= 0)
+    zStop (z, until);
+  if (z->kind == ZTRADES) {
+    while (zGetTrade (z, &tr)) {
+      if ((tr.timestamp >= from) && ((until < 0) || (tr.timestamp <= until)))
+        printf("Timestamp: %ld Price: %d\tVolume: %d\torderid1: %ld orderid2: %ld\n", tr.timestamp,
+               tr.price, tr.volume, tr.id1, tr.id2);
+    }
+  }
+  else {
+    while (zGetOrder (z, &ord)) {
+      if ((ord.timestamp >= from) && ((until < 0) || (ord.timestamp <= until)))
+        orderWrite (stdout, ord);
+    }
+  }
+
+  exit (0);
+}
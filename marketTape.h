@@ -0,0 +1,73 @@
+/*
+ *      Layout of the marketSim binary tapes
+ *
+ *      marketSim -c file writes every trade to it, marketBars reads it.
+ *      After the header the file is a sequence of fixed size blocks, each
+ *      holding up to TAPEBLOCK trades as three separate arrays, so a
+ *      reader can map the file and run its kernels straight over the
+ *      columns. Only the last block may be partly filled.
+ *
+ *      The compressed tapes, of trades (marketSim -t) or of inbound orders
+ *      (marketSim -z), are a header and a sequence of blocks of varying
+ *      size, each a zBlock and its encoded records. Every field is stored
+ *      as a varint of its difference to a prediction: timestamps as delta
+ *      of deltas, prices against the last price, ids against the last id,
+ *      signed values zig-zag mapped first. The predictions start from
+ *      zero in every block, so each block decodes on its own. On close an
+ *      index of the blocks and a trailer are appended; a tape cut short
+ *      without them is still read, by walking the block headers.
+ */
+
+#ifndef MARKETTAPE_H
+#define MARKETTAPE_H
+
+#define TAPEMAGIC 0x6570615454UL
+#define TAPEVERSION 1
+#define TAPEBLOCK 4096
+
+typedef struct {
+  unsigned long magic;
+  int version;
+  int block;                    // TAPEBLOCK of the writer
+} tapeHeader;
+
+typedef struct {
+  long count;
+  long timestamp[TAPEBLOCK];    // msec
+  int price[TAPEBLOCK];         // x10, as currentPriceX10
+  int volume[TAPEBLOCK];
+} tapeBlock;
+
+#define ZTAPEMAGIC 0x7a65706154UL
+#define ZTAPEVERSION 2
+#define ZTRADES 1
+#define ZORDERS 2
+#define ZBLOCKBYTES 16384
+#define ZRECORDMAX 96           // longest encoded record: 8 varints of 10 bytes and 3 type bytes
+
+typedef struct {
+  unsigned long magic;
+  int version;
+  int kind;                     // ZTRADES or ZORDERS
+} zHeader;
+
+typedef struct {
+  int bytes;                    // encoded records that follow
+  int count;
+  long first, last;             // timestamps of the first and the last record
+  long min, max;                // of all its records, which the stages may write out of order
+} zBlock;
+
+typedef struct {
+  long offset;                  // of the zBlock in the file
+  long first, last;
+  long min, max;
+} zIndex;
+
+typedef struct {
+  long entries;
+  long offset;                  // of the index
+  unsigned long magic;
+} zTrailer;
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ *      Chrome trace JSON from a marketSim -T event trace
+ *
+ *      Every slot of the engine becomes a thread of the timeline. Waits
+ *      on a condition variable and cancel scans are slices; enqueues,
+ *      dequeues, matches and requeues are marks, and each order is an
+ *      arrow from where it was queued to where it was taken. The output
+ *      loads in Perfetto (ui.perfetto.dev) or chrome://tracing. Times are
+ *      usec from the start of tracing, the TSC scaled by the two clock
+ *      readings in the header.
+ *
+ *      ./marketTrace file > trace.json
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "marketTrace.h"
+
+traceHeader h;
+double usecPerTick;
+double lastUsec[TRACETHREADS];
+int open[TRACETHREADS];                 // slices begun and not yet ended
+int first = 1;
+
+
+
+// ****************************************************************
+double usec (long tsc) {
+  return (tsc - h.tsc0) * usecPerTick;
+}
+
+
+
+// ****************************************************************
+void put (char *ph, char *name, traceEvent *e, char *rest) {
+  printf("%s\n{\"ph\":\"%s\",\"name\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f%s}", (first) ? "" : ",",
+         ph, name, e->thread, usec (e->tsc), rest);
+  first = 0;
+}
+
+
+
+// ****************************************************************
+void event (traceEvent *e) {
+  char rest[128];
+  char *queue = (e->arg >= 0) && (e->arg < TRACEQUEUES) ? h.queue[e->arg] : "?";
+  char *wait = (e->arg) ? "wait for room" : "wait for work";
+
+  switch (e->kind) {
+    case TRACE_ENQUEUE:
+    case TRACE_DEQUEUE:
+      snprintf (rest, sizeof (rest), ",\"dur\":0,\"args\":{\"id\":%ld,\"queue\":\"%s\"}", e->id, queue);
+      put ("X", (e->kind == TRACE_ENQUEUE) ? "enqueue" : "dequeue", e, rest);
+      snprintf (rest, sizeof (rest), ",\"cat\":\"order\",\"id\":%ld%s", e->id,
+                (e->kind == TRACE_ENQUEUE) ? "" : ",\"bp\":\"e\"");
+      put ((e->kind == TRACE_ENQUEUE) ? "s" : "f", "order", e, rest);
+      break;
+    case TRACE_MATCH:
+    case TRACE_REQUEUE:
+      snprintf (rest, sizeof (rest), ",\"dur\":0,\"args\":{\"id\":%ld,\"vol\":%d}", e->id, e->arg);
+      put ("X", (e->kind == TRACE_MATCH) ? "match" : "requeue", e, rest);
+      break;
+    case TRACE_WAIT:
+      put ("B", wait, e, "");
+      open[e->thread]++;
+      break;
+    case TRACE_SCAN:
+      snprintf (rest, sizeof (rest), ",\"args\":{\"id\":%ld}", e->id);
+      put ("B", "cancel scan", e, rest);
+      open[e->thread]++;
+      break;
+    case TRACE_WAITEND:
+    case TRACE_SCANEND:
+      // the begin may have been lost, or traced before tracing was on
+      if (open[e->thread] == 0)
+        break;
+      snprintf (rest, sizeof (rest), ",\"args\":{\"found\":%d}", e->arg);
+      put ("E", (e->kind == TRACE_WAITEND) ? wait : "cancel scan", e, (e->kind == TRACE_SCANEND) ? rest : "");
+      open[e->thread]--;
+      break;
+  }
+}
+
+
+
+// ****************************************************************
+int main (int argc, char **argv) {
+  traceEvent e;
+  traceEvent end;
+  FILE *f;
+  long n = 0, lost = 0;
+  int i;
+
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s file > trace.json\n", argv[0]);
+    exit (1);
+  }
+  if ((f = fopen (argv[1], "r")) == NULL) {
+    perror (argv[1]);
+    exit (1);
+  }
+  if ((fread (&h, sizeof (h), 1, f) != 1) || (h.magic != TRACEMAGIC) || (h.version != TRACEVERSION)) {
+    fprintf(stderr, "%s: %s is not a version %d marketSim trace\n", argv[0], argv[1], TRACEVERSION);
+    exit (1);
+  }
+  if (h.tsc1 <= h.tsc0) {
+    fprintf(stderr, "%s: %s was not closed, marketSim did not finish\n", argv[0], argv[1]);
+    exit (1);
+  }
+  usecPerTick = (h.nsec1 - h.nsec0) / 1000.0 / (h.tsc1 - h.tsc0);
+
+  printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  for (i = 0; i < h.nthreads; i++) {
+    printf("%s\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%.16s\"}}",
+           (first) ? "" : ",", i, h.name[i]);
+    first = 0;
+    lost += h.lost[i];
+  }
+  while (fread (&e, sizeof (e), 1, f) == 1) {
+    if (e.thread >= TRACETHREADS)
+      continue;
+    lastUsec[e.thread] = usec (e.tsc);
+    event (&e);
+    n++;
+  }
+
+  // slices still open end with the last event of their thread
+  for (i = 0; i < TRACETHREADS; i++)
+    for (; open[i] > 0; open[i]--) {
+      end.thread = i;
+      end.tsc = h.tsc0 + lastUsec[i] / usecPerTick;
+      put ("E", "", &end, "");
+    }
+  printf("\n]}\n");
+
+  fprintf(stderr, "%ld events of %d threads over %.1f msec", n, h.nthreads, usec (h.tsc1) / 1000.0);
+  if (lost)
+    fprintf(stderr, ", %ld lost to full rings", lost);
+  fprintf(stderr, "\n");
+  if (n != h.events)
+    fprintf(stderr, "%s: the header counts %ld events, the file holds %ld\n", argv[0], h.events, n);
+  exit (0);
+}
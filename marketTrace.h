@@ -0,0 +1,53 @@
+/*
+ *      Event trace of marketSim (-T file), read by marketTrace
+ *
+ *      Each pipeline thread writes its events to a ring of its own and
+ *      the Stats thread moves them to the file every 10 msec, so a
+ *      thread's events are in the file in time order and the threads
+ *      are interleaved by drain. The file is a traceHeader and then the
+ *      events. The header is written again at the end of the run with the
+ *      thread names, a second reading of both clocks, and the events lost
+ *      while a ring was full. Events carry the TSC, or nsec where the CPU
+ *      has none. kill -USR2 turns tracing off and on again.
+ */
+
+#ifndef MARKETTRACE_H
+#define MARKETTRACE_H
+
+#define TRACEMAGIC 0x6354546dUL
+#define TRACEVERSION 2
+
+#define TRACETHREADS 24                 // as the slots of the statistics segment
+#define TRACEQUEUES 8
+
+#define TRACE_ENQUEUE 1                 // arg is the queue, as in queue[]
+#define TRACE_DEQUEUE 2
+#define TRACE_WAIT 3                    // on a condition variable, arg 0 for work, 1 for room
+#define TRACE_WAITEND 4
+#define TRACE_MATCH 5                   // id is the first order of the trade, arg the volume
+#define TRACE_REQUEUE 6                 // the rest of a partly filled order goes back, arg its volume
+#define TRACE_SCAN 7                    // Cancel looks for id
+#define TRACE_SCANEND 8                 // arg 1 if it found it
+
+typedef struct {
+  unsigned long magic;
+  int version;
+  int nthreads;
+  long tsc0, nsec0;                     // clocks when tracing starts
+  long tsc1, nsec1;                     // and when the file is closed
+  long events;
+  char name[TRACETHREADS][16];
+  long lost[TRACETHREADS];
+  char queue[TRACEQUEUES][16];
+} traceHeader;
+
+typedef struct {
+  long tsc;
+  long id;                              // order id, 0 if none
+  int arg;
+  unsigned char kind;
+  unsigned char thread;                 // set as it is drained
+  short pad;
+} traceEvent;
+
+#endif